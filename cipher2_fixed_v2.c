@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // For getline(), clock_gettime() and pthreads under -std=c99
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,6 +18,17 @@ static char *my_strdup(const char *s) {
 #include <string.h> // For strcmp(), memcpy(), my_strdup()
 #include <stddef.h> // For size_t
 #include <curl/curl.h> // For libcurl HTTP operations
+#include <stdint.h> // For uint64_t counters and timestamps
+#include <time.h> // For clock_gettime()
+#include <signal.h> // For SIGUSR1 stats dumps in worker mode
+#include <pthread.h> // For worker mode reader/resolver threads
+#include <errno.h> // For errno checks on file operations
+#include <fcntl.h> // For open()
+#include <unistd.h> // For close(), ftruncate(), link(), unlink()
+#include <sys/file.h> // For flock() shard append locks
+#include <sys/mman.h> // For mmap() of on-disk cache shards
+#include <sys/stat.h> // For fstat(), mkdir()
+#include <strings.h> // For strncasecmp() on URL schemes and host names
 // Handle Windows-specific snprintf compatibility
 #ifdef _WIN32
 #if defined(_MSC_VER) && _MSC_VER < 1900
@@ -33,8 +45,178 @@ static char *my_strdup(const char *s) {
 struct Response {
 char *data; // Pointer to dynamically allocated memory buffer
 size_t size; // Size (in bytes) of the current data
+size_t cap; // Body scan: stop after this many bytes (0 = keep everything)
+size_t scanned; // Body scan: bytes already searched for a redirect
+char *redirect; // Body scan: redirect found in the page, or NULL
 };
 // ============================================================
+// BODY REDIRECTS: meta refresh and JS location in HTML pages
+// ------------------------------------------------------------
+// Some shorteners answer 200 with a page that redirects in the
+// browser. With CIPHER_BODY_SCAN=<bytes> set, unshorten_url() uses
+// GET instead of HEAD and write_callback() keeps at most that many
+// body bytes, feeding each block to body_redirect_scan(). It finds
+//   <meta http-equiv="refresh" content="0; url=...">
+//   location = "...", location.href = '...', location.replace("...")
+//   (also location.assign) and window./document. forms of these
+// and stops the transfer as soon as one is complete or the cap is
+// reached, so a page is never downloaded whole. The scan resumes
+// where the previous block left off; a candidate cut by the end of
+// a block is looked at again when the rest arrives.
+// ============================================================
+#define BODY_SCAN_TAG_MAX 1024 // Longer <meta> tags are not looked into
+static size_t body_scan_cap; // 0 = HEAD only
+static pthread_once_t body_scan_once = PTHREAD_ONCE_INIT;
+static void body_scan_init(void) {
+    const char *cap = getenv("CIPHER_BODY_SCAN");
+    if (cap && *cap) body_scan_cap = (size_t)strtoul(cap, NULL, 10);
+    if (body_scan_cap > 0 && body_scan_cap < 256) body_scan_cap = 256;
+}
+// RETURNS: 1 if the n bytes at p start with word (ASCII case
+// ignored), 0 if they do not, -1 if they might once more arrive.
+static int body_has_prefix(const char *p, size_t n, const char *word) {
+    size_t len = strlen(word);
+    int more = n < len;
+    if (more) len = n;
+    if (strncasecmp(p, word, len) != 0) return 0;
+    return more ? -1 : 1;
+}
+static int body_ident_byte(char c) {
+    return c == '_' || c == '$' || (c >= '0' && c <= '9') || ((c | 32) >= 'a' && (c | 32) <= 'z');
+}
+// Copies a quoted or bare URL value, decoding &amp; and "\/".
+static char *body_copy_url(const char *p, size_t len) {
+    char *url = malloc(len + 1), *o = url;
+    for (size_t i = 0; url && i < len; i++) {
+        char c = p[i];
+        if (c == '&' && len - i >= 5 && strncasecmp(p + i, "&amp;", 5) == 0) i += 4;
+        else if (c == '\\' && i + 1 < len && p[i + 1] == '/') c = p[++i];
+        *o++ = c;
+    }
+    if (url) *o = 0;
+    return url;
+}
+// Finds attribute name in a NUL-terminated tag ("<meta ...>").
+// RETURNS: its value with quotes stripped (*len bytes), or NULL if
+// the tag has no such attribute with a value.
+static const char *body_tag_attr(const char *tag, const char *name, size_t *len) {
+    size_t name_len = strlen(name);
+    const char *p = tag + strcspn(tag, " \t\r\n/>"); // Past the tag name
+    for (;;) {
+        p += strspn(p, " \t\r\n/");
+        if (!*p || *p == '>') return NULL;
+        const char *attr = p, *value = NULL;
+        size_t attr_len = strcspn(p, " \t\r\n/>="), value_len = 0;
+        p += attr_len;
+        p += strspn(p, " \t\r\n");
+        if (*p == '=') {
+            p++;
+            p += strspn(p, " \t\r\n");
+            if (*p == '"' || *p == '\'') {
+                const char *end = strchr(p + 1, *p);
+                if (!end) return NULL;
+                value = p + 1;
+                value_len = (size_t)(end - value);
+                p = end + 1;
+            } else {
+                value = p;
+                p += value_len = strcspn(p, " \t\r\n>");
+            }
+        }
+        if (attr_len == name_len && !strncasecmp(attr, name, name_len)) {
+            *len = value_len;
+            return value;
+        }
+    }
+}
+// The URL of a complete <meta http-equiv="refresh"> tag, else NULL.
+// Its content is "<delay>; url=<target>", where the case of url and
+// the quotes around target vary.
+static char *body_meta_refresh(const char *tag, size_t len) {
+    char buf[BODY_SCAN_TAG_MAX + 1];
+    if (len > BODY_SCAN_TAG_MAX) return NULL;
+    memcpy(buf, tag, len);
+    buf[len] = 0;
+    size_t n;
+    const char *equiv = body_tag_attr(buf, "http-equiv", &n);
+    if (!equiv || n != 7 || strncasecmp(equiv, "refresh", 7) != 0) return NULL;
+    const char *content = body_tag_attr(buf, "content", &n), *end = content + n;
+    if (!content) return NULL;
+    while (content < end && strchr("0123456789. \t", *content)) content++;
+    if (content == end || (*content != ';' && *content != ',')) return NULL;
+    for (content++; content < end && (*content == ' ' || *content == '\t');) content++;
+    if (end - content < 3 || strncasecmp(content, "url", 3) != 0) return NULL;
+    for (content += 3; content < end && (*content == ' ' || *content == '\t');) content++;
+    if (content == end || *content++ != '=') return NULL;
+    while (content < end && strchr(" \t'\"", *content)) content++;
+    n = 0;
+    while (content + n < end && !strchr("'\" \t\r\n", content[n])) n++;
+    return n ? body_copy_url(content, n) : NULL;
+}
+// Looks at a possible JS assignment at p ("location" matched).
+// RETURNS: 1 with *url set, 0 if not one, -1 if cut short.
+static int body_js_location(const char *p, size_t n, char **url) {
+    size_t i = 8; // strlen("location")
+    int r;
+    if ((r = body_has_prefix(p + i, n - i, ".href")) != 0) {
+        if (r < 0) return -1;
+        i += 5;
+    }
+    while (i < n && (p[i] == ' ' || p[i] == '\t')) i++;
+    if (i == n) return -1;
+    if (p[i] == '=') {
+        if (++i == n) return -1;
+        if (p[i] == '=') return 0; // A comparison
+    } else if (p[i] == '.') {
+        if ((r = body_has_prefix(p + i, n - i, ".replace(")) == 0) r = body_has_prefix(p + i, n - i, ".assign(");
+        if (r <= 0) return r;
+        i = (size_t)(strchr(p + i, '(') - p) + 1;
+    } else {
+        return 0;
+    }
+    while (i < n && (p[i] == ' ' || p[i] == '\t')) i++;
+    if (i == n) return -1;
+    if (p[i] != '"' && p[i] != '\'') return 0; // Not a literal
+    const char *end = memchr(p + i + 1, p[i], n - i - 1);
+    if (!end) return n - i - 1 > 2048 ? 0 : -1;
+    *url = body_copy_url(p + i + 1, (size_t)(end - (p + i + 1)));
+    return *url != NULL;
+}
+// ============================================================
+// FUNCTION: body_redirect_scan()
+// ------------------------------------------------------------
+// Searches mem->data from mem->scanned for a redirect.
+// RETURNS:
+// 1 with the (possibly relative) target in mem->redirect, else 0.
+// ============================================================
+static int body_redirect_scan(struct Response *mem) {
+    const char *data = mem->data;
+    size_t i = mem->scanned;
+    while (i < mem->size) {
+        const char *p = data + i;
+        size_t n = mem->size - i;
+        char *url = NULL;
+        int r = 0;
+        if (*p == '<' && (r = body_has_prefix(p, n, "<meta")) > 0) {
+            const char *gt = memchr(p, '>', n);
+            if (gt) url = body_meta_refresh(p, (size_t)(gt - p) + 1);
+            else r = n > BODY_SCAN_TAG_MAX ? 0 : -1;
+        } else if ((*p == 'l' || *p == 'L') && (i == 0 || !body_ident_byte(p[-1])) &&
+                   (r = body_has_prefix(p, n, "location")) > 0) {
+            r = body_js_location(p, n, &url);
+        }
+        if (r < 0) break; // Wait for the rest of the candidate
+        if (url && *url) {
+            mem->redirect = url;
+            return 1;
+        }
+        free(url);
+        i++;
+    }
+    mem->scanned = i;
+    return 0;
+}
+// ============================================================
 // CALLBACK FUNCTION: write_callback()
 // ------------------------------------------------------------
 // libcurl calls this function automatically when it receives
@@ -51,18 +233,251 @@ size_t size; // Size (in bytes) of the current data
 size_t write_callback(void *contents, size_t size, size_t nmemb, void *userp) {
 size_t realsize = size * nmemb; // Actual number of bytes received
 struct Response *mem = (struct Response *)userp; // Implicit cast from void is safe
-char *ptr = realloc(mem->data, mem->size + realsize + 1);
+size_t keep = realsize; // Bytes stored: with a cap, only up to it
+if (mem->cap && keep > mem->cap - mem->size) keep = mem->cap - mem->size;
+char *ptr = realloc(mem->data, mem->size + keep + 1);
 if (!ptr) { // If memory allocation failed
 fprintf(stderr, "Error: Out of memory in write_callback.\n");
 return 0; // Returning 0 tells libcurl to stop
 }
 mem->data = ptr; // Update pointer after realloc
-memcpy(&(mem->data[mem->size]), contents, realsize); // Copy new data into buffer
-mem->size += realsize; // Update total data size
+memcpy(&(mem->data[mem->size]), contents, keep); // Copy new data into buffer
+mem->size += keep; // Update total data size
 mem->data[mem->size] = 0; // Null-terminate the buffer
+// Body scan: stop the transfer at a redirect or at the cap
+if (mem->cap && (body_redirect_scan(mem) || mem->size >= mem->cap)) return 0;
 return realsize; // Return the number of bytes handled
 }
 // ============================================================
+// HELPER: now_ns()
+// ------------------------------------------------------------
+// Monotonic clock in nanoseconds. Used for queue wait times and
+// any other interval measurement (never for wall-clock dates).
+// ============================================================
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+// ============================================================
+// TRACE: optional spans for request phases
+// ------------------------------------------------------------
+// Built with -DCIPHER_TRACE and run with CIPHER_TRACE=<file>,
+// cipher records timed spans (init, encode, http with its dns,
+// connect, tls and first_byte phases, cache, parse, output, ...)
+// and writes them to file at exit: Chrome trace-event JSON
+// (chrome://tracing, Perfetto), or folded stacks for flamegraph.pl
+// when file ends in ".folded".
+//
+// Each thread appends to its own ring of TRACE_RING_EVENTS spans,
+// overwriting the oldest; only the owner writes, so recording
+// takes no lock. Without -DCIPHER_TRACE the TRACE_* macros expand
+// to nothing; built in but not enabled, a span costs one branch.
+// ============================================================
+#ifdef CIPHER_TRACE
+#define TRACE_RING_EVENTS 65536 // Per thread, a power of two
+struct TraceEvent {
+    const char *name; // Static string
+    uint64_t start; // now_ns()
+    uint64_t end;
+};
+struct TraceBuf {
+    uint64_t head; // Atomic: events ever recorded
+    unsigned tid; // Small sequential thread id
+    struct TraceBuf *next; // Registry of all threads' rings
+    struct TraceEvent events[TRACE_RING_EVENTS];
+};
+static int trace_enabled;
+static const char *trace_path;
+static uint64_t trace_epoch;
+static struct TraceBuf *trace_bufs; // Atomic list head
+static unsigned trace_threads; // Atomic
+static __thread struct TraceBuf *trace_buf;
+#define TRACE_BEGIN(t) uint64_t t = trace_enabled ? now_ns() : 0
+#define TRACE_END(t, name) do { if (t) trace_record(name, t, now_ns()); } while (0)
+#define TRACE_CURL(curl) do { if (trace_enabled) trace_curl(curl); } while (0)
+static void trace_record(const char *name, uint64_t start, uint64_t end) {
+    struct TraceBuf *b = trace_buf;
+    if (!b) { // First span of this thread: register its ring
+        if ((b = malloc(sizeof(*b))) == NULL) return;
+        b->head = 0;
+        b->tid = __atomic_add_fetch(&trace_threads, 1, __ATOMIC_RELAXED);
+        b->next = __atomic_load_n(&trace_bufs, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&trace_bufs, &b->next, b, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {}
+        trace_buf = b;
+    }
+    struct TraceEvent *e = &b->events[b->head & (TRACE_RING_EVENTS - 1)];
+    e->name = name;
+    e->start = start;
+    e->end = end;
+    __atomic_store_n(&b->head, b->head + 1, __ATOMIC_RELEASE);
+}
+// Records the transfer just finished on curl as an "http" span
+// split into the phases libcurl timed (relative to its start).
+static void trace_curl(CURL *curl) {
+    static const CURLINFO marks[] = {CURLINFO_NAMELOOKUP_TIME_T, CURLINFO_CONNECT_TIME_T,
+                                     CURLINFO_APPCONNECT_TIME_T, CURLINFO_PRETRANSFER_TIME_T,
+                                     CURLINFO_STARTTRANSFER_TIME_T};
+    static const char *const names[] = {"dns", "connect", "tls", NULL, "first_byte"};
+    curl_off_t total = 0, prev = 0, at;
+    uint64_t end = now_ns();
+    if (curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total) != CURLE_OK) return;
+    uint64_t start = end - (uint64_t)total * 1000;
+    trace_record("http", start, end);
+    for (size_t i = 0; i < sizeof(marks) / sizeof(marks[0]); i++) {
+        // Zero means the phase did not happen (reused connection, no TLS)
+        if (curl_easy_getinfo(curl, marks[i], &at) != CURLE_OK || at <= prev) continue;
+        if (names[i]) trace_record(names[i], start + (uint64_t)prev * 1000, start + (uint64_t)at * 1000);
+        prev = at;
+    }
+}
+static int trace_event_cmp(const void *a, const void *b) {
+    const struct TraceEvent *x = a, *y = b;
+    if (x->start != y->start) return x->start < y->start ? -1 : 1;
+    return x->end > y->end ? -1 : x->end < y->end; // Parents before children
+}
+// Writes one thread's spans as "outer;inner self_us" lines.
+static void trace_write_folded(FILE *out, struct TraceEvent *ev, size_t n) {
+    int *parent = malloc(n * sizeof(int));
+    uint64_t *self = malloc(n * sizeof(uint64_t));
+    int stack[64], depth = 0;
+    if (!parent || !self) n = 0;
+    qsort(ev, n, sizeof(*ev), trace_event_cmp);
+    for (size_t i = 0; i < n; i++) {
+        while (depth > 0 && (ev[stack[depth - 1]].end <= ev[i].start || ev[stack[depth - 1]].end < ev[i].end))
+            depth--;
+        parent[i] = depth > 0 ? stack[depth - 1] : -1;
+        self[i] = ev[i].end - ev[i].start;
+        if (parent[i] >= 0) self[parent[i]] -= self[parent[i]] < self[i] ? self[parent[i]] : self[i];
+        if (depth < 64) stack[depth++] = (int)i;
+    }
+    for (size_t i = 0; i < n; i++) {
+        const char *path[64];
+        int len = 0;
+        if (self[i] < 1000) continue;
+        for (int j = (int)i; j >= 0 && len < 64; j = parent[j]) path[len++] = ev[j].name;
+        while (len-- > 0) fprintf(out, "%s%c", path[len], len ? ';' : ' ');
+        fprintf(out, "%llu\n", (unsigned long long)(self[i] / 1000));
+    }
+    free(parent);
+    free(self);
+}
+// atexit() handler: writes every thread's ring to trace_path.
+static void trace_dump(void) {
+    FILE *out = fopen(trace_path, "w");
+    size_t len = strlen(trace_path), written = 0, dropped = 0;
+    int folded = len > 7 && !strcmp(trace_path + len - 7, ".folded");
+    trace_enabled = 0;
+    if (!out) {
+        fprintf(stderr, "Error: Cannot write trace '%s'\n", trace_path);
+        return;
+    }
+    if (!folded) fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    for (struct TraceBuf *b = __atomic_load_n(&trace_bufs, __ATOMIC_ACQUIRE); b; b = b->next) {
+        uint64_t head = __atomic_load_n(&b->head, __ATOMIC_ACQUIRE);
+        size_t n = head < TRACE_RING_EVENTS ? (size_t)head : TRACE_RING_EVENTS;
+        dropped += (size_t)(head - n);
+        if (folded) {
+            struct TraceEvent *copy = malloc(n * sizeof(*copy));
+            if (!copy) continue;
+            for (size_t i = 0; i < n; i++) copy[i] = b->events[(head - n + i) & (TRACE_RING_EVENTS - 1)];
+            trace_write_folded(out, copy, n);
+            free(copy);
+        } else {
+            for (uint64_t i = head - n; i < head; i++) {
+                const struct TraceEvent *e = &b->events[i & (TRACE_RING_EVENTS - 1)];
+                fprintf(out, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+                        written + (i - (head - n)) ? ",\n" : "", e->name, (int)getpid(), b->tid,
+                        (double)(e->start - trace_epoch) / 1e3, (double)(e->end - e->start) / 1e3);
+            }
+        }
+        written += n;
+    }
+    if (!folded) fprintf(out, "\n]}\n");
+    fclose(out);
+    fprintf(stderr, "[trace] %zu spans from %u threads written to %s%s", written, trace_threads, trace_path,
+            dropped ? "" : "\n");
+    if (dropped) fprintf(stderr, " (%zu older ones overwritten)\n", dropped);
+}
+static void trace_init(void) {
+    trace_path = getenv("CIPHER_TRACE");
+    if (!trace_path || !*trace_path) return;
+    trace_epoch = now_ns();
+    trace_enabled = 1;
+    atexit(trace_dump);
+}
+#else
+#define TRACE_BEGIN(t) (void)0
+#define TRACE_END(t, name) (void)0
+#define TRACE_CURL(curl) (void)0
+static void trace_init(void) {
+    if (getenv("CIPHER_TRACE")) fprintf(stderr, "Warning: CIPHER_TRACE needs a build with -DCIPHER_TRACE\n");
+}
+#endif
+#include <sys/resource.h> // For getrusage() in --cost summaries
+// ============================================================
+// COST: per-request CPU and wall-time accounting
+// ------------------------------------------------------------
+// With -w --cost every job carries a struct Cost: thread CPU time
+// (CLOCK_THREAD_CPUTIME_ID) and wall time per stage, measured on
+// whichever thread runs the stage:
+//   parse    reading the job line (reader)
+//   cache    result cache lookups (dispatcher, resolver)
+//   encode   URL encoding and request setup
+//   network  transfers, minus the TLS handshakes
+//   tls      TLS handshakes (wall only: libcurl does them inside
+//            the transfer, so their CPU is counted under network)
+//   output   formatting and writing the result line (writer)
+// A resolver points cost_current at its job while it runs
+// shorten_url() or unshorten_url(), whose COST_* spans then land
+// in the job. Engine cores multiplex many requests on one thread,
+// so there the CPU of each curl_multi_perform() pass is split
+// evenly between the requests in flight during it.
+// Without --cost, cost_current stays NULL and a span is one branch.
+// ============================================================
+enum CostStage { COST_PARSE, COST_CACHE, COST_ENCODE, COST_NETWORK, COST_TLS, COST_OUTPUT, COST_STAGES };
+static const char *const cost_stage_names[COST_STAGES] = {"parse", "cache", "encode", "network", "tls", "output"};
+struct Cost {
+    uint64_t cpu_ns[COST_STAGES];
+    uint64_t wall_ns[COST_STAGES];
+};
+struct CostMark {
+    uint64_t cpu, wall;
+};
+static int cost_enabled; // -w --cost
+static __thread struct Cost *cost_current; // Job resolved by this thread, or NULL
+static uint64_t thread_cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+static void cost_begin(struct CostMark *m) {
+    m->cpu = thread_cpu_ns();
+    m->wall = now_ns();
+}
+static void cost_add(struct Cost *c, int stage, const struct CostMark *m) {
+    c->cpu_ns[stage] += thread_cpu_ns() - m->cpu;
+    c->wall_ns[stage] += now_ns() - m->wall;
+}
+// Adds the TLS handshake time of the transfer just finished on
+// curl. RETURNS: that time, in ns.
+static uint64_t cost_tls(struct Cost *c, CURL *curl) {
+    curl_off_t connect = 0, handshake = 0;
+    curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+    curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &handshake);
+    uint64_t t = handshake > connect ? (uint64_t)(handshake - connect) * 1000 : 0; // Zero: no TLS or reused
+    c->wall_ns[COST_TLS] += t;
+    return t;
+}
+// Moves the handshake out of the network span just recorded.
+static void cost_curl(struct Cost *c, CURL *curl) {
+    uint64_t t = cost_tls(c, curl);
+    c->wall_ns[COST_NETWORK] -= t < c->wall_ns[COST_NETWORK] ? t : c->wall_ns[COST_NETWORK];
+}
+#define COST_BEGIN(m) struct CostMark m = {0, 0}; if (cost_current) cost_begin(&m)
+#define COST_END(m, stage) do { if (cost_current) cost_add(cost_current, stage, &m); } while (0)
+#define COST_CURL(curl) do { if (cost_current) cost_curl(cost_current, curl); } while (0)
+// ============================================================
 // FUNCTION: shorten_url()
 // ------------------------------------------------------------
 // Sends a long URL to the TinyURL API and retrieves a shortened version.
@@ -82,6 +497,7 @@ CURLcode res;
 struct Response response = { .data = NULL, .size = 0 };
 char *encoded_url = NULL;
 char api_url[1024];
+const char *api_base;
 // Initialize response buffer
 response.data = malloc(1);
 if (!response.data) {
@@ -89,13 +505,19 @@ return my_strdup("Error: Memory allocation failed");
 }
 response.data[0] = 0;
 // Initialize CURL handle
+TRACE_BEGIN(init_t);
 curl = curl_easy_init();
+TRACE_END(init_t, "init");
 if (!curl) {
 free(response.data);
 return my_strdup("Error: Could not initialize curl");
 }
 // URL-encode the input safely using curl handle
+TRACE_BEGIN(encode_t);
+COST_BEGIN(encode_c);
 encoded_url = curl_easy_escape(curl, long_url, 0);
+COST_END(encode_c, COST_ENCODE);
+TRACE_END(encode_t, "encode");
 if (!encoded_url) {
 free(response.data);
 curl_easy_cleanup(curl);
@@ -108,8 +530,10 @@ curl_free(encoded_url);
 curl_easy_cleanup(curl);
 return my_strdup("Error: URL too long for API");
 }
-// Construct TinyURL API endpoint
-snprintf(api_url, sizeof(api_url), "https://tinyurl.com/api-create.php?url=%s", encoded_url);
+// Construct TinyURL API endpoint (or a self-hosted one, see --serve)
+api_base = getenv("CIPHER_SHORTEN_API");
+if (!api_base || !*api_base) api_base = "https://tinyurl.com";
+snprintf(api_url, sizeof(api_url), "%s/api-create.php?url=%s", api_base, encoded_url);
 curl_free(encoded_url); // Free encoded string (no longer needed)
 // Configure CURL options
 curl_easy_setopt(curl, CURLOPT_URL, api_url);
@@ -117,8 +541,13 @@ curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
 curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
 curl_easy_setopt(curl, CURLOPT_TIMEOUT, 8L); // Timeout for safety
 curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 5L); // Fail faster on no connection
+curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L); // No SIGALRM timeouts (worker threads)
 // Execute HTTP request
+COST_BEGIN(network_c);
 res = curl_easy_perform(curl);
+COST_END(network_c, COST_NETWORK);
+TRACE_CURL(curl);
+COST_CURL(curl);
 if (res != CURLE_OK) {
 free(response.data);
 curl_easy_cleanup(curl);
@@ -141,101 +570,8612 @@ return response.data; // Return final shortened URL or error message
 // or an error message. Caller must free the returned string.
 // NOTES:
 // - Requires internet connectivity and libcurl.
-// - Uses HEAD requests to minimize data transfer.
+// - Uses HEAD requests to minimize data transfer, or capped GETs
+//   with CIPHER_BODY_SCAN (see BODY REDIRECTS).
+// - Links of a cipher cluster go straight to the node owning the
+//   code (see CLUSTER, CIPHER_CLUSTER).
+// - Redirects are followed one hop at a time so that each target
+//   host can be checked against CIPHER_HOST_FILTER first.
+// - Hops remembered by the HOP CACHE (worker mode) are not
+//   requested again.
 // ============================================================
+#define UNSHORTEN_MAX_HOPS 30
+#define UNSHORTEN_TIMEOUT_MS 8000 // For the whole chain
+static __thread long unshorten_timeout_ms; // Shorter budget for this thread's walks (0 = default)
+static const char *cluster_route(const char *url, char *buf, size_t cap);
+static int host_filter_allows(const char *url, char *host, size_t cap);
+// State of one redirect walk, shared by unshorten_url() and the
+// multi-handle ENGINE, which drive the hops differently.
+struct UnshortenWalk {
+    int hops; // Redirects followed so far
+    int allowed; // 0 once a hop was refused by CIPHER_HOST_FILTER
+    double spent; // Seconds used by the finished hops
+    char blocked[300]; // The refused host
+    unsigned cached_hops; // Hops taken from the hop cache
+    // Caching headers of the current hop's response
+    long max_age; // Cache-Control max-age, or -1
+    int64_t expires; // Expires as a Unix time, or 0
+    int no_store; // Cache-Control no-store or no-cache
+    long timeout_ms; // Budget for the whole chain
+    struct Response body; // Start of the current hop's page (CIPHER_BODY_SCAN)
+};
+static char *hop_cache_get(const char *url);
+static void hop_cache_put(const char *from, const char *to, long status, const struct UnshortenWalk *w);
+// Header callback: keeps the caching headers of the latest response.
+static size_t unshorten_header(char *buf, size_t size, size_t nitems, void *userdata) {
+    struct UnshortenWalk *w = userdata;
+    size_t len = size * nitems;
+    char line[256];
+    snprintf(line, sizeof(line), "%.*s", (int)(len < sizeof(line) ? len : sizeof(line) - 1), buf);
+    if (strncmp(line, "HTTP/", 5) == 0) { // A new response begins
+        w->max_age = -1;
+        w->expires = 0;
+        w->no_store = 0;
+    } else if (strncasecmp(line, "cache-control:", 14) == 0) {
+        char *save = NULL;
+        for (char *t = strtok_r(line + 14, " \t\r\n,", &save); t; t = strtok_r(NULL, " \t\r\n,", &save)) {
+            if (strcasecmp(t, "no-store") == 0 || strcasecmp(t, "no-cache") == 0) w->no_store = 1;
+            else if (strncasecmp(t, "max-age=", 8) == 0) w->max_age = strtol(t + 8, NULL, 10);
+        }
+    } else if (strncasecmp(line, "expires:", 8) == 0) {
+        time_t t = curl_getdate(line + 8, NULL);
+        w->expires = t > 0 ? (int64_t)t : 0;
+    }
+    return len;
+}
+// Follows the hops of url already known to the hop cache, while
+// the filter allows them. RETURNS: the first URL that needs a
+// request (caller frees), or NULL when out of memory.
+static char *unshorten_skip_known(struct UnshortenWalk *w, const char *url) {
+    char *cur = my_strdup(url), *next;
+    while (cur && w->allowed && w->hops < UNSHORTEN_MAX_HOPS && (next = hop_cache_get(cur)) != NULL) {
+        w->hops++;
+        w->cached_hops++;
+        w->allowed = host_filter_allows(next, w->blocked, sizeof(w->blocked));
+        free(cur);
+        cur = next;
+    }
+    return cur;
+}
+// Empties the body buffer for the next hop.
+static void unshorten_body_reset(struct UnshortenWalk *w) {
+    free(w->body.redirect);
+    w->body.redirect = NULL;
+    w->body.size = w->body.scanned = 0;
+}
+// Sets up curl for the first hop to url (already routed), to be
+// walked within timeout_ms.
+static void unshorten_begin(CURL *curl, struct UnshortenWalk *w, const char *url, long timeout_ms) {
+    pthread_once(&body_scan_once, body_scan_init);
+    w->timeout_ms = timeout_ms;
+    memset(&w->body, 0, sizeof(w->body));
+    w->body.cap = body_scan_cap;
+    w->hops = 0;
+    w->spent = 0.0;
+    w->cached_hops = 0;
+    w->allowed = host_filter_allows(url, w->blocked, sizeof(w->blocked));
+    char *start = w->allowed ? unshorten_skip_known(w, url) : NULL;
+    curl_easy_setopt(curl, CURLOPT_URL, start ? start : url);
+    free(start);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, unshorten_header);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, w);
+    if (w->body.cap) { // GET, reading at most the start of each page
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &w->body);
+    } else {
+        curl_easy_setopt(curl, CURLOPT_NOBODY, 1L); // HEAD request only (no body)
+    }
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, timeout_ms); // Timeout limit
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, timeout_ms < 5000 ? timeout_ms : 5000L); // Connection timeout
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L); // No SIGALRM timeouts (worker threads)
+}
+// Called when a hop has finished with *res. RETURNS: 1 if curl now
+// points at the next hop, 0 if the walk is over (*res tells how).
+static int unshorten_next_hop(CURL *curl, struct UnshortenWalk *w, CURLcode *res) {
+    char *next = NULL, *in_body = NULL;
+    double hop_time;
+    long status = 0;
+    if (*res == CURLE_WRITE_ERROR && w->body.cap) *res = CURLE_OK; // write_callback() stopped it on purpose
+    if (*res != CURLE_OK) return 0;
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &hop_time);
+    curl_easy_getinfo(curl, CURLINFO_REDIRECT_URL, &next);
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+    w->spent += hop_time;
+    if (!next && w->body.redirect && status >= 200 && status < 300) {
+        char *base = NULL;
+        CURLU *u = curl_url();
+        curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &base);
+        if (u && base && curl_url_set(u, CURLUPART_URL, base, 0) == CURLUE_OK &&
+            curl_url_set(u, CURLUPART_URL, w->body.redirect, 0) == CURLUE_OK) // Relative to the page
+            curl_url_get(u, CURLUPART_URL, &in_body, 0);
+        curl_url_cleanup(u);
+        next = in_body;
+    }
+    unshorten_body_reset(w);
+    if (!next) return 0; // Not a redirect: this is the destination
+    if (strncasecmp(next, "http://", 7) != 0 && strncasecmp(next, "https://", 8) != 0) {
+        *res = CURLE_UNSUPPORTED_PROTOCOL; // What FOLLOWLOCATION refuses too
+    } else if (++w->hops > UNSHORTEN_MAX_HOPS) {
+        *res = CURLE_TOO_MANY_REDIRECTS;
+    } else if (w->spent * 1000.0 >= (double)w->timeout_ms) {
+        *res = CURLE_OPERATION_TIMEDOUT;
+    } else if ((w->allowed = host_filter_allows(next, w->blocked, sizeof(w->blocked))) != 0) {
+        char *from = NULL;
+        curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &from);
+        if (from) hop_cache_put(from, next, status, w);
+        // next belongs to the handle until the next request: copy it
+        char *hop = unshorten_skip_known(w, next);
+        if (!hop) {
+            *res = CURLE_OUT_OF_MEMORY;
+        } else {
+            // What is left of the budget; at least 1 ms, as 0 means no timeout to curl
+            long left_ms = (long)((double)w->timeout_ms - w->spent * 1000.0);
+            if (left_ms < 1) left_ms = 1;
+            curl_easy_setopt(curl, CURLOPT_URL, hop);
+            curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, left_ms);
+            curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, left_ms < 5000 ? left_ms : 5000L);
+            free(hop);
+        }
+    }
+    curl_free(in_body);
+    return *res == CURLE_OK && w->allowed;
+}
+// RETURNS: the walk's result string (caller frees).
+static char *unshorten_result(CURL *curl, struct UnshortenWalk *w, CURLcode res) {
+    char *final_url = NULL;
+    long response_code = 0;
+    unshorten_body_reset(w);
+    free(w->body.data);
+    w->body.data = NULL;
+    if (!w->allowed) {
+        size_t len = strlen(w->blocked) + 40;
+        final_url = malloc(len);
+        if (final_url) snprintf(final_url, len, "Error: Redirect to blocked host %s", w->blocked);
+        return final_url;
+    }
+    if (res != CURLE_OK) return my_strdup("Error: Could not unshorten URL (network issue)");
+    // Get final resolved URL (after redirects)
+    curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &final_url);
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+    // Check response validity and avoid null pointer
+    if (response_code >= 200 && response_code < 400 && final_url) return my_strdup(final_url); // Copy to heap
+    return my_strdup("Error: Invalid or failed redirect response");
+}
 char *unshorten_url(const char *short_url) {
 CURL *curl;
-CURLcode res;
-char *final_url = NULL;
-long response_code;
+CURLcode res = CURLE_OK;
+char *final_url;
+char routed[2048];
+const char *url = cluster_route(short_url, routed, sizeof(routed));
+struct UnshortenWalk walk;
+TRACE_BEGIN(init_t);
 curl = curl_easy_init();
+TRACE_END(init_t, "init");
 if (!curl) {
 return my_strdup("Error: Could not initialize curl");
 }
 // Configure CURL options
-curl_easy_setopt(curl, CURLOPT_URL, short_url);
-curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L); // Follow redirects automatically
-curl_easy_setopt(curl, CURLOPT_NOBODY, 1L); // HEAD request only (no body)
-curl_easy_setopt(curl, CURLOPT_TIMEOUT, 8L); // Timeout limit
-curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 5L); // Connection timeout
-// Perform HTTP request
+COST_BEGIN(encode_c);
+unshorten_begin(curl, &walk, url, unshorten_timeout_ms ? unshorten_timeout_ms : UNSHORTEN_TIMEOUT_MS);
+COST_END(encode_c, COST_ENCODE);
+// Walk the redirect chain
+while (walk.allowed) {
+COST_BEGIN(network_c);
 res = curl_easy_perform(curl);
-if (res == CURLE_OK) {
-// Get final resolved URL (after redirects)
-curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &final_url);
-curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
-// Check response validity and avoid null pointer
-if (response_code >= 200 && response_code < 400 && final_url) {
-final_url = my_strdup(final_url); // Copy result to heap
-} else {
-final_url = my_strdup("Error: Invalid or failed redirect response");
-}
-} else {
-final_url = my_strdup("Error: Could not unshorten URL (network issue)");
+COST_END(network_c, COST_NETWORK);
+TRACE_CURL(curl);
+COST_CURL(curl);
+COST_BEGIN(hop_c);
+int more = unshorten_next_hop(curl, &walk, &res);
+COST_END(hop_c, COST_ENCODE);
+if (!more) break;
 }
+final_url = unshorten_result(curl, &walk, res);
 // Cleanup resources
 curl_easy_cleanup(curl);
 return final_url;
 }
 // ============================================================
-// FUNCTION: show_help()
+// STRUCT: LatHist
 // ------------------------------------------------------------
-// Prints a professional help/usage menu, similar to tools like
-// Hydra or Nmap when the "-h" flag is passed.
+// Small log-linear latency histogram (8 sub-buckets per power of
+// two, so percentiles are accurate to ~12%). Values are in
+// microseconds. Not thread-safe: callers hold the owner's lock.
 // ============================================================
-void show_help(const char *prog_name) {
-printf("\n===========================================\n");
-printf(" URL Shortener & Unshortener Tool\n");
-printf("===========================================\n\n");
-printf("Usage:\n");
-printf(" %s [option] [url]\n\n", prog_name);
-printf("Options:\n");
-printf(" -s <url> Shorten a long URL using TinyURL API\n");
-printf(" -u <url> Unshorten a short URL to reveal its target\n");
-printf(" -h Show this help message\n\n");
-printf("Examples:\n");
-printf(" %s -s https://example.com\n", prog_name);
-printf(" %s -u https://tinyurl.com/abc123\n\n", prog_name);
-printf("Notes:\n");
-printf(" * Requires internet connectivity and libcurl.\n");
-printf(" * Caller must free() strings returned by -s and -u options.\n");
-printf(" * Compile with: gcc -std=c99 -o %s %s.c -lcurl\n\n", prog_name, prog_name);
+#define HIST_BUCKETS 496
+struct LatHist {
+    uint64_t count; // Number of samples
+    uint64_t sum; // Sum of all samples (for the mean)
+    uint64_t max; // Largest sample seen
+    uint32_t buckets[HIST_BUCKETS];
+};
+static int hist_index(uint64_t v) {
+    if (v < 8) return (int)v;
+    int msb = 63 - __builtin_clzll(v);
+    return (msb - 2) * 8 + (int)((v >> (msb - 3)) & 7);
+}
+static uint64_t hist_bucket_floor(int idx) {
+    if (idx < 8) return (uint64_t)idx;
+    return (uint64_t)(8 + idx % 8) << (idx / 8 - 1);
+}
+static void hist_add(struct LatHist *h, uint64_t v) {
+    h->count++;
+    h->sum += v;
+    if (v > h->max) h->max = v;
+    h->buckets[hist_index(v)]++;
+}
+// Returns the lower bound of the bucket holding the p-th percentile
+// (p in 0..100), clamped to the observed maximum.
+static uint64_t hist_percentile(const struct LatHist *h, double p) {
+    if (h->count == 0) return 0;
+    uint64_t rank = (uint64_t)(p / 100.0 * (double)h->count);
+    if (rank >= h->count) rank = h->count - 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen > rank) {
+            uint64_t v = hist_bucket_floor(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
 }
 // ============================================================
-// FUNCTION: main()
+// NUMA: topology, thread pinning and node-local memory
 // ------------------------------------------------------------
-// Entry point of the program.
-// Parses arguments and determines which operation to perform.
+// With --numa (-w, --scan, --serve) worker threads are pinned one
+// per CPU. Threads take the nodes in turn, so every socket gets
+// an equal share. Each pinned thread also prefers its own node's
+// memory (set_mempolicy). Whatever it allocates and touches first
+// then stays local: curl connection state, engine inboxes, the
+// cache entries it stores, request buffers. Tables that every
+// thread probes (result cache buckets, the store index) are
+// interleaved page by page across the nodes instead, so no single
+// socket serves all of them.
+//
+// The topology comes from /sys/devices/system/node and the
+// policies are set with raw syscalls, so libnuma is not needed.
+// A machine without that directory counts as one node; with one
+// node only the pinning has an effect.
+// ============================================================
+#include <sched.h> // For CPU sets and pthread_setaffinity_np()
+#include <sys/syscall.h> // For the set_mempolicy() and mbind() syscalls
+#define NUMA_MAX_NODES 64 // Kernel node ids below this fit one mask word
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#define MPOL_INTERLEAVE 3
+#endif
+struct NumaTopo {
+    int nnodes; // Nodes with CPUs this process may use
+    int node_id[NUMA_MAX_NODES]; // Kernel node number of each
+    cpu_set_t cpus[NUMA_MAX_NODES]; // Usable CPUs of each
+    int ncpus[NUMA_MAX_NODES];
+    size_t pinned[NUMA_MAX_NODES]; // Atomic: threads pinned there
+};
+static struct NumaTopo numa_topo;
+static pthread_once_t numa_once = PTHREAD_ONCE_INIT;
+static int numa_enabled; // --numa
+static size_t numa_next_slot; // Atomic: threads pinned so far
+// Parses a sysfs CPU list such as "0-3,8-11\n".
+static void numa_parse_cpulist(const char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+    for (;;) {
+        char *end;
+        long lo = strtol(list, &end, 10), hi = lo;
+        if (end == list) break;
+        if (*end == '-') hi = strtol(end + 1, &end, 10);
+        for (long c = lo < 0 ? 0 : lo; c <= hi && c < CPU_SETSIZE; c++) CPU_SET((int)c, set);
+        if (*end != ',') break;
+        list = end + 1;
+    }
+}
+static void numa_detect(void) {
+    struct NumaTopo *t = &numa_topo;
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        CPU_ZERO(&allowed);
+        CPU_SET(0, &allowed);
+    }
+    for (int n = 0; n < NUMA_MAX_NODES; n++) {
+        char path[64], list[4096];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", n);
+        FILE *f = fopen(path, "r");
+        if (!f) continue;
+        if (fgets(list, sizeof(list), f)) {
+            cpu_set_t *set = &t->cpus[t->nnodes];
+            numa_parse_cpulist(list, set);
+            CPU_AND(set, set, &allowed);
+            if ((t->ncpus[t->nnodes] = CPU_COUNT(set)) > 0) t->node_id[t->nnodes++] = n; // Else memory only
+        }
+        fclose(f);
+    }
+    if (t->nnodes == 0) {
+        t->nnodes = 1;
+        t->cpus[0] = allowed;
+        t->ncpus[0] = CPU_COUNT(&allowed);
+    }
+}
+static const struct NumaTopo *numa_topology(void) {
+    pthread_once(&numa_once, numa_detect);
+    return &numa_topo;
+}
+// ============================================================
+// FUNCTION: numa_pin_self()
 // ------------------------------------------------------------
-// NOTES:
-// - Requires libcurl; link with -lcurl during compilation.
-// - Initializes and cleans up global CURL resources.
+// With --numa, pins the calling thread to the next CPU of the
+// plan: the i-th thread pinned goes to node i % nnodes, on that
+// node's (i / nnodes)-th CPU (wrapping once there are more
+// threads than CPUs), and prefers that node's memory from then on.
+// RETURNS:
+// The kernel node number, or -1 without --numa.
 // ============================================================
-int main(int argc, char *argv[]) {
-// If no argument provided, show help
-if (argc < 2) {
-show_help(argv[0]);
-return 1;
+static int numa_pin_self(void) {
+    if (!numa_enabled) return -1;
+    struct NumaTopo *t = (struct NumaTopo *)numa_topology();
+    size_t slot = __atomic_fetch_add(&numa_next_slot, 1, __ATOMIC_RELAXED);
+    int node = (int)(slot % (size_t)t->nnodes), k = (int)(slot / (size_t)t->nnodes % (size_t)t->ncpus[node]);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int c = 0; c < CPU_SETSIZE; c++) {
+        if (CPU_ISSET(c, &t->cpus[node]) && k-- == 0) {
+            CPU_SET(c, &set);
+            break;
+        }
+    }
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (t->nnodes > 1) {
+        unsigned long mask = 1ul << t->node_id[node];
+        syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, (unsigned long)NUMA_MAX_NODES + 1);
+    }
+    __atomic_add_fetch(&t->pinned[node], 1, __ATOMIC_RELAXED);
+    return t->node_id[node];
 }
-// Initialize libcurl globally (must be done once)
-if (curl_global_init(CURL_GLOBAL_ALL) != 0) {
-fprintf(stderr, "Error: Failed to initialize libcurl\n");
-return 1;
+// Spreads the not yet touched pages of a shared table over all
+// nodes (whole pages inside [p, p + len) only). No-op without
+// --numa or on one node.
+static void numa_interleave(void *p, size_t len) {
+    if (!numa_enabled || numa_topology()->nnodes < 2) return;
+    const struct NumaTopo *t = numa_topology();
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t lo = ((uintptr_t)p + page - 1) & ~(page - 1), hi = ((uintptr_t)p + len) & ~(page - 1);
+    unsigned long mask = 0;
+    for (int i = 0; i < t->nnodes; i++) mask |= 1ul << t->node_id[i];
+    if (hi > lo) syscall(SYS_mbind, (void *)lo, hi - lo, MPOL_INTERLEAVE, &mask, (unsigned long)NUMA_MAX_NODES + 1, 0);
 }
-// Parse command-line flags
-if (strcmp(argv[1], "-h") == 0) {
-// Display help message
-show_help(argv[0]);
-} else if (strcmp(argv[1], "-s") == 0 && argc == 3) {
-// Shorten a URL
-char *result = shorten_url(argv[2]);
-printf("Shortened URL: %s\n", result);
-free(result);
-} else if (strcmp(argv[1], "-u") == 0 && argc == 3) {
-// Unshorten a URL
-char *result = unshorten_url(argv[2]);
-printf("Original URL: %s\n", result);
-free(result);
+// "[numa] nodes=2 node0=cpus:8,threads:5 node1=..." to out.
+static void numa_print_stats(FILE *out) {
+    const struct NumaTopo *t = numa_topology();
+    fprintf(out, "[numa] nodes=%d", t->nnodes);
+    for (int i = 0; i < t->nnodes; i++)
+        fprintf(out, " node%d=cpus:%d,threads:%zu", t->node_id[i], t->ncpus[i],
+                __atomic_load_n(&t->pinned[i], __ATOMIC_RELAXED));
+    fputc('\n', out);
+}
+// ============================================================
+// PERF: hardware event counters (perf_event_open(2))
+// ------------------------------------------------------------
+// Counts one event for the calling thread, user space only (so
+// perf_event_paranoid up to 2 allows it). Virtual machines often
+// expose no PMU; callers then get -1 and report "n/a".
+// ============================================================
+#include <linux/perf_event.h> // For struct perf_event_attr
+// RETURNS: the counter fd (counting from now), or -1 with errno set.
+static int perf_counter_open(uint32_t type, uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+static uint64_t perf_counter_read(int fd) {
+    uint64_t v = 0;
+    if (fd < 0 || read(fd, &v, sizeof(v)) != (ssize_t)sizeof(v)) return 0;
+    return v;
+}
+#define PERF_DTLB_LOAD_MISSES (PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | \
+                               (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+// ============================================================
+// HUGEPAGES: huge page backing for large tables
+// ------------------------------------------------------------
+// With CIPHER_HUGEPAGES set, tables of HUGE_MIN bytes or more
+// (result and hop cache buckets, the store index) are mapped in
+// 2 MiB pages, so random probes into them need far fewer TLB
+// entries:
+//   CIPHER_HUGEPAGES=1    explicit huge pages (MAP_HUGETLB, from
+//                         the vm.nr_hugepages pool), falling back
+//                         to THP when the pool is empty
+//   CIPHER_HUGEPAGES=thp  transparent huge pages only: a 2 MiB
+//                         aligned mapping with MADV_HUGEPAGE, which
+//                         the kernel backs when it can (and with
+//                         4 KiB pages when THP is "never")
+// Smaller tables stay on malloc. Entries and other per-thread
+// data come from glibc's per-thread arenas; glibc 2.35 and later
+// back those with THP when started with
+// GLIBC_TUNABLES=glibc.malloc.hugetlb=1. --hugepage-test measures
+// probe time and dTLB misses with and without.
+// ============================================================
+#define HUGE_PAGE ((size_t)2 << 20)
+#define HUGE_MIN (HUGE_PAGE / 2)
+enum { HUGE_OFF, HUGE_THP, HUGE_HUGETLB };
+static int huge_mode;
+static pthread_once_t huge_once = PTHREAD_ONCE_INIT;
+static uint64_t huge_hugetlb_bytes, huge_thp_bytes; // Atomic
+static void huge_init(void) {
+    const char *env = getenv("CIPHER_HUGEPAGES");
+    if (env && *env && strcmp(env, "0")) huge_mode = strcmp(env, "thp") ? HUGE_HUGETLB : HUGE_THP;
+}
+static int huge_wanted(size_t size) {
+    pthread_once(&huge_once, huge_init);
+    return huge_mode != HUGE_OFF && size >= HUGE_MIN;
+}
+// ============================================================
+// FUNCTION: huge_alloc()
+// ------------------------------------------------------------
+// Zeroed memory for a table of size bytes, on huge pages when
+// CIPHER_HUGEPAGES asks for them and the table is big enough.
+// Free it with huge_free() and the same size.
+// RETURNS:
+// The table, or NULL when out of memory.
+// ============================================================
+static void *huge_alloc(size_t size) {
+    if (!huge_wanted(size)) return calloc(1, size);
+    size_t len = (size + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+    void *p = MAP_FAILED;
+    if (huge_mode == HUGE_HUGETLB)
+        p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+        __atomic_add_fetch(&huge_hugetlb_bytes, len, __ATOMIC_RELAXED);
+        return p;
+    }
+    // THP can only back 2 MiB aligned ranges: map a page more and trim
+    char *raw = mmap(NULL, len + HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) return NULL;
+    char *aligned = (char *)(((uintptr_t)raw + HUGE_PAGE - 1) & ~(uintptr_t)(HUGE_PAGE - 1));
+    if (aligned > raw) munmap(raw, (size_t)(aligned - raw));
+    if (raw + HUGE_PAGE > aligned) munmap(aligned + len, (size_t)(raw + HUGE_PAGE - aligned));
+    madvise(aligned, len, MADV_HUGEPAGE);
+    __atomic_add_fetch(&huge_thp_bytes, len, __ATOMIC_RELAXED);
+    return aligned;
+}
+static void huge_free(void *p, size_t size) {
+    if (!p) return;
+    if (!huge_wanted(size)) {
+        free(p);
+        return;
+    }
+    munmap(p, (size + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1));
+}
+// AnonHugePages of this process (THP actually granted), in KiB.
+static uint64_t huge_thp_granted_kb(void) {
+    FILE *f = fopen("/proc/self/smaps_rollup", "r");
+    char line[256];
+    uint64_t kb = 0;
+    while (f && fgets(line, sizeof(line), f))
+        if (!strncmp(line, "AnonHugePages:", 14)) kb = strtoull(line + 14, NULL, 10);
+    if (f) fclose(f);
+    return kb;
+}
+static void huge_print_stats(FILE *out) {
+    if (huge_mode == HUGE_OFF) return;
+    fprintf(out, "[hugepages] mode=%s hugetlb_mb=%.1f thp_mb=%.1f thp_granted_mb=%.1f\n",
+            huge_mode == HUGE_THP ? "thp" : "hugetlb",
+            (double)__atomic_load_n(&huge_hugetlb_bytes, __ATOMIC_RELAXED) / 1048576.0,
+            (double)__atomic_load_n(&huge_thp_bytes, __ATOMIC_RELAXED) / 1048576.0,
+            (double)huge_thp_granted_kb() / 1024.0);
+}
+// ============================================================
+// FUNCTION: run_hugepage_test()
+// ------------------------------------------------------------
+// "--hugepage-test [MiB] [lookups]": random 8-byte probes into
+// a table of MiB (default 512) on 4 KiB pages, then on huge pages
+// from huge_alloc(). Reports ns and dTLB load misses per probe
+// (perf counters; "n/a" without a PMU) and the reduction.
+// RETURNS:
+// Process exit status.
+// ============================================================
+static int run_hugepage_test(int argc, char *argv[]) {
+    size_t mb = argc > 0 ? (size_t)strtoul(argv[0], NULL, 10) : 512;
+    uint64_t lookups = argc > 1 ? strtoull(argv[1], NULL, 10) : 20000000;
+    double ns[2] = {0, 0}, misses[2] = {0, 0};
+    int fd = perf_counter_open(PERF_TYPE_HW_CACHE, PERF_DTLB_LOAD_MISSES);
+    const char *no_perf = fd < 0 ? strerror(errno) : NULL;
+    if (mb < 4 || lookups == 0) {
+        fprintf(stderr, "Error: Usage: --hugepage-test [MiB >= 4] [lookups > 0]\n");
+        return 1;
+    }
+    pthread_once(&huge_once, huge_init);
+    if (huge_mode == HUGE_OFF) huge_mode = HUGE_HUGETLB; // CIPHER_HUGEPAGES=thp still skips the pool
+    size_t n = (size_t)1 << (63 - __builtin_clzll((uint64_t)mb << 17)), size = n * sizeof(uint64_t);
+    for (int pass = 0; pass < 2; pass++) {
+        uint64_t granted = huge_thp_granted_kb(), hugetlb = huge_hugetlb_bytes, *t;
+        if (pass == 0) {
+            t = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (t != MAP_FAILED) madvise(t, size, MADV_NOHUGEPAGE);
+            else t = NULL;
+        } else {
+            t = huge_alloc(size);
+        }
+        if (!t) {
+            fprintf(stderr, "Error: Cannot map %zu MiB\n", size >> 20);
+            close(fd);
+            return 1;
+        }
+        for (size_t i = 0; i < n; i++) t[i] = i; // Faults every page in before timing
+        double huge_mb = pass == 0 ? 0.0 : (double)(huge_hugetlb_bytes - hugetlb) / 1048576.0 +
+                                           (double)(huge_thp_granted_kb() - granted) / 1024.0;
+        uint64_t x = 0x9e3779b97f4a7c15ull, sum = 0, m0 = perf_counter_read(fd), t0 = now_ns();
+        for (uint64_t i = 0; i < lookups; i++) {
+            x ^= x << 13; // xorshift64: independent random probes
+            x ^= x >> 7;
+            x ^= x << 17;
+            sum += t[x & (n - 1)];
+        }
+        ns[pass] = (double)(now_ns() - t0) / (double)lookups;
+        misses[pass] = (double)(perf_counter_read(fd) - m0) / (double)lookups;
+        char mstr[32] = "n/a";
+        if (!no_perf) snprintf(mstr, sizeof(mstr), "%.3f", misses[pass]);
+        printf("[hugepage-test] pages=%s table_mb=%zu lookups=%llu ns_per_lookup=%.2f dtlb_misses_per_lookup=%s "
+               "huge_mb=%.0f checksum=%llx\n", pass == 0 ? "4k" : huge_mode == HUGE_THP ? "thp" : "huge",
+               size >> 20, (unsigned long long)lookups, ns[pass], mstr, huge_mb, (unsigned long long)(sum & 0xfff));
+        if (pass == 0) munmap(t, size);
+        else huge_free(t, size);
+    }
+    if (no_perf) {
+        printf("[hugepage-test] time %+.1f%%, dtlb misses n/a (perf counters: %s)\n",
+               (ns[1] / ns[0] - 1.0) * 100.0, no_perf);
+    } else {
+        printf("[hugepage-test] time %+.1f%%, dtlb misses %+.1f%%\n", (ns[1] / ns[0] - 1.0) * 100.0,
+               misses[0] > 0 ? (misses[1] / misses[0] - 1.0) * 100.0 : 0.0);
+    }
+    if (fd >= 0) close(fd);
+    return 0;
+}
+// ============================================================
+// STRUCT: Ring
+// ------------------------------------------------------------
+// Bounded lock-free queue of pointers (Vyukov's array queue:
+// every cell carries a sequence number telling producers and
+// consumers whose turn it is). Safe for any number of producers
+// and consumers; the pipeline uses it as SPSC (reader -> sched)
+// and MPSC (resolvers -> writer). Capacity is a power of two and
+// never grows, which is what bounds memory under back-pressure.
+// ============================================================
+struct RingCell {
+    size_t seq;
+    void *data;
+};
+struct Ring {
+    struct RingCell *cells;
+    size_t mask; // Capacity - 1
+    size_t head __attribute__((aligned(64))); // Next push position
+    size_t tail __attribute__((aligned(64))); // Next pop position
+};
+static int ring_init(struct Ring *r, size_t min_capacity) {
+    size_t cap = 2;
+    while (cap < min_capacity) cap <<= 1;
+    r->cells = malloc(cap * sizeof(*r->cells));
+    if (!r->cells) return -1;
+    for (size_t i = 0; i < cap; i++) r->cells[i].seq = i;
+    r->mask = cap - 1;
+    r->head = r->tail = 0;
+    return 0;
+}
+static void ring_destroy(struct Ring *r) {
+    free(r->cells);
+    r->cells = NULL;
+}
+// RETURNS: 1 if the item was queued, 0 if the ring is full.
+static int ring_try_push(struct Ring *r, void *item) {
+    size_t pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    struct RingCell *cell;
+    for (;;) {
+        cell = &r->cells[pos & r->mask];
+        size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&r->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (dif < 0) {
+            return 0;
+        } else {
+            pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+        }
+    }
+    cell->data = item;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+// RETURNS: The oldest item, or NULL if the ring is empty.
+static void *ring_try_pop(struct Ring *r) {
+    size_t pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    struct RingCell *cell;
+    for (;;) {
+        cell = &r->cells[pos & r->mask];
+        size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&r->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (dif < 0) {
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+        }
+    }
+    void *item = cell->data;
+    __atomic_store_n(&cell->seq, pos + r->mask + 1, __ATOMIC_RELEASE);
+    return item;
+}
+// ============================================================
+// STRUCT: EventCount
+// ------------------------------------------------------------
+// Lets threads sleep on a lock-free condition ("ring not empty",
+// "ring not full") without a lost-wakeup race. Waiters call
+// ec_prepare(), re-check the condition, then ec_wait() or
+// ec_cancel(). Notifiers change the state first and then call
+// ec_notify(), which is a single load when nobody is waiting.
+// ============================================================
+struct EventCount {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned epoch;
+    unsigned waiters;
+};
+static void ec_init(struct EventCount *ec) {
+    pthread_mutex_init(&ec->lock, NULL);
+    pthread_cond_init(&ec->cond, NULL);
+    ec->epoch = ec->waiters = 0;
+}
+static void ec_destroy(struct EventCount *ec) {
+    pthread_cond_destroy(&ec->cond);
+    pthread_mutex_destroy(&ec->lock);
+}
+static unsigned ec_prepare(struct EventCount *ec) {
+    __atomic_add_fetch(&ec->waiters, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return __atomic_load_n(&ec->epoch, __ATOMIC_SEQ_CST);
+}
+static void ec_cancel(struct EventCount *ec) {
+    __atomic_sub_fetch(&ec->waiters, 1, __ATOMIC_SEQ_CST);
+}
+static void ec_wait(struct EventCount *ec, unsigned key) {
+    pthread_mutex_lock(&ec->lock);
+    while (__atomic_load_n(&ec->epoch, __ATOMIC_SEQ_CST) == key)
+        pthread_cond_wait(&ec->cond, &ec->lock);
+    pthread_mutex_unlock(&ec->lock);
+    __atomic_sub_fetch(&ec->waiters, 1, __ATOMIC_SEQ_CST);
+}
+// ec_wait() that gives up once deadline (CLOCK_REALTIME) passes.
+static void ec_wait_until(struct EventCount *ec, unsigned key, const struct timespec *deadline) {
+    pthread_mutex_lock(&ec->lock);
+    while (__atomic_load_n(&ec->epoch, __ATOMIC_SEQ_CST) == key)
+        if (pthread_cond_timedwait(&ec->cond, &ec->lock, deadline) == ETIMEDOUT) break;
+    pthread_mutex_unlock(&ec->lock);
+    __atomic_sub_fetch(&ec->waiters, 1, __ATOMIC_SEQ_CST);
+}
+static void ec_notify(struct EventCount *ec) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ec->waiters, __ATOMIC_SEQ_CST) == 0) return;
+    pthread_mutex_lock(&ec->lock);
+    __atomic_add_fetch(&ec->epoch, 1, __ATOMIC_SEQ_CST);
+    pthread_cond_broadcast(&ec->cond);
+    pthread_mutex_unlock(&ec->lock);
+}
+// Blocking push: waits on `space` while the ring is full.
+static void ring_push_wait(struct Ring *r, void *item, struct EventCount *space) {
+    while (!ring_try_push(r, item)) {
+        unsigned key = ec_prepare(space);
+        if (ring_try_push(r, item)) {
+            ec_cancel(space);
+            return;
+        }
+        ec_wait(space, key);
+    }
+}
+// ============================================================
+// HELPER: hash_bytes()
+// ------------------------------------------------------------
+// 64-bit FNV-1a. Used to pick cache buckets and lock stripes;
+// not meant to resist adversarial keys.
+// ============================================================
+static uint64_t hash_bytes(const void *data, size_t len) {
+    const unsigned char *p = data;
+    uint64_t h = 1469598103934665603ull;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+// Per-thread xorshift64* generator for TTL jitter.
+static __thread uint64_t rng_state;
+static double rng_unit(void) {
+    if (rng_state == 0) rng_state = now_ns() ^ (uint64_t)(uintptr_t)&rng_state;
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (double)((rng_state * 2685821657736338717ull) >> 11) / 9007199254740992.0;
+}
+// ============================================================
+// SWISS TABLE: open addressing with metadata bytes
+// ------------------------------------------------------------
+// A map from string views to pointers. Slots come in groups of
+// 16 with one control byte each: EMPTY, DELETED, or 7 bits of
+// the key's hash. A probe compares a group's 16 control bytes
+// with those 7 bits at once (SSE2, else two 64-bit words) and
+// reads only the slots that match, so a miss rarely touches
+// a key. Groups are visited in triangular order, which reaches
+// every group when their count is a power of two, and a group
+// holding an EMPTY byte ends the search.
+// Keys are not copied: the caller keeps each key alive while it
+// is in the map and passes its hash_bytes(). A slot keeps 32
+// mixed bits of that hash, which place it again when the table
+// grows and filter candidates before memcmp(). The table grows
+// past 7/8 full; callers serialize access themselves.
+// ============================================================
+#if defined(__SSE2__)
+#include <emmintrin.h> // For _mm_cmpeq_epi8() and _mm_movemask_epi8() group probes
+#endif
+#define SWISS_GROUP 16
+#define SWISS_EMPTY 0x80
+#define SWISS_DELETED 0xfe // Both have the top bit set; a full byte never does
+struct SwissSlot {
+    const char *key;
+    void *value;
+    uint32_t len;
+    uint32_t hash; // swiss_hash(): group from the low bits, control byte from the top 7
+};
+struct SwissMap {
+    struct SwissSlot *slots; // groups * SWISS_GROUP, followed by as many control bytes
+    uint8_t *ctrl;
+    size_t groups; // Power of two, or 0 before the first insert
+    size_t size, deleted;
+};
+// hash_bytes() is FNV-1a, whose low bits mix poorly; spread them
+// before taking a group index and control byte from the result.
+static inline uint32_t swiss_hash(uint64_t hash) {
+    hash ^= hash >> 32;
+    hash *= 0x9e3779b97f4a7c15ull;
+    return (uint32_t)(hash >> 32);
+}
+#if !defined(__SSE2__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define SWISS_SWAR 1
+#else
+#define SWISS_SWAR 0
+#endif
+#if SWISS_SWAR
+// Gathers the high bit of each byte of w into bits 0-7.
+static inline unsigned swiss_word_mask(uint64_t w) {
+    return (unsigned)((((w >> 7) & 0x0101010101010101ull) * 0x0102040810204080ull) >> 56);
+}
+// Sets the high bit of each byte of w that is zero, and no other.
+static inline uint64_t swiss_word_zero(uint64_t w) {
+    const uint64_t lo7 = 0x7f7f7f7f7f7f7f7full;
+    return ~(((w & lo7) + lo7) | w | lo7);
+}
+#endif
+// Bit i of the result is set when control byte i of group equals b.
+static inline unsigned swiss_match(const uint8_t *group, uint8_t b) {
+#if defined(__SSE2__)
+    __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+    return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)b)));
+#elif SWISS_SWAR
+    uint64_t w[2], splat = 0x0101010101010101ull * b;
+    memcpy(w, group, sizeof(w));
+    return swiss_word_mask(swiss_word_zero(w[0] ^ splat)) | swiss_word_mask(swiss_word_zero(w[1] ^ splat)) << 8;
+#else
+    unsigned bits = 0;
+    for (int i = 0; i < SWISS_GROUP; i++) bits |= (unsigned)(group[i] == b) << i;
+    return bits;
+#endif
+}
+// Bit i of the result is set when slot i of group is EMPTY or DELETED.
+static inline unsigned swiss_match_free(const uint8_t *group) {
+#if defined(__SSE2__)
+    return (unsigned)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+#elif SWISS_SWAR
+    uint64_t w[2];
+    memcpy(w, group, sizeof(w));
+    return swiss_word_mask(w[0]) | swiss_word_mask(w[1]) << 8;
+#else
+    unsigned bits = 0;
+    for (int i = 0; i < SWISS_GROUP; i++) bits |= (unsigned)(group[i] >> 7) << i;
+    return bits;
+#endif
+}
+static const char *swiss_probe_name(void) {
+#if defined(__SSE2__)
+    return "sse2";
+#elif SWISS_SWAR
+    return "swar";
+#else
+    return "scalar";
+#endif
+}
+static void swiss_init(struct SwissMap *m) {
+    memset(m, 0, sizeof(*m));
+}
+static void swiss_free(struct SwissMap *m) {
+    free(m->slots);
+    swiss_init(m);
+}
+static size_t swiss_bytes(const struct SwissMap *m) {
+    return m->groups * SWISS_GROUP * (sizeof(struct SwissSlot) + 1);
+}
+static struct SwissSlot *swiss_find(const struct SwissMap *m, const char *key, size_t len, uint64_t hash) {
+    uint32_t h = swiss_hash(hash);
+    size_t g = h;
+    for (size_t step = 1; step <= m->groups; step++) {
+        g &= m->groups - 1;
+        const uint8_t *group = m->ctrl + g * SWISS_GROUP;
+        for (unsigned bits = swiss_match(group, (uint8_t)(h >> 25)); bits; bits &= bits - 1) {
+            struct SwissSlot *s = &m->slots[g * SWISS_GROUP + (size_t)__builtin_ctz(bits)];
+            if (s->hash == h && s->len == len && memcmp(s->key, key, len) == 0) return s;
+        }
+        if (swiss_match(group, SWISS_EMPTY)) break;
+        g += step;
+    }
+    return NULL;
+}
+// Stores an entry known to be absent in the first free slot of its probe sequence.
+static void swiss_place(struct SwissMap *m, const char *key, uint32_t len, uint32_t h, void *value) {
+    size_t g = h;
+    for (size_t step = 1;; step++) {
+        g &= m->groups - 1;
+        unsigned bits = swiss_match_free(m->ctrl + g * SWISS_GROUP);
+        if (bits) {
+            size_t i = g * SWISS_GROUP + (size_t)__builtin_ctz(bits);
+            if (m->ctrl[i] == SWISS_DELETED) m->deleted--;
+            m->ctrl[i] = (uint8_t)(h >> 25);
+            m->slots[i] = (struct SwissSlot){key, value, len, h};
+            return;
+        }
+        g += step;
+    }
+}
+// Rebuilds the table with room for want entries at most 25/32
+// full, which grows it or, after many erases, only drops the
+// DELETED bytes.
+static int swiss_rehash(struct SwissMap *m, size_t want) {
+    size_t groups = 1;
+    while (want * 32 > groups * SWISS_GROUP * 25) groups *= 2;
+    struct SwissMap old = *m;
+    size_t n = groups * SWISS_GROUP;
+    if ((m->slots = malloc(n * (sizeof(struct SwissSlot) + 1))) == NULL) {
+        *m = old;
+        return -1;
+    }
+    m->ctrl = (uint8_t *)(m->slots + n);
+    m->groups = groups;
+    m->deleted = 0;
+    memset(m->ctrl, SWISS_EMPTY, n);
+    for (size_t i = 0; i < old.groups * SWISS_GROUP; i++) {
+        const struct SwissSlot *s = &old.slots[i];
+        if (!(old.ctrl[i] & 0x80)) swiss_place(m, s->key, s->len, s->hash, s->value);
+    }
+    free(old.slots);
+    return 0;
+}
+// Sizes an empty or growing map for n entries up front.
+static int swiss_reserve(struct SwissMap *m, size_t n) {
+    return n * 8 > m->groups * SWISS_GROUP * 7 ? swiss_rehash(m, n) : 0;
+}
+// ============================================================
+// FUNCTION: swiss_get() / swiss_put() / swiss_erase()
+// ------------------------------------------------------------
+// The map API. hash must be hash_bytes(key, len), and keys must
+// be shorter than 4 GiB. swiss_put() replaces the key pointer as
+// well as the value of an existing entry, so a new owner of the
+// same string can take over.
+// RETURNS:
+// swiss_get(): the value, or NULL when key is absent.
+// swiss_put(): 0, or -1 when out of memory or key is too long
+// (the map is intact).
+// swiss_erase(): 1 when key was removed, 0 when it was absent.
+// ============================================================
+static void *swiss_get(const struct SwissMap *m, const char *key, size_t len, uint64_t hash) {
+    struct SwissSlot *s = swiss_find(m, key, len, hash);
+    return s ? s->value : NULL;
+}
+static int swiss_put(struct SwissMap *m, const char *key, size_t len, uint64_t hash, void *value) {
+    struct SwissSlot *s = swiss_find(m, key, len, hash);
+    if (s) {
+        s->key = key;
+        s->value = value;
+        return 0;
+    }
+    if (len > UINT32_MAX) return -1;
+    if ((m->size + m->deleted + 1) * 8 > m->groups * SWISS_GROUP * 7 && swiss_rehash(m, m->size + 1) != 0) return -1;
+    swiss_place(m, key, (uint32_t)len, swiss_hash(hash), value);
+    m->size++;
+    return 0;
+}
+static int swiss_erase(struct SwissMap *m, const char *key, size_t len, uint64_t hash) {
+    struct SwissSlot *s = swiss_find(m, key, len, hash);
+    if (!s) return 0;
+    size_t i = (size_t)(s - m->slots);
+    // Inserts only pass a group with no free byte, and erases keep
+    // it that way, so a group that still has an EMPTY byte never
+    // lay on another key's path and this slot may become EMPTY.
+    if (swiss_match(m->ctrl + i / SWISS_GROUP * SWISS_GROUP, SWISS_EMPTY)) {
+        m->ctrl[i] = SWISS_EMPTY;
+    } else {
+        m->ctrl[i] = SWISS_DELETED;
+        m->deleted++;
+    }
+    m->size--;
+    return 1;
+}
+// ============================================================
+// FUNCTION: run_swiss_test()
+// ------------------------------------------------------------
+// "--swiss-test [keys] [lookups]": loads keys generated URLs
+// (default 1000000: short links on the shortener hosts --scan
+// knows, and longer article URLs) into a SwissMap and into a
+// chained table with one malloc'd node per key and a bucket per
+// key, the layout such maps usually start from; both are sized
+// for keys up front. Then it times random hits, misses, and
+// erasing and re-adding every key.
+// RETURNS:
+// Process exit status.
+// ============================================================
+struct ChainNode {
+    const char *key;
+    size_t len;
+    uint64_t hash;
+    void *value;
+    struct ChainNode *next;
+};
+static int run_swiss_test(int argc, char *argv[]) {
+    static const char *const hosts[] = {"bit.ly", "tinyurl.com", "t.co", "goo.gl", "ow.ly", "is.gd", "rb.gy"};
+    static const char alphabet[] = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+    size_t nkeys = argc > 0 ? (size_t)strtoul(argv[0], NULL, 10) : 1000000;
+    uint64_t lookups = argc > 1 ? strtoull(argv[1], NULL, 10) : 5000000;
+    size_t nbuckets = 1;
+    while (nbuckets < nkeys) nbuckets *= 2;
+    char **keys = nkeys ? calloc(2 * nkeys, sizeof(char *)) : NULL; // Then as many absent keys
+    size_t *lens = nkeys ? calloc(2 * nkeys, sizeof(size_t)) : NULL;
+    uint64_t *hashes = nkeys ? calloc(2 * nkeys, sizeof(uint64_t)) : NULL;
+    struct ChainNode **buckets = nkeys ? calloc(nbuckets, sizeof(*buckets)) : NULL;
+    struct SwissMap map;
+    uint64_t x = 0x9e3779b97f4a7c15ull, found[2][2] = {{0, 0}, {0, 0}};
+    double ns[2][4]; // Per table: put, hit, miss, erase and put again
+    size_t chain_bytes = nbuckets * sizeof(*buckets), key_bytes = 0;
+    int status = 0;
+    swiss_init(&map);
+    if (!keys || !lens || !hashes || !buckets || lookups == 0 || swiss_reserve(&map, nkeys) != 0) {
+        fprintf(stderr, "Error: Usage: --swiss-test [keys > 0] [lookups > 0] (or out of memory)\n");
+        status = 1;
+        goto out;
+    }
+    for (size_t i = 0; i < 2 * nkeys; i++) {
+        char url[160], code[16];
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        int n = 2 + (int)(x % 4);
+        for (int k = 0; k < n; k++) code[k] = alphabet[(x >> (8 + 6 * k)) % 62];
+        for (size_t k = 0, v = i; k < 5; k++, v /= 62) code[n++] = alphabet[v % 62]; // Unique per key
+        code[n] = 0;
+        if (x % 4) {
+            snprintf(url, sizeof(url), "https://%s/%s", hosts[(x >> 60) % 7], code);
+        } else {
+            snprintf(url, sizeof(url), "https://www.example-news.com/%u/%02u/story-%s-%zu.html?utm_source=feed",
+                     2000 + (unsigned)(x >> 58), 1 + (unsigned)((x >> 40) % 12), code, i);
+        }
+        if ((keys[i] = my_strdup(url)) == NULL) {
+            fprintf(stderr, "Error: Memory allocation failed\n");
+            status = 1;
+            goto out;
+        }
+        lens[i] = strlen(url);
+        key_bytes += lens[i] + 1;
+    }
+    for (size_t i = 0; i < 2 * nkeys; i++) hashes[i] = hash_bytes(keys[i], lens[i]); // Callers cache hashes
+    for (int t = 0; t < 2; t++) {
+        uint64_t t0 = now_ns();
+        for (size_t i = 0; i < nkeys; i++) {
+            if (t == 0) {
+                struct ChainNode *node = malloc(sizeof(*node)), **b = &buckets[hashes[i] & (nbuckets - 1)];
+                if (!node) {
+                    status = 1;
+                    break;
+                }
+                *node = (struct ChainNode){keys[i], lens[i], hashes[i], keys[i], *b};
+                *b = node;
+            } else if (swiss_put(&map, keys[i], lens[i], hashes[i], keys[i]) != 0) {
+                status = 1;
+                break;
+            }
+        }
+        ns[t][0] = (double)(now_ns() - t0) / (double)nkeys;
+        for (int miss = 0; miss < 2 && status == 0; miss++) {
+            uint64_t y = 88172645463325252ull;
+            t0 = now_ns();
+            for (uint64_t l = 0; l < lookups; l++) {
+                y ^= y << 13;
+                y ^= y >> 7;
+                y ^= y << 17;
+                size_t i = (size_t)(y % nkeys) + (miss ? nkeys : 0);
+                void *v;
+                if (t == 0) {
+                    struct ChainNode *node = buckets[hashes[i] & (nbuckets - 1)];
+                    while (node && !(node->hash == hashes[i] && node->len == lens[i] &&
+                                     memcmp(node->key, keys[i], lens[i]) == 0))
+                        node = node->next;
+                    v = node ? node->value : NULL;
+                } else {
+                    v = swiss_get(&map, keys[i], lens[i], hashes[i]);
+                }
+                found[t][miss] += v != NULL;
+            }
+            ns[t][1 + miss] = (double)(now_ns() - t0) / (double)lookups;
+        }
+        t0 = now_ns();
+        for (size_t i = 0; i < nkeys && status == 0; i++) {
+            if (t == 0) {
+                struct ChainNode **p = &buckets[hashes[i] & (nbuckets - 1)], *node;
+                while (!((*p)->hash == hashes[i] && (*p)->len == lens[i] && memcmp((*p)->key, keys[i], lens[i]) == 0))
+                    p = &(*p)->next;
+                node = *p;
+                *p = node->next;
+                free(node);
+                if ((node = malloc(sizeof(*node))) == NULL) {
+                    status = 1;
+                    break;
+                }
+                p = &buckets[hashes[i] & (nbuckets - 1)];
+                *node = (struct ChainNode){keys[i], lens[i], hashes[i], keys[i], *p};
+                *p = node;
+            } else if (swiss_erase(&map, keys[i], lens[i], hashes[i]) != 1 ||
+                       swiss_put(&map, keys[i], lens[i], hashes[i], keys[i]) != 0) {
+                status = 1;
+            }
+        }
+        ns[t][3] = (double)(now_ns() - t0) / (double)nkeys;
+        if (status != 0) {
+            fprintf(stderr, "Error: Memory allocation failed\n");
+            goto out;
+        }
+    }
+    chain_bytes += nkeys * ((sizeof(struct ChainNode) + 8 + 15) & ~(size_t)15); // glibc chunk per node
+    for (int t = 0; t < 2; t++)
+        printf("[swiss-test] table=%s probe=%s keys=%zu avg_key_bytes=%.1f put_ns=%.1f hit_ns=%.1f miss_ns=%.1f "
+               "erase_put_ns=%.1f bytes_per_key=%.1f hits=%llu false_hits=%llu\n",
+               t == 0 ? "chained" : "swiss", t == 0 ? "list" : swiss_probe_name(), nkeys,
+               (double)key_bytes / (double)(2 * nkeys), ns[t][0], ns[t][1], ns[t][2], ns[t][3],
+               (double)(t == 0 ? chain_bytes : swiss_bytes(&map)) / (double)nkeys,
+               (unsigned long long)found[t][0], (unsigned long long)found[t][1]);
+    printf("[swiss-test] swiss vs chained: hit %.2fx miss %.2fx put %.2fx, %.0f%% of the memory\n",
+           ns[0][1] / ns[1][1], ns[0][2] / ns[1][2], ns[0][0] / ns[1][0],
+           100.0 * (double)swiss_bytes(&map) / (double)chain_bytes);
+out:
+    for (size_t b = 0; buckets && b < nbuckets; b++) {
+        for (struct ChainNode *node = buckets[b], *next; node; node = next) {
+            next = node->next;
+            free(node);
+        }
+    }
+    for (size_t i = 0; keys && i < 2 * nkeys; i++) free(keys[i]);
+    swiss_free(&map);
+    free(buckets);
+    free(keys);
+    free(lens);
+    free(hashes);
+    return status;
+}
+// ============================================================
+// SYMBOL TABLE: FSST-style URL compression
+// ------------------------------------------------------------
+// A table of up to 255 symbols (1-8 byte strings) learned from
+// sample URLs ("https://www.", ".com/", "?utm_source=" ...). Each
+// URL is encoded on its own as a sequence of one-byte symbol codes;
+// code 255 escapes one literal byte. Because no state crosses
+// entries, any single URL decodes independently - a redirect only
+// pays for the entry it serves.
+//
+// Training follows the FSST recipe: a few rounds of encoding the
+// sample with the current table, counting how often each symbol
+// and each pair of adjacent symbols occurs, then keeping the 255
+// candidates (symbols and concatenated pairs) with the highest
+// gain = count * length.
+// ============================================================
+#define SYM_MAX 255
+#define SYM_ESCAPE 255
+#define SYM_MAX_LEN 8
+struct SymbolTable {
+    unsigned nsym;
+    unsigned char len[SYM_MAX];
+    unsigned char sym[SYM_MAX][SYM_MAX_LEN]; // Zero-padded
+    // Encoder lookup: codes of symbols starting with a byte,
+    // longest first
+    unsigned char by_first_n[256];
+    unsigned char by_first[256][SYM_MAX];
+};
+static void symtab_index(struct SymbolTable *t) {
+    memset(t->by_first_n, 0, sizeof(t->by_first_n));
+    for (unsigned l = SYM_MAX_LEN; l >= 1; l--)
+        for (unsigned i = 0; i < t->nsym; i++)
+            if (t->len[i] == l) {
+                unsigned char f = t->sym[i][0];
+                t->by_first[f][t->by_first_n[f]++] = (unsigned char)i;
+            }
+}
+// Longest symbol matching at p (n bytes left), or -1.
+static int symtab_match(const struct SymbolTable *t, const unsigned char *p, size_t n) {
+    unsigned char f = p[0];
+    for (unsigned k = 0; k < t->by_first_n[f]; k++) {
+        unsigned code = t->by_first[f][k];
+        if (t->len[code] <= n && memcmp(t->sym[code], p, t->len[code]) == 0) return (int)code;
+    }
+    return -1;
+}
+// ============================================================
+// FUNCTION: symtab_encode()
+// ------------------------------------------------------------
+// PARAMETERS:
+// out → Buffer of at least 2 * len bytes (worst case: all escapes)
+// RETURNS:
+// Encoded length.
+// ============================================================
+static size_t symtab_encode(const struct SymbolTable *t, const unsigned char *in, size_t len, unsigned char *out) {
+    size_t o = 0;
+    for (size_t i = 0; i < len;) {
+        int code = symtab_match(t, in + i, len - i);
+        if (code >= 0) {
+            out[o++] = (unsigned char)code;
+            i += t->len[code];
+        } else {
+            out[o++] = SYM_ESCAPE;
+            out[o++] = in[i++];
+        }
+    }
+    return o;
+}
+// Decodes into out (capacity cap). RETURNS: decoded length, or
+// (size_t)-1 if the input is corrupt or does not fit.
+static size_t symtab_decode(const struct SymbolTable *t, const unsigned char *in, size_t len, char *out, size_t cap) {
+    size_t o = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned code = in[i];
+        if (code == SYM_ESCAPE) {
+            if (++i == len || o == cap) return (size_t)-1;
+            out[o++] = (char)in[i];
+        } else {
+            if (code >= t->nsym || o + t->len[code] > cap) return (size_t)-1;
+            // Symbols are zero-padded: a fixed 8-byte copy compiles to
+            // one load and store, a variable-length one does not
+            if (o + SYM_MAX_LEN <= cap) memcpy(out + o, t->sym[code], SYM_MAX_LEN);
+            else memcpy(out + o, t->sym[code], t->len[code]);
+            o += t->len[code];
+        }
+    }
+    return o;
+}
+struct SymCandidate {
+    unsigned char bytes[SYM_MAX_LEN];
+    unsigned char len;
+    uint64_t gain;
+};
+static int sym_candidate_cmp(const void *a, const void *b) {
+    const struct SymCandidate *x = a, *y = b;
+    if (x->gain != y->gain) return x->gain < y->gain ? 1 : -1;
+    return memcmp(x->bytes, y->bytes, SYM_MAX_LEN);
+}
+// Adds gain to the candidate for bytes[0..len), merging duplicates
+// through a small open-addressing table keyed by content.
+static void sym_candidate_add(struct SymCandidate *tab, size_t mask, const unsigned char *bytes, size_t len,
+                              uint64_t gain) {
+    unsigned char key[SYM_MAX_LEN] = {0};
+    memcpy(key, bytes, len);
+    for (size_t i = hash_bytes(key, sizeof(key)) & mask;; i = (i + 1) & mask) {
+        if (tab[i].len == 0) {
+            memcpy(tab[i].bytes, key, sizeof(key));
+            tab[i].len = (unsigned char)len;
+            tab[i].gain = gain;
+            return;
+        }
+        if (tab[i].len == len && memcmp(tab[i].bytes, key, sizeof(key)) == 0) {
+            tab[i].gain += gain;
+            return;
+        }
+    }
+}
+// Bytes behind training code c (< 256: a literal byte).
+static size_t sym_code_bytes(const struct SymbolTable *t, int c, unsigned char *out) {
+    if (c < 256) {
+        out[0] = (unsigned char)c;
+        return 1;
+    }
+    memcpy(out, t->sym[c - 256], t->len[c - 256]);
+    return t->len[c - 256];
+}
+// ============================================================
+// FUNCTION: symtab_train()
+// ------------------------------------------------------------
+// Builds t from samples (NUL-terminated URLs).
+// RETURNS:
+// 0 on success, -1 on allocation failure.
+// ============================================================
+static int symtab_train(struct SymbolTable *t, char *const *samples, size_t nsamples) {
+    enum { CODES = 256 + SYM_MAX }; // Literal bytes, then symbols
+    uint32_t *count1 = malloc(CODES * sizeof(uint32_t));
+    uint32_t *count2 = malloc((size_t)CODES * CODES * sizeof(uint32_t));
+    size_t cand_cap = 1u << 19; // At least twice CODES + CODES * CODES
+    struct SymCandidate *cand = malloc(cand_cap * sizeof(*cand));
+    if (!count1 || !count2 || !cand) {
+        free(count1);
+        free(count2);
+        free(cand);
+        return -1;
+    }
+    memset(t, 0, sizeof(*t));
+    for (int round = 0; round < 5; round++) {
+        memset(count1, 0, CODES * sizeof(uint32_t));
+        memset(count2, 0, (size_t)CODES * CODES * sizeof(uint32_t));
+        for (size_t s = 0; s < nsamples; s++) {
+            const unsigned char *p = (const unsigned char *)samples[s];
+            size_t n = strlen(samples[s]);
+            int prev = -1;
+            for (size_t i = 0; i < n;) {
+                int code = symtab_match(t, p + i, n - i);
+                int c = code >= 0 ? 256 + code : p[i];
+                i += code >= 0 ? t->len[code] : 1;
+                count1[c]++;
+                if (prev >= 0) count2[(size_t)prev * CODES + (size_t)c]++;
+                prev = c;
+            }
+        }
+        memset(cand, 0, cand_cap * sizeof(*cand));
+        for (int a = 0; a < CODES; a++) {
+            if (!count1[a]) continue;
+            unsigned char buf[2 * SYM_MAX_LEN];
+            size_t alen = sym_code_bytes(t, a, buf);
+            sym_candidate_add(cand, cand_cap - 1, buf, alen, (uint64_t)count1[a] * alen);
+            for (int b = 0; b < CODES; b++) {
+                uint32_t n2 = count2[(size_t)a * CODES + (size_t)b];
+                if (n2 < 2) continue;
+                size_t blen = sym_code_bytes(t, b, buf + alen);
+                if (alen + blen <= SYM_MAX_LEN)
+                    sym_candidate_add(cand, cand_cap - 1, buf, alen + blen, (uint64_t)n2 * (alen + blen));
+            }
+        }
+        qsort(cand, cand_cap, sizeof(*cand), sym_candidate_cmp);
+        // Bytes that lose out stay reachable through escapes.
+        t->nsym = 0;
+        for (size_t i = 0; i < cand_cap && t->nsym < SYM_MAX && cand[i].gain > 0; i++) {
+            t->len[t->nsym] = cand[i].len;
+            memcpy(t->sym[t->nsym], cand[i].bytes, SYM_MAX_LEN);
+            t->nsym++;
+        }
+        symtab_index(t);
+    }
+    free(count1);
+    free(count2);
+    free(cand);
+    return 0;
+}
+// Serialized form: nsym, lens[nsym], then the symbol bytes.
+static size_t symtab_serialize(const struct SymbolTable *t, unsigned char *out) {
+    size_t o = 0;
+    out[o++] = (unsigned char)t->nsym;
+    for (unsigned i = 0; i < t->nsym; i++) out[o++] = t->len[i];
+    for (unsigned i = 0; i < t->nsym; i++) {
+        memcpy(out + o, t->sym[i], t->len[i]);
+        o += t->len[i];
+    }
+    return o;
+}
+static int symtab_deserialize(struct SymbolTable *t, const unsigned char *in, size_t len) {
+    memset(t, 0, sizeof(*t));
+    if (len < 1 || len < 1u + in[0]) return -1;
+    t->nsym = in[0];
+    size_t o = 1 + t->nsym;
+    for (unsigned i = 0; i < t->nsym; i++) {
+        t->len[i] = in[1 + i];
+        if (t->len[i] < 1 || t->len[i] > SYM_MAX_LEN || o + t->len[i] > len) return -1;
+        memcpy(t->sym[i], in + o, t->len[i]);
+        o += t->len[i];
+    }
+    symtab_index(t);
+    return 0;
+}
+// ============================================================
+// COLD TIER: sorted, compressed, immutable cache segments
+// ------------------------------------------------------------
+// With --cache-hot-mb, each shard keeps at most that much record
+// data in its mmap'd hot file. When a compaction finds more, the
+// oldest-written records are demoted into a cold segment:
+//
+//   [ header | blocks ... | block index | first keys | bloom | dict ]
+//
+// Records are sorted by key and packed into ~16 KiB blocks. Inside
+// a block every key is front-coded against the previous one (URLs
+// share long prefixes), and when built with -DCIPHER_USE_ZSTD each
+// block is then compressed with a zstd dictionary trained on the
+// segment's own blocks. A lookup costs one Bloom filter probe
+// (10 bits/key), a binary search over the first key of each block
+// and the decoding of a single block.
+//
+// A shard's segment ids live in its hot header, so compaction
+// publishes a new segment list atomically with the new hot file.
+// Once COLD_MAX_SEGMENTS exist, the next demotion merges all of
+// them into one (newest version of a key wins, expired ones drop).
+// ============================================================
+#ifdef CIPHER_USE_ZSTD
+#include <zstd.h> // For block compression of cold segments
+#include <zdict.h> // For ZDICT_trainFromBuffer()
+#endif
+#define SEG_MAGIC "CIPHSEG1"
+#define SEG_HEADER_SIZE 256
+#define SEG_BLOCK_TARGET (16u << 10)
+#define SEG_BLOOM_BITS_PER_KEY 10
+#define SEG_BLOOM_K 7
+#define SEG_DICT_SAMPLE_BLOCKS 64
+#define SEG_DICT_SIZE (16u << 10)
+#define SEG_FLAG_ZSTD 1u
+#define COLD_MAX_SEGMENTS 8
+struct SegHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags; // SEG_FLAG_ZSTD
+    uint64_t nentries;
+    uint64_t nblocks;
+    uint64_t index_off; // nblocks x struct SegIndexEntry
+    uint64_t keys_off; // Pool of first keys referenced by the index
+    uint64_t bloom_off;
+    uint64_t bloom_bits; // Power of two
+    uint64_t dict_off;
+    uint64_t dict_len; // 0 when blocks are not zstd-compressed
+    uint64_t raw_bytes; // Sum of uncompressed block sizes
+    uint64_t file_size;
+};
+struct SegIndexEntry {
+    uint64_t offset; // Block position in the file
+    uint64_t key_off; // First key, relative to keys_off
+    uint32_t stored_len; // Bytes on disk
+    uint32_t raw_len; // Bytes once decompressed
+    uint32_t key_len;
+    uint32_t nentries;
+};
+struct ColdSegment {
+    unsigned char *base;
+    size_t size;
+    uint64_t id;
+#ifdef CIPHER_USE_ZSTD
+    ZSTD_DDict *ddict;
+#endif
+};
+// One decoded entry; key and value point into a block buffer.
+struct ColdEntry {
+    const unsigned char *key;
+    size_t klen;
+    const unsigned char *value;
+    size_t vlen;
+    int64_t fresh_until;
+    int64_t stale_until;
+    uint32_t flags;
+};
+static const struct SegHeader *seg_header(const struct ColdSegment *s) {
+    return (const struct SegHeader *)s->base;
+}
+static void seg_cold_path(char *out, size_t cap, const char *prefix, uint64_t id) {
+    snprintf(out, cap, "%s.cold-%06llu.seg", prefix, (unsigned long long)id);
+}
+static size_t varint_put(unsigned char *p, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (unsigned char)v;
+    return n;
+}
+// RETURNS: bytes consumed, or 0 if the varint runs past end.
+static size_t varint_get(const unsigned char *p, const unsigned char *end, uint64_t *v) {
+    uint64_t r = 0;
+    for (size_t n = 0; p + n < end && n < 10; n++) {
+        r |= (uint64_t)(p[n] & 0x7f) << (7 * n);
+        if (!(p[n] & 0x80)) {
+            *v = r;
+            return n + 1;
+        }
+    }
+    return 0;
+}
+// Decodes the entry at *pos, front-coded against prev (whose key
+// bytes live in keybuf, capacity keycap, and are updated in place).
+// RETURNS: 1 on success, 0 at end of block or on corruption.
+static int seg_decode_entry(const unsigned char **pos, const unsigned char *end, unsigned char **keybuf,
+                            size_t *keycap, struct ColdEntry *e) {
+    const unsigned char *p = *pos;
+    uint64_t shared, suffix, vlen;
+    size_t n;
+    if (p >= end) return 0;
+    if (!(n = varint_get(p, end, &shared))) return 0;
+    p += n;
+    if (!(n = varint_get(p, end, &suffix))) return 0;
+    p += n;
+    if (shared > e->klen || suffix > (uint64_t)(end - p)) return 0;
+    if (shared + suffix > *keycap) {
+        size_t cap = (size_t)(shared + suffix) * 2;
+        unsigned char *grown = realloc(*keybuf, cap);
+        if (!grown) return 0;
+        *keybuf = grown;
+        *keycap = cap;
+    }
+    memcpy(*keybuf + shared, p, (size_t)suffix);
+    p += suffix;
+    if (!(n = varint_get(p, end, &vlen))) return 0;
+    p += n;
+    if (vlen + 17 > (uint64_t)(end - p)) return 0;
+    e->key = *keybuf;
+    e->klen = (size_t)(shared + suffix);
+    e->value = p;
+    e->vlen = (size_t)vlen;
+    p += vlen;
+    memcpy(&e->fresh_until, p, 8);
+    memcpy(&e->stale_until, p + 8, 8);
+    e->flags = p[16];
+    *pos = p + 17;
+    return 1;
+}
+#ifdef CIPHER_USE_ZSTD
+static pthread_key_t seg_dctx_key;
+static pthread_once_t seg_dctx_once = PTHREAD_ONCE_INIT;
+static void seg_dctx_free(void *dctx) {
+    ZSTD_freeDCtx(dctx);
+}
+static void seg_dctx_init(void) {
+    pthread_key_create(&seg_dctx_key, seg_dctx_free);
+}
+// Per-thread decompression context (created on first use).
+static ZSTD_DCtx *seg_dctx(void) {
+    pthread_once(&seg_dctx_once, seg_dctx_init);
+    ZSTD_DCtx *dctx = pthread_getspecific(seg_dctx_key);
+    if (!dctx && (dctx = ZSTD_createDCtx()) != NULL) pthread_setspecific(seg_dctx_key, dctx);
+    return dctx;
+}
+#endif
+// ============================================================
+// FUNCTION: seg_load_block()
+// ------------------------------------------------------------
+// RETURNS:
+// Heap buffer with block b in raw (front-coded) form, its length
+// in *raw_len, or NULL on corruption/allocation failure. The index
+// entry was bounds-checked by seg_open().
+// ============================================================
+static unsigned char *seg_load_block(const struct ColdSegment *s, uint64_t b, size_t *raw_len) {
+    const struct SegHeader *h = seg_header(s);
+    const struct SegIndexEntry *ix = (const struct SegIndexEntry *)(s->base + h->index_off) + b;
+    unsigned char *raw = malloc(ix->raw_len ? ix->raw_len : 1);
+    if (!raw) return NULL;
+    if (!(h->flags & SEG_FLAG_ZSTD)) {
+        memcpy(raw, s->base + ix->offset, ix->raw_len);
+    } else {
+#ifdef CIPHER_USE_ZSTD
+        ZSTD_DCtx *dctx = seg_dctx();
+        size_t got = dctx ? ZSTD_decompress_usingDDict(dctx, raw, ix->raw_len, s->base + ix->offset,
+                                                       ix->stored_len, s->ddict)
+                          : 0;
+        if (!dctx || ZSTD_isError(got) || got != ix->raw_len) {
+            free(raw);
+            return NULL;
+        }
+#else
+        free(raw); // Segment written by a zstd-enabled build
+        return NULL;
+#endif
+    }
+    *raw_len = ix->raw_len;
+    return raw;
+}
+static void seg_bloom_probe(uint64_t hash, uint64_t bits, uint64_t *pos) {
+    uint64_t h2 = (hash >> 33 | hash << 31) | 1;
+    for (int i = 0; i < SEG_BLOOM_K; i++) pos[i] = (hash + (uint64_t)i * h2) & (bits - 1);
+}
+static int seg_key_cmp(const void *a, size_t alen, const void *b, size_t blen) {
+    int c = memcmp(a, b, alen < blen ? alen : blen);
+    return c ? c : (alen > blen) - (alen < blen);
+}
+// ============================================================
+// FUNCTION: seg_get()
+// ------------------------------------------------------------
+// Looks key up in one segment.
+// RETURNS:
+// 1 and fills the out parameters (value is a heap string) if the
+// segment holds the key, 0 otherwise.
+// ============================================================
+static int seg_get(const struct ColdSegment *s, const char *key, size_t klen, uint64_t hash, char **value,
+                   int64_t *fresh_until, int64_t *stale_until, uint32_t *flags) {
+    const struct SegHeader *h = seg_header(s);
+    uint64_t pos[SEG_BLOOM_K];
+    seg_bloom_probe(hash, h->bloom_bits, pos);
+    for (int i = 0; i < SEG_BLOOM_K; i++)
+        if (!(s->base[h->bloom_off + pos[i] / 8] & (1u << (pos[i] % 8)))) return 0;
+    const struct SegIndexEntry *ix = (const struct SegIndexEntry *)(s->base + h->index_off);
+    const unsigned char *keys = s->base + h->keys_off;
+    uint64_t lo = 0, hi = h->nblocks; // Last block whose first key <= key
+    while (hi - lo > 1) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (seg_key_cmp(keys + ix[mid].key_off, ix[mid].key_len, key, klen) <= 0) lo = mid; else hi = mid;
+    }
+    if (h->nblocks == 0) return 0;
+    size_t raw_len;
+    unsigned char *raw = seg_load_block(s, lo, &raw_len);
+    if (!raw) return 0;
+    const unsigned char *p = raw;
+    unsigned char *keybuf = NULL;
+    size_t keycap = 0;
+    struct ColdEntry e;
+    int found = 0;
+    e.klen = 0;
+    while (seg_decode_entry(&p, raw + raw_len, &keybuf, &keycap, &e)) {
+        int c = seg_key_cmp(e.key, e.klen, key, klen);
+        if (c > 0) break;
+        if (c == 0) {
+            if ((*value = malloc(e.vlen + 1)) != NULL) {
+                memcpy(*value, e.value, e.vlen);
+                (*value)[e.vlen] = 0;
+                *fresh_until = e.fresh_until;
+                *stale_until = e.stale_until;
+                *flags = e.flags;
+                found = 1;
+            }
+            break;
+        }
+    }
+    free(keybuf);
+    free(raw);
+    return found;
+}
+// RETURNS: 1 if [off, off + len) lies within size bytes.
+static int seg_range_ok(uint64_t off, uint64_t len, uint64_t size) {
+    return off <= size && len <= size - off;
+}
+// Maps a segment and checks its header and every index entry once,
+// so that lookups and merges can trust them (the cache directory
+// is shared, and a segment may be truncated or corrupt).
+// RETURNS: the segment, or NULL if it is missing or invalid.
+static struct ColdSegment *seg_open(const char *prefix, uint64_t id) {
+    char path[4200];
+    seg_cold_path(path, sizeof(path), prefix, id);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    struct ColdSegment *s = calloc(1, sizeof(*s));
+    if (!s || fstat(fd, &st) != 0 || (size_t)st.st_size < SEG_HEADER_SIZE) {
+        close(fd);
+        free(s);
+        return NULL;
+    }
+    s->size = (size_t)st.st_size;
+    s->id = id;
+    s->base = mmap(NULL, s->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    const struct SegHeader *h = s->base != MAP_FAILED ? seg_header(s) : NULL;
+    int ok = h && memcmp(h->magic, SEG_MAGIC, 8) == 0 && h->file_size == s->size &&
+             h->nblocks <= s->size / sizeof(struct SegIndexEntry) &&
+             seg_range_ok(h->index_off, h->nblocks * sizeof(struct SegIndexEntry), s->size) &&
+             h->bloom_bits >= 8 && (h->bloom_bits & (h->bloom_bits - 1)) == 0 &&
+             seg_range_ok(h->bloom_off, h->bloom_bits / 8, s->size) &&
+             seg_range_ok(h->dict_off, h->dict_len, s->size) && h->keys_off <= s->size;
+    for (uint64_t b = 0; ok && b < h->nblocks; b++) {
+        const struct SegIndexEntry *ix = (const struct SegIndexEntry *)(s->base + h->index_off) + b;
+        ok = seg_range_ok(ix->offset, ix->stored_len, s->size) &&
+             seg_range_ok(ix->key_off, ix->key_len, s->size - h->keys_off) &&
+             ((h->flags & SEG_FLAG_ZSTD) || ix->raw_len == ix->stored_len); // Raw blocks are copied as stored
+    }
+#ifdef CIPHER_USE_ZSTD
+    if (ok && (h->flags & SEG_FLAG_ZSTD))
+        ok = (s->ddict = ZSTD_createDDict(s->base + h->dict_off, h->dict_len)) != NULL;
+#else
+    if (ok && (h->flags & SEG_FLAG_ZSTD)) {
+        fprintf(stderr, "Error: Cache segment '%s' needs a build with -DCIPHER_USE_ZSTD\n", path);
+        ok = 0;
+    }
+#endif
+    if (!ok) {
+        if (s->base != MAP_FAILED) munmap(s->base, s->size);
+        free(s);
+        return NULL;
+    }
+    madvise(s->base, s->size, MADV_RANDOM);
+    return s;
+}
+static void seg_close(struct ColdSegment *s) {
+    if (!s) return;
+#ifdef CIPHER_USE_ZSTD
+    ZSTD_freeDDict(s->ddict);
+#endif
+    munmap(s->base, s->size);
+    free(s);
+}
+// ============================================================
+// STRUCT: SegWriter
+// ------------------------------------------------------------
+// Streams key-sorted entries into a new segment file. Raw blocks
+// are held back until SEG_DICT_SAMPLE_BLOCKS exist (or the input
+// ends) so the zstd dictionary can be trained on them first.
+// ============================================================
+struct SegWriter {
+    int fd;
+    uint64_t off; // Next block position
+    struct SegHeader h;
+    unsigned char *bloom;
+    struct SegIndexEntry *index;
+    size_t index_cap;
+    unsigned char *keys; // First-key pool
+    size_t keys_len, keys_cap;
+    unsigned char *block; // Block being filled
+    size_t block_len, block_cap;
+    uint32_t block_entries;
+    unsigned char *prev_key; // For front coding
+    size_t prev_len, prev_cap;
+    unsigned char **pending; // Raw blocks awaiting the dictionary
+    size_t npending;
+    int compress; // Use zstd for this segment
+    int failed;
+#ifdef CIPHER_USE_ZSTD
+    unsigned char dict[SEG_DICT_SIZE];
+    ZSTD_CDict *cdict;
+    ZSTD_CCtx *cctx;
+#endif
+};
+static int sw_grow(unsigned char **buf, size_t *cap, size_t need) {
+    if (need <= *cap) return 0;
+    size_t cap2 = *cap ? *cap : 256;
+    while (cap2 < need) cap2 *= 2;
+    unsigned char *grown = realloc(*buf, cap2);
+    if (!grown) return -1;
+    *buf = grown;
+    *cap = cap2;
+    return 0;
+}
+static void sw_write_raw(struct SegWriter *w, const void *data, size_t len) {
+    if (w->failed) return;
+    if (pwrite(w->fd, data, len, (off_t)w->off) != (ssize_t)len) w->failed = 1;
+    w->off += len;
+}
+// Writes one raw block (index entry already recorded) to the file.
+static void sw_emit_block(struct SegWriter *w, uint64_t b, const unsigned char *raw) {
+    struct SegIndexEntry *ix = &w->index[b];
+    ix->offset = w->off;
+#ifdef CIPHER_USE_ZSTD
+    if (w->compress) {
+        size_t cap = ZSTD_compressBound(ix->raw_len);
+        unsigned char *out = malloc(cap);
+        size_t n = out ? ZSTD_compress_usingCDict(w->cctx, out, cap, raw, ix->raw_len, w->cdict) : 0;
+        if (!out || ZSTD_isError(n)) {
+            w->failed = 1;
+        } else {
+            ix->stored_len = (uint32_t)n;
+            sw_write_raw(w, out, n);
+        }
+        free(out);
+        return;
+    }
+#endif
+    ix->stored_len = ix->raw_len;
+    sw_write_raw(w, raw, ix->raw_len);
+}
+// Trains the dictionary on the held-back blocks and flushes them.
+static void sw_flush_pending(struct SegWriter *w) {
+#ifdef CIPHER_USE_ZSTD
+    if (w->compress && !w->cdict) {
+        size_t total = 0;
+        size_t *sizes = malloc((w->npending + 1) * sizeof(size_t));
+        unsigned char *samples = NULL;
+        for (size_t i = 0; i < w->npending; i++) total += w->index[w->h.nblocks - w->npending + i].raw_len;
+        samples = malloc(total + 1);
+        size_t dict_len = 0, at = 0;
+        if (sizes && samples) {
+            for (size_t i = 0; i < w->npending; i++) {
+                size_t len = w->index[w->h.nblocks - w->npending + i].raw_len;
+                memcpy(samples + at, w->pending[i], len);
+                sizes[i] = len;
+                at += len;
+            }
+            dict_len = ZDICT_trainFromBuffer(w->dict, sizeof(w->dict), samples, sizes, (unsigned)w->npending);
+        }
+        free(sizes);
+        free(samples);
+        // Too little data to train on: fall back to plain blocks.
+        if (!sizes || !samples || ZDICT_isError(dict_len) ||
+            !(w->cdict = ZSTD_createCDict(w->dict, dict_len, 3)) || !(w->cctx = ZSTD_createCCtx())) {
+            w->compress = 0;
+        } else {
+            w->h.dict_len = dict_len;
+        }
+    }
+#endif
+    for (size_t i = 0; i < w->npending; i++) {
+        sw_emit_block(w, w->h.nblocks - w->npending + i, w->pending[i]);
+        free(w->pending[i]);
+    }
+    w->npending = 0;
+}
+static int sw_dict_ready(const struct SegWriter *w) {
+#ifdef CIPHER_USE_ZSTD
+    return !w->compress || w->cdict != NULL;
+#else
+    (void)w;
+    return 1;
+#endif
+}
+static void sw_finish_block(struct SegWriter *w) {
+    if (w->block_entries == 0) return;
+    struct SegIndexEntry *ix = &w->index[w->h.nblocks];
+    ix->raw_len = (uint32_t)w->block_len;
+    ix->nentries = w->block_entries;
+    w->h.raw_bytes += w->block_len;
+    w->pending[w->npending++] = w->block;
+    w->h.nblocks++;
+    w->block = NULL;
+    w->block_len = w->block_cap = 0;
+    w->block_entries = 0;
+    w->prev_len = 0;
+    if (w->npending == SEG_DICT_SAMPLE_BLOCKS || sw_dict_ready(w)) sw_flush_pending(w);
+}
+static int sw_open(struct SegWriter *w, const char *tmp_path, uint64_t max_entries) {
+    memset(w, 0, sizeof(*w));
+    w->fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (w->fd < 0) return -1;
+    uint64_t bits = 64;
+    while (bits < max_entries * SEG_BLOOM_BITS_PER_KEY) bits <<= 1;
+    w->h.bloom_bits = bits;
+    w->bloom = calloc(bits / 8, 1);
+    w->pending = calloc(SEG_DICT_SAMPLE_BLOCKS, sizeof(*w->pending));
+    w->off = SEG_HEADER_SIZE;
+#ifdef CIPHER_USE_ZSTD
+    w->compress = 1;
+#endif
+    if (!w->bloom || !w->pending) {
+        close(w->fd);
+        free(w->bloom);
+        free(w->pending);
+        return -1;
+    }
+    return 0;
+}
+// Appends one entry; keys must arrive in strictly ascending order.
+static void sw_add(struct SegWriter *w, const struct ColdEntry *e, uint64_t hash) {
+    if (w->failed) return;
+    if (w->block_entries == 0) {
+        // Starting a block: record its first key for the index.
+        if (w->h.nblocks + 1 > w->index_cap) {
+            size_t cap = w->index_cap ? w->index_cap * 2 : 64;
+            struct SegIndexEntry *grown = realloc(w->index, cap * sizeof(*grown));
+            if (!grown) {
+                w->failed = 1;
+                return;
+            }
+            w->index = grown;
+            w->index_cap = cap;
+        }
+        if (sw_grow(&w->keys, &w->keys_cap, w->keys_len + e->klen) != 0) {
+            w->failed = 1;
+            return;
+        }
+        memset(&w->index[w->h.nblocks], 0, sizeof(w->index[0]));
+        w->index[w->h.nblocks].key_off = w->keys_len;
+        w->index[w->h.nblocks].key_len = (uint32_t)e->klen;
+        memcpy(w->keys + w->keys_len, e->key, e->klen);
+        w->keys_len += e->klen;
+    }
+    size_t shared = 0;
+    while (shared < w->prev_len && shared < e->klen && w->prev_key[shared] == e->key[shared]) shared++;
+    if (sw_grow(&w->block, &w->block_cap, w->block_len + 30 + e->klen - shared + e->vlen + 17) != 0 ||
+        sw_grow(&w->prev_key, &w->prev_cap, e->klen) != 0) {
+        w->failed = 1;
+        return;
+    }
+    unsigned char *p = w->block + w->block_len;
+    p += varint_put(p, shared);
+    p += varint_put(p, e->klen - shared);
+    memcpy(p, e->key + shared, e->klen - shared);
+    p += e->klen - shared;
+    p += varint_put(p, e->vlen);
+    memcpy(p, e->value, e->vlen);
+    p += e->vlen;
+    memcpy(p, &e->fresh_until, 8);
+    memcpy(p + 8, &e->stale_until, 8);
+    p[16] = (unsigned char)e->flags;
+    w->block_len = (size_t)(p + 17 - w->block);
+    memcpy(w->prev_key, e->key, e->klen);
+    w->prev_len = e->klen;
+    w->block_entries++;
+    w->h.nentries++;
+    uint64_t pos[SEG_BLOOM_K];
+    seg_bloom_probe(hash, w->h.bloom_bits, pos);
+    for (int i = 0; i < SEG_BLOOM_K; i++) w->bloom[pos[i] / 8] |= (unsigned char)(1u << (pos[i] % 8));
+    if (w->block_len >= SEG_BLOCK_TARGET) sw_finish_block(w);
+}
+// Writes the trailer and header. RETURNS: 0 on success.
+static int sw_close(struct SegWriter *w) {
+    static const unsigned char zeros[8];
+    sw_finish_block(w);
+    if (w->npending) sw_flush_pending(w);
+    sw_write_raw(w, zeros, (8 - w->off % 8) % 8); // Readers access the index in place
+    w->h.index_off = w->off;
+    sw_write_raw(w, w->index, w->h.nblocks * sizeof(*w->index));
+    w->h.keys_off = w->off;
+    sw_write_raw(w, w->keys, w->keys_len);
+    w->h.bloom_off = w->off;
+    sw_write_raw(w, w->bloom, w->h.bloom_bits / 8);
+    w->h.dict_off = w->off;
+#ifdef CIPHER_USE_ZSTD
+    if (w->compress) {
+        w->h.flags |= SEG_FLAG_ZSTD;
+        sw_write_raw(w, w->dict, w->h.dict_len);
+    } else {
+        w->h.dict_len = 0;
+    }
+    ZSTD_freeCDict(w->cdict);
+    ZSTD_freeCCtx(w->cctx);
+#endif
+    w->h.file_size = w->off;
+    w->h.version = 1;
+    memcpy(w->h.magic, SEG_MAGIC, 8);
+    uint64_t end = w->off;
+    w->off = 0;
+    sw_write_raw(w, &w->h, sizeof(w->h));
+    w->off = end;
+    if (!w->failed && fsync(w->fd) != 0) w->failed = 1;
+    close(w->fd);
+    for (size_t i = 0; i < w->npending; i++) free(w->pending[i]);
+    free(w->pending);
+    free(w->bloom);
+    free(w->index);
+    free(w->keys);
+    free(w->block);
+    free(w->prev_key);
+    return w->failed ? -1 : 0;
+}
+// ============================================================
+// STRUCT: SegIter
+// ------------------------------------------------------------
+// Walks a segment's entries in key order, one block at a time.
+// ============================================================
+struct SegIter {
+    const struct ColdSegment *seg;
+    uint64_t block;
+    unsigned char *raw;
+    size_t raw_len;
+    const unsigned char *pos;
+    unsigned char *keybuf;
+    size_t keycap;
+    struct ColdEntry cur;
+    int valid;
+};
+static void seg_iter_next(struct SegIter *it) {
+    for (;;) {
+        if (it->raw && seg_decode_entry(&it->pos, it->raw + it->raw_len, &it->keybuf, &it->keycap, &it->cur)) {
+            it->valid = 1;
+            return;
+        }
+        free(it->raw);
+        it->raw = NULL;
+        if (it->block >= seg_header(it->seg)->nblocks) {
+            it->valid = 0;
+            return;
+        }
+        it->raw = seg_load_block(it->seg, it->block++, &it->raw_len);
+        if (!it->raw) {
+            it->valid = 0;
+            return;
+        }
+        it->pos = it->raw;
+        it->cur.klen = 0;
+    }
+}
+// ============================================================
+// DISK CACHE: sharded, multi-process resolution cache
+// ------------------------------------------------------------
+// --cache-dir keeps unshorten results on disk so that several
+// cipher processes on one host share them. Keys are spread over
+// N shard files by hash; each shard is one pre-sized, sparse
+// file mapped MAP_SHARED by every process:
+//
+//   [ header 4 KiB | slot table | append-only record log ]
+//
+// Readers never lock: they probe the slot table (open addressing,
+// {hash, record offset} pairs published with release stores) and
+// read the record straight from the mapping. Writers serialize
+// per shard only - a pthread mutex inside the process plus an
+// flock() on "shard-NNN.lock" across processes - append a record,
+// then publish its slot. Rewriting a key appends a new record and
+// repoints the slot, leaving the old one as dead bytes.
+//
+// Compaction copies the live, unexpired records into a new file,
+// renames it over the shard and flags the old header "retired";
+// every process notices the flag on its next access and remaps.
+// It runs inline when a shard is full and from a background
+// thread when dead bytes outweigh live ones or the shard holds
+// more than its hot budget (see COLD TIER).
+// ============================================================
+#define SHARD_MAGIC "CIPHSHD1"
+#define SHARD_HEADER_SIZE 4096
+#define SHARD_MIN_SLOTS 4096
+#define SHARD_MIN_LOG (4u << 20)
+struct ShardHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t retired; // Set once a compacted file replaced this one
+    uint64_t slot_count; // Power of two
+    uint64_t capacity; // Total file size
+    uint64_t data_start; // Offset of the first record
+    uint64_t tail; // End of the committed log (release/acquire)
+    uint64_t live_slots; // Occupied slots (writers only)
+    uint64_t live_bytes; // Bytes of records referenced by a slot
+    uint64_t dead_bytes; // Bytes of superseded records
+    uint32_t ncold; // Cold segments, oldest first
+    uint32_t reserved;
+    uint64_t next_cold_id; // Last segment id handed out
+    uint64_t cold_ids[COLD_MAX_SEGMENTS];
+};
+struct ShardSlot {
+    uint64_t hash;
+    uint64_t offset; // 0 = empty; published last
+};
+struct ShardRecord {
+    uint64_t hash;
+    int64_t fresh_until; // Wall-clock ns (CLOCK_REALTIME)
+    int64_t stale_until; // Wall-clock ns
+    uint32_t klen;
+    uint32_t vlen;
+    uint32_t flags; // SHARD_REC_NEGATIVE
+    uint32_t reserved;
+    // Followed by the key and the value, not NUL-terminated,
+    // padded to 8 bytes
+};
+#define SHARD_REC_NEGATIVE 1u
+// One mapping of a shard file. Readers pin it with refs; once
+// retired, the last reader out unmaps it.
+struct ShardMap {
+    unsigned char *base;
+    size_t size;
+    unsigned refs;
+    int retired;
+    int unmapped;
+    struct ColdSegment *cold[COLD_MAX_SEGMENTS]; // Opened from the header's list
+    unsigned ncold;
+    struct ShardMap *graveyard_next;
+};
+struct Shard {
+    pthread_mutex_t lock; // In-process writer lock
+    int lock_fd; // flock()ed across processes
+    char path[4096];
+    char prefix[4000]; // Path without ".cache", for cold segment names
+    struct ShardMap *map; // Current mapping (atomic pointer)
+    struct ShardMap *graveyard; // Retired mappings, freed on close
+};
+struct DiskCache {
+    char dir[4000];
+    unsigned nshards;
+    struct Shard *shards;
+    pthread_t compactor;
+    int compactor_running;
+    pthread_mutex_t stop_lock;
+    pthread_cond_t stop_cond;
+    int stopping;
+    uint64_t hot_budget; // Max live record bytes per hot shard, 0 = no cold tier
+    uint64_t hits, cold_hits, misses, writes, compactions, demoted; // Atomic counters
+};
+static int64_t wall_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+static struct ShardHeader *shard_header(struct ShardMap *m) {
+    return (struct ShardHeader *)m->base;
+}
+static struct ShardSlot *shard_slots(struct ShardMap *m) {
+    return (struct ShardSlot *)(m->base + SHARD_HEADER_SIZE);
+}
+static size_t shard_record_size(uint32_t klen, uint32_t vlen) {
+    return (sizeof(struct ShardRecord) + klen + vlen + 7) & ~(size_t)7;
+}
+// Returns the record at offset, or NULL if it does not fit in the
+// mapping (guards against torn or foreign files).
+static struct ShardRecord *shard_record(struct ShardMap *m, uint64_t offset) {
+    if (offset < shard_header(m)->data_start || offset + sizeof(struct ShardRecord) > m->size) return NULL;
+    struct ShardRecord *r = (struct ShardRecord *)(m->base + offset);
+    if (offset + shard_record_size(r->klen, r->vlen) > m->size) return NULL;
+    return r;
+}
+static void shard_map_reclaim(struct ShardMap *m) {
+    int expected = 0;
+    if (__atomic_compare_exchange_n(&m->unmapped, &expected, 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        munmap(m->base, m->size);
+        for (unsigned i = 0; i < m->ncold; i++) seg_close(m->cold[i]);
+    }
+}
+static void shard_map_release(struct ShardMap *m) {
+    if (__atomic_sub_fetch(&m->refs, 1, __ATOMIC_SEQ_CST) == 0 && __atomic_load_n(&m->retired, __ATOMIC_SEQ_CST))
+        shard_map_reclaim(m);
+}
+// Maps the shard file and the cold segments it lists.
+// RETURNS: new ShardMap, or NULL.
+static struct ShardMap *shard_map_open(const char *path, const char *prefix) {
+    int fd = open(path, O_RDWR);
+    if (fd < 0) return NULL;
+    struct stat st;
+    struct ShardMap *m = calloc(1, sizeof(*m));
+    if (!m || fstat(fd, &st) != 0 || (size_t)st.st_size < SHARD_HEADER_SIZE) {
+        close(fd);
+        free(m);
+        return NULL;
+    }
+    m->size = (size_t)st.st_size;
+    m->base = mmap(NULL, m->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m->base == MAP_FAILED || memcmp(shard_header(m)->magic, SHARD_MAGIC, 8) != 0 ||
+        shard_header(m)->capacity != m->size) {
+        if (m->base != MAP_FAILED) munmap(m->base, m->size);
+        free(m);
+        return NULL;
+    }
+    struct ShardHeader *h = shard_header(m);
+    for (m->ncold = 0; m->ncold < h->ncold && m->ncold < COLD_MAX_SEGMENTS; m->ncold++) {
+        if (!(m->cold[m->ncold] = seg_open(prefix, h->cold_ids[m->ncold]))) {
+            // Raced with a merge that already replaced this file.
+            m->unmapped = 0;
+            shard_map_reclaim(m);
+            free(m);
+            return NULL;
+        }
+    }
+    return m;
+}
+// Swaps in a new mapping (caller holds sh->lock).
+static void shard_install(struct Shard *sh, struct ShardMap *m) {
+    struct ShardMap *old = sh->map;
+    __atomic_store_n(&sh->map, m, __ATOMIC_SEQ_CST);
+    if (!old) return;
+    __atomic_store_n(&old->retired, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&old->refs, __ATOMIC_SEQ_CST) == 0) shard_map_reclaim(old);
+    old->graveyard_next = sh->graveyard;
+    sh->graveyard = old;
+}
+// Remaps if another process compacted the shard (caller holds
+// sh->lock). RETURNS: 0 if sh->map is current, -1 on failure.
+static int shard_refresh_locked(struct Shard *sh) {
+    if (sh->map && !__atomic_load_n(&shard_header(sh->map)->retired, __ATOMIC_ACQUIRE)) return 0;
+    struct ShardMap *m = NULL;
+    for (int attempt = 0; !m && attempt < 3; attempt++) m = shard_map_open(sh->path, sh->prefix);
+    if (!m) return -1;
+    shard_install(sh, m);
+    return 0;
+}
+// Pins the current mapping for a lock-free read.
+static struct ShardMap *shard_acquire(struct Shard *sh) {
+    for (;;) {
+        struct ShardMap *m = __atomic_load_n(&sh->map, __ATOMIC_SEQ_CST);
+        if (!m) return NULL;
+        __atomic_add_fetch(&m->refs, 1, __ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&m->retired, __ATOMIC_SEQ_CST)) {
+            if (!__atomic_load_n(&shard_header(m)->retired, __ATOMIC_ACQUIRE)) return m;
+            // Compacted by another process: remap, then retry.
+            shard_map_release(m);
+            pthread_mutex_lock(&sh->lock);
+            int rc = shard_refresh_locked(sh);
+            pthread_mutex_unlock(&sh->lock);
+            if (rc != 0) return NULL;
+            continue;
+        }
+        shard_map_release(m);
+    }
+}
+// ============================================================
+// FUNCTION: shard_write_file()
+// ------------------------------------------------------------
+// Creates a shard file at path (via a temporary file and
+// rename) holding the given records, sized so that they fill at
+// most half of both the slot table and the log.
+// PARAMETERS:
+// recs/nrecs → Live records to copy (may be 0)
+// live_bytes → Total record bytes of recs
+// cold → Header whose cold segment list is copied, or NULL
+// RETURNS:
+// 0 on success, -1 on I/O failure.
+// ============================================================
+static int shard_write_file(const char *path, struct ShardRecord **recs, size_t nrecs, uint64_t live_bytes,
+                            const struct ShardHeader *cold) {
+    uint64_t slots = SHARD_MIN_SLOTS;
+    while (slots < nrecs * 2) slots <<= 1;
+    uint64_t data_start = SHARD_HEADER_SIZE + slots * sizeof(struct ShardSlot);
+    uint64_t log = live_bytes * 2 > SHARD_MIN_LOG ? live_bytes * 2 : SHARD_MIN_LOG;
+    uint64_t capacity = (data_start + log + 4095) & ~(uint64_t)4095;
+    char tmp[4200];
+    snprintf(tmp, sizeof(tmp), "%s.tmp.%ld", path, (long)getpid());
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    unsigned char *base = MAP_FAILED;
+    if (ftruncate(fd, (off_t)capacity) == 0)
+        base = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        unlink(tmp);
+        return -1;
+    }
+    struct ShardHeader *h = (struct ShardHeader *)base;
+    struct ShardSlot *slot_tab = (struct ShardSlot *)(base + SHARD_HEADER_SIZE);
+    uint64_t tail = data_start;
+    for (size_t i = 0; i < nrecs; i++) {
+        size_t size = shard_record_size(recs[i]->klen, recs[i]->vlen);
+        memcpy(base + tail, recs[i], size);
+        for (uint64_t s = recs[i]->hash & (slots - 1);; s = (s + 1) & (slots - 1)) {
+            if (slot_tab[s].offset == 0) {
+                slot_tab[s].hash = recs[i]->hash;
+                slot_tab[s].offset = tail;
+                break;
+            }
+        }
+        tail += size;
+    }
+    h->version = 1;
+    h->slot_count = slots;
+    h->capacity = capacity;
+    h->data_start = data_start;
+    h->tail = tail;
+    h->live_slots = nrecs;
+    h->live_bytes = live_bytes;
+    if (cold) {
+        h->ncold = cold->ncold;
+        h->next_cold_id = cold->next_cold_id;
+        memcpy(h->cold_ids, cold->cold_ids, sizeof(h->cold_ids));
+    }
+    memcpy(h->magic, SHARD_MAGIC, 8); // Written last: marks the file valid
+    int rc = msync(base, capacity, MS_SYNC);
+    munmap(base, capacity);
+    if (rc != 0 || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+// ============================================================
+// FUNCTION: cold_build_segment()
+// ------------------------------------------------------------
+// Writes segment `id` from the key-sorted hot records in demote
+// merged with the segments in merge (newest first). For equal
+// keys the hot record wins, then the newest segment; entries
+// past stale_until are dropped.
+// RETURNS:
+// 0 on success, -1 on failure (no file is left behind).
+// ============================================================
+static int cold_build_segment(const char *prefix, uint64_t id, struct ColdEntry *demote, size_t ndemote,
+                              struct ColdSegment **merge, unsigned nmerge, uint64_t *entries_out) {
+    char path[4200], tmp[4300];
+    struct SegWriter w;
+    struct SegIter iters[COLD_MAX_SEGMENTS];
+    uint64_t max_entries = ndemote;
+    int64_t now = wall_ns();
+    size_t di = 0;
+    for (unsigned i = 0; i < nmerge; i++) max_entries += seg_header(merge[i])->nentries;
+    seg_cold_path(path, sizeof(path), prefix, id);
+    snprintf(tmp, sizeof(tmp), "%s.tmp.%ld", path, (long)getpid());
+    if (sw_open(&w, tmp, max_entries) != 0) return -1;
+    memset(iters, 0, sizeof(iters));
+    for (unsigned i = 0; i < nmerge; i++) {
+        iters[i].seg = merge[i];
+        seg_iter_next(&iters[i]);
+    }
+    for (;;) {
+        const struct ColdEntry *best = di < ndemote ? &demote[di] : NULL;
+        for (unsigned i = 0; i < nmerge; i++) {
+            if (iters[i].valid &&
+                (!best || seg_key_cmp(iters[i].cur.key, iters[i].cur.klen, best->key, best->klen) < 0))
+                best = &iters[i].cur;
+        }
+        if (!best) break;
+        struct ColdEntry pick = *best;
+        // Copy the key: advancing the source it came from reuses the buffer.
+        unsigned char *key = malloc(pick.klen + 1);
+        unsigned char *value = malloc(pick.vlen + 1);
+        if (!key || !value) {
+            free(key);
+            free(value);
+            w.failed = 1;
+            break;
+        }
+        memcpy(key, pick.key, pick.klen);
+        memcpy(value, pick.value, pick.vlen);
+        pick.key = key;
+        pick.value = value;
+        if (di < ndemote && seg_key_cmp(demote[di].key, demote[di].klen, key, pick.klen) == 0) di++;
+        for (unsigned i = 0; i < nmerge; i++)
+            while (iters[i].valid && seg_key_cmp(iters[i].cur.key, iters[i].cur.klen, key, pick.klen) == 0)
+                seg_iter_next(&iters[i]);
+        if (pick.stale_until >= now) sw_add(&w, &pick, hash_bytes(key, pick.klen));
+        free(key);
+        free(value);
+    }
+    for (unsigned i = 0; i < nmerge; i++) {
+        free(iters[i].raw);
+        free(iters[i].keybuf);
+    }
+    *entries_out = w.h.nentries;
+    if (sw_close(&w) != 0 || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+static int cold_entry_cmp(const void *a, const void *b) {
+    const struct ColdEntry *x = a, *y = b;
+    return seg_key_cmp(x->key, x->klen, y->key, y->klen);
+}
+static int record_offset_cmp(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t)*(struct ShardRecord *const *)a, y = (uintptr_t)*(struct ShardRecord *const *)b;
+    return (x > y) - (x < y);
+}
+// ============================================================
+// FUNCTION: cold_demote()
+// ------------------------------------------------------------
+// Called by compaction when the live records exceed the hot
+// budget. recs must be in log order (oldest first); moves the
+// oldest ones into a new cold segment until the rest fit in half
+// the budget, and
+// fills *h with the new segment list. Merges every segment into
+// one when the list is full; merged files are reported through
+// unlink_ids/nunlink for removal once the new hot file is live.
+// RETURNS:
+// Number of records left hot (the tail of recs, moved to the
+// front), or (size_t)-1.
+// ============================================================
+static size_t cold_demote(struct DiskCache *d, struct Shard *sh, struct ShardRecord **recs, size_t nrecs,
+                          uint64_t *bytes, struct ShardHeader *h, uint64_t *unlink_ids, unsigned *nunlink) {
+    const struct ShardHeader *old = shard_header(sh->map);
+    size_t ndemote = 0;
+    uint64_t keep_bytes = *bytes;
+    while (ndemote < nrecs && keep_bytes > d->hot_budget / 2) {
+        keep_bytes -= shard_record_size(recs[ndemote]->klen, recs[ndemote]->vlen);
+        ndemote++;
+    }
+    struct ColdEntry *demote = malloc((ndemote + 1) * sizeof(*demote));
+    if (!demote) return (size_t)-1;
+    for (size_t i = 0; i < ndemote; i++) {
+        struct ShardRecord *r = recs[i];
+        demote[i].key = (const unsigned char *)(r + 1);
+        demote[i].klen = r->klen;
+        demote[i].value = (const unsigned char *)(r + 1) + r->klen;
+        demote[i].vlen = r->vlen;
+        demote[i].fresh_until = r->fresh_until;
+        demote[i].stale_until = r->stale_until;
+        demote[i].flags = r->flags;
+    }
+    qsort(demote, ndemote, sizeof(*demote), cold_entry_cmp);
+    struct ColdSegment *merge[COLD_MAX_SEGMENTS];
+    unsigned nmerge = 0;
+    *nunlink = 0;
+    h->ncold = old->ncold;
+    h->next_cold_id = old->next_cold_id;
+    memcpy(h->cold_ids, old->cold_ids, sizeof(h->cold_ids));
+    if (old->ncold == COLD_MAX_SEGMENTS) {
+        for (unsigned i = 0; i < sh->map->ncold; i++) {
+            merge[nmerge++] = sh->map->cold[sh->map->ncold - 1 - i];
+            unlink_ids[(*nunlink)++] = old->cold_ids[i];
+        }
+        h->ncold = 0;
+    }
+    uint64_t id = ++h->next_cold_id, entries = 0;
+    int rc = cold_build_segment(sh->prefix, id, demote, ndemote, merge, nmerge, &entries);
+    free(demote);
+    if (rc != 0) return (size_t)-1;
+    h->cold_ids[h->ncold++] = id;
+    __atomic_add_fetch(&d->demoted, ndemote, __ATOMIC_RELAXED);
+    memmove(recs, recs + ndemote, (nrecs - ndemote) * sizeof(*recs));
+    *bytes = keep_bytes;
+    return nrecs - ndemote;
+}
+// Rewrites the shard without dead and expired records, demoting
+// the oldest ones to the cold tier when over budget. Caller holds
+// sh->lock and the shard's flock, and sh->map is current.
+static int shard_compact_locked(struct DiskCache *d, struct Shard *sh) {
+    struct ShardMap *m = sh->map;
+    struct ShardHeader *h = shard_header(m);
+    struct ShardSlot *slot_tab = shard_slots(m);
+    int64_t now = wall_ns();
+    struct ShardRecord **recs = malloc((h->live_slots + 1) * sizeof(*recs));
+    size_t n = 0;
+    uint64_t bytes = 0;
+    if (!recs) return -1;
+    for (uint64_t s = 0; s < h->slot_count && n < h->live_slots; s++) {
+        uint64_t off = __atomic_load_n(&slot_tab[s].offset, __ATOMIC_ACQUIRE);
+        struct ShardRecord *r = off ? shard_record(m, off) : NULL;
+        if (!r || r->stale_until < now) continue;
+        recs[n++] = r;
+        bytes += shard_record_size(r->klen, r->vlen);
+    }
+    // Keep log order in the rewritten file too, so that offset
+    // still means age at the next demotion
+    qsort(recs, n, sizeof(*recs), record_offset_cmp);
+    struct ShardHeader cold = *h;
+    uint64_t unlink_ids[COLD_MAX_SEGMENTS];
+    unsigned nunlink = 0;
+    if (d->hot_budget && bytes > d->hot_budget &&
+        (n = cold_demote(d, sh, recs, n, &bytes, &cold, unlink_ids, &nunlink)) == (size_t)-1) {
+        free(recs);
+        return -1;
+    }
+    int rc = shard_write_file(sh->path, recs, n, bytes, &cold);
+    free(recs);
+    if (rc != 0) return -1;
+    __atomic_store_n(&h->retired, 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&d->compactions, 1, __ATOMIC_RELAXED);
+    rc = shard_refresh_locked(sh);
+    for (unsigned i = 0; i < nunlink; i++) {
+        char path[4200];
+        seg_cold_path(path, sizeof(path), sh->prefix, unlink_ids[i]);
+        unlink(path);
+    }
+    return rc;
+}
+static int shard_lock(struct Shard *sh) {
+    pthread_mutex_lock(&sh->lock);
+    while (flock(sh->lock_fd, LOCK_EX) != 0) {
+        if (errno != EINTR) {
+            pthread_mutex_unlock(&sh->lock);
+            return -1;
+        }
+    }
+    if (shard_refresh_locked(sh) != 0) {
+        flock(sh->lock_fd, LOCK_UN);
+        pthread_mutex_unlock(&sh->lock);
+        return -1;
+    }
+    return 0;
+}
+static void shard_unlock(struct Shard *sh) {
+    flock(sh->lock_fd, LOCK_UN);
+    pthread_mutex_unlock(&sh->lock);
+}
+static struct Shard *disk_shard(struct DiskCache *d, uint64_t hash) {
+    return &d->shards[(hash >> 40) % d->nshards];
+}
+// ============================================================
+// FUNCTION: disk_cache_get()
+// ------------------------------------------------------------
+// Lock-free lookup. On a hit, *value receives a heap copy of the
+// cached result and the deadlines/negative flag are filled in.
+// RETURNS:
+// 1 on a hit that is not past stale_until, 0 otherwise.
+// ============================================================
+static int disk_cache_get(struct DiskCache *d, const char *key, char **value,
+                          int64_t *fresh_until, int64_t *stale_until, int *negative) {
+    size_t klen = strlen(key);
+    uint64_t hash = hash_bytes(key, klen);
+    struct Shard *sh = disk_shard(d, hash);
+    struct ShardMap *m = shard_acquire(sh);
+    int found = 0;
+    if (!m) return 0;
+    struct ShardHeader *h = shard_header(m);
+    struct ShardSlot *slot_tab = shard_slots(m);
+    uint64_t mask = h->slot_count - 1;
+    int in_hot = 0;
+    for (uint64_t s = hash & mask, probes = 0; probes <= mask; s = (s + 1) & mask, probes++) {
+        uint64_t off = __atomic_load_n(&slot_tab[s].offset, __ATOMIC_ACQUIRE);
+        if (off == 0) break;
+        if (__atomic_load_n(&slot_tab[s].hash, __ATOMIC_RELAXED) != hash) continue;
+        struct ShardRecord *r = shard_record(m, off);
+        if (!r || r->klen != klen || memcmp(r + 1, key, klen) != 0) continue;
+        in_hot = 1; // Newer than anything in the cold tier
+        if (r->stale_until >= wall_ns() && (*value = malloc(r->vlen + 1)) != NULL) {
+            memcpy(*value, (char *)(r + 1) + klen, r->vlen);
+            (*value)[r->vlen] = 0;
+            *fresh_until = r->fresh_until;
+            *stale_until = r->stale_until;
+            *negative = (r->flags & SHARD_REC_NEGATIVE) != 0;
+            found = 1;
+        }
+        break;
+    }
+    uint32_t flags;
+    for (unsigned i = m->ncold; !in_hot && i-- > 0;) { // Newest segment first
+        if (seg_get(m->cold[i], key, klen, hash, value, fresh_until, stale_until, &flags)) {
+            if (*stale_until >= wall_ns()) {
+                *negative = (flags & SHARD_REC_NEGATIVE) != 0;
+                found = 1;
+                __atomic_add_fetch(&d->cold_hits, 1, __ATOMIC_RELAXED);
+            } else {
+                free(*value);
+            }
+            break;
+        }
+    }
+    shard_map_release(m);
+    __atomic_add_fetch(found ? &d->hits : &d->misses, 1, __ATOMIC_RELAXED);
+    return found;
+}
+// ============================================================
+// FUNCTION: disk_cache_put()
+// ------------------------------------------------------------
+// Appends a record under the shard's append lock and points the
+// key's slot at it, compacting first if the shard is full.
+// ============================================================
+static void disk_cache_put(struct DiskCache *d, const char *key, const char *value,
+                           int64_t fresh_until, int64_t stale_until, int negative) {
+    size_t klen = strlen(key), vlen = strlen(value);
+    uint64_t hash = hash_bytes(key, klen);
+    size_t size = shard_record_size((uint32_t)klen, (uint32_t)vlen);
+    struct Shard *sh = disk_shard(d, hash);
+    if (klen > UINT32_MAX / 2 || vlen > UINT32_MAX / 2 || shard_lock(sh) != 0) return;
+    struct ShardHeader *h = shard_header(sh->map);
+    if (h->tail + size > h->capacity || (h->live_slots + 1) * 10 > h->slot_count * 7) {
+        if (shard_compact_locked(d, sh) != 0) {
+            shard_unlock(sh);
+            return;
+        }
+        h = shard_header(sh->map);
+        if (h->tail + size > h->capacity) { // Single record larger than a fresh log
+            shard_unlock(sh);
+            return;
+        }
+    }
+    struct ShardMap *m = sh->map;
+    uint64_t off = h->tail;
+    struct ShardRecord *r = (struct ShardRecord *)(m->base + off);
+    r->hash = hash;
+    r->fresh_until = fresh_until;
+    r->stale_until = stale_until;
+    r->klen = (uint32_t)klen;
+    r->vlen = (uint32_t)vlen;
+    r->flags = negative ? SHARD_REC_NEGATIVE : 0;
+    r->reserved = 0;
+    memcpy(r + 1, key, klen);
+    memcpy((char *)(r + 1) + klen, value, vlen);
+    __atomic_store_n(&h->tail, off + size, __ATOMIC_RELEASE);
+    struct ShardSlot *slot_tab = shard_slots(m);
+    uint64_t mask = h->slot_count - 1;
+    for (uint64_t s = hash & mask;; s = (s + 1) & mask) {
+        uint64_t cur = slot_tab[s].offset;
+        if (cur == 0) {
+            __atomic_store_n(&slot_tab[s].hash, hash, __ATOMIC_RELAXED);
+            __atomic_store_n(&slot_tab[s].offset, off, __ATOMIC_RELEASE);
+            h->live_slots++;
+            h->live_bytes += size;
+            break;
+        }
+        struct ShardRecord *old = slot_tab[s].hash == hash ? shard_record(m, cur) : NULL;
+        if (old && old->klen == klen && memcmp(old + 1, key, klen) == 0) {
+            __atomic_store_n(&slot_tab[s].offset, off, __ATOMIC_RELEASE);
+            size_t old_size = shard_record_size(old->klen, old->vlen);
+            h->live_bytes += size - old_size;
+            h->dead_bytes += old_size;
+            break;
+        }
+    }
+    __atomic_add_fetch(&d->writes, 1, __ATOMIC_RELAXED);
+    shard_unlock(sh);
+}
+static int disk_needs_compaction(const struct DiskCache *d, const struct ShardHeader *h) {
+    if (d->hot_budget && h->live_bytes > d->hot_budget) return 1;
+    return h->dead_bytes >= (1u << 20) && h->dead_bytes >= h->live_bytes;
+}
+// Background compactor: every couple of seconds, rewrites shards
+// whose dead bytes outweigh the live ones or that exceed the hot
+// budget.
+static void *disk_compactor_main(void *arg) {
+    struct DiskCache *d = arg;
+    pthread_mutex_lock(&d->stop_lock);
+    while (!d->stopping) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += 2;
+        pthread_cond_timedwait(&d->stop_cond, &d->stop_lock, &until);
+        if (d->stopping) break;
+        pthread_mutex_unlock(&d->stop_lock);
+        for (unsigned i = 0; i < d->nshards; i++) {
+            struct Shard *sh = &d->shards[i];
+            // Pin the map for the unlocked pre-check: an inline
+            // compaction in disk_cache_put() may replace it meanwhile
+            struct ShardMap *map = shard_acquire(sh);
+            if (!map) continue;
+            int needed = disk_needs_compaction(d, shard_header(map));
+            shard_map_release(map);
+            if (!needed || shard_lock(sh) != 0) continue;
+            if (disk_needs_compaction(d, shard_header(sh->map))) shard_compact_locked(d, sh);
+            shard_unlock(sh);
+        }
+        pthread_mutex_lock(&d->stop_lock);
+    }
+    pthread_mutex_unlock(&d->stop_lock);
+    return NULL;
+}
+// Reads the shard count recorded in <dir>/LAYOUT, creating the
+// file with `want` shards if it does not exist yet. Every process
+// sharing the directory must agree on the count.
+static unsigned disk_layout(const char *dir, unsigned want) {
+    char path[4200], tmp[4200], buf[64];
+    unsigned n = 0;
+    snprintf(path, sizeof(path), "%s/LAYOUT", dir);
+    snprintf(tmp, sizeof(tmp), "%s/LAYOUT.tmp.%ld", dir, (long)getpid());
+    FILE *f = fopen(tmp, "w");
+    if (f) {
+        fprintf(f, "cipher-cache 1 shards=%u\n", want);
+        fclose(f);
+        if (link(tmp, path) != 0 && errno != EEXIST) want = 0;
+        unlink(tmp);
+    }
+    f = fopen(path, "r");
+    if (f && fgets(buf, sizeof(buf), f)) sscanf(buf, "cipher-cache 1 shards=%u", &n);
+    if (f) fclose(f);
+    return want ? n : 0;
+}
+static void disk_cache_close(struct DiskCache *d);
+// ============================================================
+// FUNCTION: disk_cache_open()
+// ------------------------------------------------------------
+// Opens (creating as needed) the cache directory and maps every
+// shard, then starts the background compactor.
+// PARAMETERS:
+// hot_budget → Total hot record bytes across shards before older
+//              records move to the cold tier (0 = never)
+// RETURNS:
+// 0 on success, -1 on failure (details on stderr).
+// ============================================================
+static int disk_cache_open(struct DiskCache *d, const char *dir, unsigned nshards, uint64_t hot_budget) {
+    memset(d, 0, sizeof(*d));
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Error: Cannot create cache directory '%s'\n", dir);
+        return -1;
+    }
+    snprintf(d->dir, sizeof(d->dir), "%s", dir);
+    d->nshards = disk_layout(dir, nshards ? nshards : 16);
+    d->shards = d->nshards ? calloc(d->nshards, sizeof(*d->shards)) : NULL;
+    if (!d->shards) {
+        fprintf(stderr, "Error: Cannot read cache layout in '%s'\n", dir);
+        return -1;
+    }
+    d->hot_budget = hot_budget / d->nshards;
+    for (unsigned i = 0; i < d->nshards; i++) d->shards[i].lock_fd = -1;
+    for (unsigned i = 0; i < d->nshards; i++) {
+        struct Shard *sh = &d->shards[i];
+        char lock_path[4200];
+        pthread_mutex_init(&sh->lock, NULL);
+        snprintf(sh->prefix, sizeof(sh->prefix), "%s/shard-%03u", dir, i);
+        snprintf(sh->path, sizeof(sh->path), "%s.cache", sh->prefix);
+        snprintf(lock_path, sizeof(lock_path), "%s/shard-%03u.lock", dir, i);
+        sh->lock_fd = open(lock_path, O_RDWR | O_CREAT, 0644);
+        if (sh->lock_fd < 0) {
+            fprintf(stderr, "Error: Cannot open '%s'\n", lock_path);
+            disk_cache_close(d);
+            return -1;
+        }
+        flock(sh->lock_fd, LOCK_EX);
+        if (access(sh->path, F_OK) != 0) shard_write_file(sh->path, NULL, 0, 0, NULL);
+        sh->map = shard_map_open(sh->path, sh->prefix);
+        flock(sh->lock_fd, LOCK_UN);
+        if (!sh->map) {
+            fprintf(stderr, "Error: Cannot map cache shard '%s'\n", sh->path);
+            disk_cache_close(d);
+            return -1;
+        }
+    }
+    pthread_mutex_init(&d->stop_lock, NULL);
+    pthread_cond_init(&d->stop_cond, NULL);
+    d->compactor_running = pthread_create(&d->compactor, NULL, disk_compactor_main, d) == 0;
+    return 0;
+}
+static void disk_cache_close(struct DiskCache *d) {
+    if (d->compactor_running) {
+        pthread_mutex_lock(&d->stop_lock);
+        d->stopping = 1;
+        pthread_cond_signal(&d->stop_cond);
+        pthread_mutex_unlock(&d->stop_lock);
+        pthread_join(d->compactor, NULL);
+        pthread_cond_destroy(&d->stop_cond);
+        pthread_mutex_destroy(&d->stop_lock);
+    }
+    for (unsigned i = 0; d->shards && i < d->nshards; i++) {
+        struct Shard *sh = &d->shards[i];
+        if (sh->map) {
+            shard_map_reclaim(sh->map);
+            free(sh->map);
+        }
+        while (sh->graveyard) {
+            struct ShardMap *m = sh->graveyard;
+            sh->graveyard = m->graveyard_next;
+            shard_map_reclaim(m);
+            free(m);
+        }
+        if (sh->lock_fd >= 0) close(sh->lock_fd);
+        pthread_mutex_destroy(&sh->lock);
+    }
+    free(d->shards);
+    d->shards = NULL;
+}
+// Prints counters plus the footprint of both tiers as seen by
+// this process (hot = live record bytes in the shard files, cold
+// = segment file sizes).
+static void disk_cache_print_stats(struct DiskCache *d, FILE *out) {
+    uint64_t hot_entries = 0, hot_bytes = 0, cold_entries = 0, cold_bytes = 0, cold_raw = 0;
+    unsigned nsegs = 0;
+    for (unsigned i = 0; i < d->nshards; i++) {
+        struct ShardMap *m = shard_acquire(&d->shards[i]);
+        if (!m) continue;
+        hot_entries += shard_header(m)->live_slots;
+        hot_bytes += shard_header(m)->live_bytes;
+        for (unsigned j = 0; j < m->ncold; j++, nsegs++) {
+            cold_entries += seg_header(m->cold[j])->nentries;
+            cold_bytes += m->cold[j]->size;
+            cold_raw += seg_header(m->cold[j])->raw_bytes;
+        }
+        shard_map_release(m);
+    }
+    fprintf(out, "[disk] shards=%u hits=%llu cold_hits=%llu misses=%llu writes=%llu compactions=%llu "
+            "demoted=%llu\n", d->nshards,
+            (unsigned long long)__atomic_load_n(&d->hits, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&d->cold_hits, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&d->misses, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&d->writes, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&d->compactions, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&d->demoted, __ATOMIC_RELAXED));
+    fprintf(out, "[disk] hot_entries=%llu hot_bytes_per_entry=%.1f cold_segments=%u cold_entries=%llu "
+            "cold_bytes_per_entry=%.1f (front-coded %.1f)\n",
+            (unsigned long long)hot_entries, hot_entries ? (double)hot_bytes / (double)hot_entries : 0.0, nsegs,
+            (unsigned long long)cold_entries, cold_entries ? (double)cold_bytes / (double)cold_entries : 0.0,
+            cold_entries ? (double)cold_raw / (double)cold_entries : 0.0);
+}
+// Result strings from shorten_url()/unshorten_url() report
+// failures in-band with this prefix.
+static int is_error_result(const char *result) {
+    return !result || strncmp(result, "Error:", 6) == 0;
+}
+// ============================================================
+// STRUCT: ResultCache
+// ------------------------------------------------------------
+// In-memory cache of unshorten_url() results with
+// stale-while-revalidate semantics. Every entry has two deadlines:
+//   fresh_until  served as-is until then
+//   stale_until  after fresh_until and before this, the stale
+//                value is served immediately and one background
+//                refresh is queued; after it, a lookup is a miss
+// TTLs are shortened by a random factor of up to `jitter` so that
+// entries written together do not expire together. Failures are
+// cached too (negative entries), with their own shorter TTL and
+// no stale window, so a dead link is retried after neg_ttl.
+//
+// Buckets hold at most CACHE_CHAIN entries; inserting into a full
+// bucket evicts the entry closest to expiry, which bounds memory
+// to CACHE_CHAIN * buckets entries. Buckets are guarded by a
+// fixed set of striped locks. With a DiskCache attached, misses
+// fall through to it and every store is written through.
+// ============================================================
+#define CACHE_STRIPES 64
+#define CACHE_CHAIN 4
+struct CacheEntry {
+    struct CacheEntry *next;
+    uint64_t hash;
+    uint64_t fresh_until_ns;
+    uint64_t stale_until_ns;
+    int negative; // Cached failure
+    int refreshing; // A background refresh is queued or running
+    char *value;
+    char key[]; // NUL-terminated URL
+};
+enum CacheState { CACHE_MISS = 0, CACHE_FRESH, CACHE_STALE };
+struct ResultCache {
+    struct CacheEntry **buckets;
+    size_t mask; // Bucket count - 1
+    pthread_mutex_t locks[CACHE_STRIPES];
+    uint64_t ttl_ns; // Fresh lifetime of a successful result
+    uint64_t stale_ns; // Extra window during which stale data is served
+    uint64_t neg_ttl_ns; // Lifetime of a cached failure
+    double jitter; // Max fraction shaved off each TTL
+    struct Ring refresh; // URLs waiting for a background refresh
+    struct EventCount refresh_ready;
+    pthread_t *refreshers;
+    size_t nrefreshers;
+    int stopping;
+    // Counters (atomic) and cache-served latency (under served_lock)
+    uint64_t hits_fresh, hits_stale, hits_negative, misses;
+    uint64_t refreshes, refreshes_dropped, evictions;
+    pthread_mutex_t served_lock;
+    struct LatHist served_ns;
+    struct DiskCache *disk; // Shared on-disk tier, or NULL
+};
+static pthread_mutex_t *cache_stripe(struct ResultCache *c, uint64_t hash) {
+    return &c->locks[(hash >> 32) % CACHE_STRIPES];
+}
+static void cache_entry_free(struct CacheEntry *e) {
+    free(e->value);
+    free(e);
+}
+// Links a new entry into its bucket, replacing any entry for the
+// same key and evicting the one closest to expiry from a full
+// bucket. Takes ownership of value.
+static void cache_insert(struct ResultCache *c, const char *url, uint64_t hash, char *value, int negative,
+                         uint64_t fresh_until_ns, uint64_t stale_until_ns, int refreshing) {
+    size_t klen = strlen(url) + 1;
+    struct CacheEntry *fresh = malloc(sizeof(*fresh) + klen);
+    if (!fresh || !value) {
+        free(fresh);
+        free(value);
+        return;
+    }
+    memcpy(fresh->key, url, klen);
+    fresh->hash = hash;
+    fresh->value = value;
+    fresh->negative = negative;
+    fresh->refreshing = refreshing;
+    fresh->fresh_until_ns = fresh_until_ns;
+    fresh->stale_until_ns = stale_until_ns;
+    pthread_mutex_t *lock = cache_stripe(c, hash);
+    pthread_mutex_lock(lock);
+    struct CacheEntry **slot = &c->buckets[hash & c->mask];
+    struct CacheEntry **victim = NULL, **oldest = NULL;
+    size_t chain = 0;
+    for (struct CacheEntry **pp = slot; *pp; pp = &(*pp)->next, chain++) {
+        if ((*pp)->hash == hash && strcmp((*pp)->key, url) == 0) {
+            victim = pp; // Replace the previous result
+            break;
+        }
+        if (!oldest || (*pp)->stale_until_ns < (*oldest)->stale_until_ns) oldest = pp;
+    }
+    if (!victim && chain >= CACHE_CHAIN) {
+        victim = oldest;
+        __atomic_add_fetch(&c->evictions, 1, __ATOMIC_RELAXED);
+    }
+    if (victim) {
+        struct CacheEntry *old = *victim;
+        *victim = old->next;
+        cache_entry_free(old);
+    }
+    fresh->next = *slot;
+    *slot = fresh;
+    pthread_mutex_unlock(lock);
+}
+// Hands url to the refresher threads. If the queue is full the
+// refresh is dropped and the entry unflagged, so a later stale
+// hit tries again.
+static void cache_queue_refresh(struct ResultCache *c, const char *url, uint64_t hash) {
+    char *key = my_strdup(url);
+    if (key && ring_try_push(&c->refresh, key)) {
+        ec_notify(&c->refresh_ready);
+        return;
+    }
+    free(key);
+    __atomic_add_fetch(&c->refreshes_dropped, 1, __ATOMIC_RELAXED);
+    pthread_mutex_t *lock = cache_stripe(c, hash);
+    pthread_mutex_lock(lock);
+    for (struct CacheEntry *e = c->buckets[hash & c->mask]; e; e = e->next)
+        if (e->hash == hash && strcmp(e->key, url) == 0) e->refreshing = 0;
+    pthread_mutex_unlock(lock);
+}
+// ============================================================
+// FUNCTION: cache_lookup()
+// ------------------------------------------------------------
+// PARAMETERS:
+// url → Key to look up
+// state → Receives CACHE_MISS, CACHE_FRESH or CACHE_STALE
+// RETURNS:
+// Heap copy of the cached result (caller frees), or NULL on a
+// miss. On CACHE_STALE the entry is also queued for refresh.
+// Disk hits are promoted into memory with their remaining TTLs.
+// cache_lookup_hashed() takes the key's hash_bytes() precomputed.
+// ============================================================
+static char *cache_lookup_hashed(struct ResultCache *c, const char *url, uint64_t hash, enum CacheState *state) {
+    uint64_t t0 = now_ns();
+    pthread_mutex_t *lock = cache_stripe(c, hash);
+    char *value = NULL;
+    int queue_refresh = 0, negative = 0;
+    *state = CACHE_MISS;
+    pthread_mutex_lock(lock);
+    for (struct CacheEntry *e = c->buckets[hash & c->mask]; e; e = e->next) {
+        if (e->hash != hash || strcmp(e->key, url) != 0) continue;
+        if (t0 < e->fresh_until_ns) {
+            *state = CACHE_FRESH;
+        } else if (t0 < e->stale_until_ns) {
+            *state = CACHE_STALE;
+            if (!e->refreshing) e->refreshing = queue_refresh = 1;
+        }
+        if (*state != CACHE_MISS) {
+            value = my_strdup(e->value);
+            negative = e->negative;
+        }
+        break;
+    }
+    pthread_mutex_unlock(lock);
+    int64_t fresh_wall = 0, stale_wall = 0;
+    char *disk_value = NULL;
+    if (*state == CACHE_MISS && c->disk &&
+        disk_cache_get(c->disk, url, &disk_value, &fresh_wall, &stale_wall, &negative)) {
+        int64_t wall = wall_ns(); // May be past stale_wall by now: clamp both deadlines
+        *state = fresh_wall > wall ? CACHE_FRESH : CACHE_STALE;
+        queue_refresh = *state == CACHE_STALE;
+        value = my_strdup(disk_value);
+        cache_insert(c, url, hash, disk_value, negative, t0 + (uint64_t)(fresh_wall > wall ? fresh_wall - wall : 0),
+                     t0 + (uint64_t)(stale_wall > wall ? stale_wall - wall : 0), queue_refresh);
+    }
+    if (queue_refresh) cache_queue_refresh(c, url, hash);
+    if (!value) {
+        *state = CACHE_MISS;
+        __atomic_add_fetch(&c->misses, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    if (negative) __atomic_add_fetch(&c->hits_negative, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(*state == CACHE_FRESH ? &c->hits_fresh : &c->hits_stale, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&c->served_lock);
+    hist_add(&c->served_ns, now_ns() - t0);
+    pthread_mutex_unlock(&c->served_lock);
+    return value;
+}
+static char *cache_lookup(struct ResultCache *c, const char *url, enum CacheState *state) {
+    return cache_lookup_hashed(c, url, hash_bytes(url, strlen(url)), state);
+}
+// ============================================================
+// FUNCTION: cache_lookup_batch()
+// ------------------------------------------------------------
+// cache_lookup() for n keys at once, with group prefetching. In
+// groups of CACHE_BATCH, every key is hashed and its bucket
+// prefetched, then every bucket's first entry is prefetched, and
+// only then are the keys compared. A probe into a table larger
+// than the CPU caches costs two dependent misses (bucket, then
+// entry). Done one key at a time, those misses are paid in
+// sequence; here up to 2 * CACHE_BATCH of them are in flight
+// together. Stages 1 and 2 read the buckets without the lock: a
+// prefetch of an entry that is being freed is harmless.
+// PARAMETERS:
+// urls → n keys
+// values → Receives n results, as cache_lookup() returns them
+// states → Receives n CacheStates
+// ============================================================
+#define CACHE_BATCH 16
+static void cache_lookup_batch(struct ResultCache *c, const char *const *urls, size_t n, char **values,
+                               enum CacheState *states) {
+    uint64_t hash[CACHE_BATCH];
+    for (size_t base = 0; base < n; base += CACHE_BATCH) {
+        size_t g = n - base < CACHE_BATCH ? n - base : CACHE_BATCH;
+        for (size_t i = 0; i < g; i++) {
+            hash[i] = hash_bytes(urls[base + i], strlen(urls[base + i]));
+            __builtin_prefetch(&c->buckets[hash[i] & c->mask]);
+        }
+        for (size_t i = 0; i < g; i++) {
+            struct CacheEntry *e = __atomic_load_n(&c->buckets[hash[i] & c->mask], __ATOMIC_RELAXED);
+            if (e) {
+                __builtin_prefetch(e); // Link and hash
+                __builtin_prefetch(e->key); // Usually the same line; the next one for long URLs
+            }
+        }
+        for (size_t i = 0; i < g; i++)
+            values[base + i] = cache_lookup_hashed(c, urls[base + i], hash[i], &states[base + i]);
+    }
+}
+// ============================================================
+// FUNCTION: cache_store()
+// ------------------------------------------------------------
+// Inserts or replaces the result for url (and writes it through
+// to the disk tier). Error results become negative entries. The
+// value is copied.
+// ============================================================
+static void cache_store(struct ResultCache *c, const char *url, const char *result) {
+    uint64_t now = now_ns();
+    const char *text = result ? result : "Error: Memory allocation failed";
+    int negative = is_error_result(result);
+    uint64_t ttl = negative ? c->neg_ttl_ns : c->ttl_ns;
+    ttl = (uint64_t)((double)ttl * (1.0 - c->jitter * rng_unit()));
+    uint64_t stale = negative ? 0 : c->stale_ns;
+    cache_insert(c, url, hash_bytes(url, strlen(url)), my_strdup(text), negative, now + ttl, now + ttl + stale, 0);
+    if (c->disk) {
+        int64_t wall = wall_ns();
+        disk_cache_put(c->disk, url, text, wall + (int64_t)ttl, wall + (int64_t)(ttl + stale), negative);
+    }
+}
+// Background refresher: re-resolves stale keys off the hot path.
+static void *cache_refresher_main(void *arg) {
+    struct ResultCache *c = arg;
+    for (;;) {
+        char *url = ring_try_pop(&c->refresh);
+        if (!url) {
+            unsigned key = ec_prepare(&c->refresh_ready);
+            if ((url = ring_try_pop(&c->refresh)) != NULL) {
+                ec_cancel(&c->refresh_ready);
+            } else if (__atomic_load_n(&c->stopping, __ATOMIC_SEQ_CST)) {
+                ec_cancel(&c->refresh_ready);
+                return NULL;
+            } else {
+                ec_wait(&c->refresh_ready, key);
+                continue;
+            }
+        }
+        char *result = unshorten_url(url);
+        cache_store(c, url, result);
+        __atomic_add_fetch(&c->refreshes, 1, __ATOMIC_RELAXED);
+        free(result);
+        free(url);
+    }
+}
+static int cache_init(struct ResultCache *c, size_t max_entries, size_t nrefreshers) {
+    size_t nbuckets = 1;
+    while (nbuckets * CACHE_CHAIN < max_entries) nbuckets <<= 1;
+    c->buckets = huge_alloc(nbuckets * sizeof(*c->buckets));
+    if (c->buckets) numa_interleave(c->buckets, nbuckets * sizeof(*c->buckets));
+    if (!c->buckets || ring_init(&c->refresh, 1024) != 0) {
+        huge_free(c->buckets, nbuckets * sizeof(*c->buckets));
+        return -1;
+    }
+    c->mask = nbuckets - 1;
+    for (int i = 0; i < CACHE_STRIPES; i++) pthread_mutex_init(&c->locks[i], NULL);
+    pthread_mutex_init(&c->served_lock, NULL);
+    ec_init(&c->refresh_ready);
+    c->refreshers = calloc(nrefreshers ? nrefreshers : 1, sizeof(pthread_t));
+    c->nrefreshers = c->refreshers ? nrefreshers : 0;
+    for (size_t i = 0; i < c->nrefreshers; i++)
+        pthread_create(&c->refreshers[i], NULL, cache_refresher_main, c);
+    return 0;
+}
+// Stops the refreshers (pending refreshes are dropped) and frees
+// every entry.
+static void cache_destroy(struct ResultCache *c) {
+    __atomic_store_n(&c->stopping, 1, __ATOMIC_SEQ_CST);
+    char *url;
+    while ((url = ring_try_pop(&c->refresh)) != NULL) free(url);
+    ec_notify(&c->refresh_ready);
+    for (size_t i = 0; i < c->nrefreshers; i++) pthread_join(c->refreshers[i], NULL);
+    while ((url = ring_try_pop(&c->refresh)) != NULL) free(url);
+    for (size_t b = 0; b <= c->mask; b++) {
+        while (c->buckets[b]) {
+            struct CacheEntry *e = c->buckets[b];
+            c->buckets[b] = e->next;
+            cache_entry_free(e);
+        }
+    }
+    for (int i = 0; i < CACHE_STRIPES; i++) pthread_mutex_destroy(&c->locks[i]);
+    pthread_mutex_destroy(&c->served_lock);
+    ec_destroy(&c->refresh_ready);
+    ring_destroy(&c->refresh);
+    free(c->refreshers);
+    huge_free(c->buckets, (c->mask + 1) * sizeof(*c->buckets));
+}
+static void cache_print_stats(struct ResultCache *c, FILE *out) {
+    pthread_mutex_lock(&c->served_lock);
+    fprintf(out, "[cache] hits_fresh=%llu hits_stale=%llu hits_negative=%llu misses=%llu "
+            "refreshes=%llu refreshes_dropped=%llu evictions=%llu "
+            "served_p50_us=%.3f served_p99_us=%.3f served_max_us=%.3f\n",
+            (unsigned long long)__atomic_load_n(&c->hits_fresh, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&c->hits_stale, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&c->hits_negative, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&c->misses, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&c->refreshes, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&c->refreshes_dropped, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&c->evictions, __ATOMIC_RELAXED),
+            (double)hist_percentile(&c->served_ns, 50) / 1000.0,
+            (double)hist_percentile(&c->served_ns, 99) / 1000.0,
+            (double)c->served_ns.max / 1000.0);
+    pthread_mutex_unlock(&c->served_lock);
+}
+// ============================================================
+// FUNCTION: run_cache_batch_test()
+// ------------------------------------------------------------
+// "--cache-batch-test [entries] [lookups]": fills a result cache
+// with entries short URLs (default 1000000), then probes random
+// hits one at a time with cache_lookup() and CACHE_BATCH at a time
+// with cache_lookup_batch(). Each round copies 1024 keys into a
+// small buffer first, as the dispatcher gets them from freshly
+// parsed jobs; only the probes are timed.
+// RETURNS:
+// Process exit status.
+// ============================================================
+static int run_cache_batch_test(int argc, char *argv[]) {
+    size_t entries = argc > 0 ? (size_t)strtoul(argv[0], NULL, 10) : 1000000;
+    uint64_t lookups = argc > 1 ? strtoull(argv[1], NULL, 10) : 5000000;
+    enum { ROUND = 1024, KEY = 32 };
+    struct ResultCache cache;
+    char **keys = entries ? calloc(entries, sizeof(char *)) : NULL, *round = malloc(ROUND * KEY);
+    const char *urls[ROUND];
+    char *values[ROUND];
+    enum CacheState states[ROUND];
+    double ns[2] = {0, 0};
+    uint64_t x = 0x9e3779b97f4a7c15ull, hits[2] = {0, 0};
+    memset(&cache, 0, sizeof(cache));
+    cache.ttl_ns = cache.stale_ns = 3600 * 1000000000ull;
+    if (!keys || !round || lookups == 0 || cache_init(&cache, entries * 2, 0) != 0) { // Room for all
+        fprintf(stderr, "Error: Usage: --cache-batch-test [entries > 0] [lookups > 0] (or out of memory)\n");
+        free(keys);
+        free(round);
+        return 1;
+    }
+    for (size_t i = 0; i < entries; i++) {
+        char url[KEY];
+        snprintf(url, sizeof(url), "https://tinyurl.com/%08zx", i * 2654435761u % 0xffffffffu);
+        keys[i] = my_strdup(url);
+        if (keys[i]) cache_store(&cache, url, "https://example.com/some/target/page");
+    }
+    for (int pass = 0; pass < 2; pass++) {
+        uint64_t t = 0;
+        for (uint64_t done = 0; done < lookups; done += ROUND) {
+            size_t n = lookups - done < ROUND ? (size_t)(lookups - done) : ROUND;
+            for (size_t i = 0; i < n; i++) {
+                x ^= x << 13;
+                x ^= x >> 7;
+                x ^= x << 17;
+                const char *key = keys[x % entries];
+                snprintf(round + i * KEY, KEY, "%s", key ? key : "");
+                urls[i] = round + i * KEY;
+            }
+            uint64_t t0 = now_ns();
+            if (pass == 0) {
+                for (size_t i = 0; i < n; i++) values[i] = cache_lookup(&cache, urls[i], &states[i]);
+            } else {
+                cache_lookup_batch(&cache, urls, n, values, states);
+            }
+            t += now_ns() - t0;
+            for (size_t i = 0; i < n; i++) {
+                hits[pass] += values[i] != NULL;
+                free(values[i]);
+            }
+        }
+        ns[pass] = (double)t / (double)lookups;
+        printf("[cache-batch-test] probe=%s entries=%zu lookups=%llu hits=%llu ns_per_lookup=%.1f "
+               "mlookups_per_s=%.2f\n", pass == 0 ? "sequential" : "batch", entries, (unsigned long long)lookups,
+               (unsigned long long)hits[pass], ns[pass], 1e3 / ns[pass]);
+    }
+    printf("[cache-batch-test] batch of %d: %.2fx sequential throughput\n", CACHE_BATCH, ns[0] / ns[1]);
+    cache_destroy(&cache);
+    for (size_t i = 0; i < entries; i++) free(keys[i]);
+    free(keys);
+    free(round);
+    return 0;
+}
+// ============================================================
+// HOP CACHE: redirects remembered by source URL
+// ------------------------------------------------------------
+// Redirect walks record each hop they request (source URL ->
+// Location) with a lifetime taken from the response:
+//   Cache-Control no-store / no-cache   not cached
+//   Cache-Control max-age=N             N seconds
+//   Expires                             until then
+//   otherwise 301 / 308                 HOP_CACHE_PERMANENT_S
+//   otherwise 302 / 303 / 307           not cached
+// Later walks, even from a different short URL, jump over known
+// hops without a request, so only the unknown part of a chain and
+// its final URL go over the network. The table is a ResultCache
+// with per-entry deadlines and no refreshers; worker mode turns
+// it on (--hop-cache).
+// ============================================================
+#define HOP_CACHE_PERMANENT_S (30 * 86400)
+static struct ResultCache *hop_cache; // NULL while disabled
+static struct ResultCache hop_cache_table;
+static int hop_cache_enable(size_t max_entries) {
+    memset(&hop_cache_table, 0, sizeof(hop_cache_table));
+    if (cache_init(&hop_cache_table, max_entries, 0) != 0) return -1;
+    hop_cache = &hop_cache_table;
+    return 0;
+}
+// Call only once no walk is running.
+static void hop_cache_disable(void) {
+    if (!hop_cache) return;
+    hop_cache = NULL;
+    cache_destroy(&hop_cache_table);
+}
+// RETURNS: where url is known to redirect to (caller frees), or NULL.
+static char *hop_cache_get(const char *url) {
+    enum CacheState state;
+    return hop_cache ? cache_lookup(hop_cache, url, &state) : NULL;
+}
+static void hop_cache_put(const char *from, const char *to, long status, const struct UnshortenWalk *w) {
+    int64_t lifetime_s = 0;
+    if (!hop_cache || w->no_store) return;
+    if (w->max_age >= 0) lifetime_s = w->max_age;
+    else if (w->expires > 0) lifetime_s = w->expires - (int64_t)time(NULL);
+    else if (status == 301 || status == 308) lifetime_s = HOP_CACHE_PERMANENT_S;
+    if (lifetime_s <= 0) return;
+    uint64_t until = now_ns() + (uint64_t)lifetime_s * 1000000000ull;
+    cache_insert(hop_cache, from, hash_bytes(from, strlen(from)), my_strdup(to), 0, until, until, 0);
+}
+static void hop_cache_print_stats(FILE *out) {
+    if (!hop_cache) return;
+    fprintf(out, "[hop-cache] requests_skipped=%llu misses=%llu evictions=%llu\n",
+            (unsigned long long)__atomic_load_n(&hop_cache->hits_fresh, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&hop_cache->misses, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&hop_cache->evictions, __ATOMIC_RELAXED));
+}
+// ============================================================
+// ENGINE: thread-per-core unshorten engine
+// ------------------------------------------------------------
+// Each core is a thread with its own curl multi handle, so its
+// connection pool, DNS cache and TLS sessions are private: nothing
+// is locked between cores. A request goes to the core chosen by
+// the hash of its host, which keeps every connection to a host on
+// one core where later requests can reuse it.
+//
+// Submitters push requests into the core's inbox (a Ring) and
+// wake its curl_multi_poll(). The core drives every redirect walk
+// with the same unshorten_next_hop() steps as unshorten_url() and
+// calls req->done() from its own thread when the result is ready;
+// done() must not block for long, as it stalls the whole core.
+// Core threads are pinned to the CPUs of the process's affinity
+// mask, one each, while there are enough of them (with --numa,
+// by the NUMA plan instead). Each core creates its multi handle
+// and inbox itself once pinned, so they live on its own node.
+// ============================================================
+#define ENGINE_MAX_CORES 256
+struct EngineReq {
+    const char *url; // Short URL to resolve (kept by the caller)
+    char *result; // Set before done() runs; caller frees
+    void (*done)(struct EngineReq *req);
+    void *arg; // Caller's context
+    long timeout_ms; // Budget for the walk (0 = UNSHORTEN_TIMEOUT_MS)
+    struct Cost *cost; // Accounting (see COST), or NULL
+    // Engine-private
+    CURL *curl;
+    uint64_t started_ns;
+    double share_start; // Core's cpu_share when the walk started
+    struct UnshortenWalk walk;
+    char routed[2048];
+};
+struct EngineCore {
+    struct Engine *engine;
+    CURLM *multi;
+    struct Ring inbox; // Submitters -> this core
+    struct EventCount space; // The inbox has room again
+    CURL *spare[64]; // Finished easy handles kept for reuse
+    size_t nspare;
+    size_t inflight; // Requests being walked
+    uint64_t completed; // Atomic
+    double cpu_share; // Sum over perform passes of CPU ns / requests in flight
+    int cpu; // Pinned CPU, or -1
+    size_t inbox_cap;
+    int state; // Atomic: 1 once the core is set up, -1 if that failed
+    pthread_t thread;
+};
+struct Engine {
+    struct EngineCore *cores;
+    size_t ncores;
+    int stopping; // Atomic: exit once the inboxes are drained
+    struct EventCount started; // A core has set its state
+};
+static size_t host_filter_url_host(const char *url, char *host, size_t cap);
+static void engine_finish(struct EngineCore *core, struct EngineReq *req, CURLcode res) {
+    if (req->cost) {
+        uint64_t wall = now_ns() - req->started_ns, tls = req->cost->wall_ns[COST_TLS];
+        req->cost->cpu_ns[COST_NETWORK] += (uint64_t)(core->cpu_share - req->share_start);
+        req->cost->wall_ns[COST_NETWORK] += wall > tls ? wall - tls : 0;
+    }
+    req->result = unshorten_result(req->curl, &req->walk, res);
+    if (core->nspare < sizeof(core->spare) / sizeof(core->spare[0])) {
+        curl_easy_reset(req->curl);
+        core->spare[core->nspare++] = req->curl;
+    } else {
+        curl_easy_cleanup(req->curl);
+    }
+    req->curl = NULL;
+    core->inflight--;
+    __atomic_add_fetch(&core->completed, 1, __ATOMIC_RELAXED);
+    req->done(req);
+}
+static void engine_start_req(struct EngineCore *core, struct EngineReq *req) {
+    struct CostMark m = {0, 0};
+    if (req->cost) cost_begin(&m);
+    const char *url = cluster_route(req->url, req->routed, sizeof(req->routed));
+    req->curl = core->nspare ? core->spare[--core->nspare] : curl_easy_init();
+    core->inflight++;
+    if (!req->curl) {
+        core->inflight--;
+        req->result = my_strdup("Error: Could not initialize curl");
+        req->done(req);
+        return;
+    }
+    unshorten_begin(req->curl, &req->walk, url, req->timeout_ms ? req->timeout_ms : UNSHORTEN_TIMEOUT_MS);
+    curl_easy_setopt(req->curl, CURLOPT_PRIVATE, req);
+    if (req->cost) {
+        cost_add(req->cost, COST_ENCODE, &m);
+        req->started_ns = now_ns();
+        req->share_start = core->cpu_share;
+    }
+    if (!req->walk.allowed || curl_multi_add_handle(core->multi, req->curl) != CURLM_OK)
+        engine_finish(core, req, CURLE_FAILED_INIT);
+}
+static void *engine_core_main(void *arg) {
+    struct EngineCore *core = arg;
+    struct Engine *e = core->engine;
+    if (numa_pin_self() < 0 && core->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(core->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+    int ok = (core->multi = curl_multi_init()) != NULL && ring_init(&core->inbox, core->inbox_cap) == 0;
+    if (!ok && core->multi) curl_multi_cleanup(core->multi);
+    __atomic_store_n(&core->state, ok ? 1 : -1, __ATOMIC_SEQ_CST);
+    ec_notify(&e->started);
+    if (!ok) return NULL;
+    for (;;) {
+        struct EngineReq *req;
+        int running, left;
+        CURLMsg *msg;
+        while ((req = ring_try_pop(&core->inbox)) != NULL) {
+            ec_notify(&core->space);
+            engine_start_req(core, req);
+        }
+        uint64_t cpu0 = cost_enabled ? thread_cpu_ns() : 0;
+        curl_multi_perform(core->multi, &running);
+        if (cost_enabled && core->inflight)
+            core->cpu_share += (double)(thread_cpu_ns() - cpu0) / (double)core->inflight;
+        while ((msg = curl_multi_info_read(core->multi, &left)) != NULL) {
+            if (msg->msg != CURLMSG_DONE) continue;
+            CURL *curl = msg->easy_handle;
+            CURLcode res = msg->data.result;
+            char *priv = NULL;
+            curl_easy_getinfo(curl, CURLINFO_PRIVATE, &priv);
+            req = (struct EngineReq *)(void *)priv;
+            TRACE_CURL(curl);
+            curl_multi_remove_handle(core->multi, curl);
+            struct CostMark m = {0, 0};
+            if (req->cost) {
+                cost_tls(req->cost, curl);
+                cost_begin(&m);
+            }
+            int more = unshorten_next_hop(curl, &req->walk, &res);
+            if (req->cost) cost_add(req->cost, COST_ENCODE, &m);
+            if (more && curl_multi_add_handle(core->multi, curl) == CURLM_OK) continue;
+            engine_finish(core, req, res);
+        }
+        if (core->inflight == 0 && __atomic_load_n(&e->stopping, __ATOMIC_ACQUIRE)) {
+            if ((req = ring_try_pop(&core->inbox)) == NULL) break;
+            ec_notify(&core->space); // Submitted just before the stop
+            engine_start_req(core, req);
+            continue;
+        }
+        curl_multi_poll(core->multi, NULL, 0, 1000, NULL); // Woken early by engine_submit()
+    }
+    return NULL;
+}
+// Finishes every submitted request, then stops the cores.
+static void engine_stop(struct Engine *e) {
+    __atomic_store_n(&e->stopping, 1, __ATOMIC_RELEASE);
+    for (size_t i = 0; i < e->ncores; i++) curl_multi_wakeup(e->cores[i].multi);
+    for (size_t i = 0; i < e->ncores; i++) {
+        struct EngineCore *core = &e->cores[i];
+        pthread_join(core->thread, NULL);
+        while (core->nspare) curl_easy_cleanup(core->spare[--core->nspare]);
+        curl_multi_cleanup(core->multi);
+        ring_destroy(&core->inbox);
+        ec_destroy(&core->space);
+    }
+    ec_destroy(&e->started);
+    free(e->cores);
+    e->cores = NULL;
+    e->ncores = 0;
+}
+// ============================================================
+// FUNCTION: engine_start()
+// ------------------------------------------------------------
+// PARAMETERS:
+// ncores → Core threads (1..ENGINE_MAX_CORES)
+// inbox → Requests each core can have queued but not started
+// RETURNS:
+// 0 with the cores running, or -1.
+// ============================================================
+static int engine_start(struct Engine *e, size_t ncores, size_t inbox) {
+    cpu_set_t allowed;
+    int cpus[ENGINE_MAX_CORES], ncpus = 0, ok = ncores > 0 && ncores <= ENGINE_MAX_CORES;
+    memset(e, 0, sizeof(*e));
+    ec_init(&e->started);
+    if (ok && sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+        for (int c = 0; c < CPU_SETSIZE && ncpus < ENGINE_MAX_CORES; c++)
+            if (CPU_ISSET(c, &allowed)) cpus[ncpus++] = c;
+    e->cores = ok ? calloc(ncores, sizeof(struct EngineCore)) : NULL;
+    ok = e->cores != NULL;
+    for (size_t i = 0; ok && i < ncores; i++) {
+        struct EngineCore *core = &e->cores[i];
+        core->engine = e;
+        core->cpu = ncores <= (size_t)ncpus ? cpus[i] : -1; // Oversubscribed: let the kernel place them
+        core->inbox_cap = inbox;
+        ec_init(&core->space);
+        if (pthread_create(&core->thread, NULL, engine_core_main, core) != 0) {
+            ec_destroy(&core->space);
+            ok = 0;
+            break;
+        }
+        while (__atomic_load_n(&core->state, __ATOMIC_SEQ_CST) == 0) {
+            unsigned key = ec_prepare(&e->started);
+            if (__atomic_load_n(&core->state, __ATOMIC_SEQ_CST) != 0) ec_cancel(&e->started);
+            else ec_wait(&e->started, key);
+        }
+        if (core->state > 0) {
+            e->ncores++;
+        } else { // The core has exited
+            pthread_join(core->thread, NULL);
+            ec_destroy(&core->space);
+            ok = 0;
+        }
+    }
+    if (!ok && e->cores) engine_stop(e); // Stops the cores already running
+    else if (!ok) ec_destroy(&e->started);
+    return ok ? 0 : -1;
+}
+// Routes req to the core owning its host, blocking while that
+// core's inbox is full.
+static void engine_submit(struct Engine *e, struct EngineReq *req) {
+    char host[256];
+    size_t len = host_filter_url_host(req->url, host, sizeof(host));
+    struct EngineCore *core = &e->cores[hash_bytes(host, len) % e->ncores];
+    ring_push_wait(&core->inbox, req, &core->space);
+    curl_multi_wakeup(core->multi);
+}
+// Counting semaphore for callers that bound their requests in
+// flight on the engine (the engine itself queues without limit).
+struct Slots {
+    size_t used; // Atomic
+    size_t cap;
+    struct EventCount freed;
+};
+static void slots_acquire(struct Slots *sl) {
+    for (;;) {
+        size_t n = __atomic_load_n(&sl->used, __ATOMIC_SEQ_CST);
+        if (n < sl->cap) {
+            if (__atomic_compare_exchange_n(&sl->used, &n, n + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) return;
+            continue;
+        }
+        unsigned key = ec_prepare(&sl->freed);
+        if (__atomic_load_n(&sl->used, __ATOMIC_SEQ_CST) < sl->cap) {
+            ec_cancel(&sl->freed);
+            continue;
+        }
+        ec_wait(&sl->freed, key);
+    }
+}
+static void slots_release(struct Slots *sl) {
+    __atomic_sub_fetch(&sl->used, 1, __ATOMIC_SEQ_CST);
+    ec_notify(&sl->freed);
+}
+// Blocks until every slot is free again.
+static void slots_drain(struct Slots *sl) {
+    for (;;) {
+        unsigned key = ec_prepare(&sl->freed);
+        if (__atomic_load_n(&sl->used, __ATOMIC_SEQ_CST) == 0) {
+            ec_cancel(&sl->freed);
+            return;
+        }
+        ec_wait(&sl->freed, key);
+    }
+}
+// ============================================================
+// BATCH WORKER: jobs, clients and priority classes
+// ------------------------------------------------------------
+// Worker mode (-w) lets several submitters ("clients") feed one
+// cipher process. Each client is a line-oriented source (a file,
+// a FIFO or stdin) read by its own thread. Every line is a job:
+//
+//   [interactive|bulk] [-s|-u] <url>
+//
+// Interactive jobs are dispatched ahead of bulk ones; inside a
+// class, clients share the resolver threads by weight.
+//
+// The stages are connected by bounded rings:
+//
+//   reader (1/client) --SPSC--> scheduler -> dispatcher
+//   dispatcher -> per-host queues -> resolvers (-j)
+//   dispatcher (cache hits), resolvers --MPSC--> writer -> stdout
+//
+// With --cores, resolvers hand -u jobs to the ENGINE instead of
+// resolving them, and the engine cores push the results.
+//
+// A full ring blocks its producer, so a stalled stdout stops the
+// resolvers, which stops the readers, and a fast input can never
+// queue more than --queue-depth jobs per client and class. Peak
+// memory is therefore fixed by the options, not by input size.
+// ============================================================
+enum JobClass { CLASS_INTERACTIVE = 0, CLASS_BULK = 1, CLASS_COUNT = 2 };
+static const char *const class_names[CLASS_COUNT] = { "interactive", "bulk" };
+enum JobOp { OP_UNSHORTEN = 0, OP_SHORTEN = 1 };
+struct Client;
+struct Job {
+    struct Client *client; // Submitter this job belongs to
+    int cls; // enum JobClass
+    int op; // enum JobOp
+    char *url; // Heap copy of the URL to resolve
+    char *result; // Set by the resolver, printed by the writer
+    uint64_t enqueued_ns; // now_ns() at submission, for wait stats
+    struct HostQueue *host; // Politeness queue while waiting or in flight
+    struct Job *host_next; // Next job waiting for the same host
+    uint64_t started_ns; // When it left the host queue
+    long timeout_ms; // Deadline mode: shortened request budget, or 0
+    int expired; // Deadline mode: given up without a request
+    int cached; // Answered by the result cache
+    struct Cost cost; // --cost accounting
+};
+struct Client {
+    char name[64]; // Label echoed in the output lines
+    double weight; // Share of the resolvers relative to other clients
+    FILE *in; // Job source
+    struct Ring queue[CLASS_COUNT]; // Reader -> scheduler, one per class
+    size_t pending[CLASS_COUNT]; // Jobs pushed but not yet dispatched
+    double finish[CLASS_COUNT]; // WFQ finish tag of the last dispatched job
+    pthread_t reader;
+    struct Scheduler *sched;
+};
+// ============================================================
+// STRUCT: HostGate
+// ------------------------------------------------------------
+// Politeness layer between the scheduler and the resolvers.
+// Jobs leave the scheduler in priority/fairness order and wait in
+// a FIFO per target host (the host of the -u URL, or of the
+// shorten API for -s). Resolvers serve the hosts round-robin,
+// skipping a host while it has per_host jobs in flight or its
+// pacing interval has not passed, so one busy shortener cannot
+// take every resolver and no host sees more than per_host
+// concurrent requests or `rate` new ones per second. The resolver
+// count (-j) stays the global cap.
+//
+// At most `backlog` jobs wait here; the dispatcher blocks beyond
+// that, which keeps the worker's memory bound. Hosts that have
+// gone idle are freed lazily once their pacing slot has passed.
+//
+// With a deadline (--deadline), the gate keeps a moving average of
+// each host's job time and serves the eligible host with the
+// shortest one instead of round-robin, which maximizes completions
+// in the time left. A job whose host cannot finish before the
+// deadline (by that estimate) is handed out as expired, without a
+// request, so it leaves the backlog at once; hosts are then kept
+// after going idle so their estimates survive.
+// ============================================================
+#define HOST_GATE_BUCKETS 4096
+struct HostQueue {
+    struct HostQueue *hash_next;
+    struct HostQueue *rr_prev, *rr_next; // Ring of hosts with waiting jobs
+    struct HostQueue *idle_next; // Idle list, oldest first
+    struct Job *head, *tail; // Waiting jobs, linked by Job.host_next
+    size_t queued; // Jobs in head..tail
+    size_t inflight; // Jobs handed to resolvers
+    uint64_t next_start_ns; // Pacing: earliest start of the next job
+    double est_ns; // Deadline mode: average job time, or 0 before the first
+    uint64_t hash;
+    int in_idle_list;
+    char host[];
+};
+struct HostGate {
+    pthread_mutex_t lock;
+    pthread_cond_t ready; // A host may have become eligible (resolvers)
+    pthread_cond_t space; // The backlog has room (dispatcher)
+    struct HostQueue *buckets[HOST_GATE_BUCKETS];
+    struct HostQueue *rr; // Next host to consider, or NULL
+    struct HostQueue *idle_head, *idle_tail;
+    size_t per_host; // In-flight cap per host (0 = none)
+    uint64_t interval_ns; // Minimum gap between starts per host (0 = none)
+    size_t backlog; // Jobs allowed to wait here
+    size_t staged; // Jobs waiting here
+    int closed; // No more jobs will be put
+    size_t nhosts, max_hosts, max_staged;
+    uint64_t dispatched;
+    uint64_t capped_waits; // Takes that found only hosts at their cap
+    uint64_t paced_waits; // Takes that waited for a pacing slot
+    uint64_t deadline_ns; // now_ns() time of the deadline, or 0
+    double est_ns; // Deadline mode: average job time of all hosts
+    uint64_t expired; // Jobs handed out as expired
+};
+static int gate_init(struct HostGate *g, size_t per_host, double rate, size_t backlog) {
+    pthread_condattr_t attr;
+    memset(g, 0, sizeof(*g));
+    g->per_host = per_host;
+    g->interval_ns = rate > 0 ? (uint64_t)(1e9 / rate) : 0;
+    g->backlog = backlog;
+    if (pthread_condattr_init(&attr) != 0) return -1;
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC); // Deadlines come from now_ns()
+    pthread_mutex_init(&g->lock, NULL);
+    pthread_cond_init(&g->ready, &attr);
+    pthread_cond_init(&g->space, &attr);
+    pthread_condattr_destroy(&attr);
+    return 0;
+}
+static void gate_destroy(struct HostGate *g) {
+    for (size_t b = 0; b < HOST_GATE_BUCKETS; b++) {
+        struct HostQueue *h = g->buckets[b];
+        while (h) {
+            struct HostQueue *next = h->hash_next;
+            free(h);
+            h = next;
+        }
+    }
+    pthread_cond_destroy(&g->space);
+    pthread_cond_destroy(&g->ready);
+    pthread_mutex_destroy(&g->lock);
+}
+// Frees idle hosts whose pacing slot has passed, oldest first.
+static void gate_reclaim_locked(struct HostGate *g, uint64_t now) {
+    struct HostQueue *h;
+    if (g->deadline_ns) return; // Keep the estimates
+    while ((h = g->idle_head) != NULL) {
+        int idle = h->queued == 0 && h->inflight == 0;
+        if (idle && h->next_start_ns > now) break;
+        g->idle_head = h->idle_next;
+        if (!g->idle_head) g->idle_tail = NULL;
+        h->in_idle_list = 0;
+        if (!idle) continue; // Busy again; re-listed when it next goes idle
+        struct HostQueue **pp = &g->buckets[h->hash % HOST_GATE_BUCKETS];
+        while (*pp != h) pp = &(*pp)->hash_next;
+        *pp = h->hash_next;
+        g->nhosts--;
+        free(h);
+    }
+}
+static struct HostQueue *gate_host_locked(struct HostGate *g, const char *host, uint64_t now) {
+    size_t len = strlen(host);
+    uint64_t hash = hash_bytes(host, len);
+    struct HostQueue **bucket = &g->buckets[hash % HOST_GATE_BUCKETS];
+    for (struct HostQueue *h = *bucket; h; h = h->hash_next)
+        if (h->hash == hash && strcmp(h->host, host) == 0) return h;
+    gate_reclaim_locked(g, now);
+    struct HostQueue *h = calloc(1, sizeof(*h) + len + 1);
+    if (!h) return NULL;
+    memcpy(h->host, host, len + 1);
+    h->hash = hash;
+    h->hash_next = *bucket;
+    *bucket = h;
+    if (++g->nhosts > g->max_hosts) g->max_hosts = g->nhosts;
+    return h;
+}
+// The host a job sends its request to: the -u URL's, or the
+// shorten API's for -s ("" when unparsable).
+static void job_host(const struct Job *job, char *host, size_t cap) {
+    const char *api = getenv("CIPHER_SHORTEN_API");
+    const char *target = job->op == OP_SHORTEN ? (api && *api ? api : "https://tinyurl.com") : job->url;
+    if (host_filter_url_host(target, host, cap) == 0) host[0] = 0;
+}
+// Dispatcher side: queues job behind its host, blocking while the
+// backlog is full. RETURNS: 0, or -1 when out of memory.
+static int gate_put(struct HostGate *g, struct Job *job) {
+    char host[256];
+    job_host(job, host, sizeof(host)); // Unparsable: one shared queue
+    pthread_mutex_lock(&g->lock);
+    while (g->staged >= g->backlog) pthread_cond_wait(&g->space, &g->lock);
+    struct HostQueue *h = gate_host_locked(g, host, now_ns());
+    if (h) {
+        job->host = h;
+        job->host_next = NULL;
+        if (h->tail) h->tail->host_next = job;
+        else h->head = job;
+        h->tail = job;
+        if (h->queued++ == 0) { // Joins the round-robin ring just behind the cursor
+            if (!g->rr) {
+                g->rr = h->rr_prev = h->rr_next = h;
+            } else {
+                h->rr_next = g->rr;
+                h->rr_prev = g->rr->rr_prev;
+                h->rr_prev->rr_next = h;
+                g->rr->rr_prev = h;
+            }
+        }
+        if (++g->staged > g->max_staged) g->max_staged = g->staged;
+        pthread_cond_signal(&g->ready);
+    }
+    pthread_mutex_unlock(&g->lock);
+    return h ? 0 : -1;
+}
+// Moves the head job of h out of the gate, as in flight.
+static struct Job *gate_pop_locked(struct HostGate *g, struct HostQueue *h, uint64_t now) {
+    struct Job *job = h->head;
+    h->head = job->host_next;
+    if (!h->head) h->tail = NULL;
+    h->inflight++;
+    g->staged--;
+    g->rr = h->rr_next; // Next take starts at the following host
+    if (--h->queued == 0) { // Leaves the ring
+        if (h->rr_next == h) {
+            g->rr = NULL;
+        } else {
+            h->rr_prev->rr_next = h->rr_next;
+            h->rr_next->rr_prev = h->rr_prev;
+        }
+    }
+    pthread_cond_signal(&g->space);
+    if (g->closed && g->staged == 0) pthread_cond_broadcast(&g->ready); // Let the others exit
+    job->started_ns = now;
+    return job;
+}
+// Resolver side: blocks until some host may start a job. RETURNS:
+// the job, or NULL once the gate is closed and drained.
+static struct Job *gate_take(struct HostGate *g) {
+    struct Job *job = NULL;
+    pthread_mutex_lock(&g->lock);
+    while (!job) {
+        uint64_t now = now_ns(), wake = UINT64_MAX;
+        struct HostQueue *h = g->rr, *best = NULL;
+        double best_est = 0;
+        for (size_t i = 0; h && (i == 0 || h != g->rr); i++, h = h->rr_next) {
+            double est = h->est_ns > 0 ? h->est_ns : g->est_ns; // Unknown hosts: the average
+            if (g->deadline_ns && (double)now + est >= (double)g->deadline_ns) { // Cannot finish in time
+                job = gate_pop_locked(g, h, now);
+                job->expired = 1;
+                g->expired++;
+                break;
+            }
+            if (g->per_host && h->inflight >= g->per_host) continue;
+            if (h->next_start_ns > now) {
+                if (h->next_start_ns < wake) wake = h->next_start_ns;
+                continue;
+            }
+            if (!best || est < best_est) {
+                best = h;
+                best_est = est;
+            }
+            if (!g->deadline_ns) break; // Round-robin: the first eligible host
+        }
+        if (!job && best) {
+            best->next_start_ns = now + g->interval_ns;
+            g->dispatched++;
+            job = gate_pop_locked(g, best, now);
+        }
+        if (job) break;
+        if (g->closed && g->staged == 0) break;
+        if (wake != UINT64_MAX || (g->deadline_ns > now && g->staged)) {
+            if (wake != UINT64_MAX) g->paced_waits++;
+            if (g->deadline_ns > now && g->deadline_ns < wake) wake = g->deadline_ns; // Expire what is left
+            struct timespec ts = {(time_t)(wake / 1000000000ull), (long)(wake % 1000000000ull)};
+            pthread_cond_timedwait(&g->ready, &g->lock, &ts);
+        } else {
+            if (g->staged) g->capped_waits++;
+            pthread_cond_wait(&g->ready, &g->lock);
+        }
+    }
+    pthread_mutex_unlock(&g->lock);
+    return job;
+}
+// Resolver side: job's request has finished.
+static void gate_done(struct HostGate *g, struct Job *job) {
+    struct HostQueue *h = job->host;
+    pthread_mutex_lock(&g->lock);
+    h->inflight--;
+    if (g->deadline_ns && !job->expired) {
+        double t = (double)(now_ns() - job->started_ns);
+        h->est_ns = h->est_ns > 0 ? 0.7 * h->est_ns + 0.3 * t : t;
+        g->est_ns = g->est_ns > 0 ? 0.9 * g->est_ns + 0.1 * t : t;
+    }
+    if (h->queued == 0 && h->inflight == 0 && !h->in_idle_list) {
+        h->in_idle_list = 1;
+        h->idle_next = NULL;
+        if (g->idle_tail) g->idle_tail->idle_next = h;
+        else g->idle_head = h;
+        g->idle_tail = h;
+    }
+    if (h->queued) pthread_cond_signal(&g->ready); // Its next job may start now
+    pthread_mutex_unlock(&g->lock);
+    job->host = NULL;
+}
+static void gate_close(struct HostGate *g) {
+    pthread_mutex_lock(&g->lock);
+    g->closed = 1;
+    pthread_cond_broadcast(&g->ready);
+    pthread_mutex_unlock(&g->lock);
+}
+static void gate_print_stats(struct HostGate *g, FILE *out) {
+    pthread_mutex_lock(&g->lock);
+    fprintf(out, "[hosts] per_host=%zu rate=%.1f/s dispatched=%llu hosts=%zu max_hosts=%zu waiting=%zu "
+            "max_waiting=%zu capped_waits=%llu paced_waits=%llu\n",
+            g->per_host, g->interval_ns ? 1e9 / (double)g->interval_ns : 0.0, (unsigned long long)g->dispatched,
+            g->nhosts, g->max_hosts, g->staged, g->max_staged, (unsigned long long)g->capped_waits,
+            (unsigned long long)g->paced_waits);
+    pthread_mutex_unlock(&g->lock);
+}
+// ============================================================
+// STRUCT: Scheduler
+// ------------------------------------------------------------
+// Two-level dispatcher shared by all resolver threads:
+//  1. Priority: interactive before bulk. While both classes are
+//     waiting, every bulk_every-th dispatch still goes to bulk so
+//     a stream of interactive lookups cannot starve big batches
+//     (bulk_every = 0 means strict priority).
+//  2. Fairness: start-time fair queuing per class. A client's next
+//     job starts at max(class virtual time, its last finish tag)
+//     and advances its finish tag by 1/weight; the smallest start
+//     tag wins. Idle clients do not bank credit.
+// Readers push without taking the lock; the lock only serializes
+// the consumers, so each client ring stays single-consumer.
+// ============================================================
+#define COST_ROW_BUCKETS 1024
+struct CostRow {
+    struct CostRow *next;
+    const char *mode;
+    uint64_t hash;
+    uint64_t requests;
+    struct Cost sum;
+    char host[];
+};
+struct ClassStats {
+    uint64_t enqueued; // Jobs submitted in this class (atomic)
+    uint64_t dispatched; // Jobs handed to a resolver
+    size_t depth; // Jobs currently waiting (atomic)
+    size_t max_depth; // High-water mark of depth (atomic)
+    struct LatHist wait_us; // Submission-to-dispatch wait
+};
+struct Scheduler {
+    pthread_mutex_t lock;
+    struct EventCount ready; // Jobs were queued, or a reader finished
+    struct EventCount space; // A reader ring has room again
+    struct Client *clients;
+    size_t nclients;
+    size_t readers_active; // Sources still producing jobs (atomic)
+    size_t resolvers_active; // Resolvers still running (atomic)
+    struct Ring out; // Resolvers -> writer
+    struct EventCount out_ready; // Results were queued, or a resolver exited
+    struct EventCount out_space; // The output ring has room again
+    struct ResultCache *cache; // Unshorten result cache, or NULL
+    struct HostGate hosts; // Per-host politeness queues
+    struct Engine *engine; // Resolves -u jobs with --cores, or NULL
+    struct Slots inflight; // Engine mode: -j requests in flight at most
+    double vtime[CLASS_COUNT]; // Virtual time per class
+    unsigned bulk_every; // Anti-starvation period (see above)
+    unsigned streak; // Interactive dispatches since the last bulk one
+    struct ClassStats stats[CLASS_COUNT];
+    // Deadline mode (the deadline itself is hosts.deadline_ns)
+    FILE *remainder; // Inputs left undone, as job lines
+    pthread_mutex_t remainder_lock;
+    uint64_t remaindered, shortened, written; // Atomic
+    // --cost totals per (mode, host), kept by the writer
+    struct CostRow *cost_rows[COST_ROW_BUCKETS];
+    size_t cost_nrows;
+    uint64_t started_ns;
+    double started_cpu; // Process CPU seconds at started_ns
+};
+// Producer side: called by the client's reader thread only.
+static void sched_submit(struct Scheduler *s, struct Job *job) {
+    struct Client *c = job->client;
+    struct ClassStats *st = &s->stats[job->cls];
+    job->enqueued_ns = now_ns();
+    ring_push_wait(&c->queue[job->cls], job, &s->space);
+    __atomic_add_fetch(&c->pending[job->cls], 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&st->enqueued, 1, __ATOMIC_RELAXED);
+    size_t depth = __atomic_add_fetch(&st->depth, 1, __ATOMIC_SEQ_CST);
+    size_t max = __atomic_load_n(&st->max_depth, __ATOMIC_RELAXED);
+    while (depth > max && !__atomic_compare_exchange_n(&st->max_depth, &max, depth, 1,
+                                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    ec_notify(&s->ready);
+}
+// Picks the client whose head job has the smallest WFQ start tag.
+static struct Client *sched_pick_client_locked(struct Scheduler *s, int cls, double *start_out) {
+    struct Client *best = NULL;
+    double best_start = 0;
+    for (size_t i = 0; i < s->nclients; i++) {
+        struct Client *c = &s->clients[i];
+        if (__atomic_load_n(&c->pending[cls], __ATOMIC_SEQ_CST) == 0) continue;
+        double start = c->finish[cls] > s->vtime[cls] ? c->finish[cls] : s->vtime[cls];
+        if (!best || start < best_start) {
+            best = c;
+            best_start = start;
+        }
+    }
+    *start_out = best_start;
+    return best;
+}
+static struct Job *sched_take_locked(struct Scheduler *s) {
+    int cls;
+    size_t inter = __atomic_load_n(&s->stats[CLASS_INTERACTIVE].depth, __ATOMIC_SEQ_CST);
+    size_t bulk = __atomic_load_n(&s->stats[CLASS_BULK].depth, __ATOMIC_SEQ_CST);
+    if (inter == 0 && bulk == 0) return NULL;
+    if (inter && (!bulk || s->bulk_every == 0 || s->streak + 1 < s->bulk_every)) {
+        cls = CLASS_INTERACTIVE;
+        s->streak++;
+    } else {
+        cls = CLASS_BULK;
+        s->streak = 0;
+    }
+    double start;
+    struct Client *c = sched_pick_client_locked(s, cls, &start);
+    if (!c) return NULL;
+    struct Job *job = ring_try_pop(&c->queue[cls]);
+    if (!job) return NULL;
+    __atomic_sub_fetch(&c->pending[cls], 1, __ATOMIC_SEQ_CST);
+    s->vtime[cls] = start;
+    c->finish[cls] = start + 1.0 / c->weight;
+    struct ClassStats *st = &s->stats[cls];
+    __atomic_sub_fetch(&st->depth, 1, __ATOMIC_SEQ_CST);
+    st->dispatched++;
+    hist_add(&st->wait_us, (now_ns() - job->enqueued_ns) / 1000);
+    return job;
+}
+// Blocks until a job is available. Returns NULL once every source
+// has hit EOF and all queues are drained.
+static struct Job *sched_next(struct Scheduler *s) {
+    for (;;) {
+        pthread_mutex_lock(&s->lock);
+        struct Job *job = sched_take_locked(s);
+        pthread_mutex_unlock(&s->lock);
+        if (job) {
+            ec_notify(&s->space);
+            return job;
+        }
+        unsigned key = ec_prepare(&s->ready);
+        // Load the reader count before the depths: a reader finishes
+        // only after its last push is counted, so seeing zero readers
+        // and then zero depth really means "drained".
+        size_t readers = __atomic_load_n(&s->readers_active, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&s->stats[CLASS_INTERACTIVE].depth, __ATOMIC_SEQ_CST) ||
+            __atomic_load_n(&s->stats[CLASS_BULK].depth, __ATOMIC_SEQ_CST)) {
+            ec_cancel(&s->ready);
+            continue;
+        }
+        if (readers == 0) {
+            ec_cancel(&s->ready);
+            return NULL;
+        }
+        ec_wait(&s->ready, key);
+    }
+}
+// sched_next(), then up to max - 1 more jobs that are already
+// queued, in the same order. RETURNS: the number taken, 0 at the end.
+static size_t sched_next_batch(struct Scheduler *s, struct Job **jobs, size_t max) {
+    size_t n = 0;
+    if ((jobs[n] = sched_next(s)) == NULL) return 0;
+    pthread_mutex_lock(&s->lock);
+    while (++n < max && (jobs[n] = sched_take_locked(s)) != NULL) {}
+    pthread_mutex_unlock(&s->lock);
+    if (n > 1) ec_notify(&s->space);
+    return n;
+}
+static void sched_reader_done(struct Scheduler *s) {
+    __atomic_sub_fetch(&s->readers_active, 1, __ATOMIC_SEQ_CST);
+    ec_notify(&s->ready);
+}
+static void sched_print_stats(struct Scheduler *s, FILE *out) {
+    pthread_mutex_lock(&s->lock);
+    for (int c = 0; c < CLASS_COUNT; c++) {
+        const struct ClassStats *st = &s->stats[c];
+        const struct LatHist *h = &st->wait_us;
+        fprintf(out, "[sched] class=%s enqueued=%llu dispatched=%llu depth=%zu max_depth=%zu "
+                "wait_avg_ms=%.3f wait_p50_ms=%.3f wait_p99_ms=%.3f wait_max_ms=%.3f\n",
+                class_names[c], (unsigned long long)__atomic_load_n(&st->enqueued, __ATOMIC_RELAXED),
+                (unsigned long long)st->dispatched, __atomic_load_n(&st->depth, __ATOMIC_RELAXED),
+                __atomic_load_n(&st->max_depth, __ATOMIC_RELAXED),
+                h->count ? (double)h->sum / (double)h->count / 1000.0 : 0.0,
+                (double)hist_percentile(h, 50) / 1000.0,
+                (double)hist_percentile(h, 99) / 1000.0, (double)h->max / 1000.0);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+// ============================================================
+// FUNCTION: job_parse()
+// ------------------------------------------------------------
+// Turns one input line into a Job. Accepted forms:
+//   <url>                       bulk unshorten
+//   [interactive|i|bulk|b] [-s|-u] <url>
+// RETURNS:
+// Heap-allocated Job, or NULL for blank/comment/malformed lines.
+// ============================================================
+static struct Job *job_parse(struct Client *c, char *line) {
+    char *tok[3];
+    int ntok = 0;
+    char *save = NULL;
+    for (char *t = strtok_r(line, " \t\r\n", &save); t; t = strtok_r(NULL, " \t\r\n", &save)) {
+        if (ntok == 3) return NULL; // Too many fields
+        tok[ntok++] = t;
+    }
+    if (ntok == 0 || tok[0][0] == '#') return NULL;
+    struct Job *job = calloc(1, sizeof(*job));
+    if (!job) return NULL;
+    job->client = c;
+    job->cls = CLASS_BULK;
+    job->op = OP_UNSHORTEN;
+    int i = 0;
+    if (ntok - i > 1 && (!strcmp(tok[i], "interactive") || !strcmp(tok[i], "i"))) {
+        job->cls = CLASS_INTERACTIVE;
+        i++;
+    } else if (ntok - i > 1 && (!strcmp(tok[i], "bulk") || !strcmp(tok[i], "b"))) {
+        i++;
+    }
+    if (ntok - i > 1 && !strcmp(tok[i], "-s")) {
+        job->op = OP_SHORTEN;
+        i++;
+    } else if (ntok - i > 1 && !strcmp(tok[i], "-u")) {
+        i++;
+    }
+    if (ntok - i != 1 || !(job->url = my_strdup(tok[i]))) {
+        free(job);
+        return NULL;
+    }
+    return job;
+}
+static void job_free(struct Job *job) {
+    free(job->url);
+    free(job->result);
+    free(job);
+}
+// Deadline mode: appends an unprocessed input line to the
+// remainder file.
+static void sched_remainder_line(struct Scheduler *s, const char *line) {
+    size_t len = strlen(line);
+    pthread_mutex_lock(&s->remainder_lock);
+    fputs(line, s->remainder);
+    if (len == 0 || line[len - 1] != '\n') fputc('\n', s->remainder);
+    pthread_mutex_unlock(&s->remainder_lock);
+    __atomic_add_fetch(&s->remaindered, 1, __ATOMIC_RELAXED);
+}
+// Same for a parsed job, which is freed.
+static void sched_remainder_job(struct Scheduler *s, struct Job *job) {
+    pthread_mutex_lock(&s->remainder_lock);
+    fprintf(s->remainder, "%s%s%s\n", job->cls == CLASS_INTERACTIVE ? "interactive " : "",
+            job->op == OP_SHORTEN ? "-s " : "", job->url);
+    pthread_mutex_unlock(&s->remainder_lock);
+    __atomic_add_fetch(&s->remaindered, 1, __ATOMIC_RELAXED);
+    job_free(job);
+}
+// Deadline mode: whether job belongs in the remainder rather than
+// the output (it expired, or failed within a shortened budget).
+static int job_cut_off(const struct Job *job) {
+    return job->expired || (job->timeout_ms && is_error_result(job->result));
+}
+// Reader thread: one per client source. Blocks in sched_submit()
+// while the client's ring is full (back-pressure on the input).
+static void *reader_main(void *arg) {
+    struct Client *c = arg;
+    char *line = NULL;
+    size_t cap = 0;
+    while (getline(&line, &cap, c->in) != -1) {
+        if (c->sched->remainder && now_ns() >= c->sched->hosts.deadline_ns) { // Past the deadline
+            sched_remainder_line(c->sched, line);
+            continue;
+        }
+        TRACE_BEGIN(parse_t);
+        struct CostMark m = {0, 0};
+        if (cost_enabled) cost_begin(&m);
+        struct Job *job = job_parse(c, line);
+        if (job && cost_enabled) cost_add(&job->cost, COST_PARSE, &m);
+        TRACE_END(parse_t, "parse");
+        if (job) sched_submit(c->sched, job);
+    }
+    free(line);
+    if (c->in != stdin) fclose(c->in);
+    sched_reader_done(c->sched);
+    return NULL;
+}
+static volatile sig_atomic_t stats_requested; // Set by SIGUSR1
+static void on_sigusr1(int sig) {
+    (void)sig;
+    stats_requested = 1;
+}
+// Dispatcher thread: takes jobs in scheduler order, answers cache
+// hits at once and queues the rest behind their hosts. Jobs that
+// are already queued are taken CACHE_BATCH at a time and probed
+// with one cache_lookup_batch(); the cost of the batch is split
+// evenly between its -u jobs.
+static void *dispatcher_main(void *arg) {
+    struct Scheduler *s = arg;
+    struct Job *batch[CACHE_BATCH], *probed[CACHE_BATCH];
+    const char *urls[CACHE_BATCH];
+    char *values[CACHE_BATCH];
+    enum CacheState states[CACHE_BATCH];
+    size_t n;
+    while ((n = sched_next_batch(s, batch, CACHE_BATCH)) > 0) {
+        size_t nprobed = 0;
+        for (size_t i = 0; s->cache && i < n; i++) {
+            if (batch[i]->op != OP_UNSHORTEN) continue;
+            probed[nprobed] = batch[i];
+            urls[nprobed++] = batch[i]->url;
+        }
+        if (nprobed > 0) {
+            TRACE_BEGIN(lookup_t);
+            struct CostMark m = {0, 0};
+            if (cost_enabled) cost_begin(&m);
+            cache_lookup_batch(s->cache, urls, nprobed, values, states);
+            uint64_t cpu = cost_enabled ? (thread_cpu_ns() - m.cpu) / nprobed : 0;
+            uint64_t wall = cost_enabled ? (now_ns() - m.wall) / nprobed : 0;
+            for (size_t i = 0; i < nprobed; i++) {
+                probed[i]->result = values[i];
+                probed[i]->cached = values[i] != NULL;
+                probed[i]->cost.cpu_ns[COST_CACHE] += cpu;
+                probed[i]->cost.wall_ns[COST_CACHE] += wall;
+            }
+            TRACE_END(lookup_t, "cache");
+        }
+        for (size_t i = 0; i < n; i++) {
+            struct Job *job = batch[i];
+            if (!job->result && s->remainder && now_ns() >= s->hosts.deadline_ns) {
+                sched_remainder_job(s, job);
+                continue;
+            }
+            if (!job->result && gate_put(&s->hosts, job) == 0) continue;
+            ring_push_wait(&s->out, job, &s->out_space); // Cache hit, or no memory for a host queue
+            ec_notify(&s->out_ready);
+        }
+    }
+    gate_close(&s->hosts);
+    return NULL;
+}
+static void resolver_finish(struct Scheduler *s, struct Job *job) {
+    gate_done(&s->hosts, job);
+    if (s->remainder && job_cut_off(job)) {
+        sched_remainder_job(s, job);
+        return;
+    }
+    ring_push_wait(&s->out, job, &s->out_space);
+    ec_notify(&s->out_ready);
+}
+// Engine mode: runs on an engine core when a -u job is resolved.
+static void resolver_engine_done(struct EngineReq *req) {
+    struct Job *job = req->arg;
+    struct Scheduler *s = job->client->sched;
+    job->result = req->result;
+    free(req);
+    if (s->cache && !job_cut_off(job)) cache_store(s->cache, job->url, job->result);
+    resolver_finish(s, job);
+    slots_release(&s->inflight);
+}
+// Resolver thread: pulls jobs from the host queues and hands the
+// results to the writer, blocking while the output ring is full.
+// In engine mode it only submits -u jobs (up to -j in flight).
+static void *resolver_main(void *arg) {
+    struct Scheduler *s = arg;
+    struct Job *job;
+    numa_pin_self();
+    for (;;) {
+        if (s->engine) slots_acquire(&s->inflight);
+        if ((job = gate_take(&s->hosts)) == NULL) break;
+        if (job->expired) {
+            resolver_finish(s, job);
+            if (s->engine) slots_release(&s->inflight);
+            continue;
+        }
+        TRACE_BEGIN(job_t);
+        if (s->remainder && job->op == OP_UNSHORTEN) { // Budget: the time left, if under the default
+            uint64_t left_ms = (s->hosts.deadline_ns - job->started_ns) / 1000000;
+            if (left_ms < UNSHORTEN_TIMEOUT_MS) {
+                job->timeout_ms = left_ms > 0 ? (long)left_ms : 1;
+                __atomic_add_fetch(&s->shortened, 1, __ATOMIC_RELAXED);
+            }
+        }
+        if (cost_enabled) cost_current = &job->cost;
+        if (job->op == OP_SHORTEN) {
+            job->result = shorten_url(job->url);
+        } else {
+            enum CacheState state;
+            struct EngineReq *req = NULL;
+            if (s->cache) { // The same URL may have been resolved while this job waited
+                TRACE_BEGIN(lookup_t);
+                COST_BEGIN(lookup_c);
+                job->result = cache_lookup(s->cache, job->url, &state);
+                job->cached = job->result != NULL;
+                __atomic_sub_fetch(&s->cache->misses, 1, __ATOMIC_RELAXED); // Counted by the dispatcher already
+                COST_END(lookup_c, COST_CACHE);
+                TRACE_END(lookup_t, "cache");
+            }
+            if (!job->result && s->engine && (req = calloc(1, sizeof(*req))) != NULL) {
+                req->url = job->url;
+                req->done = resolver_engine_done;
+                req->arg = job;
+                req->timeout_ms = job->timeout_ms;
+                req->cost = cost_current;
+                cost_current = NULL; // The job belongs to the engine now
+                engine_submit(s->engine, req);
+                continue; // Finished by resolver_engine_done()
+            }
+            if (!job->result) {
+                TRACE_BEGIN(resolve_t);
+                unshorten_timeout_ms = job->timeout_ms;
+                job->result = unshorten_url(job->url);
+                unshorten_timeout_ms = 0;
+                TRACE_END(resolve_t, "unshorten");
+                TRACE_BEGIN(store_t);
+                COST_BEGIN(store_c);
+                if (s->cache && !job_cut_off(job)) cache_store(s->cache, job->url, job->result);
+                COST_END(store_c, COST_CACHE);
+                TRACE_END(store_t, "cache");
+            }
+        }
+        cost_current = NULL;
+        TRACE_END(job_t, job->op == OP_SHORTEN ? "shorten" : "job");
+        resolver_finish(s, job);
+        if (s->engine) slots_release(&s->inflight);
+    }
+    if (s->engine) slots_release(&s->inflight);
+    __atomic_sub_fetch(&s->resolvers_active, 1, __ATOMIC_SEQ_CST);
+    ec_notify(&s->out_ready);
+    return NULL;
+}
+// ============================================================
+// FUNCTION: cost_record()
+// ------------------------------------------------------------
+// Folds a written job's Cost into the --cost row of its mode and
+// host. Called by the writer only, so the rows need no lock.
+// Modes: "shorten", "cache" (answered by the result cache),
+// "unshorten" or "unshorten-engine" (resolved on --cores).
+// ============================================================
+static void cost_record(struct Scheduler *s, const struct Job *job) {
+    char host[256];
+    const char *mode = job->op == OP_SHORTEN ? "shorten" : job->cached ? "cache"
+                       : s->engine ? "unshorten-engine" : "unshorten";
+    job_host(job, host, sizeof(host));
+    size_t len = strlen(host);
+    uint64_t h = hash_bytes(host, len) ^ (uint64_t)(uintptr_t)mode;
+    struct CostRow **slot = &s->cost_rows[h % COST_ROW_BUCKETS], *row = *slot;
+    while (row && (row->hash != h || row->mode != mode || strcmp(row->host, host)))
+        row = row->next;
+    if (!row) {
+        if ((row = calloc(1, sizeof(*row) + len + 1)) == NULL) return; // Dropped from the summary only
+        row->mode = mode;
+        row->hash = h;
+        memcpy(row->host, host, len + 1);
+        row->next = *slot;
+        *slot = row;
+        s->cost_nrows++;
+    }
+    row->requests++;
+    for (int i = 0; i < COST_STAGES; i++) {
+        row->sum.cpu_ns[i] += job->cost.cpu_ns[i];
+        row->sum.wall_ns[i] += job->cost.wall_ns[i];
+    }
+}
+static double process_cpu_s(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return (double)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+static int cost_row_cmp(const void *a, const void *b) {
+    const struct CostRow *x = *(struct CostRow *const *)a, *y = *(struct CostRow *const *)b;
+    return x->requests < y->requests ? 1 : x->requests > y->requests ? -1 : strcmp(x->host, y->host);
+}
+// ============================================================
+// FUNCTION: cost_print_stats()
+// ------------------------------------------------------------
+// Prints one "[cost]" line per (mode, host), busiest first, with
+// per-request CPU (us) and wall (ms) totals and per stage, then a
+// "[cost] total" line for capacity planning:
+//   cores_per_1k_rps  process CPU seconds per 1000 requests
+//   utilization       process CPU / (elapsed * usable CPUs)
+//   bound             cpu when utilization is 70% or more,
+//                     latency otherwise (more -j/--cores helps)
+// Process CPU (since the threads started) also covers polling and
+// bookkeeping that no request is charged with; "accounted" is the
+// per-request share.
+// Called by the writer (SIGUSR1) or after it has exited.
+// ============================================================
+static void cost_print_stats(struct Scheduler *s, FILE *out) {
+    struct CostRow **rows = calloc(s->cost_nrows + 1, sizeof(*rows));
+    size_t n = 0;
+    uint64_t requests = 0, accounted = 0;
+    for (size_t b = 0; rows && b < COST_ROW_BUCKETS; b++)
+        for (struct CostRow *row = s->cost_rows[b]; row; row = row->next)
+            rows[n++] = row;
+    qsort(rows, n, sizeof(*rows), cost_row_cmp);
+    for (size_t i = 0; i < n; i++) {
+        const struct CostRow *row = rows[i];
+        double r = (double)row->requests;
+        uint64_t cpu = 0, wall = 0;
+        char stages[COST_STAGES * 40], *p = stages;
+        for (int st = 0; st < COST_STAGES; st++) {
+            cpu += row->sum.cpu_ns[st];
+            wall += row->sum.wall_ns[st];
+            p += sprintf(p, " %s=%.1f/%.3f", cost_stage_names[st], (double)row->sum.cpu_ns[st] / r / 1e3,
+                         (double)row->sum.wall_ns[st] / r / 1e6);
+        }
+        fprintf(out, "[cost] mode=%s host=%s requests=%llu cpu_us=%.1f wall_ms=%.3f%s\n", row->mode,
+                row->host[0] ? row->host : "-", (unsigned long long)row->requests, (double)cpu / r / 1e3,
+                (double)wall / r / 1e6, stages);
+        requests += row->requests;
+        accounted += cpu;
+    }
+    free(rows);
+    cpu_set_t allowed;
+    int ncpus = sched_getaffinity(0, sizeof(allowed), &allowed) == 0 ? CPU_COUNT(&allowed) : 1;
+    double cpu = process_cpu_s() - s->started_cpu;
+    double elapsed = (double)(now_ns() - s->started_ns) / 1e9;
+    double util = elapsed > 0 ? cpu / (elapsed * ncpus) : 0;
+    fprintf(out, "[cost] total requests=%llu elapsed_s=%.3f req_per_s=%.1f process_cpu_s=%.3f accounted_cpu_s=%.3f "
+            "cores_per_1k_rps=%.3f cpus=%d utilization=%.1f%% bound=%s\n", (unsigned long long)requests, elapsed,
+            elapsed > 0 ? (double)requests / elapsed : 0.0, cpu, (double)accounted / 1e9,
+            requests ? cpu / (double)requests * 1000.0 : 0.0, ncpus, util * 100.0, util >= 0.7 ? "cpu" : "latency");
+}
+static void cost_free_rows(struct Scheduler *s) {
+    for (size_t b = 0; b < COST_ROW_BUCKETS; b++)
+        while (s->cost_rows[b]) {
+            struct CostRow *row = s->cost_rows[b];
+            s->cost_rows[b] = row->next;
+            free(row);
+        }
+}
+// Writer thread: prints "<client>\t<input url>\t<result>" lines.
+// stdout is flushed whenever the output ring runs dry, so lines
+// are batched under load but never held back while idle.
+static void *writer_main(void *arg) {
+    struct Scheduler *s = arg;
+    for (;;) {
+        struct Job *job = ring_try_pop(&s->out);
+        if (!job) {
+            fflush(stdout);
+            if (stats_requested) {
+                stats_requested = 0;
+                sched_print_stats(s, stderr);
+                gate_print_stats(&s->hosts, stderr);
+                if (s->cache) cache_print_stats(s->cache, stderr);
+                hop_cache_print_stats(stderr);
+                if (s->cache && s->cache->disk) disk_cache_print_stats(s->cache->disk, stderr);
+                if (cost_enabled) cost_print_stats(s, stderr);
+            }
+            unsigned key = ec_prepare(&s->out_ready);
+            size_t active = __atomic_load_n(&s->resolvers_active, __ATOMIC_SEQ_CST);
+            if ((job = ring_try_pop(&s->out)) != NULL) {
+                ec_cancel(&s->out_ready);
+            } else if (active == 0) {
+                ec_cancel(&s->out_ready);
+                break;
+            } else {
+                ec_wait(&s->out_ready, key);
+                continue;
+            }
+        }
+        ec_notify(&s->out_space);
+        TRACE_BEGIN(output_t);
+        struct CostMark m = {0, 0};
+        if (cost_enabled) cost_begin(&m);
+        printf("%s\t%s\t%s\n", job->client->name, job->url,
+               job->result ? job->result : "Error: Memory allocation failed");
+        if (cost_enabled) {
+            cost_add(&job->cost, COST_OUTPUT, &m);
+            cost_record(s, job);
+        }
+        TRACE_END(output_t, "output");
+        __atomic_add_fetch(&s->written, 1, __ATOMIC_RELAXED);
+        job_free(job);
+    }
+    return NULL;
+}
+// ============================================================
+// FUNCTION: parse_client_spec()
+// ------------------------------------------------------------
+// Parses "name[:weight]=path", "path" or "-" (stdin) into a
+// Client and opens its source.
+// RETURNS:
+// 0 on success, -1 on a bad spec or unreadable file.
+// ============================================================
+static int parse_client_spec(struct Client *c, const char *spec) {
+    const char *eq = strchr(spec, '=');
+    const char *path = eq ? eq + 1 : spec;
+    c->weight = 1.0;
+    if (eq) {
+        size_t nlen = (size_t)(eq - spec);
+        const char *colon = memchr(spec, ':', nlen);
+        if (colon) {
+            c->weight = strtod(colon + 1, NULL);
+            nlen = (size_t)(colon - spec);
+        }
+        if (nlen == 0 || nlen >= sizeof(c->name) || !(c->weight > 0)) return -1;
+        memcpy(c->name, spec, nlen);
+        c->name[nlen] = 0;
+    } else {
+        snprintf(c->name, sizeof(c->name), "%s", strcmp(path, "-") ? path : "stdin");
+    }
+    c->in = strcmp(path, "-") ? fopen(path, "r") : stdin;
+    if (!c->in) {
+        fprintf(stderr, "Error: Cannot open job source '%s'\n", path);
+        return -1;
+    }
+    return 0;
+}
+// ============================================================
+// FUNCTION: run_worker()
+// ------------------------------------------------------------
+// Entry point of worker mode: "-w [options] [client specs...]".
+// Starts one reader per client, a pool of resolver threads and
+// the writer, waits for all input to be processed, then prints
+// per-class queue statistics to stderr (also on SIGUSR1).
+// RETURNS:
+// Process exit status.
+// ============================================================
+static int run_worker(int argc, char *argv[]) {
+    struct Scheduler sched;
+    size_t nthreads = 8;
+    size_t queue_depth = 256;
+    struct ResultCache cache;
+    size_t cache_size = 100000;
+    double ttl = 600, stale = 3600, neg_ttl = 30, jitter = 0.1;
+    struct DiskCache disk;
+    const char *cache_dir = NULL;
+    unsigned cache_shards = 16;
+    double hot_mb = 0;
+    size_t host_conns = 4, host_backlog = 4096;
+    double host_rate = 0;
+    struct Engine engine;
+    size_t ncores = 0, hop_cache_size = 100000;
+    double deadline = 0;
+    const char *remainder_path = NULL;
+    int ok = 1;
+    memset(&cache, 0, sizeof(cache));
+    memset(&sched, 0, sizeof(sched));
+    sched.bulk_every = 8;
+    sched.clients = calloc((size_t)argc + 1, sizeof(struct Client));
+    if (!sched.clients) return 1;
+    for (int i = 0; i < argc && ok; i++) {
+        if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+            nthreads = (size_t)strtoul(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--bulk-every") && i + 1 < argc) {
+            sched.bulk_every = (unsigned)strtoul(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--queue-depth") && i + 1 < argc) {
+            queue_depth = (size_t)strtoul(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--cache-size") && i + 1 < argc) {
+            cache_size = (size_t)strtoul(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--cache-ttl") && i + 1 < argc) {
+            ttl = strtod(argv[++i], NULL);
+        } else if (!strcmp(argv[i], "--cache-stale") && i + 1 < argc) {
+            stale = strtod(argv[++i], NULL);
+        } else if (!strcmp(argv[i], "--cache-neg-ttl") && i + 1 < argc) {
+            neg_ttl = strtod(argv[++i], NULL);
+        } else if (!strcmp(argv[i], "--cache-jitter") && i + 1 < argc) {
+            jitter = strtod(argv[++i], NULL);
+        } else if (!strcmp(argv[i], "--cache-dir") && i + 1 < argc) {
+            cache_dir = argv[++i];
+        } else if (!strcmp(argv[i], "--cache-shards") && i + 1 < argc) {
+            cache_shards = (unsigned)strtoul(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--cache-hot-mb") && i + 1 < argc) {
+            hot_mb = strtod(argv[++i], NULL);
+        } else if (!strcmp(argv[i], "--host-conns") && i + 1 < argc) {
+            host_conns = (size_t)strtoul(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--host-rate") && i + 1 < argc) {
+            host_rate = strtod(argv[++i], NULL);
+        } else if (!strcmp(argv[i], "--host-backlog") && i + 1 < argc) {
+            host_backlog = (size_t)strtoul(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--cores") && i + 1 < argc) {
+            ncores = (size_t)strtoul(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--hop-cache") && i + 1 < argc) {
+            hop_cache_size = (size_t)strtoul(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--deadline") && i + 1 < argc) {
+            deadline = strtod(argv[++i], NULL);
+        } else if (!strcmp(argv[i], "--remainder") && i + 1 < argc) {
+            remainder_path = argv[++i];
+        } else if (!strcmp(argv[i], "--cost")) {
+            cost_enabled = 1;
+        } else if (!strcmp(argv[i], "--numa")) {
+            numa_enabled = 1;
+        } else if (argv[i][0] == '-' && argv[i][1] != 0) {
+            fprintf(stderr, "Error: Unknown worker option '%s'\n", argv[i]);
+            ok = 0;
+        } else {
+            ok = parse_client_spec(&sched.clients[sched.nclients], argv[i]) == 0;
+            if (ok) sched.nclients++;
+        }
+    }
+    if (ok && sched.nclients == 0) ok = parse_client_spec(&sched.clients[sched.nclients++], "-") == 0;
+    for (size_t i = 0; ok && i < sched.nclients; i++)
+        for (int c = 0; ok && c < CLASS_COUNT; c++)
+            ok = ring_init(&sched.clients[i].queue[c], queue_depth) == 0;
+    if (ok) ok = ring_init(&sched.out, queue_depth) == 0;
+    if (ttl < 0 || stale < 0 || neg_ttl < 0 || jitter < 0 || jitter >= 1) {
+        fprintf(stderr, "Error: Cache TTLs must be >= 0 and jitter in [0, 1)\n");
+        ok = 0;
+    }
+    if (ncores > ENGINE_MAX_CORES) {
+        fprintf(stderr, "Error: --cores must be at most %d\n", ENGINE_MAX_CORES);
+        ok = 0;
+    }
+    if (host_rate < 0 || host_backlog == 0) {
+        fprintf(stderr, "Error: --host-rate must be >= 0 and --host-backlog > 0\n");
+        ok = 0;
+    }
+    if (cache_dir && cache_size == 0) {
+        fprintf(stderr, "Error: --cache-dir needs the in-memory cache (--cache-size > 0)\n");
+        ok = 0;
+    }
+    if (deadline < 0 || (deadline > 0) != (remainder_path != NULL)) {
+        fprintf(stderr, "Error: --deadline <s> (> 0) and --remainder <file> go together\n");
+        ok = 0;
+    }
+    if (ok && remainder_path && (sched.remainder = fopen(remainder_path, "w")) == NULL) {
+        fprintf(stderr, "Error: Cannot create %s: %s\n", remainder_path, strerror(errno));
+        ok = 0;
+    }
+    if (ok && cache_dir && disk_cache_open(&disk, cache_dir, cache_shards, (uint64_t)(hot_mb * 1048576.0)) != 0) {
+        cache_dir = NULL;
+        ok = 0;
+    }
+    if (nthreads == 0 || queue_depth == 0) ok = 0;
+    // With --cores, ncores threads submit to the engine instead of nthreads blocking resolvers
+    pthread_t *resolvers = ok ? calloc(ncores > 0 ? ncores : nthreads, sizeof(pthread_t)) : NULL;
+    if (ok && !resolvers) {
+        fprintf(stderr, "Error: Out of memory starting the worker\n");
+        ok = 0;
+    }
+    if (ok && ncores > 0 && engine_start(&engine, ncores, nthreads) != 0) { // Last: nothing below fails
+        fprintf(stderr, "Error: Cannot start %zu engine cores\n", ncores);
+        ok = 0;
+    }
+    if (!ok) {
+        free(resolvers);
+        if (cache_dir) disk_cache_close(&disk);
+        if (sched.remainder) fclose(sched.remainder);
+        for (size_t i = 0; i < sched.nclients; i++) {
+            if (sched.clients[i].in && sched.clients[i].in != stdin) fclose(sched.clients[i].in);
+            for (int c = 0; c < CLASS_COUNT; c++) ring_destroy(&sched.clients[i].queue[c]);
+        }
+        ring_destroy(&sched.out);
+        free(sched.clients);
+        return 1;
+    }
+    if (ncores > 0) { // -j caps the engine's requests in flight; ncores threads submit them
+        sched.engine = &engine;
+        sched.inflight.cap = nthreads;
+        ec_init(&sched.inflight.freed);
+        nthreads = ncores;
+    }
+    if (hop_cache_size > 0 && hop_cache_enable(hop_cache_size) != 0)
+        fprintf(stderr, "Warning: No memory for the hop cache; running without it\n");
+    pthread_t writer, dispatcher;
+    if (cache_size > 0) {
+        cache.ttl_ns = (uint64_t)(ttl * 1e9);
+        cache.stale_ns = (uint64_t)(stale * 1e9);
+        cache.neg_ttl_ns = (uint64_t)(neg_ttl * 1e9);
+        cache.jitter = jitter;
+        cache.disk = cache_dir ? &disk : NULL;
+        if (cache_init(&cache, cache_size, 2) == 0) sched.cache = &cache;
+    }
+    gate_init(&sched.hosts, host_conns, host_rate, host_backlog);
+    if (sched.remainder) sched.hosts.deadline_ns = now_ns() + (uint64_t)(deadline * 1e9);
+    pthread_mutex_init(&sched.remainder_lock, NULL);
+    pthread_mutex_init(&sched.lock, NULL);
+    ec_init(&sched.ready);
+    ec_init(&sched.space);
+    ec_init(&sched.out_ready);
+    ec_init(&sched.out_space);
+    signal(SIGUSR1, on_sigusr1);
+    sched.started_ns = now_ns();
+    sched.started_cpu = process_cpu_s();
+    sched.readers_active = sched.nclients;
+    sched.resolvers_active = nthreads + (sched.engine != NULL); // The engine pushes results too
+    for (size_t i = 0; i < sched.nclients; i++) {
+        sched.clients[i].sched = &sched;
+        pthread_create(&sched.clients[i].reader, NULL, reader_main, &sched.clients[i]);
+    }
+    pthread_create(&dispatcher, NULL, dispatcher_main, &sched);
+    for (size_t i = 0; i < nthreads; i++)
+        pthread_create(&resolvers[i], NULL, resolver_main, &sched);
+    pthread_create(&writer, NULL, writer_main, &sched);
+    for (size_t i = 0; i < sched.nclients; i++)
+        pthread_join(sched.clients[i].reader, NULL);
+    pthread_join(dispatcher, NULL);
+    for (size_t i = 0; i < nthreads; i++)
+        pthread_join(resolvers[i], NULL);
+    if (sched.engine) {
+        engine_stop(sched.engine);
+        ec_destroy(&sched.inflight.freed);
+        __atomic_sub_fetch(&sched.resolvers_active, 1, __ATOMIC_SEQ_CST);
+        ec_notify(&sched.out_ready);
+    }
+    pthread_join(writer, NULL);
+    sched_print_stats(&sched, stderr);
+    gate_print_stats(&sched.hosts, stderr);
+    if (sched.remainder) {
+        fprintf(stderr, "[deadline] budget=%.1fs completed=%llu remainder=%llu expired_waiting=%llu "
+                "shortened_timeouts=%llu\n", deadline, (unsigned long long)sched.written,
+                (unsigned long long)sched.remaindered, (unsigned long long)sched.hosts.expired,
+                (unsigned long long)sched.shortened);
+        if (fclose(sched.remainder) != 0) fprintf(stderr, "Error: Writing %s failed\n", remainder_path);
+    }
+    huge_print_stats(stderr); // While the tables are still mapped
+    if (sched.cache) {
+        cache_print_stats(sched.cache, stderr);
+        cache_destroy(sched.cache); // Stops its refreshers, the last walks
+    }
+    hop_cache_print_stats(stderr);
+    hop_cache_disable();
+    if (cache_dir) {
+        disk_cache_print_stats(&disk, stderr);
+        disk_cache_close(&disk);
+    }
+    if (cost_enabled) cost_print_stats(&sched, stderr);
+    cost_free_rows(&sched);
+    if (numa_enabled) numa_print_stats(stderr);
+    for (size_t i = 0; i < sched.nclients; i++)
+        for (int c = 0; c < CLASS_COUNT; c++) ring_destroy(&sched.clients[i].queue[c]);
+    ring_destroy(&sched.out);
+    free(resolvers);
+    free(sched.clients);
+    ec_destroy(&sched.out_space);
+    ec_destroy(&sched.out_ready);
+    ec_destroy(&sched.space);
+    ec_destroy(&sched.ready);
+    pthread_mutex_destroy(&sched.lock);
+    pthread_mutex_destroy(&sched.remainder_lock);
+    gate_destroy(&sched.hosts);
+    return 0;
+}
+// ============================================================
+// SCAN: short links inside text and logs
+// ------------------------------------------------------------
+// "--scan" copies text to stdout with every link on a known
+// shortener host expanded in place. The hosts are compiled into
+// an Aho-Corasick automaton over "://host/" (and "://www.host/"),
+// laid out as a dense DFA with case folded into the table: one
+// load per input byte and no backtracking. Every pattern starts
+// with ':', so while no match is under way memchr() skips to the
+// next ':' and most text is passed over at memchr speed.
+//
+// The reader cuts the input into chunks at line ends and finds
+// the links of each; a link not seen in the chunks still waiting
+// for output, nor in the result cache, goes to the engine once.
+// The writer prints chunks in input order as soon as their links
+// are resolved, so scanning runs ahead while requests are out.
+// Chunks in flight (--window) and requests in flight (-j) are
+// both bounded, so memory does not grow with the input.
+// ============================================================
+#include <ctype.h> // For tolower() on shortener hosts
+#define SCAN_CHUNK 65536
+static const char *const scan_default_hosts[] = {
+    "bit.ly", "bitly.com", "tinyurl.com", "t.co", "goo.gl", "ow.ly", "is.gd", "v.gd", "buff.ly", "rebrand.ly",
+    "cutt.ly", "shorturl.at", "tiny.cc", "rb.gy", "t.ly", "lnkd.in", "dlvr.it", "trib.al", "s.id", "bl.ink",
+};
+struct ScanMatcher {
+    int32_t *next; // nstates * 256 transitions
+    uint16_t *match; // Per state: length of the longest pattern ending there, or 0
+    size_t nstates;
+};
+struct ScanLink {
+    char *result; // Atomic: NULL until resolved
+    uint64_t hash;
+    size_t len;
+    size_t refs; // Occurrences not yet written (under Scan.lock)
+    char url[]; // NUL-terminated
+};
+struct ScanHit {
+    size_t start, len; // Link position in the chunk
+    struct ScanLink *link;
+};
+struct ScanChunk {
+    char *text;
+    size_t len;
+    struct ScanHit *hits;
+    size_t nhits, cap;
+    uint64_t born_ns; // -f: when its first byte was read, else 0
+};
+struct Scan {
+    struct ScanMatcher matcher;
+    int mode; // SCAN_ANNOTATE, SCAN_REWRITE or SCAN_EXTRACT
+    struct Ring chunks; // Reader -> writer, in input order
+    struct EventCount chunks_ready, chunks_space;
+    int reading; // Atomic: the reader may push more chunks
+    pthread_mutex_t lock; // Guards links
+    struct SwissMap links; // url -> ScanLink, for chunks not yet written
+    struct EventCount resolved;
+    struct Engine engine;
+    struct Slots inflight;
+    struct ResultCache *cache;
+    // Counters
+    uint64_t bytes, occurrences, requests, cache_hits, scan_ns;
+    uint64_t batches, rotations, truncations; // -f
+    struct LatHist delay_us; // -f: read to written, kept by the writer
+};
+enum { SCAN_ANNOTATE, SCAN_REWRITE, SCAN_EXTRACT };
+static void scan_matcher_free(struct ScanMatcher *m) {
+    free(m->next);
+    free(m->match);
+    m->next = NULL;
+    m->match = NULL;
+}
+// ============================================================
+// FUNCTION: scan_matcher_build()
+// ------------------------------------------------------------
+// Builds the automaton for hosts (lowercase or not; a host may
+// carry a :port). The trie is laid out in the DFA table itself;
+// the breadth-first pass then fills each missing transition from
+// the state's failure link, whose row is already complete.
+// RETURNS:
+// 0, or -1 when out of memory or a host is too long.
+// ============================================================
+static int scan_matcher_build(struct ScanMatcher *m, const char *const *hosts, size_t nhosts) {
+    size_t max_states = 1, n = 0;
+    for (size_t i = 0; i < nhosts; i++) {
+        if (strlen(hosts[i]) > 253) return -1;
+        max_states += 2 * (strlen(hosts[i]) + 8);
+    }
+    m->next = calloc(max_states * 256, sizeof(int32_t));
+    m->match = calloc(max_states, sizeof(uint16_t));
+    int32_t *fail = calloc(max_states, sizeof(int32_t)), *queue = calloc(max_states, sizeof(int32_t));
+    if (!m->next || !m->match || !fail || !queue) {
+        free(fail);
+        free(queue);
+        scan_matcher_free(m);
+        return -1;
+    }
+    m->nstates = 1;
+    for (size_t i = 0; i < nhosts; i++) {
+        for (int www = 0; www < 2; www++) {
+            char pattern[300];
+            if (www && strncasecmp(hosts[i], "www.", 4) == 0) continue;
+            int len = snprintf(pattern, sizeof(pattern), "://%s%s/", www ? "www." : "", hosts[i]);
+            int32_t s = 0;
+            for (int k = 0; k < len; k++) {
+                unsigned char c = (unsigned char)tolower((unsigned char)pattern[k]);
+                if (m->next[(size_t)s * 256 + c] == 0) m->next[(size_t)s * 256 + c] = (int32_t)m->nstates++;
+                s = m->next[(size_t)s * 256 + c];
+            }
+            m->match[s] = (uint16_t)len;
+        }
+    }
+    // Trie edges never lead back to the root, so a zero entry is a
+    // missing edge until its row has been filled
+    for (int c = 0; c < 256; c++)
+        if (m->next[c]) queue[n++] = m->next[c];
+    for (size_t head = 0; head < n; head++) {
+        int32_t s = queue[head];
+        int32_t *row = &m->next[(size_t)s * 256];
+        if (m->match[fail[s]] > m->match[s]) m->match[s] = m->match[fail[s]];
+        for (int c = 0; c < 256; c++) {
+            int32_t via_fail = m->next[(size_t)fail[s] * 256 + c];
+            if (row[c]) {
+                fail[row[c]] = via_fail;
+                queue[n++] = row[c];
+            } else {
+                row[c] = via_fail;
+            }
+        }
+    }
+    for (size_t s = 0; s < m->nstates; s++) // Fold case: 'A'..'Z' take the lowercase edge
+        for (int c = 'A'; c <= 'Z'; c++) m->next[s * 256 + c] = m->next[s * 256 + c + 32];
+    free(fail);
+    free(queue);
+    return 0;
+}
+// Bytes that can continue a URL in running text.
+static int scan_url_byte(unsigned char c) {
+    return c > ' ' && c != 0x7f && !strchr("\"'<>`{}|\\^", c);
+}
+static int scan_add_hit(struct ScanChunk *c, size_t start, size_t len) {
+    if (c->nhits == c->cap) {
+        size_t cap = c->cap ? 2 * c->cap : 16;
+        struct ScanHit *hits = realloc(c->hits, cap * sizeof(*hits));
+        if (!hits) return -1;
+        c->hits = hits;
+        c->cap = cap;
+    }
+    c->hits[c->nhits].start = start;
+    c->hits[c->nhits].len = len;
+    c->hits[c->nhits++].link = NULL;
+    return 0;
+}
+// ============================================================
+// FUNCTION: scan_find()
+// ------------------------------------------------------------
+// Records every http(s) link on a matched host in c->hits. A link
+// runs to the first byte that cannot be part of a URL, minus
+// trailing punctuation; a bare "://host/" is not a link.
+// RETURNS:
+// 0, or -1 when out of memory.
+// ============================================================
+static int scan_find(const struct ScanMatcher *m, struct ScanChunk *c) {
+    const unsigned char *text = (const unsigned char *)c->text, *p = text, *end = text + c->len;
+    int32_t s = 0;
+    while (p < end) {
+        if (s == 0 && (p = memchr(p, ':', (size_t)(end - p))) == NULL) break;
+        s = m->next[(size_t)s * 256 + *p++];
+        if (!m->match[s]) continue;
+        const unsigned char *colon = p - m->match[s], *q = p;
+        size_t scheme = 0;
+        if (colon - text >= 5 && strncasecmp((const char *)colon - 5, "https", 5) == 0) scheme = 5;
+        else if (colon - text >= 4 && strncasecmp((const char *)colon - 4, "http", 4) == 0) scheme = 4;
+        while (q < end && scan_url_byte(*q)) q++;
+        while (q > p && strchr(".,;:!?)]}", q[-1])) q--;
+        if (!scheme || q == p) continue;
+        if (scan_add_hit(c, (size_t)(colon - scheme - text), (size_t)(q - (colon - scheme))) != 0) return -1;
+        p = q;
+        s = 0;
+    }
+    return 0;
+}
+struct ScanReq {
+    struct EngineReq req; // First, so the engine's pointer is the ScanReq
+    struct Scan *scan;
+};
+static void scan_resolved(struct EngineReq *req) {
+    struct Scan *scan = ((struct ScanReq *)req)->scan;
+    struct ScanLink *link = req->arg;
+    char *result = req->result ? req->result : my_strdup("Error: Memory allocation failed");
+    if (scan->cache && result) cache_store(scan->cache, link->url, result);
+    __atomic_store_n(&link->result, result, __ATOMIC_RELEASE);
+    free(req);
+    slots_release(&scan->inflight);
+    ec_notify(&scan->resolved);
+}
+// ============================================================
+// FUNCTION: scan_link()
+// ------------------------------------------------------------
+// Returns the shared link for url, taking a reference for one
+// occurrence. A new link is answered from the result cache when
+// possible and otherwise sent to the engine, which blocks while
+// -j requests are already in flight.
+// RETURNS:
+// The link, or NULL when out of memory.
+// ============================================================
+static struct ScanLink *scan_link(struct Scan *scan, const char *url, size_t len) {
+    uint64_t hash = hash_bytes(url, len);
+    struct ScanLink *link;
+    pthread_mutex_lock(&scan->lock);
+    if ((link = swiss_get(&scan->links, url, len, hash)) != NULL) link->refs++;
+    pthread_mutex_unlock(&scan->lock);
+    if (link) return link;
+    if ((link = malloc(sizeof(*link) + len + 1)) == NULL) return NULL;
+    memcpy(link->url, url, len);
+    link->url[len] = 0;
+    link->hash = hash;
+    link->len = len;
+    link->refs = 1;
+    link->result = NULL;
+    if (scan->mode == SCAN_EXTRACT) {
+        link->result = my_strdup(""); // Not resolved
+    } else if (scan->cache) {
+        enum CacheState state;
+        if ((link->result = cache_lookup(scan->cache, link->url, &state)) != NULL) scan->cache_hits++;
+    }
+    struct ScanReq *sr = NULL;
+    if (!link->result && (sr = calloc(1, sizeof(*sr))) == NULL) {
+        free(link);
+        return NULL;
+    }
+    pthread_mutex_lock(&scan->lock); // Only the reader adds links, so url is still absent
+    int added = swiss_put(&scan->links, link->url, len, hash, link);
+    pthread_mutex_unlock(&scan->lock);
+    if (added != 0) {
+        free(link->result);
+        free(link);
+        free(sr);
+        return NULL;
+    }
+    if (sr) {
+        sr->scan = scan;
+        sr->req.url = link->url;
+        sr->req.done = scan_resolved;
+        sr->req.arg = link;
+        scan->requests++;
+        slots_acquire(&scan->inflight);
+        engine_submit(&scan->engine, &sr->req);
+    }
+    return link;
+}
+// Drops one occurrence of link, freeing it after the last.
+static void scan_unlink(struct Scan *scan, struct ScanLink *link) {
+    pthread_mutex_lock(&scan->lock);
+    if (--link->refs == 0) {
+        swiss_erase(&scan->links, link->url, link->len, link->hash);
+    } else {
+        link = NULL;
+    }
+    pthread_mutex_unlock(&scan->lock);
+    if (link) {
+        free(link->result);
+        free(link);
+    }
+}
+static void scan_chunk_free(struct ScanChunk *c) {
+    free(c->text);
+    free(c->hits);
+    free(c);
+}
+// Output of one chunk: its text, with each link annotated,
+// replaced by its target, or alone on a line (--extract).
+static void scan_write_chunk(struct Scan *scan, struct ScanChunk *c) {
+    size_t at = 0;
+    for (size_t i = 0; i < c->nhits; i++) {
+        struct ScanHit *h = &c->hits[i];
+        const char *result;
+        while ((result = __atomic_load_n(&h->link->result, __ATOMIC_ACQUIRE)) == NULL) {
+            fflush(stdout); // Let the text so far out while waiting
+            unsigned key = ec_prepare(&scan->resolved);
+            if (__atomic_load_n(&h->link->result, __ATOMIC_ACQUIRE)) {
+                ec_cancel(&scan->resolved);
+                continue;
+            }
+            ec_wait(&scan->resolved, key);
+        }
+        if (scan->mode == SCAN_EXTRACT) {
+            printf("%.*s\n", (int)h->len, c->text + h->start);
+        } else {
+            fwrite(c->text + at, 1, h->start - at, stdout);
+            if (scan->mode == SCAN_REWRITE && !is_error_result(result)) fputs(result, stdout);
+            else fwrite(c->text + h->start, 1, h->len, stdout);
+            if (scan->mode == SCAN_ANNOTATE) printf(" [=> %s]", result);
+            at = h->start + h->len;
+        }
+        scan_unlink(scan, h->link);
+    }
+    if (scan->mode != SCAN_EXTRACT) fwrite(c->text + at, 1, c->len - at, stdout);
+}
+static void *scan_writer_main(void *arg) {
+    struct Scan *scan = arg;
+    for (;;) {
+        struct ScanChunk *c = ring_try_pop(&scan->chunks);
+        if (!c) {
+            fflush(stdout);
+            unsigned key = ec_prepare(&scan->chunks_ready);
+            int reading = __atomic_load_n(&scan->reading, __ATOMIC_SEQ_CST);
+            if ((c = ring_try_pop(&scan->chunks)) != NULL) {
+                ec_cancel(&scan->chunks_ready);
+            } else if (!reading) {
+                ec_cancel(&scan->chunks_ready);
+                break;
+            } else {
+                ec_wait(&scan->chunks_ready, key);
+                continue;
+            }
+        }
+        ec_notify(&scan->chunks_space);
+        scan_write_chunk(scan, c);
+        if (c->born_ns) { // -f: each micro-batch goes out at once
+            fflush(stdout);
+            hist_add(&scan->delay_us, (now_ns() - c->born_ns) / 1000);
+        }
+        scan_chunk_free(c);
+    }
+    return NULL;
+}
+// Finds the links in text[0..len) and queues it for output as
+// one chunk, taking ownership of text (a SCAN_CHUNK buffer).
+// RETURNS: 0, or -1 when out of memory.
+static int scan_submit(struct Scan *scan, char *text, size_t len, uint64_t born_ns) {
+    struct ScanChunk *c = calloc(1, sizeof(*c));
+    if (!c) {
+        free(text);
+        return -1;
+    }
+    c->text = text;
+    c->len = len;
+    c->born_ns = born_ns;
+    uint64_t t0 = now_ns();
+    int found = scan_find(&scan->matcher, c);
+    scan->scan_ns += now_ns() - t0;
+    scan->bytes += c->len;
+    for (size_t i = 0; found == 0 && i < c->nhits; i++)
+        if ((c->hits[i].link = scan_link(scan, c->text + c->hits[i].start, c->hits[i].len)) == NULL) found = -1;
+    if (found != 0) {
+        c->nhits = 0; // Links already taken stay referenced; the run is failing anyway
+        scan_chunk_free(c);
+        return -1;
+    }
+    scan->occurrences += c->nhits;
+    ring_push_wait(&scan->chunks, c, &scan->chunks_space);
+    ec_notify(&scan->chunks_ready);
+    return 0;
+}
+// Moves buf[0..cut) into a chunk; the rest stays at the start of
+// a fresh *buf. RETURNS: 0, or -1 when out of memory.
+static int scan_cut(struct Scan *scan, char **buf, size_t *have, size_t cut, uint64_t born_ns) {
+    char *rest = malloc(SCAN_CHUNK);
+    if (!rest) return -1;
+    memcpy(rest, *buf + cut, *have - cut);
+    char *text = *buf;
+    *buf = rest;
+    *have -= cut;
+    return scan_submit(scan, text, cut, born_ns);
+}
+// ============================================================
+// FUNCTION: scan_input()
+// ------------------------------------------------------------
+// Reads fd to its end, cutting chunks of up to SCAN_CHUNK bytes
+// at the last line end (a longer line is cut where the buffer is
+// full). read() returns what a pipe has, so text arriving slowly
+// is passed on line by line rather than held for a full buffer.
+// RETURNS:
+// 0, or -1 on a read error or when out of memory.
+// ============================================================
+static int scan_input(struct Scan *scan, int fd) {
+    char *buf = malloc(SCAN_CHUNK);
+    size_t have = 0;
+    int eof = 0;
+    while (buf && !eof) {
+        ssize_t n = read(fd, buf + have, SCAN_CHUNK - have);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) break;
+        eof = n == 0;
+        have += (size_t)n;
+        char *nl = have ? memrchr(buf, '\n', have) : NULL;
+        size_t cut = eof ? have : nl ? (size_t)(nl - buf) + 1 : have == SCAN_CHUNK ? have : 0;
+        if (cut == 0) continue;
+        if (scan_cut(scan, &buf, &have, cut, 0) != 0) break;
+    }
+    free(buf);
+    return eof ? 0 : -1;
+}
+// ============================================================
+// FUNCTION: scan_follow()
+// ------------------------------------------------------------
+// "--scan -f <file>": follows a growing log from its current end
+// until SIGINT/SIGTERM (stop_fd, a signalfd). inotify watches the
+// file's directory, which reports writes to the file as well as a
+// new file appearing under its name, so both kinds of rotation
+// are seen: after a rename or delete the old file is drained and
+// the new one read from its start; a file cut short in place
+// (copytruncate) is read again from its start.
+//
+// New lines are micro-batched: a chunk is cut once batch_bytes of
+// complete lines are waiting or batch_ms after the first of them
+// was read, whichever comes first. A trailing partial line waits
+// for its end (or for a rotation or the stop). Each batch goes
+// through the same matcher, cache and engine as --scan input and
+// is flushed as soon as its links are resolved.
+// RETURNS:
+// 0 once stopped, or -1 on a watch or read error or when out of
+// memory.
+// ============================================================
+#include <sys/inotify.h> // For inotify_init1() in --scan -f
+#include <libgen.h> // For dirname() of the followed file
+#include <sys/signalfd.h> // For signalfd() stopping --scan -f
+#include <poll.h> // For poll() on inotify and signal descriptors
+static int scan_follow(struct Scan *scan, const char *path, int stop_fd, long batch_ms, size_t batch_bytes) {
+    char dir[4096];
+    char *buf = malloc(SCAN_CHUNK);
+    size_t have = 0, lines = 0; // lines: bytes up to the last '\n' in buf
+    uint64_t born = 0, batch_ns = (uint64_t)batch_ms * 1000000ull;
+    int in_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC), fd = open(path, O_RDONLY | O_CLOEXEC);
+    int stop = 0, stopping = 0; // stop: -1 on errors
+    struct stat st, named;
+    snprintf(dir, sizeof(dir), "%s", path);
+    if (!buf || in_fd < 0 || inotify_add_watch(in_fd, dirname(dir), IN_MODIFY | IN_CREATE | IN_MOVED_TO) < 0) {
+        fprintf(stderr, "Error: Cannot watch %s: %s\n", path, strerror(errno));
+        stop = -1;
+    }
+    if (fd >= 0) lseek(fd, 0, SEEK_END); // Lines already there are not followed
+    while (stop == 0) {
+        int rotated = 0;
+        if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size < lseek(fd, 0, SEEK_CUR)) {
+            lseek(fd, 0, SEEK_SET); // Truncated in place
+            scan->truncations++;
+        }
+        // Read what is new, cutting a batch whenever enough lines are waiting
+        for (;;) {
+            ssize_t n = fd >= 0 ? read(fd, buf + have, SCAN_CHUNK - have) : 0;
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) {
+                fprintf(stderr, "Error: Cannot read %s: %s\n", path, strerror(errno));
+                stop = -1;
+                break;
+            }
+            if (n == 0) break;
+            if (!born) born = now_ns();
+            char *nl = memrchr(buf + have, '\n', (size_t)n);
+            have += (size_t)n;
+            if (nl) lines = (size_t)(nl - buf) + 1;
+            if (lines >= batch_bytes || have == SCAN_CHUNK) {
+                if (scan_cut(scan, &buf, &have, lines ? lines : have, born) != 0) stop = -1;
+                scan->batches++;
+                lines = 0;
+                born = have ? now_ns() : 0;
+            }
+            if (stop != 0) break;
+        }
+        // At the end of the file: has its name moved on to a new one?
+        if (stat(path, &named) == 0 &&
+            (fd < 0 || fstat(fd, &st) != 0 || named.st_ino != st.st_ino || named.st_dev != st.st_dev)) {
+            if (have > 0) lines = have; // The old file ended mid-line
+            rotated = 1;
+        }
+        uint64_t t = now_ns();
+        if (stop == 0 && lines > 0 && (rotated || t - born >= batch_ns)) {
+            if (scan_cut(scan, &buf, &have, lines, born) != 0) stop = -1;
+            scan->batches++;
+            lines = 0;
+            born = have ? t : 0;
+        }
+        if (stop == 0 && rotated) {
+            if (fd >= 0) {
+                close(fd);
+                scan->rotations++;
+            }
+            fd = open(path, O_RDONLY | O_CLOEXEC);
+            continue; // Read the new file from its start
+        }
+        if (stop != 0 || stopping) break;
+        struct pollfd pfd[2] = {{.fd = in_fd, .events = POLLIN}, {.fd = stop_fd, .events = POLLIN}};
+        int timeout = lines > 0 ? (int)((born + batch_ns - t + 999999) / 1000000) : -1;
+        if (poll(pfd, 2, timeout) < 0 && errno != EINTR) stop = -1;
+        if (pfd[0].revents) { // Only a wake-up: the file itself is checked above
+            char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+            while (read(in_fd, events, sizeof(events)) > 0) {}
+        }
+        stopping = pfd[1].revents != 0; // Stops after one last read
+    }
+    if (stop == 0 && have > 0) { // The partial line too
+        if (scan_cut(scan, &buf, &have, have, born) != 0) stop = -1;
+        scan->batches++;
+    }
+    if (fd >= 0) close(fd);
+    if (in_fd >= 0) close(in_fd);
+    free(buf);
+    return stop;
+}
+// Reads a host list: one host per line, '#' starts a comment.
+static char **scan_read_hosts(const char *path, size_t *count) {
+    FILE *f = fopen(path, "r");
+    char line[512], **hosts = NULL;
+    size_t n = 0, cap = 0;
+    if (!f) {
+        fprintf(stderr, "Error: Cannot open host list %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        char *h = line + strspn(line, " \t");
+        h[strcspn(h, " \t\r\n#")] = 0;
+        if (!*h) continue;
+        if (n == cap) {
+            char **grown = realloc(hosts, (cap = cap ? 2 * cap : 32) * sizeof(char *));
+            if (!grown) break;
+            hosts = grown;
+        }
+        if ((hosts[n] = my_strdup(h)) != NULL) n++;
+    }
+    fclose(f);
+    if (n == 0) fprintf(stderr, "Error: No hosts in %s\n", path);
+    *count = n;
+    return hosts;
+}
+// ============================================================
+// FUNCTION: run_scan()
+// ------------------------------------------------------------
+// Entry point of "--scan [options] [file...]": expands the short
+// links in the files (or stdin) and prints a summary to stderr.
+// RETURNS:
+// Process exit status.
+// ============================================================
+static int run_scan(int argc, char *argv[]) {
+    struct Scan scan;
+    struct ResultCache cache;
+    const char *hosts_path = NULL, *follow = NULL;
+    size_t inflight = 64, window = 64, ncores = 1, cache_size = 100000, hop_cache_size = 100000;
+    size_t batch_bytes = 16384;
+    long batch_ms = 2;
+    int first_file = argc, ok = 1, status = 0, stop_fd = -1;
+    memset(&scan, 0, sizeof(scan));
+    memset(&cache, 0, sizeof(cache));
+    for (int i = 0; i < argc && ok && first_file == argc; i++) {
+        if (!strcmp(argv[i], "--rewrite")) {
+            scan.mode = SCAN_REWRITE;
+        } else if (!strcmp(argv[i], "--extract")) {
+            scan.mode = SCAN_EXTRACT;
+        } else if (!strcmp(argv[i], "--hosts") && i + 1 < argc) {
+            hosts_path = argv[++i];
+        } else if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+            inflight = (size_t)strtoul(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--cores") && i + 1 < argc) {
+            ncores = (size_t)strtoul(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--window") && i + 1 < argc) {
+            window = (size_t)strtoul(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--cache-size") && i + 1 < argc) {
+            cache_size = (size_t)strtoul(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--hop-cache") && i + 1 < argc) {
+            hop_cache_size = (size_t)strtoul(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "-f") && i + 1 < argc) {
+            follow = argv[++i];
+        } else if (!strcmp(argv[i], "--batch-ms") && i + 1 < argc) {
+            batch_ms = strtol(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--batch-bytes") && i + 1 < argc) {
+            batch_bytes = (size_t)strtoul(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--numa")) {
+            numa_enabled = 1;
+        } else if (argv[i][0] == '-' && argv[i][1] != 0) {
+            fprintf(stderr, "Error: Unknown scan option '%s'\n", argv[i]);
+            ok = 0;
+        } else {
+            first_file = i;
+        }
+    }
+    if (ok && (inflight == 0 || window == 0 || ncores == 0 || ncores > ENGINE_MAX_CORES)) {
+        fprintf(stderr, "Error: -j and --window must be > 0 and --cores in 1..%d\n", ENGINE_MAX_CORES);
+        ok = 0;
+    }
+    if (ok && follow && (first_file < argc || batch_ms < 0 || batch_bytes == 0 || batch_bytes > SCAN_CHUNK)) {
+        fprintf(stderr, "Error: -f takes no other files, --batch-ms >= 0 and --batch-bytes in 1..%d\n", SCAN_CHUNK);
+        ok = 0;
+    }
+    if (ok && follow) { // Before any thread starts, so that all of them inherit the mask
+        sigset_t stop;
+        sigemptyset(&stop);
+        sigaddset(&stop, SIGINT);
+        sigaddset(&stop, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &stop, NULL);
+        if ((stop_fd = signalfd(-1, &stop, SFD_CLOEXEC)) < 0) ok = 0;
+    }
+    size_t nhosts = sizeof(scan_default_hosts) / sizeof(scan_default_hosts[0]);
+    char **hosts = ok && hosts_path ? scan_read_hosts(hosts_path, &nhosts) : NULL;
+    if (ok && hosts_path && (!hosts || nhosts == 0)) ok = 0;
+    if (ok && scan_matcher_build(&scan.matcher, hosts ? (const char *const *)hosts : scan_default_hosts, nhosts) != 0) {
+        fprintf(stderr, "Error: Cannot build the host matcher (out of memory or host too long)\n");
+        ok = 0;
+    }
+    for (size_t i = 0; hosts && i < nhosts; i++) free(hosts[i]);
+    free(hosts);
+    if (ok && ring_init(&scan.chunks, window) != 0) ok = 0;
+    if (ok && scan.mode != SCAN_EXTRACT && engine_start(&scan.engine, ncores, inflight) != 0) {
+        fprintf(stderr, "Error: Cannot start %zu engine cores\n", ncores);
+        ok = 0;
+    }
+    if (!ok) {
+        if (stop_fd >= 0) close(stop_fd);
+        scan_matcher_free(&scan.matcher);
+        ring_destroy(&scan.chunks);
+        return 1;
+    }
+    if (scan.mode != SCAN_EXTRACT) {
+        if (hop_cache_size > 0 && hop_cache_enable(hop_cache_size) != 0)
+            fprintf(stderr, "Warning: No memory for the hop cache; running without it\n");
+        cache.ttl_ns = 600 * 1000000000ull;
+        cache.stale_ns = 3600 * 1000000000ull;
+        cache.neg_ttl_ns = 30 * 1000000000ull;
+        cache.jitter = 0.1;
+        if (cache_size > 0 && cache_init(&cache, cache_size, 1) == 0) scan.cache = &cache;
+    }
+    scan.inflight.cap = inflight;
+    scan.reading = 1;
+    pthread_mutex_init(&scan.lock, NULL);
+    ec_init(&scan.inflight.freed);
+    ec_init(&scan.resolved);
+    ec_init(&scan.chunks_ready);
+    ec_init(&scan.chunks_space);
+    pthread_t writer;
+    pthread_create(&writer, NULL, scan_writer_main, &scan);
+    uint64_t start = now_ns();
+    if (follow && scan_follow(&scan, follow, stop_fd, batch_ms, batch_bytes) != 0) status = 1;
+    for (int i = first_file; !follow && (i < argc || i == first_file); i++) { // No files: stdin
+        const char *path = i < argc ? argv[i] : "-";
+        int fd = strcmp(path, "-") ? open(path, O_RDONLY) : 0;
+        if (fd < 0 || scan_input(&scan, fd) != 0) {
+            fprintf(stderr, "Error: Cannot read %s: %s\n", path, strerror(errno));
+            status = 1;
+        }
+        if (fd > 0) close(fd);
+    }
+    __atomic_store_n(&scan.reading, 0, __ATOMIC_SEQ_CST);
+    ec_notify(&scan.chunks_ready);
+    pthread_join(writer, NULL);
+    double secs = (double)(now_ns() - start) / 1e9, scan_secs = (double)scan.scan_ns / 1e9;
+    fprintf(stderr, "[scan] bytes=%llu links=%llu requests=%llu cache_hits=%llu elapsed=%.3fs"
+            " match=%.3fs (%.0f MB/s)\n", (unsigned long long)scan.bytes, (unsigned long long)scan.occurrences,
+            (unsigned long long)scan.requests, (unsigned long long)scan.cache_hits, secs, scan_secs,
+            scan_secs > 0 ? (double)scan.bytes / scan_secs / 1e6 : 0.0);
+    if (follow) {
+        fprintf(stderr, "[follow] batches=%llu rotations=%llu truncations=%llu delay_p50_ms=%.3f "
+                "delay_p99_ms=%.3f delay_max_ms=%.3f\n", (unsigned long long)scan.batches,
+                (unsigned long long)scan.rotations, (unsigned long long)scan.truncations,
+                (double)hist_percentile(&scan.delay_us, 50) / 1000.0,
+                (double)hist_percentile(&scan.delay_us, 99) / 1000.0, (double)scan.delay_us.max / 1000.0);
+        close(stop_fd);
+    }
+    huge_print_stats(stderr); // While the tables are still mapped
+    if (scan.mode != SCAN_EXTRACT) {
+        engine_stop(&scan.engine);
+        if (scan.cache) cache_destroy(scan.cache);
+        hop_cache_print_stats(stderr);
+        hop_cache_disable();
+    }
+    if (numa_enabled) numa_print_stats(stderr);
+    scan_matcher_free(&scan.matcher);
+    ring_destroy(&scan.chunks);
+    ec_destroy(&scan.chunks_space);
+    ec_destroy(&scan.chunks_ready);
+    ec_destroy(&scan.resolved);
+    ec_destroy(&scan.inflight.freed);
+    pthread_mutex_destroy(&scan.lock);
+    swiss_free(&scan.links);
+    return status;
+}
+// ============================================================
+// CLUSTER: consistent-hash partitioning of the code space
+// ------------------------------------------------------------
+// Several --serve instances can split the codes between them. A
+// node is named by its base URL (e.g. http://10.0.0.2:8080) and
+// owns CLUSTER_VNODES points on a 64-bit hash ring; a code belongs
+// to the node owning the first point at or after hash(code). Adding
+// or removing a node only moves the codes between its points and
+// their predecessors (about 1/N of the space), and the assignment
+// depends on the set of node names, not on their order.
+//
+// Servers allocate new codes only from their own partition and
+// answer 307 to the owner for codes they do not own. Clients that
+// know the ring (CIPHER_CLUSTER) send unshorten_url() straight to
+// the owner and skip that hop.
+// ============================================================
+#define CLUSTER_VNODES 160
+#define CLUSTER_MAX_NODES 64
+struct RingPoint {
+    uint64_t point;
+    unsigned node;
+};
+struct HashRing {
+    unsigned nnodes;
+    char *nodes[CLUSTER_MAX_NODES]; // Base URLs without a trailing '/'
+    size_t npoints;
+    struct RingPoint *points; // Sorted by point, then node name
+};
+// splitmix64 finalizer: spreads FNV's weak low bits over the ring.
+static uint64_t hash_mix(uint64_t h) {
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebull;
+    return h ^ (h >> 31);
+}
+static uint64_t ring_key_hash(const char *key, size_t len) {
+    return hash_mix(hash_bytes(key, len));
+}
+static const struct HashRing *ring_sort_ctx; // qsort has no context argument
+static int ring_point_cmp(const void *a, const void *b) {
+    const struct RingPoint *x = a, *y = b;
+    if (x->point != y->point) return x->point < y->point ? -1 : 1;
+    return strcmp(ring_sort_ctx->nodes[x->node], ring_sort_ctx->nodes[y->node]);
+}
+static void hash_ring_free(struct HashRing *r) {
+    for (unsigned i = 0; i < r->nnodes; i++) free(r->nodes[i]);
+    free(r->points);
+    memset(r, 0, sizeof(*r));
+}
+// Index of node (trailing '/' ignored), or -1.
+static int hash_ring_find(const struct HashRing *r, const char *node, size_t len) {
+    while (len > 0 && node[len - 1] == '/') len--;
+    for (unsigned i = 0; i < r->nnodes; i++)
+        if (strlen(r->nodes[i]) == len && !strncmp(r->nodes[i], node, len)) return (int)i;
+    return -1;
+}
+// ============================================================
+// FUNCTION: hash_ring_build()
+// ------------------------------------------------------------
+// Builds the ring for a comma-separated list of node base URLs.
+// RETURNS:
+// 0 on success, -1 on an empty, duplicate or oversized list.
+// ============================================================
+static int hash_ring_build(struct HashRing *r, const char *list) {
+    static pthread_mutex_t sort_lock = PTHREAD_MUTEX_INITIALIZER;
+    memset(r, 0, sizeof(*r));
+    for (const char *p = list; *p;) {
+        size_t len = strcspn(p, ",");
+        size_t trimmed = len;
+        while (trimmed > 0 && p[trimmed - 1] == '/') trimmed--;
+        if (trimmed > 0) {
+            if (r->nnodes == CLUSTER_MAX_NODES || hash_ring_find(r, p, trimmed) >= 0 ||
+                (r->nodes[r->nnodes] = malloc(trimmed + 1)) == NULL) {
+                hash_ring_free(r);
+                return -1;
+            }
+            memcpy(r->nodes[r->nnodes], p, trimmed);
+            r->nodes[r->nnodes++][trimmed] = 0;
+        }
+        p += len;
+        if (*p == ',') p++;
+    }
+    if (r->nnodes == 0 || (r->points = malloc((size_t)r->nnodes * CLUSTER_VNODES * sizeof(*r->points))) == NULL) {
+        hash_ring_free(r);
+        return -1;
+    }
+    for (unsigned n = 0; n < r->nnodes; n++)
+        for (unsigned v = 0; v < CLUSTER_VNODES; v++) {
+            char name[1100];
+            int len = snprintf(name, sizeof(name), "%s#%u", r->nodes[n], v);
+            r->points[r->npoints].point = ring_key_hash(name, (size_t)len);
+            r->points[r->npoints++].node = n;
+        }
+    pthread_mutex_lock(&sort_lock);
+    ring_sort_ctx = r;
+    qsort(r->points, r->npoints, sizeof(*r->points), ring_point_cmp);
+    pthread_mutex_unlock(&sort_lock);
+    return 0;
+}
+// Node owning ring position h: first point at or after it.
+static unsigned hash_ring_owner_of(const struct HashRing *r, uint64_t h) {
+    size_t lo = 0, hi = r->npoints;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (r->points[mid].point < h) lo = mid + 1; else hi = mid;
+    }
+    return r->points[lo == r->npoints ? 0 : lo].node;
+}
+static unsigned hash_ring_owner(const struct HashRing *r, const char *code, size_t len) {
+    return hash_ring_owner_of(r, ring_key_hash(code, len));
+}
+// Client-side ring from $CIPHER_CLUSTER, built on first use.
+static struct HashRing client_ring;
+static int client_ring_ok;
+static pthread_once_t client_ring_once = PTHREAD_ONCE_INIT;
+static void client_ring_init(void) {
+    const char *list = getenv("CIPHER_CLUSTER");
+    client_ring_ok = list && *list && hash_ring_build(&client_ring, list) == 0;
+}
+// ============================================================
+// FUNCTION: cluster_route()
+// ------------------------------------------------------------
+// Rewrites a short link served by the cluster so that it goes
+// straight to the node owning its code. A link belongs to the
+// cluster when its scheme://host[:port] is one of the nodes or its
+// host is $CIPHER_CLUSTER_DOMAIN (the public short domain).
+// RETURNS:
+// buf holding the routed URL, or url itself when not routed.
+// ============================================================
+static const char *cluster_route(const char *url, char *buf, size_t cap) {
+    pthread_once(&client_ring_once, client_ring_init);
+    if (!client_ring_ok) return url;
+    const char *scheme_end = strstr(url, "://");
+    if (!scheme_end) return url;
+    const char *host = scheme_end + 3, *path = host + strcspn(host, "/?#");
+    const char *domain = getenv("CIPHER_CLUSTER_DOMAIN");
+    size_t host_len = (size_t)(path - host);
+    int member = hash_ring_find(&client_ring, url, (size_t)(path - url)) >= 0 ||
+                 (domain && strlen(domain) == host_len && !strncasecmp(host, domain, host_len));
+    if (!member || *path != '/') return url;
+    const char *code = path + 1;
+    size_t code_len = strcspn(code, "/?#");
+    if (code_len == 0 || code[code_len] == '/') return url;
+    unsigned owner = hash_ring_owner(&client_ring, code, code_len);
+    int n = snprintf(buf, cap, "%s/%s", client_ring.nodes[owner], code);
+    return n > 0 && (size_t)n < cap ? buf : url;
+}
+// ============================================================
+// HOST FILTER: compiled allow/block list for redirect targets
+// ------------------------------------------------------------
+// unshorten_url() checks the host of every hop against the filter
+// named by $CIPHER_HOST_FILTER before following it. The filter is
+// compiled once from a text list (--host-filter-compile):
+//
+//   # comment
+//   block example.com     (example.com and all its subdomains)
+//   allow safe.example.com
+//   default block         (verdict for unlisted hosts; default allow)
+//
+// The most specific entry wins. Compiled, the list is a trie over
+// reversed labels (com -> example -> safe) whose edges all live in
+// one open-addressing table keyed by (parent node, label). A lookup
+// costs one hash probe per label of the host, whatever the list
+// size. An edge's slot also holds the verdict of the node it leads
+// to. The file is used in place through mmap:
+//
+//   [ header | slots (nslots x 24 B) | labels ]
+//
+// It is in host byte order, for use on the machine that built it.
+// ============================================================
+#include <ctype.h> // For tolower() on host names
+#define HOST_FILTER_MAGIC "CIPHHF01"
+#define HOST_FILTER_NONE 0 // Verdicts
+#define HOST_FILTER_ALLOW 1
+#define HOST_FILTER_BLOCK 2
+#define HOST_FILTER_MAX_HOST 255
+struct HostFilterHeader {
+    char magic[8];
+    uint32_t nnodes; // Trie nodes; node 0 is the root
+    uint32_t nslots; // Edge table size, a power of two
+    uint32_t label_bytes;
+    uint32_t unlisted; // Verdict for hosts no entry covers
+    uint64_t reserved;
+};
+struct HostFilterSlot {
+    uint64_t hash; // host_filter_hash(parent, label)
+    uint32_t parent;
+    uint32_t child; // 0 = empty slot
+    uint32_t label_off;
+    uint16_t label_len;
+    uint8_t verdict; // Of child
+    uint8_t unused;
+};
+struct HostFilter {
+    void *map;
+    size_t size;
+    const struct HostFilterHeader *header;
+    const struct HostFilterSlot *slots;
+    const char *labels;
+};
+static uint64_t host_filter_hash(uint32_t parent, const char *label, size_t len) {
+    return hash_mix(hash_bytes(label, len) + parent * 0x9e3779b97f4a7c15ull);
+}
+// Finds the edge (parent, label). RETURNS: its slot index, or the
+// empty slot where it belongs (child == 0).
+static size_t host_filter_probe(const struct HostFilterSlot *slots, uint32_t nslots, const char *labels,
+                                uint32_t parent, const char *label, size_t len, uint64_t hash) {
+    size_t mask = nslots - 1, i = hash & mask;
+    for (;; i = (i + 1) & mask) {
+        const struct HostFilterSlot *s = &slots[i];
+        if (s->child == 0 || (s->hash == hash && s->parent == parent && s->label_len == len &&
+                              !memcmp(labels + s->label_off, label, len)))
+            return i;
+    }
+}
+// Copies the host of url into host (lowercased, without port,
+// userinfo, brackets or a trailing dot). RETURNS: its length, or 0.
+static size_t host_filter_url_host(const char *url, char *host, size_t cap) {
+    const char *p = strstr(url, "://");
+    if (!p) return 0;
+    p += 3;
+    size_t auth = strcspn(p, "/?#");
+    const char *at = memchr(p, '@', auth);
+    while (at) { // The last '@' of the authority ends the userinfo
+        auth -= (size_t)(at + 1 - p);
+        p = at + 1;
+        at = memchr(p, '@', auth);
+    }
+    size_t len = *p == '[' ? strcspn(p + 1, "]") : strcspn(p, ":");
+    if (*p == '[') p++;
+    if (len > auth) len = auth;
+    while (len > 0 && p[len - 1] == '.') len--;
+    if (len == 0 || len >= cap) return 0;
+    for (size_t i = 0; i < len; i++) host[i] = (char)tolower((unsigned char)p[i]);
+    host[len] = 0;
+    return len;
+}
+// ============================================================
+// FUNCTION: host_filter_verdict()
+// ------------------------------------------------------------
+// Walks the host's labels right to left down the trie.
+// RETURNS:
+// HOST_FILTER_ALLOW or HOST_FILTER_BLOCK.
+// ============================================================
+static int host_filter_verdict(const struct HostFilter *f, const char *host, size_t len) {
+    uint32_t node = 0, verdict = f->header->unlisted;
+    size_t end = len;
+    while (end > 0) {
+        size_t start = end;
+        while (start > 0 && host[start - 1] != '.') start--;
+        const char *label = host + start;
+        size_t i = host_filter_probe(f->slots, f->header->nslots, f->labels, node, label, end - start,
+                                     host_filter_hash(node, label, end - start));
+        if (f->slots[i].child == 0) break;
+        node = f->slots[i].child;
+        if (f->slots[i].verdict != HOST_FILTER_NONE) verdict = f->slots[i].verdict;
+        end = start > 0 ? start - 1 : 0;
+    }
+    return (int)verdict;
+}
+// Maps a compiled filter. RETURNS: 0, or -1 (details on stderr).
+static int host_filter_open(struct HostFilter *f, const char *path) {
+    struct stat sb;
+    int fd = open(path, O_RDONLY);
+    memset(f, 0, sizeof(*f));
+    if (fd < 0 || fstat(fd, &sb) != 0) {
+        fprintf(stderr, "Error: Cannot open host filter '%s'\n", path);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    f->size = (size_t)sb.st_size;
+    f->map = MAP_FAILED;
+    if (f->size >= sizeof(struct HostFilterHeader)) // Populated: every hop of every lookup may touch it
+        f->map = mmap(NULL, f->size, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+    close(fd);
+    const struct HostFilterHeader *h = f->map;
+    int ok = f->map != MAP_FAILED && !memcmp(h->magic, HOST_FILTER_MAGIC, 8) && h->nnodes > 0 && h->nslots > 0 &&
+             (h->nslots & (h->nslots - 1)) == 0 && h->unlisted >= HOST_FILTER_ALLOW &&
+             h->unlisted <= HOST_FILTER_BLOCK &&
+             sizeof(*h) + (uint64_t)h->nslots * sizeof(struct HostFilterSlot) + h->label_bytes == f->size;
+    if (ok) {
+        f->header = h;
+        f->slots = (const struct HostFilterSlot *)(h + 1);
+        f->labels = (const char *)(f->slots + h->nslots);
+        // Checked once here so lookups can trust every offset (and
+        // find an empty slot to end each probe)
+        uint32_t empty = 0;
+        for (uint32_t i = 0; ok && i < h->nslots; i++) {
+            const struct HostFilterSlot *s = &f->slots[i];
+            empty += s->child == 0;
+            ok = s->child == 0 || (s->child < h->nnodes && s->parent < h->nnodes && s->verdict <= HOST_FILTER_BLOCK &&
+                                   (uint64_t)s->label_off + s->label_len <= h->label_bytes);
+        }
+        ok = ok && empty > 0;
+    }
+    if (!ok) {
+        fprintf(stderr, "Error: '%s' is not a compiled host filter\n", path);
+        if (f->map != MAP_FAILED) munmap(f->map, f->size);
+        f->map = NULL;
+        return -1;
+    }
+    return 0;
+}
+static void host_filter_close(struct HostFilter *f) {
+    if (f->map) munmap(f->map, f->size);
+    f->map = NULL;
+}
+// Client-side filter from $CIPHER_HOST_FILTER, mapped on first use.
+static struct HostFilter client_filter;
+static int client_filter_state; // 0 = none, 1 = loaded, -1 = unusable
+static pthread_once_t client_filter_once = PTHREAD_ONCE_INIT;
+static void client_filter_init(void) {
+    const char *path = getenv("CIPHER_HOST_FILTER");
+    if (path && *path) client_filter_state = host_filter_open(&client_filter, path) == 0 ? 1 : -1;
+}
+// ============================================================
+// FUNCTION: host_filter_allows()
+// ------------------------------------------------------------
+// Redirect walker check for one hop. A set but unusable
+// $CIPHER_HOST_FILTER blocks everything rather than nothing.
+// RETURNS:
+// 1 if url may be requested; else 0 with its host in host.
+// ============================================================
+static int host_filter_allows(const char *url, char *host, size_t cap) {
+    char buf[HOST_FILTER_MAX_HOST + 1];
+    pthread_once(&client_filter_once, client_filter_init);
+    if (client_filter_state == 0) return 1;
+    size_t len = host_filter_url_host(url, buf, sizeof(buf));
+    if (client_filter_state == 1 && len > 0 && host_filter_verdict(&client_filter, buf, len) == HOST_FILTER_ALLOW)
+        return 1;
+    snprintf(host, cap, "%s", len > 0 ? buf : "?");
+    return 0;
+}
+// Compiler state: the same edge table, growable.
+struct HostFilterBuild {
+    struct HostFilterSlot *slots;
+    uint32_t nslots, nedges;
+    uint32_t nnodes;
+    char *labels;
+    size_t label_bytes, label_cap;
+};
+static int host_filter_build_grow(struct HostFilterBuild *b) {
+    uint32_t nslots = b->nslots ? b->nslots * 2 : 1024;
+    struct HostFilterSlot *slots = calloc(nslots, sizeof(*slots));
+    if (!slots) return -1;
+    for (uint32_t i = 0; i < b->nslots; i++)
+        if (b->slots[i].child != 0) {
+            const struct HostFilterSlot *s = &b->slots[i];
+            slots[host_filter_probe(slots, nslots, b->labels, s->parent, b->labels + s->label_off, s->label_len,
+                                    s->hash)] = *s;
+        }
+    free(b->slots);
+    b->slots = slots;
+    b->nslots = nslots;
+    return 0;
+}
+// Edge from parent for label, created if missing. RETURNS: its
+// slot (valid until the next call), or NULL when out of memory.
+static struct HostFilterSlot *host_filter_build_edge(struct HostFilterBuild *b, uint32_t parent, const char *label,
+                                                     size_t len) {
+    if ((b->nedges + 1) * 2 > b->nslots && host_filter_build_grow(b) != 0) return NULL;
+    uint64_t hash = host_filter_hash(parent, label, len);
+    size_t i = host_filter_probe(b->slots, b->nslots, b->labels, parent, label, len, hash);
+    if (b->slots[i].child != 0) return &b->slots[i];
+    if (b->label_bytes + len > b->label_cap) {
+        char *grown = realloc(b->labels, (b->label_cap = b->label_cap * 2 + len));
+        if (!grown) return NULL;
+        b->labels = grown;
+    }
+    memcpy(b->labels + b->label_bytes, label, len);
+    b->slots[i] = (struct HostFilterSlot){hash, parent, b->nnodes++, (uint32_t)b->label_bytes, (uint16_t)len,
+                                          HOST_FILTER_NONE, 0};
+    b->label_bytes += len;
+    b->nedges++;
+    return &b->slots[i];
+}
+// ============================================================
+// FUNCTION: host_filter_compile()
+// ------------------------------------------------------------
+// Compiles the text list in file in into out (format above).
+// RETURNS:
+// 0 on success, -1 on failure (details on stderr).
+// ============================================================
+static int host_filter_compile(const char *in_path, const char *out_path) {
+    struct HostFilterBuild b = {0};
+    struct HostFilterHeader h;
+    FILE *in = fopen(in_path, "r"), *out = NULL;
+    char *line = NULL, host[HOST_FILTER_MAX_HOST + 1], tmp[4200];
+    size_t line_cap = 0, lineno = 0, entries = 0;
+    uint32_t unlisted = HOST_FILTER_ALLOW;
+    int ok = in != NULL;
+    memset(&h, 0, sizeof(h));
+    if (!in) fprintf(stderr, "Error: Cannot open '%s'\n", in_path);
+    b.nnodes = 1;
+    if (ok && host_filter_build_grow(&b) != 0) ok = 0;
+    while (ok && getline(&line, &line_cap, in) > 0) {
+        char verb[16], name[HOST_FILTER_MAX_HOST + 8];
+        lineno++;
+        line[strcspn(line, "#\r\n")] = 0;
+        int fields = sscanf(line, "%15s %262s", verb, name);
+        if (fields <= 0) continue;
+        int verdict = !strcmp(verb, "allow") ? HOST_FILTER_ALLOW : !strcmp(verb, "block") ? HOST_FILTER_BLOCK : 0;
+        if (fields == 2 && !strcmp(verb, "default") && (!strcmp(name, "allow") || !strcmp(name, "block"))) {
+            unlisted = name[0] == 'a' ? HOST_FILTER_ALLOW : HOST_FILTER_BLOCK;
+            continue;
+        }
+        size_t len = 0;
+        if (fields == 2 && verdict) {
+            // "*.example.com" and ".example.com" mean what "example.com" does
+            const char *d = name + (!strncmp(name, "*.", 2) ? 2 : name[0] == '.');
+            snprintf(tmp, sizeof(tmp), "x://%s", d);
+            if (d[strcspn(d, ":/?#@[]")] == 0 && !strstr(d, "..")) len = host_filter_url_host(tmp, host, sizeof(host));
+        }
+        if (len == 0) {
+            fprintf(stderr, "Error: %s:%zu: expected 'allow <domain>', 'block <domain>' or 'default allow|block'\n",
+                    in_path, lineno);
+            ok = 0;
+            break;
+        }
+        struct HostFilterSlot *edge = NULL;
+        for (size_t end = len; ok && end > 0;) {
+            size_t start = end;
+            while (start > 0 && host[start - 1] != '.') start--;
+            edge = host_filter_build_edge(&b, edge ? edge->child : 0, host + start, end - start);
+            ok = edge != NULL;
+            end = start > 0 ? start - 1 : 0;
+        }
+        if (ok) edge->verdict = (uint8_t)verdict; // A later entry for the same domain wins
+        entries++;
+    }
+    free(line);
+    if (in) fclose(in);
+    if (ok) {
+        memcpy(h.magic, HOST_FILTER_MAGIC, 8);
+        h.nnodes = b.nnodes;
+        h.nslots = b.nslots;
+        h.label_bytes = (uint32_t)b.label_bytes;
+        h.unlisted = unlisted;
+        // Written under a temporary name so readers never map half a file
+        snprintf(tmp, sizeof(tmp), "%s.tmp", out_path);
+        ok = (out = fopen(tmp, "wb")) != NULL && fwrite(&h, sizeof(h), 1, out) == 1 &&
+             fwrite(b.slots, sizeof(*b.slots), b.nslots, out) == b.nslots &&
+             fwrite(b.labels, 1, b.label_bytes, out) == b.label_bytes;
+        if (out && fclose(out) != 0) ok = 0;
+        if (!ok || rename(tmp, out_path) != 0) {
+            fprintf(stderr, "Error: Cannot write '%s'\n", out_path);
+            unlink(tmp);
+            ok = 0;
+        }
+    }
+    if (ok)
+        printf("[filter] entries=%zu nodes=%u slots=%u bytes=%zu unlisted=%s\n", entries, b.nnodes, b.nslots,
+               sizeof(h) + (size_t)b.nslots * sizeof(*b.slots) + b.label_bytes,
+               unlisted == HOST_FILTER_ALLOW ? "allow" : "block");
+    free(b.slots);
+    free(b.labels);
+    return ok ? 0 : -1;
+}
+// ============================================================
+// PERFECT HASH: minimal perfect hashing of a fixed key set
+// ------------------------------------------------------------
+// A PTHash-style function mapping n known keys one to one onto
+// positions 0..n-1. Keys are split by hash into partitions of
+// about MPH_PART_KEYS, each built on its own so that the build's
+// working set stays in cache. Within a partition keys are hashed
+// into buckets, about MPH_LAMBDA per bucket (skewed, so that a
+// third of the buckets hold most keys). Buckets are placed
+// biggest first: each gets the first 16-bit pilot under which
+// all its keys land on free positions of a table 1% larger than
+// the partition. Positions past its end are then remapped onto
+// the holes left below it.
+// A lookup hashes the key, reads its partition (a small table),
+// its bucket's pilot and, for about 1% of keys, one remap entry.
+// At 16/MPH_LAMBDA bits of pilots plus the remap, the function
+// costs about 3 bits per key. A key outside the set gets some
+// position too; callers compare it with what is stored there.
+// ============================================================
+#define MPH_MAGIC "CIPHMPH1"
+#define MPH_LAMBDA 6
+#define MPH_PART_KEYS (1u << 20)
+#define MPH_MAX_BUCKET 64
+#define MPH_MAX_KEYS 0x7fffffffu
+struct MphPart {
+    uint32_t key_base, nkeys; // Positions key_base.. of the whole function
+    uint32_t bucket_base, nbuckets; // Pilots
+    uint32_t remap_base, table; // table - nkeys remap entries
+};
+struct Mph {
+    uint64_t seed; // Of mph_hash()
+    uint64_t nkeys, nparts, nbuckets, nremap;
+    const struct MphPart *parts;
+    const uint16_t *pilots; // nbuckets
+    const uint32_t *remap; // nremap
+};
+// Key hash under seed. A build that meets two keys with equal
+// hashes fails, and is retried with another seed.
+static uint64_t mph_hash(const void *key, size_t len, uint64_t seed) {
+    const unsigned char *p = key;
+    uint64_t h = 1469598103934665603ull ^ hash_mix(seed);
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 1099511628211ull;
+    }
+    return hash_mix(h);
+}
+// The top of the low 32 bits of a hash picks its partition, the
+// bottom 16 whether its bucket is a dense one, the high 32 which
+// bucket, and all 64 its position for a pilot.
+static uint64_t mph_part(uint64_t nparts, uint64_t hash) {
+    return ((hash & 0xffffffffu) * nparts) >> 32;
+}
+static uint64_t mph_bucket(const struct MphPart *p, uint64_t hash) {
+    uint64_t dense = p->nbuckets * 3 / 10, hi = hash >> 32;
+    if ((hash & 0xffff) < 39322) return (hi * dense) >> 32; // 60% of keys
+    return dense + ((hi * (p->nbuckets - dense)) >> 32);
+}
+static uint64_t mph_slot(const struct MphPart *p, uint64_t hash, unsigned pilot) {
+    uint64_t x = hash_mix(hash ^ (0x9e3779b97f4a7c15ull * (pilot + 1ull)));
+    return ((x >> 32) * p->table) >> 32;
+}
+// RETURNS: the position (< nkeys) of the key with this mph_hash().
+static uint64_t mph_position(const struct Mph *m, uint64_t hash) {
+    const struct MphPart *p = &m->parts[mph_part(m->nparts, hash)];
+    if (p->nkeys == 0) return 0; // Not a key
+    uint64_t s = mph_slot(p, hash, m->pilots[p->bucket_base + mph_bucket(p, hash)]);
+    return p->key_base + (s < p->nkeys ? s : m->remap[p->remap_base + s - p->nkeys]);
+}
+static void mph_free(struct Mph *m) {
+    free((void *)m->parts);
+    free((void *)m->pilots);
+    free((void *)m->remap);
+    memset(m, 0, sizeof(*m));
+}
+static size_t mph_index_bytes(const struct Mph *m) {
+    return m->nparts * sizeof(struct MphPart) + m->nbuckets * sizeof(uint16_t) + m->nremap * sizeof(uint32_t);
+}
+// Places the keys of one partition (hashes, p->nkeys of them).
+// RETURNS: 0, 1 if some bucket found no pilot, or -1.
+static int mph_build_part(const struct MphPart *p, const uint64_t *hashes, uint16_t *pilots, uint32_t *remap) {
+    uint32_t *start = calloc(p->nbuckets + 1, sizeof(uint32_t)); // Keys of bucket b: keys[start[b]..start[b+1])
+    uint32_t *keys = malloc((p->nkeys + 1) * sizeof(uint32_t)), *order = malloc(p->nbuckets * sizeof(uint32_t));
+    uint64_t *taken = calloc((p->table + 63) / 64, sizeof(uint64_t));
+    size_t sizes[MPH_MAX_BUCKET + 1] = {0}, used = 0;
+    int rc = -1;
+    if (!start || !keys || !order || !taken) goto out;
+    rc = 1;
+    for (uint32_t i = 0; i < p->nkeys; i++) start[mph_bucket(p, hashes[i]) + 1]++;
+    for (uint32_t b = 0; b < p->nbuckets; b++) {
+        if (start[b + 1] > MPH_MAX_BUCKET) goto out;
+        sizes[start[b + 1]]++;
+        order[b] = start[b]; // Fill cursor while keys are sorted into buckets
+        start[b + 1] += start[b];
+    }
+    for (uint32_t i = 0; i < p->nkeys; i++) keys[order[mph_bucket(p, hashes[i])]++] = i;
+    for (size_t s = MPH_MAX_BUCKET; s > 0; s--) { // Non-empty buckets, biggest first
+        size_t first = used;
+        used += sizes[s];
+        sizes[s] = first;
+    }
+    for (uint32_t b = 0; b < p->nbuckets; b++) {
+        size_t s = start[b + 1] - start[b];
+        if (s > 0) order[sizes[s]++] = b;
+    }
+    for (size_t k = 0; k < used; k++) {
+        uint32_t b = order[k];
+        uint64_t h[MPH_MAX_BUCKET], pos[MPH_MAX_BUCKET];
+        size_t s = start[b + 1] - start[b];
+        unsigned pilot;
+        for (size_t i = 0; i < s; i++) h[i] = hashes[keys[start[b] + i]];
+        for (pilot = 0; pilot <= 0xffff; pilot++) {
+            size_t i;
+            for (i = 0; i < s; i++) {
+                uint64_t q = mph_slot(p, h[i], pilot);
+                if (taken[q / 64] >> (q % 64) & 1) break;
+                size_t j = 0;
+                while (j < i && pos[j] != q) j++;
+                if (j < i) break;
+                pos[i] = q;
+            }
+            if (i == s) break;
+        }
+        if (pilot > 0xffff) goto out; // Equal hashes, or a very unlucky seed
+        for (size_t i = 0; i < s; i++) taken[pos[i] / 64] |= 1ull << (pos[i] % 64);
+        pilots[b] = (uint16_t)pilot;
+    }
+    // As many positions below nkeys are free as are taken past it
+    for (uint32_t q = p->nkeys, hole = 0; q < p->table; q++) {
+        if (!(taken[q / 64] >> (q % 64) & 1)) {
+            remap[q - p->nkeys] = 0; // Never reached by a key
+            continue;
+        }
+        while (taken[hole / 64] >> (hole % 64) & 1) hole++;
+        remap[q - p->nkeys] = hole++;
+    }
+    rc = 0;
+out:
+    free(start);
+    free(keys);
+    free(order);
+    free(taken);
+    return rc;
+}
+// ============================================================
+// FUNCTION: mph_build()
+// ------------------------------------------------------------
+// Builds m over the n keys whose mph_hash(key, seed) are hashes.
+// Needs 8 bytes per key plus a partition's worth of scratch.
+// RETURNS:
+// 0 on success, 1 when seed does not work for this key set (try
+// another), -1 when out of memory or n is too large.
+// ============================================================
+static int mph_build(struct Mph *m, const uint64_t *hashes, size_t n, uint64_t seed) {
+    memset(m, 0, sizeof(*m));
+    if (n == 0 || n > MPH_MAX_KEYS) return -1;
+    m->seed = seed;
+    m->nkeys = n;
+    m->nparts = n / MPH_PART_KEYS + 1;
+    struct MphPart *parts = calloc(m->nparts, sizeof(*parts));
+    uint64_t *sorted = malloc(n * sizeof(uint64_t)); // Hashes by partition
+    uint16_t *pilots = NULL;
+    uint32_t *remap = NULL, *fill = calloc(m->nparts, sizeof(uint32_t));
+    int rc = -1;
+    if (!parts || !sorted || !fill) goto out;
+    for (size_t i = 0; i < n; i++) parts[mph_part(m->nparts, hashes[i])].nkeys++;
+    for (uint64_t i = 0; i < m->nparts; i++) {
+        struct MphPart *p = &parts[i];
+        p->key_base = (uint32_t)(i ? parts[i - 1].key_base + parts[i - 1].nkeys : 0);
+        p->nbuckets = p->nkeys / MPH_LAMBDA + 1;
+        p->bucket_base = (uint32_t)m->nbuckets;
+        p->table = p->nkeys + p->nkeys / 99 + 1;
+        p->remap_base = (uint32_t)m->nremap;
+        m->nbuckets += p->nbuckets;
+        m->nremap += p->table - p->nkeys;
+        fill[i] = p->key_base;
+    }
+    if ((pilots = calloc(m->nbuckets, sizeof(uint16_t))) == NULL ||
+        (remap = malloc(m->nremap * sizeof(uint32_t))) == NULL)
+        goto out;
+    for (size_t i = 0; i < n; i++) sorted[fill[mph_part(m->nparts, hashes[i])]++] = hashes[i];
+    rc = 0;
+    for (uint64_t i = 0; rc == 0 && i < m->nparts; i++)
+        rc = mph_build_part(&parts[i], sorted + parts[i].key_base, pilots + parts[i].bucket_base,
+                            remap + parts[i].remap_base);
+out:
+    free(sorted);
+    free(fill);
+    m->parts = parts;
+    m->pilots = pilots;
+    m->remap = remap;
+    if (rc != 0) mph_free(m);
+    return rc;
+}
+// ============================================================
+// STRUCT: MphFile
+// ------------------------------------------------------------
+// A built function and one 32-bit value per position, in a file
+// that is used in place through mmap:
+//
+//   [ header 64 B | partitions | pilots | remap | values (nkeys x 4 B) ]
+//
+// with each part padded to 8 bytes. The header also records what
+// the values refer to (owner, e.g. a store's log id) and how much
+// of it (covered). Host byte order, like the host filter.
+// ============================================================
+struct MphHeader {
+    char magic[8];
+    uint64_t owner;
+    uint64_t covered;
+    uint64_t seed;
+    uint64_t nkeys, nparts, nbuckets, nremap;
+};
+struct MphFile {
+    void *map; // NULL when not loaded
+    size_t size;
+    const struct MphHeader *header;
+    struct Mph mph; // Pointing into map
+    const uint32_t *values; // By position
+};
+static size_t mph_pad8(size_t n) {
+    return (n + 7) & ~(size_t)7;
+}
+// Writes m and values to path (through a temporary name).
+// RETURNS: 0, or -1 (details on stderr).
+static int mph_file_write(const char *path, const struct Mph *m, const uint32_t *values, uint64_t owner,
+                          uint64_t covered) {
+    static const char zeros[8];
+    struct MphHeader h;
+    char tmp[4200];
+    size_t part_bytes = m->nparts * sizeof(struct MphPart), pilot_bytes = m->nbuckets * sizeof(uint16_t);
+    size_t remap_bytes = m->nremap * sizeof(uint32_t);
+    FILE *out;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, MPH_MAGIC, 8);
+    h.owner = owner;
+    h.covered = covered;
+    h.seed = m->seed;
+    h.nkeys = m->nkeys;
+    h.nparts = m->nparts;
+    h.nbuckets = m->nbuckets;
+    h.nremap = m->nremap;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int ok = (out = fopen(tmp, "wb")) != NULL && fwrite(&h, sizeof(h), 1, out) == 1 &&
+             fwrite(m->parts, 1, part_bytes, out) == part_bytes && // A multiple of 8
+             fwrite(m->pilots, 1, pilot_bytes, out) == pilot_bytes &&
+             fwrite(zeros, 1, mph_pad8(pilot_bytes) - pilot_bytes, out) == mph_pad8(pilot_bytes) - pilot_bytes &&
+             fwrite(m->remap, 1, remap_bytes, out) == remap_bytes &&
+             fwrite(zeros, 1, mph_pad8(remap_bytes) - remap_bytes, out) == mph_pad8(remap_bytes) - remap_bytes &&
+             fwrite(values, sizeof(uint32_t), m->nkeys, out) == m->nkeys;
+    if (out && fclose(out) != 0) ok = 0;
+    if (!ok || rename(tmp, path) != 0) {
+        fprintf(stderr, "Error: Cannot write '%s'\n", path);
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+// Maps a file written by mph_file_write(). A missing file is not
+// reported, so callers can treat it as optional.
+// RETURNS: 0, or -1 (details on stderr).
+static int mph_file_open(struct MphFile *f, const char *path) {
+    struct stat sb;
+    int fd = open(path, O_RDONLY);
+    memset(f, 0, sizeof(*f));
+    if (fd < 0 || fstat(fd, &sb) != 0) {
+        if (errno != ENOENT) fprintf(stderr, "Error: Cannot open '%s'\n", path);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    f->size = (size_t)sb.st_size;
+    f->map = MAP_FAILED;
+    if (f->size >= sizeof(struct MphHeader)) // Populated: lookups should not fault
+        f->map = mmap(NULL, f->size, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+    close(fd);
+    const struct MphHeader *h = f->map;
+    int ok = f->map != MAP_FAILED && !memcmp(h->magic, MPH_MAGIC, 8) && h->nkeys > 0 && h->nkeys <= MPH_MAX_KEYS &&
+             h->nparts > 0 && h->nparts <= h->nkeys && h->nbuckets <= 2 * h->nkeys && h->nremap <= 2 * h->nkeys &&
+             sizeof(*h) + h->nparts * sizeof(struct MphPart) + mph_pad8(h->nbuckets * sizeof(uint16_t)) +
+             mph_pad8(h->nremap * sizeof(uint32_t)) + h->nkeys * sizeof(uint32_t) == f->size;
+    if (ok) {
+        const unsigned char *p = (const unsigned char *)(h + 1);
+        f->header = h;
+        f->mph = (struct Mph){h->seed, h->nkeys, h->nparts, h->nbuckets, h->nremap, (const struct MphPart *)p,
+                              NULL, NULL};
+        p += h->nparts * sizeof(struct MphPart);
+        f->mph.pilots = (const uint16_t *)p;
+        p += mph_pad8(h->nbuckets * sizeof(uint16_t));
+        f->mph.remap = (const uint32_t *)p;
+        f->values = (const uint32_t *)(p + mph_pad8(h->nremap * sizeof(uint32_t)));
+        // Checked once here so lookups can trust every index
+        for (uint64_t i = 0, keys = 0; ok && i < h->nparts; i++) {
+            const struct MphPart *part = &f->mph.parts[i];
+            ok = part->key_base == keys && part->nbuckets > 0 && part->table > part->nkeys &&
+                 (uint64_t)part->bucket_base + part->nbuckets <= h->nbuckets &&
+                 (uint64_t)part->remap_base + part->table - part->nkeys <= h->nremap;
+            for (uint64_t r = 0; ok && r < part->table - part->nkeys; r++)
+                ok = f->mph.remap[part->remap_base + r] < part->nkeys || part->nkeys == 0;
+            keys += part->nkeys;
+            if (i == h->nparts - 1) ok = ok && keys == h->nkeys;
+        }
+    }
+    if (!ok) {
+        fprintf(stderr, "Error: '%s' is not a cipher perfect hash file\n", path);
+        if (f->map != MAP_FAILED) munmap(f->map, f->size);
+        memset(f, 0, sizeof(*f));
+        return -1;
+    }
+    return 0;
+}
+static void mph_file_close(struct MphFile *f) {
+    if (f->map) munmap(f->map, f->size);
+    memset(f, 0, sizeof(*f));
+}
+// ============================================================
+// STORE: self-hosted short-code -> URL mapping
+// ------------------------------------------------------------
+// --serve runs cipher as its own shortener. Links live in
+// <dir>/store.log, an append-only log:
+//
+//   [ header 64 B | record | record | ... ]
+//
+// LINK records hold a code and its URL. SYMBOLS records hold a
+// symbol table (see SYMBOL TABLE), and every LINK names the table
+// its URL was encoded with (0 = stored raw). The first
+// STORE_TRAIN_AFTER URLs are stored raw; a table is then trained
+// on them, appended to the log and used for later links.
+//
+// The log is mapped once into a large reserved address range, so
+// its base never moves while the file grows. An in-memory
+// open-addressing index maps code -> record offset; it has one
+// writer (under write_lock) and lock-free readers, and grows by
+// publishing a doubled copy (old copies are freed on close).
+//
+// Because bytes below the tail never change, the prefix of the log
+// up to a captured tail is a consistent snapshot, and a follower
+// replicates by fetching the bytes past its own tail (see
+// REPLICATION). The header carries a random log id so a follower
+// never appends one leader's records to another's log.
+//
+// For a mostly static link set, --store-compile writes a perfect
+// hash of all codes to <dir>/store.mph (see PERFECT HASH), each
+// position holding its record's offset / 8. store_open() maps it
+// when it names this log, and only links past the part it covers
+// go into the in-memory index: a lookup of a compiled code costs
+// a pilot read and one offset read instead of 23+ bytes of index
+// per link.
+// ============================================================
+#define STORE_MAGIC "CIPHSTO1"
+#define STORE_HEADER_SIZE 64
+#define STORE_REC_MAGIC 0x52504943u // "CIPR"
+#define STORE_REC_LINK 1
+#define STORE_REC_SYMBOLS 2
+#define STORE_MAX_TABLES 16
+#define STORE_TRAIN_AFTER 2048
+#define STORE_GROW_STEP (64u << 20)
+#define STORE_RESERVE (64ull << 30)
+#define STORE_MAX_URL 8192
+#define STORE_MAX_CODE 64
+struct StoreRecord {
+    uint32_t magic; // STORE_REC_MAGIC
+    uint16_t type; // STORE_REC_LINK or STORE_REC_SYMBOLS
+    uint16_t table; // Symbol table of the URL (0 = raw)
+    uint32_t total; // Record size including header, padded to 8
+    uint16_t code_len;
+    uint16_t reserved;
+    uint32_t data_len; // Stored URL (or table) bytes after the code
+    uint32_t raw_len; // Decoded URL length
+};
+struct StoreIndexSlot {
+    uint64_t hash;
+    uint64_t offset; // 0 = empty; published last
+};
+struct StoreIndex {
+    uint64_t mask;
+    uint64_t count;
+    struct StoreIndex *retired_next;
+    struct StoreIndexSlot slots[];
+};
+struct Store {
+    int fd;
+    int replica; // Follower: records only arrive through store_apply()
+    uint64_t log_id; // Header bytes 8..15
+    unsigned char *base; // Reserved mapping of store.log
+    size_t file_size; // Current file length (writer only)
+    uint64_t tail; // End of the committed log (atomic)
+    pthread_mutex_t write_lock;
+    struct StoreIndex *index; // Current index (atomic pointer)
+    struct StoreIndex *retired; // Replaced indexes
+    struct MphFile mph; // store.mph, covering links below mph.header->covered
+    struct SymbolTable *tables[STORE_MAX_TABLES + 1]; // 1-based
+    unsigned ntables; // Atomic
+    char **train; // Raw URLs collected for the first table
+    size_t ntrain;
+    uint64_t links; // LINK records
+    uint64_t url_bytes; // Sum of decoded URL lengths
+    uint64_t stored_bytes; // Sum of stored URL lengths
+    struct EventCount appended; // Notified when the tail moves
+};
+static const struct StoreRecord *store_record(const struct Store *st, uint64_t off) {
+    return (const struct StoreRecord *)(st->base + off);
+}
+static const unsigned char *store_record_code(const struct StoreRecord *r) {
+    return (const unsigned char *)(r + 1);
+}
+static const unsigned char *store_record_data(const struct StoreRecord *r) {
+    return (const unsigned char *)(r + 1) + r->code_len;
+}
+static struct StoreIndex *store_index_new(uint64_t nslots) {
+    struct StoreIndex *ix = huge_alloc(sizeof(*ix) + nslots * sizeof(struct StoreIndexSlot));
+    if (ix) numa_interleave(ix, sizeof(*ix) + nslots * sizeof(struct StoreIndexSlot));
+    if (ix) ix->mask = nslots - 1;
+    return ix;
+}
+static void store_index_free(struct StoreIndex *ix) {
+    if (ix) huge_free(ix, sizeof(*ix) + (ix->mask + 1) * sizeof(struct StoreIndexSlot));
+}
+static void store_index_place(struct StoreIndex *ix, uint64_t hash, uint64_t offset) {
+    for (uint64_t s = hash & ix->mask;; s = (s + 1) & ix->mask) {
+        if (ix->slots[s].offset == 0) {
+            __atomic_store_n(&ix->slots[s].hash, hash, __ATOMIC_RELAXED);
+            __atomic_store_n(&ix->slots[s].offset, offset, __ATOMIC_RELEASE);
+            ix->count++;
+            return;
+        }
+    }
+}
+// Writer only: indexes a LINK record, doubling the table first
+// when it would pass 70% load.
+static int store_index_add(struct Store *st, uint64_t hash, uint64_t offset) {
+    struct StoreIndex *ix = st->index;
+    if ((ix->count + 1) * 10 > (ix->mask + 1) * 7) {
+        struct StoreIndex *grown = store_index_new((ix->mask + 1) * 2);
+        if (!grown) return -1;
+        for (uint64_t s = 0; s <= ix->mask; s++)
+            if (ix->slots[s].offset) store_index_place(grown, ix->slots[s].hash, ix->slots[s].offset);
+        __atomic_store_n(&st->index, grown, __ATOMIC_RELEASE);
+        ix->retired_next = st->retired;
+        st->retired = ix;
+        ix = grown;
+    }
+    store_index_place(ix, hash, offset);
+    return 0;
+}
+// RETURNS: offset of the LINK record for code in store.mph, or 0.
+static uint64_t store_mph_find(const struct Store *st, const char *code, size_t len) {
+    const struct MphFile *f = &st->mph;
+    uint64_t off = (uint64_t)f->values[mph_position(&f->mph, mph_hash(code, len, f->mph.seed))] * 8;
+    if (off < STORE_HEADER_SIZE || off + sizeof(struct StoreRecord) + len > f->header->covered) return 0;
+    const struct StoreRecord *r = store_record(st, off);
+    return r->type == STORE_REC_LINK && r->code_len == len && memcmp(store_record_code(r), code, len) == 0 ? off : 0;
+}
+// Lock-free. RETURNS: offset of the LINK record for code, or 0.
+static uint64_t store_find(struct Store *st, const char *code, size_t len) {
+    uint64_t found = st->mph.map ? store_mph_find(st, code, len) : 0;
+    if (found) return found;
+    uint64_t hash = hash_bytes(code, len);
+    struct StoreIndex *ix = __atomic_load_n(&st->index, __ATOMIC_ACQUIRE);
+    for (uint64_t s = hash & ix->mask;; s = (s + 1) & ix->mask) {
+        uint64_t off = __atomic_load_n(&ix->slots[s].offset, __ATOMIC_ACQUIRE);
+        if (off == 0) return 0;
+        if (__atomic_load_n(&ix->slots[s].hash, __ATOMIC_RELAXED) != hash) continue;
+        const struct StoreRecord *r = store_record(st, off);
+        if (r->code_len == len && memcmp(store_record_code(r), code, len) == 0) return off;
+    }
+}
+// URLs end up in a Location header: control bytes (CR/LF would
+// split the response) and DEL are never stored or served.
+static int store_url_safe(const char *url, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        if ((unsigned char)url[i] < 0x20 || url[i] == 0x7f) return 0;
+    return 1;
+}
+// ============================================================
+// FUNCTION: store_get_url()
+// ------------------------------------------------------------
+// Decodes the URL stored for code into out (NUL-terminated).
+// Only this one entry is touched.
+// RETURNS:
+// URL length, or -1 if code is unknown, out is too small or the
+// stored URL is not header-safe.
+// ============================================================
+static long store_get_url(struct Store *st, const char *code, size_t len, char *out, size_t cap) {
+    uint64_t off = store_find(st, code, len);
+    if (!off) return -1;
+    const struct StoreRecord *r = store_record(st, off);
+    size_t n;
+    if (r->table == 0) {
+        if ((n = r->data_len) >= cap) return -1;
+        memcpy(out, store_record_data(r), n);
+    } else {
+        const struct SymbolTable *t = __atomic_load_n(&st->tables[r->table], __ATOMIC_ACQUIRE);
+        n = t ? symtab_decode(t, store_record_data(r), r->data_len, out, cap - 1) : (size_t)-1;
+        if (n == (size_t)-1) return -1;
+    }
+    out[n] = 0;
+    return store_url_safe(out, n) ? (long)n : -1;
+}
+// Writer only: extends the file so that [0, end) is mapped.
+static int store_grow(struct Store *st, uint64_t end) {
+    if (end > STORE_RESERVE) return -1;
+    if (end > st->file_size) {
+        size_t size = st->file_size + STORE_GROW_STEP;
+        while (size < end) size += STORE_GROW_STEP;
+        if (ftruncate(st->fd, (off_t)size) != 0) return -1;
+        st->file_size = size;
+    }
+    return 0;
+}
+// Writer only: appends a record and publishes the new tail.
+// RETURNS: the record's offset, or 0 on I/O failure.
+static uint64_t store_append(struct Store *st, int type, unsigned table, const void *code, size_t code_len,
+                             const void *data, size_t data_len, size_t raw_len) {
+    size_t total = (sizeof(struct StoreRecord) + code_len + data_len + 7) & ~(size_t)7;
+    uint64_t off = st->tail;
+    if (store_grow(st, off + total) != 0) return 0;
+    struct StoreRecord *r = (struct StoreRecord *)(st->base + off);
+    r->type = (uint16_t)type;
+    r->table = (uint16_t)table;
+    r->total = (uint32_t)total;
+    r->code_len = (uint16_t)code_len;
+    r->reserved = 0;
+    r->data_len = (uint32_t)data_len;
+    r->raw_len = (uint32_t)raw_len;
+    memcpy(r + 1, code, code_len);
+    memcpy((unsigned char *)(r + 1) + code_len, data, data_len);
+    __atomic_store_n(&r->magic, STORE_REC_MAGIC, __ATOMIC_RELEASE);
+    __atomic_store_n(&st->tail, off + total, __ATOMIC_RELEASE);
+    ec_notify(&st->appended);
+    return off;
+}
+// Writer only: trains the first symbol table on the collected raw
+// URLs and appends it to the log.
+static void store_train_table(struct Store *st) {
+    struct SymbolTable *t = malloc(sizeof(*t));
+    unsigned char buf[1 + SYM_MAX + SYM_MAX * SYM_MAX_LEN];
+    if (!t || symtab_train(t, st->train, st->ntrain) != 0) {
+        free(t);
+        return;
+    }
+    size_t len = symtab_serialize(t, buf);
+    unsigned id = st->ntables + 1;
+    if (!store_append(st, STORE_REC_SYMBOLS, id, "", 0, buf, len, len)) {
+        free(t);
+        return;
+    }
+    __atomic_store_n(&st->tables[id], t, __ATOMIC_RELEASE);
+    __atomic_store_n(&st->ntables, id, __ATOMIC_RELEASE);
+    for (size_t i = 0; i < st->ntrain; i++) free(st->train[i]);
+    free(st->train);
+    st->train = NULL;
+    st->ntrain = 0;
+}
+// Writer only: bookkeeping shared by new and replayed LINK records.
+static int store_note_link(struct Store *st, uint64_t off) {
+    const struct StoreRecord *r = store_record(st, off);
+    int compiled = st->mph.map && off < st->mph.header->covered; // Found through store.mph
+    if (!compiled && store_index_add(st, hash_bytes(store_record_code(r), r->code_len), off) != 0) return -1;
+    st->links++;
+    st->url_bytes += r->raw_len;
+    st->stored_bytes += r->data_len;
+    if (st->ntables == 0 && r->table == 0 && st->ntrain < STORE_TRAIN_AFTER) {
+        char *url = malloc(r->data_len + 1);
+        char **grown = realloc(st->train, (st->ntrain + 1) * sizeof(char *));
+        if (!grown || !url) {
+            free(url);
+            return 0; // Training is best effort
+        }
+        st->train = grown;
+        memcpy(url, store_record_data(r), r->data_len);
+        url[r->data_len] = 0;
+        st->train[st->ntrain++] = url;
+    }
+    return 0;
+}
+// ============================================================
+// FUNCTION: store_put()
+// ------------------------------------------------------------
+// Adds code -> url, encoding the URL with the newest symbol
+// table. Takes the write lock.
+// RETURNS:
+// 0 on success, 1 if code is already taken, -1 on failure.
+// ============================================================
+static int store_put(struct Store *st, const char *code, const char *url) {
+    size_t code_len = strlen(code), url_len = strlen(url);
+    unsigned char *enc = NULL;
+    int rc = -1;
+    if (st->replica || !store_url_safe(url, url_len) || code_len == 0 || code_len > STORE_MAX_CODE || url_len == 0 ||
+        url_len >= STORE_MAX_URL)
+        return -1;
+    pthread_mutex_lock(&st->write_lock);
+    if (store_find(st, code, code_len)) {
+        rc = 1;
+    } else {
+        unsigned table = st->ntables;
+        const void *data = url;
+        size_t data_len = url_len;
+        if (table && (enc = malloc(2 * url_len)) != NULL) {
+            data_len = symtab_encode(st->tables[table], (const unsigned char *)url, url_len, enc);
+            data = enc;
+        } else {
+            table = 0;
+        }
+        uint64_t off = store_append(st, STORE_REC_LINK, table, code, code_len, data, data_len, url_len);
+        if (off && store_note_link(st, off) == 0) rc = 0;
+        if (st->ntables == 0 && st->ntrain == STORE_TRAIN_AFTER) store_train_table(st);
+    }
+    pthread_mutex_unlock(&st->write_lock);
+    free(enc);
+    return rc;
+}
+// Fills code (STORE_CODE_LEN chars + NUL) with random base62.
+#define STORE_CODE_LEN 7
+static void store_random_code(char *code) {
+    static const char alphabet[] = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+    for (int i = 0; i < STORE_CODE_LEN; i++) code[i] = alphabet[(size_t)(rng_unit() * 62.0) % 62];
+    code[STORE_CODE_LEN] = 0;
+}
+// Creates a link under a fresh random code; with a ring, only codes
+// that node self owns are drawn.
+// RETURNS: 0 and the code in code_out, or -1.
+static int store_create_link(struct Store *st, const char *url, const struct HashRing *ring, unsigned self,
+                             char *code_out) {
+    for (int attempt = 0; attempt < 16; attempt++) {
+        do store_random_code(code_out);
+        while (ring && hash_ring_owner(ring, code_out, STORE_CODE_LEN) != self);
+        int rc = store_put(st, code_out, url);
+        if (rc <= 0) return rc;
+    }
+    return -1;
+}
+// Checks that a whole record starts at off, below end.
+static int store_record_valid(const struct Store *st, uint64_t off, uint64_t end) {
+    if (off + sizeof(struct StoreRecord) > end) return 0;
+    const struct StoreRecord *r = store_record(st, off);
+    return r->magic == STORE_REC_MAGIC && r->total >= sizeof(*r) && r->total % 8 == 0 && off + r->total <= end &&
+           sizeof(*r) + r->code_len + r->data_len <= r->total;
+}
+// Writer only: makes the record at off visible to lookups.
+// RETURNS: 0, 1 if the record is unusable (treated as the end of
+// the log), or -1 when out of memory.
+static int store_load_record(struct Store *st, uint64_t off) {
+    const struct StoreRecord *r = store_record(st, off);
+    if (r->type == STORE_REC_SYMBOLS) {
+        if (r->table != st->ntables + 1 || r->table > STORE_MAX_TABLES) return 1;
+        struct SymbolTable *t = malloc(sizeof(*t));
+        if (!t) return -1;
+        if (symtab_deserialize(t, store_record_data(r), r->data_len) != 0) {
+            free(t);
+            return 1;
+        }
+        __atomic_store_n(&st->tables[r->table], t, __ATOMIC_RELEASE);
+        __atomic_store_n(&st->ntables, r->table, __ATOMIC_RELEASE);
+        for (size_t i = 0; i < st->ntrain; i++) free(st->train[i]);
+        free(st->train);
+        st->train = NULL;
+        st->ntrain = 0;
+        return 0;
+    }
+    if (r->type == STORE_REC_LINK) {
+        if (r->table > st->ntables || r->code_len == 0) return 1;
+        return store_note_link(st, off);
+    }
+    return 0; // Unknown types are skipped
+}
+// Replays the log into the index and symbol tables. Stops at the
+// first record that is torn or foreign; that becomes the tail.
+static int store_replay(struct Store *st) {
+    uint64_t off = STORE_HEADER_SIZE;
+    while (store_record_valid(st, off, st->file_size)) {
+        int rc = store_load_record(st, off);
+        if (rc < 0) return -1;
+        if (rc > 0) break;
+        off += store_record(st, off)->total;
+    }
+    st->tail = off;
+    return 0;
+}
+// ============================================================
+// FUNCTION: store_apply()
+// ------------------------------------------------------------
+// Follower side of replication: appends log bytes fetched from the
+// leader, which must start at this store's tail (offset 0 = the
+// leader's whole log, accepted only while this one is empty).
+// Each record is copied with its magic written last and indexed
+// before the tail moves past it, so lock-free readers never see a
+// partial record.
+// RETURNS:
+// The new tail, or 0 if the bytes do not continue this log.
+// ============================================================
+static uint64_t store_apply(struct Store *st, uint64_t from, const unsigned char *data, size_t len) {
+    uint64_t tail;
+    pthread_mutex_lock(&st->write_lock);
+    if (from == 0 && st->tail == STORE_HEADER_SIZE && st->links == 0 && st->ntables == 0 &&
+        len >= STORE_HEADER_SIZE && memcmp(data, STORE_MAGIC, 8) == 0) {
+        memcpy(st->base + 8, data + 8, STORE_HEADER_SIZE - 8); // Adopt the leader's log id
+        memcpy(&st->log_id, data + 8, sizeof(st->log_id));
+        data += STORE_HEADER_SIZE;
+        len -= STORE_HEADER_SIZE;
+        from = STORE_HEADER_SIZE;
+    }
+    int ok = from == st->tail && from >= STORE_HEADER_SIZE && store_grow(st, from + len) == 0;
+    for (size_t pos = 0; ok && pos < len;) {
+        const struct StoreRecord *in = (const struct StoreRecord *)(data + pos);
+        uint64_t off = st->tail;
+        ok = len - pos >= sizeof(*in) && in->magic == STORE_REC_MAGIC && in->total >= sizeof(*in) &&
+             in->total % 8 == 0 && in->total <= len - pos && sizeof(*in) + in->code_len + in->data_len <= in->total;
+        if (!ok) break;
+        memcpy(st->base + off + sizeof(uint32_t), data + pos + sizeof(uint32_t), in->total - sizeof(uint32_t));
+        __atomic_store_n((uint32_t *)(st->base + off), STORE_REC_MAGIC, __ATOMIC_RELEASE);
+        if (store_load_record(st, off) != 0) {
+            __atomic_store_n((uint32_t *)(st->base + off), 0, __ATOMIC_RELAXED);
+            ok = 0;
+            break;
+        }
+        pos += in->total;
+        __atomic_store_n(&st->tail, off + in->total, __ATOMIC_RELEASE);
+    }
+    tail = ok ? st->tail : 0;
+    pthread_mutex_unlock(&st->write_lock);
+    if (tail) ec_notify(&st->appended);
+    return tail;
+}
+static void store_close(struct Store *st) {
+    msync(st->base, st->tail, MS_SYNC);
+    munmap(st->base, STORE_RESERVE);
+    close(st->fd);
+    store_index_free(st->index);
+    mph_file_close(&st->mph);
+    while (st->retired) {
+        struct StoreIndex *ix = st->retired;
+        st->retired = ix->retired_next;
+        store_index_free(ix);
+    }
+    for (unsigned i = 1; i <= st->ntables; i++) free(st->tables[i]);
+    for (size_t i = 0; i < st->ntrain; i++) free(st->train[i]);
+    free(st->train);
+    pthread_mutex_destroy(&st->write_lock);
+    ec_destroy(&st->appended);
+}
+// ============================================================
+// FUNCTION: store_open()
+// ------------------------------------------------------------
+// Opens (creating if needed) <dir>/store.log and rebuilds the
+// index from it.
+// PARAMETERS:
+// replica - 1 for a follower, which never writes records itself
+// RETURNS:
+// 0 on success, -1 on failure (details on stderr).
+// ============================================================
+static int store_open(struct Store *st, const char *dir, int replica) {
+    char path[4200];
+    struct stat sb;
+    memset(st, 0, sizeof(*st));
+    st->fd = -1;
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Error: Cannot create store directory '%s'\n", dir);
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/store.log", dir);
+    st->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (st->fd < 0 || fstat(st->fd, &sb) != 0) {
+        fprintf(stderr, "Error: Cannot open store '%s'\n", path);
+        if (st->fd >= 0) close(st->fd);
+        return -1;
+    }
+    if (flock(st->fd, LOCK_EX | LOCK_NB) != 0) { // One writer per store
+        fprintf(stderr, "Error: Store '%s' is in use by another process\n", path);
+        close(st->fd);
+        return -1;
+    }
+    st->file_size = (size_t)sb.st_size;
+    if (st->file_size < STORE_HEADER_SIZE) {
+        char header[STORE_HEADER_SIZE] = STORE_MAGIC;
+        uint64_t id = now_ns() ^ ((uint64_t)getpid() << 32);
+        id ^= (uint64_t)(rng_unit() * 18446744073709551615.0);
+        memcpy(header + 8, &id, sizeof(id));
+        if (pwrite(st->fd, header, sizeof(header), 0) != (ssize_t)sizeof(header)) {
+            close(st->fd);
+            return -1;
+        }
+        st->file_size = STORE_HEADER_SIZE;
+    }
+    st->base = mmap(NULL, STORE_RESERVE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, st->fd, 0);
+    if (st->base == MAP_FAILED || memcmp(st->base, STORE_MAGIC, 8) != 0) {
+        fprintf(stderr, "Error: '%s' is not a cipher store\n", path);
+        if (st->base != MAP_FAILED) munmap(st->base, STORE_RESERVE);
+        close(st->fd);
+        return -1;
+    }
+    memcpy(&st->log_id, st->base + 8, sizeof(st->log_id));
+    st->replica = replica;
+    pthread_mutex_init(&st->write_lock, NULL);
+    ec_init(&st->appended);
+    snprintf(path, sizeof(path), "%s/store.mph", dir);
+    if (mph_file_open(&st->mph, path) == 0 &&
+        (st->mph.header->owner != st->log_id || st->mph.header->covered > st->file_size)) {
+        fprintf(stderr, "Warning: Ignoring '%s', compiled from another store.log\n", path);
+        mph_file_close(&st->mph);
+    }
+    snprintf(path, sizeof(path), "%s/store.log", dir);
+    st->index = store_index_new(1024);
+    if (!st->index || store_replay(st) != 0) {
+        fprintf(stderr, "Error: Out of memory loading store '%s'\n", path);
+        store_close(st); // Unmaps, closes and so unlocks the log
+        return -1;
+    }
+    if (st->mph.map && st->tail < st->mph.header->covered) {
+        fprintf(stderr, "Error: '%s' ends before the part store.mph covers; remove store.mph\n", path);
+        store_close(st);
+        return -1;
+    }
+    // Replay only collects samples; train now if a run stopped
+    // between the last raw link and appending the table
+    if (!replica && st->ntables == 0 && st->ntrain == STORE_TRAIN_AFTER) store_train_table(st);
+    return 0;
+}
+// Prints entry counts and bytes per URL before/after encoding.
+static void store_print_stats(const struct Store *st, FILE *out) {
+    double n = st->links ? (double)st->links : 1.0;
+    fprintf(out, "[store] links=%llu symbol_tables=%u log_bytes=%llu\n", (unsigned long long)st->links,
+            st->ntables, (unsigned long long)st->tail);
+    fprintf(out, "[store] url_bytes_per_link raw=%.1f stored=%.1f (%.1f%%) record_bytes_per_link=%.1f\n",
+            (double)st->url_bytes / n, (double)st->stored_bytes / n,
+            st->url_bytes ? 100.0 * (double)st->stored_bytes / (double)st->url_bytes : 100.0,
+            (double)(st->tail - STORE_HEADER_SIZE) / n);
+    if (st->mph.map)
+        fprintf(out, "[store] compiled_links=%llu covered_bytes=%llu index_bits_per_link=%.2f "
+                "file_bytes_per_compiled_link=%.2f\n", (unsigned long long)st->mph.mph.nkeys,
+                (unsigned long long)st->mph.header->covered,
+                8.0 * (double)mph_index_bytes(&st->mph.mph) / (double)st->mph.mph.nkeys,
+                (double)st->mph.size / (double)st->mph.mph.nkeys);
+}
+// ============================================================
+// SERVER: HTTP front end of the self-hosted shortener
+// ------------------------------------------------------------
+// --serve answers these requests over HTTP/1.1 with keep-alive:
+//
+//   GET /api-create.php?url=<encoded url>  -> 200, body "http://<host>/<code>"
+//   GET|HEAD /<code>                       -> 301, Location: <url>
+//   GET /_snapshot                         -> the store log up to its tail
+//   GET /_repl?from=<off>&id=<log id>      -> log bytes past off (long poll)
+//
+// The first mirrors the TinyURL API, so "-s" can point at a cipher
+// server through CIPHER_SHORTEN_API. One dispatcher thread accepts
+// connections and poll()s the idle ones; a connection with input is
+// handed through the `ready` ring to a fixed pool of workers, which
+// answer every complete request it holds and park it back. Idle
+// keep-alive clients therefore cost a pollfd, not a worker. Lookups
+// never take a lock.
+// ============================================================
+#include <ctype.h> // For isxdigit() in url_decode()
+#include <strings.h> // For strncasecmp() on header names
+#include <sys/socket.h> // For socket(), accept(), send()
+#include <netinet/in.h> // For struct sockaddr_in
+#include <arpa/inet.h> // For inet_pton()
+#include <poll.h> // For poll() on idle keep-alive connections
+#define SERVER_BUF 16384
+#define SERVER_IDLE_MS 30000
+#define SERVER_MAX_CONNS 4096 // Open connections; accepting pauses beyond
+#define REPL_CHUNK (4u << 20) // Max log bytes per /_repl response
+#define REPL_MAX_WAIT 60 // Max seconds a /_repl request may wait
+struct ServerConn {
+    int fd; // Non-blocking
+    size_t used; // Buffered request bytes
+    int64_t idle_since; // now_ns() when parked
+    char buf[SERVER_BUF + 1];
+};
+struct Server {
+    int listen_fd;
+    int stopping; // Atomic; set once on SIGINT/SIGTERM
+    struct Store *store;
+    const struct HashRing *ring; // NULL unless --cluster
+    unsigned self; // This node's index in ring
+    size_t nthreads;
+    struct Ring ready; // Dispatcher -> workers: connections with input
+    struct EventCount ready_ec;
+    struct Ring parked; // Workers -> dispatcher: connections to watch
+    int wake[2]; // Pipe that wakes the dispatcher's poll()
+    unsigned long_polls; // Atomic: workers waiting in /_repl
+    unsigned conns; // Atomic: open connections
+    uint64_t requests; // Atomic counters
+    uint64_t redirects;
+    uint64_t created;
+    uint64_t not_found;
+    uint64_t repl_bytes; // Log bytes sent by /_snapshot and /_repl
+};
+// Decodes %XX escapes and '+' in place. RETURNS: decoded length.
+static size_t url_decode(char *s) {
+    char *out = s;
+    for (char *p = s; *p; p++) {
+        if (*p == '%' && isxdigit((unsigned char)p[1]) && isxdigit((unsigned char)p[2])) {
+            char hex[3] = {p[1], p[2], 0};
+            *out++ = (char)strtol(hex, NULL, 16);
+            p += 2;
+        } else {
+            *out++ = *p == '+' ? ' ' : *p;
+        }
+    }
+    *out = 0;
+    return (size_t)(out - s);
+}
+// PARAMETERS: more - 1 if more data follows at once (MSG_MORE)
+static int send_all(int fd, const char *data, size_t len, int more) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) { // Socket buffer full
+            struct pollfd pfd = {fd, POLLOUT, 0};
+            if (poll(&pfd, 1, SERVER_IDLE_MS) > 0) continue;
+            return -1;
+        }
+        if (n <= 0) return -1;
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+// Writes one response in a single send() (a separate body write
+// would wait out Nagle's algorithm on keep-alive connections);
+// location may be NULL. RETURNS: 0 or -1.
+static int server_reply(int fd, int status, const char *reason, const char *location, const char *body,
+                        int head_only, int keep_alive) {
+    char reply[STORE_MAX_URL + 1024];
+    size_t body_len = strlen(body);
+    int n = snprintf(reply, sizeof(reply),
+                     "HTTP/1.1 %d %s\r\n%s%s%sContent-Type: text/plain\r\nContent-Length: %zu\r\n"
+                     "Connection: %s\r\n\r\n%s",
+                     status, reason, location ? "Location: " : "", location ? location : "", location ? "\r\n" : "",
+                     body_len, keep_alive ? "keep-alive" : "close", head_only ? "" : body);
+    if (n < 0 || (size_t)n >= sizeof(reply)) return -1;
+    return send_all(fd, reply, (size_t)n, 0);
+}
+// Returns the value of query parameter name in target (it ends at
+// the next '&'), or NULL.
+static const char *query_param(const char *target, const char *name) {
+    size_t len = strlen(name);
+    for (const char *p = strchr(target, '?'); p; p = strchr(p + 1, '&'))
+        if (!strncmp(p + 1, name, len) && p[1 + len] == '=') return p + 2 + len;
+    return NULL;
+}
+// Custom codes (?alias=) are 1..STORE_MAX_CODE of [A-Za-z0-9_-].
+static int server_code_valid(const char *code, size_t len) {
+    if (len == 0 || len > STORE_MAX_CODE) return 0;
+    for (size_t i = 0; i < len; i++)
+        if (!isalnum((unsigned char)code[i]) && code[i] != '-' && code[i] != '_') return 0;
+    return 1;
+}
+// ============================================================
+// FUNCTION: server_log_stream()
+// ------------------------------------------------------------
+// Serves /_snapshot (from = 0, up to the tail seen on entry) and
+// /_repl (from = the follower's tail, at most REPL_CHUNK bytes).
+// Log bytes below the tail never change, so both are sent straight
+// from the mapping without locks. A /_repl already at the tail
+// waits up to wait= seconds for appends, so followers learn about
+// new links without polling. Headers X-Cipher-Log-Id and
+// X-Cipher-Log-End describe the bytes sent.
+// RETURNS:
+// 0 to keep the connection, -1 to close it.
+// ============================================================
+static int server_log_stream(struct Server *srv, int fd, const char *target, int snapshot, int head_only,
+                             int keep_alive) {
+    struct Store *st = srv->store;
+    const char *from_arg = query_param(target, "from"), *id_arg = query_param(target, "id");
+    const char *wait_arg = query_param(target, "wait");
+    uint64_t from = snapshot || !from_arg ? 0 : strtoull(from_arg, NULL, 10);
+    uint64_t tail = __atomic_load_n(&st->tail, __ATOMIC_ACQUIRE);
+    if (from != 0 && (!id_arg || strtoull(id_arg, NULL, 16) != st->log_id || from < STORE_HEADER_SIZE ||
+                      from > tail || (from < tail && !store_record_valid(st, from, tail))))
+        return server_reply(fd, 409, "Conflict", NULL, "Error: offset is not part of this log\n", head_only,
+                            keep_alive);
+    long wait = wait_arg ? strtol(wait_arg, NULL, 10) : 0;
+    unsigned max_polls = srv->nthreads > 2 ? (unsigned)(srv->nthreads / 2) : 1;
+    if (!snapshot && from == tail && wait > 0 &&
+        __atomic_add_fetch(&srv->long_polls, 1, __ATOMIC_RELAXED) > max_polls) {
+        // A waiting /_repl holds a worker: keep half of them for redirects
+        __atomic_sub_fetch(&srv->long_polls, 1, __ATOMIC_RELAXED);
+        return server_reply(fd, 503, "Service Unavailable", NULL, "Error: too many followers waiting\n", head_only,
+                            keep_alive);
+    }
+    if (!snapshot && from == tail && wait > 0) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += wait < REPL_MAX_WAIT ? wait : REPL_MAX_WAIT;
+        for (;;) {
+            unsigned key = ec_prepare(&st->appended);
+            struct timespec now;
+            clock_gettime(CLOCK_REALTIME, &now);
+            if (__atomic_load_n(&st->tail, __ATOMIC_ACQUIRE) != from ||
+                __atomic_load_n(&srv->stopping, __ATOMIC_SEQ_CST) || now.tv_sec > deadline.tv_sec ||
+                (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec)) {
+                ec_cancel(&st->appended);
+                break;
+            }
+            ec_wait_until(&st->appended, key, &deadline);
+        }
+        __atomic_sub_fetch(&srv->long_polls, 1, __ATOMIC_RELAXED);
+        tail = __atomic_load_n(&st->tail, __ATOMIC_ACQUIRE);
+    }
+    uint64_t end = snapshot || tail - from <= REPL_CHUNK ? tail : from + REPL_CHUNK;
+    // A chunk ends on a record boundary: walk forward from from
+    if (end != tail) {
+        uint64_t off = from ? from : STORE_HEADER_SIZE;
+        while (off + store_record(st, off)->total <= end) off += store_record(st, off)->total;
+        end = off;
+    }
+    char header[512];
+    int n = snprintf(header, sizeof(header),
+                     "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nContent-Length: %llu\r\n"
+                     "X-Cipher-Log-Id: %016llx\r\nX-Cipher-Log-End: %llu\r\nConnection: %s\r\n\r\n",
+                     (unsigned long long)(end - from), (unsigned long long)st->log_id, (unsigned long long)end,
+                     keep_alive ? "keep-alive" : "close");
+    if (send_all(fd, header, (size_t)n, !head_only && end > from) != 0) return -1;
+    if (head_only) return 0;
+    __atomic_add_fetch(&srv->repl_bytes, end - from, __ATOMIC_RELAXED);
+    return send_all(fd, (const char *)st->base + from, end - from, 0);
+}
+// ============================================================
+// FUNCTION: server_handle()
+// ------------------------------------------------------------
+// Routes one parsed request and writes the response.
+// PARAMETERS:
+// target - request target, modified in place (query decoding)
+// host - value of the Host header ("" if absent)
+// RETURNS:
+// 0 to keep the connection, -1 to close it.
+// ============================================================
+static int server_handle(struct Server *srv, int fd, const char *method, char *target, const char *host,
+                         int keep_alive) {
+    int head_only = !strcmp(method, "HEAD");
+    __atomic_add_fetch(&srv->requests, 1, __ATOMIC_RELAXED);
+    if (!head_only && strcmp(method, "GET") != 0) {
+        server_reply(fd, 405, "Method Not Allowed", NULL, "Method not allowed\n", 0, 0);
+        return -1;
+    }
+    if (!strcmp(target, "/_snapshot") || !strncmp(target, "/_repl?", 7))
+        return server_log_stream(srv, fd, target, target[2] == 's', head_only, keep_alive);
+    if (!strncmp(target, "/api-create.php?", 16) && srv->store->replica)
+        return server_reply(fd, 403, "Forbidden", NULL, "Error: read-only replica\n", head_only, keep_alive);
+    if (!strncmp(target, "/api-create.php?", 16)) {
+        char *url = strstr(target + 15, "url=");
+        const char *alias = query_param(target, "alias");
+        char code[STORE_MAX_CODE + 1], body[512];
+        size_t alias_len = alias ? strcspn(alias, "&") : 0;
+        while (url && url[-1] != '?' && url[-1] != '&') url = strstr(url + 4, "url=");
+        if (!url) return server_reply(fd, 400, "Bad Request", NULL, "Error: missing url\n", head_only, keep_alive);
+        if (alias && !server_code_valid(alias, alias_len))
+            return server_reply(fd, 400, "Bad Request", NULL, "Error: alias must be 1-64 of [A-Za-z0-9_-]\n",
+                                head_only, keep_alive);
+        if (alias) {
+            memcpy(code, alias, alias_len);
+            code[alias_len] = 0;
+        }
+        url += 4;
+        url[strcspn(url, "&")] = 0;
+        size_t url_len = url_decode(url);
+        if (strncmp(url, "http://", 7) != 0 && strncmp(url, "https://", 8) != 0)
+            return server_reply(fd, 400, "Bad Request", NULL, "Error: url must be http(s)\n", head_only, keep_alive);
+        if (!store_url_safe(url, url_len) || strlen(url) != url_len) // Control bytes or an encoded NUL
+            return server_reply(fd, 400, "Bad Request", NULL, "Error: url contains control characters\n",
+                                head_only, keep_alive);
+        if (alias && srv->ring && hash_ring_owner(srv->ring, code, alias_len) != srv->self) {
+            snprintf(body, sizeof(body), "Error: alias belongs to %s\n",
+                     srv->ring->nodes[hash_ring_owner(srv->ring, code, alias_len)]);
+            return server_reply(fd, 421, "Misdirected Request", NULL, body, head_only, keep_alive);
+        }
+        if (alias) {
+            char taken[STORE_MAX_URL];
+            int rc = store_put(srv->store, code, url);
+            // Re-adding the same link is fine (resharding copies may be retried)
+            if (rc == 1 && (store_get_url(srv->store, code, alias_len, taken, sizeof(taken)) < 0 ||
+                            strcmp(taken, url) != 0))
+                return server_reply(fd, 409, "Conflict", NULL, "Error: alias already taken\n", head_only,
+                                    keep_alive);
+            if (rc < 0)
+                return server_reply(fd, 500, "Internal Server Error", NULL, "Error: could not store link\n",
+                                    head_only, keep_alive);
+        } else if (store_create_link(srv->store, url, srv->ring, srv->self, code) != 0) {
+            return server_reply(fd, 500, "Internal Server Error", NULL, "Error: could not store link\n", head_only,
+                                keep_alive);
+        }
+        __atomic_add_fetch(&srv->created, 1, __ATOMIC_RELAXED);
+        snprintf(body, sizeof(body), "http://%s/%s", *host ? host : "localhost", code);
+        return server_reply(fd, 200, "OK", NULL, body, head_only, keep_alive);
+    }
+    char url[STORE_MAX_URL];
+    const char *code = target + 1;
+    size_t code_len = strcspn(code, "?#");
+    unsigned owner = srv->ring && code_len > 0 ? hash_ring_owner(srv->ring, code, code_len) : srv->self;
+    if (owner != srv->self && store_url_safe(target, strlen(target))) { // Another partition's code
+        snprintf(url, sizeof(url), "%s%s", srv->ring->nodes[owner], target);
+        return server_reply(fd, 307, "Temporary Redirect", url, "", head_only, keep_alive);
+    }
+    if (owner == srv->self && code_len > 0 && store_get_url(srv->store, code, code_len, url, sizeof(url)) >= 0) {
+        __atomic_add_fetch(&srv->redirects, 1, __ATOMIC_RELAXED);
+        return server_reply(fd, 301, "Moved Permanently", url, "", head_only, keep_alive);
+    }
+    __atomic_add_fetch(&srv->not_found, 1, __ATOMIC_RELAXED);
+    return server_reply(fd, 404, "Not Found", NULL, "Not found\n", head_only, keep_alive);
+}
+struct ServerRequest {
+    char *method;
+    char *target;
+    const char *host; // "" if absent
+    int keep_alive;
+};
+// Splits the request head buf (end points at its "\r\n\r\n") in
+// place. RETURNS: 0, or -1 on a malformed request line.
+static int server_parse_request(char *buf, char *end, struct ServerRequest *req) {
+    *end = 0;
+    // Request line: METHOD SP target SP version
+    char *version, *line_end = strstr(buf, "\r\n");
+    if (line_end) *line_end = 0;
+    req->method = buf;
+    req->target = strchr(buf, ' ');
+    version = req->target ? strchr(req->target + 1, ' ') : NULL;
+    if (!req->target || !version || req->target[1] != '/') return -1;
+    *req->target++ = 0;
+    *version++ = 0;
+    req->keep_alive = strcmp(version, "HTTP/1.0") != 0;
+    req->host = "";
+    for (char *h = line_end ? line_end + 2 : end; h < end;) {
+        char *next = strstr(h, "\r\n");
+        if (next) *next = 0;
+        if (!strncasecmp(h, "Host:", 5)) {
+            req->host = h + 5;
+            while (*req->host == ' ' || *req->host == '\t') req->host++;
+        } else if (!strncasecmp(h, "Connection:", 11)) {
+            if (strcasestr(h + 11, "close")) req->keep_alive = 0;
+            else if (strcasestr(h + 11, "keep-alive")) req->keep_alive = 1;
+        }
+        if (!next) break;
+        h = next + 2;
+    }
+    return 0;
+}
+// ============================================================
+// FUNCTION: server_connection()
+// ------------------------------------------------------------
+// Worker side: answers every complete request buffered or readable
+// on c without blocking for more input.
+// RETURNS:
+// 1 to park the connection until it has input again, 0 to close it.
+// ============================================================
+static int server_connection(struct Server *srv, struct ServerConn *c) {
+    char *buf = c->buf;
+    int fd = c->fd;
+    for (;;) {
+        char *end;
+        buf[c->used] = 0;
+        while ((end = strstr(buf, "\r\n\r\n")) == NULL) {
+            if (c->used == SERVER_BUF) {
+                server_reply(fd, 431, "Request Header Fields Too Large", NULL, "", 0, 0);
+                return 0;
+            }
+            ssize_t n = recv(fd, buf + c->used, SERVER_BUF - c->used, 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return !__atomic_load_n(&srv->stopping, __ATOMIC_SEQ_CST);
+            if (n <= 0) return 0;
+            c->used += (size_t)n;
+            buf[c->used] = 0;
+        }
+        TRACE_BEGIN(parse_t);
+        struct ServerRequest req;
+        size_t consumed = (size_t)(end + 4 - buf);
+        if (server_parse_request(buf, end, &req) != 0) {
+            server_reply(fd, 400, "Bad Request", NULL, "Bad request\n", 0, 0);
+            return 0;
+        }
+        int keep_alive = req.keep_alive && !__atomic_load_n(&srv->stopping, __ATOMIC_SEQ_CST); // Drain on shutdown
+        TRACE_END(parse_t, "parse");
+        TRACE_BEGIN(handle_t);
+        int handled = server_handle(srv, fd, req.method, req.target, req.host, keep_alive);
+        TRACE_END(handle_t, "request");
+        if (handled != 0 || !keep_alive) return 0;
+        // Keep pipelined bytes that followed this request
+        memmove(buf, buf + consumed, c->used - consumed);
+        c->used -= consumed;
+    }
+}
+static void server_conn_close(struct Server *srv, struct ServerConn *c) {
+    close(c->fd);
+    free(c);
+    __atomic_sub_fetch(&srv->conns, 1, __ATOMIC_RELAXED);
+}
+// Worker: serves connections handed over by the dispatcher.
+static void *server_main(void *arg) {
+    struct Server *srv = arg;
+    numa_pin_self();
+    for (;;) {
+        struct ServerConn *c = ring_try_pop(&srv->ready);
+        if (!c) {
+            unsigned key = ec_prepare(&srv->ready_ec);
+            if ((c = ring_try_pop(&srv->ready)) == NULL) {
+                if (__atomic_load_n(&srv->stopping, __ATOMIC_SEQ_CST)) {
+                    ec_cancel(&srv->ready_ec);
+                    break;
+                }
+                ec_wait(&srv->ready_ec, key);
+                continue;
+            }
+            ec_cancel(&srv->ready_ec);
+        }
+        if (!server_connection(srv, c)) {
+            server_conn_close(srv, c);
+            continue;
+        }
+        c->idle_since = now_ns();
+        ring_try_push(&srv->parked, c); // Sized for every connection: cannot fail
+        char wake = 1;
+        if (write(srv->wake[1], &wake, 1) < 0) {} // Pipe full: a wake-up is already pending
+    }
+    return NULL;
+}
+// ============================================================
+// FUNCTION: server_dispatch_main()
+// ------------------------------------------------------------
+// Dispatcher: accepts connections, watches idle ones with poll()
+// and hands those with input (or a hang-up) to the workers.
+// Connections idle for SERVER_IDLE_MS are closed; on shutdown all
+// idle ones are.
+// ============================================================
+static void *server_dispatch_main(void *arg) {
+    struct Server *srv = arg;
+    struct pollfd *pfds = calloc(SERVER_MAX_CONNS + 2, sizeof(*pfds));
+    struct ServerConn **idle = calloc(SERVER_MAX_CONNS, sizeof(*idle));
+    size_t nidle = 0;
+    if (!pfds || !idle) {
+        free(pfds);
+        free(idle);
+        return NULL;
+    }
+    while (!__atomic_load_n(&srv->stopping, __ATOMIC_SEQ_CST)) {
+        struct ServerConn *c;
+        while ((c = ring_try_pop(&srv->parked)) != NULL) idle[nidle++] = c;
+        pfds[0].fd = srv->wake[0];
+        pfds[0].events = POLLIN;
+        int accepting = __atomic_load_n(&srv->conns, __ATOMIC_RELAXED) < SERVER_MAX_CONNS;
+        pfds[1].fd = accepting ? srv->listen_fd : -1; // At the cap: stop accepting
+        pfds[1].events = POLLIN;
+        for (size_t i = 0; i < nidle; i++) {
+            pfds[i + 2].fd = idle[i]->fd;
+            pfds[i + 2].events = POLLIN;
+        }
+        if (poll(pfds, nidle + 2, 500) < 0 && errno != EINTR) break;
+        if (pfds[0].revents & POLLIN) {
+            char drain[256];
+            while (read(srv->wake[0], drain, sizeof(drain)) > 0) {}
+        }
+        // Hand over ready connections, expire idle ones, compact the rest
+        int64_t now = now_ns();
+        size_t kept = 0;
+        for (size_t i = 0; i < nidle; i++) {
+            c = idle[i];
+            if (pfds[i + 2].revents) {
+                ring_try_push(&srv->ready, c);
+                ec_notify(&srv->ready_ec);
+            } else if (now - c->idle_since > (int64_t)SERVER_IDLE_MS * 1000000) {
+                server_conn_close(srv, c);
+            } else {
+                idle[kept++] = c;
+            }
+        }
+        nidle = kept;
+        while (accepting && (pfds[1].revents & POLLIN) &&
+               __atomic_load_n(&srv->conns, __ATOMIC_RELAXED) < SERVER_MAX_CONNS) {
+            int fd = accept4(srv->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) break;
+            if ((c = malloc(sizeof(*c))) == NULL) {
+                close(fd);
+                break;
+            }
+            c->fd = fd;
+            c->used = 0;
+            c->idle_since = now;
+            idle[nidle++] = c;
+            __atomic_add_fetch(&srv->conns, 1, __ATOMIC_RELAXED);
+        }
+    }
+    for (size_t i = 0; i < nidle; i++) server_conn_close(srv, idle[i]);
+    free(pfds);
+    free(idle);
+    return NULL;
+}
+// ============================================================
+// REPLICATION: follower side
+// ------------------------------------------------------------
+// "--serve ... --follow <leader url>" runs a read-only replica. One
+// thread long-polls the leader's /_repl from the local tail and
+// hands the bytes to store_apply(); redirects keep being served
+// from the lock-free index the whole time. A new replica starts at
+// offset 0 and so receives the leader's full log (the snapshot).
+// Followers can themselves be followed, since their logs are
+// byte-identical to the leader's.
+// ============================================================
+#define REPL_WAIT 20 // Seconds each /_repl request may wait
+struct Follower {
+    struct Store *store;
+    const char *leader; // Base URL, e.g. http://10.0.0.1:8080
+    int stop; // Atomic
+    uint64_t fetches;
+    uint64_t applied_bytes;
+    uint64_t errors;
+    pthread_t thread;
+};
+// curl progress callback: aborts the transfer once stop is set.
+static int follower_progress(void *arg, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal,
+                             curl_off_t ulnow) {
+    (void)dltotal;
+    (void)dlnow;
+    (void)ultotal;
+    (void)ulnow;
+    return __atomic_load_n(&((struct Follower *)arg)->stop, __ATOMIC_SEQ_CST);
+}
+static void *follower_main(void *arg) {
+    struct Follower *f = arg;
+    struct Store *st = f->store;
+    CURL *curl = curl_easy_init();
+    char url[1200];
+    int failing = 0, synced = 0;
+    if (!curl) return NULL;
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, (long)REPL_WAIT + 30L);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 5L);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, follower_progress);
+    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, f);
+    while (!__atomic_load_n(&f->stop, __ATOMIC_SEQ_CST)) {
+        // An empty replica first asks for everything, header included
+        uint64_t from = !synced && st->links == 0 && st->ntables == 0 && st->tail == STORE_HEADER_SIZE ? 0 : st->tail;
+        struct Response body = { .data = NULL, .size = 0 };
+        long status = 0;
+        snprintf(url, sizeof(url), "%s/_repl?from=%llu&id=%016llx&wait=%d", f->leader, (unsigned long long)from,
+                 (unsigned long long)st->log_id, REPL_WAIT);
+        curl_easy_setopt(curl, CURLOPT_URL, url);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &body);
+        CURLcode res = curl_easy_perform(curl);
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+        f->fetches++;
+        int ok = res == CURLE_OK && status == 200 &&
+                 (body.size == 0 || store_apply(st, from, (unsigned char *)body.data, body.size) != 0);
+        if (ok) {
+            f->applied_bytes += body.size;
+            synced = 1;
+            if (failing) fprintf(stderr, "[follow] replicating from %s again at offset %llu\n", f->leader,
+                                 (unsigned long long)st->tail);
+            failing = 0;
+        } else if (!__atomic_load_n(&f->stop, __ATOMIC_SEQ_CST)) {
+            int busy = res == CURLE_OK && status == 503; // Leader's long-poll slots are taken: retry quietly
+            if (!busy) f->errors++;
+            if (!failing && !busy)
+                fprintf(stderr, "[follow] %s: %s\n", f->leader,
+                        res != CURLE_OK ? curl_easy_strerror(res)
+                        : status == 409 ? "leader has a different log (offset or log id mismatch)"
+                        : status != 200 ? "unexpected HTTP status" : "received bytes do not continue the log");
+            failing |= !busy;
+            for (int i = 0; i < 10 && !__atomic_load_n(&f->stop, __ATOMIC_SEQ_CST); i++) {
+                struct timespec pause = {0, 100000000};
+                nanosleep(&pause, NULL);
+            }
+        }
+        free(body.data);
+    }
+    curl_easy_cleanup(curl);
+    return NULL;
+}
+// ============================================================
+// FUNCTION: run_server()
+// ------------------------------------------------------------
+// Entry point of "--serve <port> --store <dir> [options]". Runs
+// until SIGINT or SIGTERM, then prints request and store
+// statistics to stderr.
+// RETURNS:
+// Process exit status.
+// ============================================================
+static int run_server(int argc, char *argv[]) {
+    struct Server srv;
+    struct Store store;
+    struct Follower follower;
+    const char *dir = NULL, *bind_addr = "0.0.0.0", *follow = NULL, *cluster = NULL, *self = NULL;
+    struct HashRing ring;
+    size_t nthreads = 8;
+    long port = argc > 0 ? strtol(argv[0], NULL, 10) : 0;
+    memset(&srv, 0, sizeof(srv));
+    memset(&follower, 0, sizeof(follower));
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--store") && i + 1 < argc) {
+            dir = argv[++i];
+        } else if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+            nthreads = (size_t)strtoul(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--bind") && i + 1 < argc) {
+            bind_addr = argv[++i];
+        } else if (!strcmp(argv[i], "--follow") && i + 1 < argc) {
+            follow = argv[++i];
+        } else if (!strcmp(argv[i], "--cluster") && i + 1 < argc) {
+            cluster = argv[++i];
+        } else if (!strcmp(argv[i], "--self") && i + 1 < argc) {
+            self = argv[++i];
+        } else if (!strcmp(argv[i], "--numa")) {
+            numa_enabled = 1;
+        } else {
+            fprintf(stderr, "Error: Unknown server option '%s'\n", argv[i]);
+            return 1;
+        }
+    }
+    if (port <= 0 || port > 65535 || !dir || nthreads == 0) {
+        fprintf(stderr, "Error: Usage: --serve <port> --store <dir> [-j n] [--bind addr] [--follow url] "
+                        "[--cluster urls --self url] [--numa]\n");
+        return 1;
+    }
+    if (cluster) {
+        int idx = -1;
+        if (!self || hash_ring_build(&ring, cluster) != 0) {
+            fprintf(stderr, "Error: --cluster needs a list of distinct node URLs and --self\n");
+            return 1;
+        }
+        if ((idx = hash_ring_find(&ring, self, strlen(self))) < 0) {
+            fprintf(stderr, "Error: --self '%s' is not in --cluster\n", self);
+            hash_ring_free(&ring);
+            return 1;
+        }
+        srv.ring = &ring;
+        srv.self = (unsigned)idx;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    if (inet_pton(AF_INET, bind_addr, &addr.sin_addr) != 1) {
+        fprintf(stderr, "Error: Invalid bind address '%s'\n", bind_addr);
+        return 1;
+    }
+    if (store_open(&store, dir, follow != NULL) != 0) {
+        if (cluster) hash_ring_free(&ring);
+        return 1;
+    }
+    int one = 1;
+    srv.store = &store;
+    srv.listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (srv.listen_fd < 0 || setsockopt(srv.listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+        bind(srv.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(srv.listen_fd, 1024) != 0) {
+        fprintf(stderr, "Error: Cannot listen on %s:%ld\n", bind_addr, port);
+        if (srv.listen_fd >= 0) close(srv.listen_fd);
+        store_close(&store);
+        if (cluster) hash_ring_free(&ring);
+        return 1;
+    }
+    srv.nthreads = nthreads;
+    srv.wake[0] = srv.wake[1] = -1;
+    pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+    if (!threads || ring_init(&srv.ready, SERVER_MAX_CONNS) != 0 || ring_init(&srv.parked, SERVER_MAX_CONNS) != 0 ||
+        pipe2(srv.wake, O_NONBLOCK | O_CLOEXEC) != 0) {
+        fprintf(stderr, "Error: Out of memory starting the server\n");
+        free(threads);
+        ring_destroy(&srv.ready);
+        ring_destroy(&srv.parked);
+        close(srv.listen_fd);
+        store_close(&store);
+        if (cluster) hash_ring_free(&ring);
+        return 1;
+    }
+    ec_init(&srv.ready_ec);
+    fcntl(srv.listen_fd, F_SETFL, O_NONBLOCK);
+    pthread_t dispatcher;
+    // Only this thread takes SIGINT/SIGTERM; the pool inherits the mask
+    sigset_t stop;
+    int sig;
+    sigemptyset(&stop);
+    sigaddset(&stop, SIGINT);
+    sigaddset(&stop, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop, NULL);
+    for (size_t i = 0; i < nthreads; i++)
+        pthread_create(&threads[i], NULL, server_main, &srv);
+    pthread_create(&dispatcher, NULL, server_dispatch_main, &srv);
+    if (follow) {
+        follower.store = &store;
+        follower.leader = follow;
+        pthread_create(&follower.thread, NULL, follower_main, &follower);
+    }
+    fprintf(stderr, "[serve] listening on %s:%ld, %llu links in %s%s%s\n", bind_addr, port,
+            (unsigned long long)store.links, dir, follow ? ", following " : "", follow ? follow : "");
+    if (cluster)
+        fprintf(stderr, "[serve] cluster node %u of %u (%s)\n", srv.self + 1, ring.nnodes, ring.nodes[srv.self]);
+    sigwait(&stop, &sig);
+    if (follow) {
+        __atomic_store_n(&follower.stop, 1, __ATOMIC_SEQ_CST);
+        pthread_join(follower.thread, NULL);
+    }
+    __atomic_store_n(&srv.stopping, 1, __ATOMIC_SEQ_CST);
+    ec_notify(&store.appended); // Ends /_repl long polls
+    char wake = 1;
+    if (write(srv.wake[1], &wake, 1) < 0) {} // Ends the dispatcher's poll()
+    pthread_join(dispatcher, NULL);
+    ec_notify(&srv.ready_ec); // Idle workers exit; busy ones finish first
+    for (size_t i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    struct ServerConn *left;
+    while ((left = ring_try_pop(&srv.ready)) != NULL || (left = ring_try_pop(&srv.parked)) != NULL)
+        server_conn_close(&srv, left);
+    close(srv.listen_fd);
+    close(srv.wake[0]);
+    close(srv.wake[1]);
+    ring_destroy(&srv.ready);
+    ring_destroy(&srv.parked);
+    ec_destroy(&srv.ready_ec);
+    free(threads);
+    fprintf(stderr, "[serve] requests=%llu redirects=%llu created=%llu not_found=%llu repl_bytes=%llu\n",
+            (unsigned long long)srv.requests, (unsigned long long)srv.redirects, (unsigned long long)srv.created,
+            (unsigned long long)srv.not_found, (unsigned long long)srv.repl_bytes);
+    if (numa_enabled) numa_print_stats(stderr);
+    huge_print_stats(stderr);
+    if (follow)
+        fprintf(stderr, "[follow] fetches=%llu applied_bytes=%llu errors=%llu tail=%llu\n",
+                (unsigned long long)follower.fetches, (unsigned long long)follower.applied_bytes,
+                (unsigned long long)follower.errors, (unsigned long long)store.tail);
+    store_print_stats(&store, stderr);
+    store_close(&store);
+    if (cluster) hash_ring_free(&ring);
+    return 0;
+}
+// ============================================================
+// FUNCTION: store_compile()
+// ------------------------------------------------------------
+// Writes <dir>/store.mph: a perfect hash over the codes of all
+// links in st (opened from dir), whose values are their record
+// offsets / 8. Up to 8 seeds are tried.
+// RETURNS:
+// 0 on success, -1 on failure (details on stderr).
+// ============================================================
+static int store_compile(struct Store *st, const char *dir) {
+    char path[4200];
+    uint64_t n = 0, seed = 0, *hashes = st->links ? malloc(st->links * sizeof(uint64_t)) : NULL;
+    uint32_t *offs = st->links ? malloc(st->links * sizeof(uint32_t)) : NULL;
+    uint32_t *values = st->links ? malloc(st->links * sizeof(uint32_t)) : NULL;
+    struct Mph m;
+    int rc = -1;
+    memset(&m, 0, sizeof(m));
+    if (st->links == 0 || st->links > MPH_MAX_KEYS || st->tail / 8 > UINT32_MAX) {
+        fprintf(stderr, "Error: Cannot compile a store with %llu links and %llu log bytes (1 to %u links, "
+                "32 GiB of log)\n", (unsigned long long)st->links, (unsigned long long)st->tail, MPH_MAX_KEYS);
+    } else if (!hashes || !offs || !values) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+    } else {
+        for (uint64_t off = STORE_HEADER_SIZE; off < st->tail && n < st->links; off += store_record(st, off)->total)
+            if (store_record(st, off)->type == STORE_REC_LINK) offs[n++] = (uint32_t)(off / 8);
+        uint64_t t0 = now_ns();
+        for (rc = 1; rc == 1 && seed < 8; seed++) {
+            for (uint64_t i = 0; i < n; i++) {
+                const struct StoreRecord *r = store_record(st, (uint64_t)offs[i] * 8);
+                hashes[i] = mph_hash(store_record_code(r), r->code_len, seed);
+            }
+            rc = mph_build(&m, hashes, n, seed);
+        }
+        if (rc == 0) {
+            for (uint64_t i = 0; i < n; i++) values[mph_position(&m, hashes[i])] = offs[i];
+            snprintf(path, sizeof(path), "%s/store.mph", dir);
+            rc = mph_file_write(path, &m, values, st->log_id, st->tail);
+        } else {
+            fprintf(stderr, "Error: %s\n", rc < 0 ? "Memory allocation failed" : "No seed gave a perfect hash");
+            rc = -1;
+        }
+        if (rc == 0)
+            printf("[compile] links=%llu seed=%llu build_s=%.2f index_bits_per_link=%.2f file_bytes_per_link=%.2f\n",
+                   (unsigned long long)n, (unsigned long long)m.seed, (double)(now_ns() - t0) / 1e9,
+                   8.0 * (double)mph_index_bytes(&m) / (double)n,
+                   (double)(sizeof(struct MphHeader) + mph_index_bytes(&m) + n * sizeof(uint32_t)) / (double)n);
+        mph_free(&m);
+    }
+    free(hashes);
+    free(offs);
+    free(values);
+    return rc;
+}
+// ============================================================
+// FUNCTION: run_store_tool()
+// ------------------------------------------------------------
+// "--store-stats <dir>" prints a store's size per link.
+// "--store-compile <dir>" writes <dir>/store.mph.
+// "--store-compress-test <file>" trains a symbol table on a URL
+// corpus (one per line), round-trips every URL through it and
+// reports bytes per URL before and after encoding.
+// RETURNS:
+// Process exit status.
+// ============================================================
+static int run_store_tool(const char *mode, const char *arg) {
+    if (!strcmp(mode, "--store-stats") || !strcmp(mode, "--store-compile")) {
+        struct Store store;
+        int rc = 0;
+        if (store_open(&store, arg, 1) != 0) return 1;
+        if (!strcmp(mode, "--store-stats")) {
+            store_print_stats(&store, stdout);
+        } else {
+            rc = store_compile(&store, arg);
+        }
+        store_close(&store);
+        return rc == 0 ? 0 : 1;
+    }
+    FILE *in = fopen(arg, "r");
+    char **urls = NULL, *line = NULL;
+    size_t n = 0, cap = 0, line_cap = 0, raw = 0, enc_total = 0, bad = 0;
+    ssize_t len;
+    if (!in) {
+        fprintf(stderr, "Error: Cannot open '%s'\n", arg);
+        return 1;
+    }
+    while ((len = getline(&line, &line_cap, in)) > 0) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) line[--len] = 0;
+        if (len == 0 || len >= STORE_MAX_URL) continue;
+        if (n == cap) {
+            char **grown = realloc(urls, (cap = cap ? cap * 2 : 1024) * sizeof(char *));
+            if (!grown) break;
+            urls = grown;
+        }
+        if ((urls[n] = my_strdup(line)) == NULL) break;
+        raw += (size_t)len;
+        n++;
+    }
+    free(line);
+    fclose(in);
+    struct SymbolTable t;
+    unsigned char *enc = NULL;
+    size_t *enc_off = NULL;
+    char dec[STORE_MAX_URL];
+    size_t ntrain = n < STORE_TRAIN_AFTER ? n : STORE_TRAIN_AFTER;
+    int64_t t0 = now_ns();
+    int ok = n > 0 && symtab_train(&t, urls, ntrain) == 0;
+    int64_t t1 = now_ns(), decode_ns = 0;
+    // Encode everything into one buffer, then time decoding alone
+    if (ok && ((enc = malloc(2 * raw)) == NULL || (enc_off = malloc((n + 1) * sizeof(size_t))) == NULL)) ok = 0;
+    for (size_t i = 0; ok && i < n; i++) {
+        enc_off[i] = enc_total;
+        enc_total += symtab_encode(&t, (const unsigned char *)urls[i], strlen(urls[i]), enc + enc_total);
+    }
+    if (ok) {
+        enc_off[n] = enc_total;
+        int64_t d0 = now_ns();
+        for (size_t i = 0; i < n; i++) {
+            size_t dlen = symtab_decode(&t, enc + enc_off[i], enc_off[i + 1] - enc_off[i], dec, sizeof(dec) - 1);
+            dec[dlen == (size_t)-1 ? 0 : dlen] = 0;
+            if (strcmp(dec, urls[i]) != 0) bad++;
+        }
+        decode_ns = now_ns() - d0;
+    }
+    free(enc);
+    free(enc_off);
+    if (ok) {
+        printf("[compress] urls=%zu trained_on=%zu train_ms=%.1f\n", n, ntrain, (double)(t1 - t0) / 1e6);
+        printf("[compress] bytes_per_url raw=%.1f encoded=%.1f (%.1f%%) decode_ns_per_url=%.0f mismatches=%zu\n",
+               (double)raw / (double)n, (double)enc_total / (double)n, 100.0 * (double)enc_total / (double)raw,
+               (double)decode_ns / (double)n, bad);
+    } else {
+        fprintf(stderr, "Error: No URLs to train on in '%s'\n", arg);
+    }
+    for (size_t i = 0; i < n; i++) free(urls[i]);
+    free(urls);
+    return ok && bad == 0 ? 0 : 1;
+}
+// ============================================================
+// FUNCTION: run_mph_test()
+// ------------------------------------------------------------
+// "--mph-test [keys] [lookups]": builds a perfect hash over keys
+// distinct 7-character codes (default 10000000), writes it with
+// each key's number as its value to a temporary file, maps the
+// file back and times random lookups (hash, pilot, value) and
+// checks each against the key. Up to 16M keys, the same lookups
+// are also timed in a StoreIndex, the table kept for links that
+// are not compiled.
+// RETURNS:
+// Process exit status.
+// ============================================================
+static void mph_test_code(uint64_t i, char *code) {
+    static const char alphabet[] = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+    uint64_t x = i * 0x9e3779b1u % 3521614606208ull; // One to one below 62^7
+    for (int k = 0; k < STORE_CODE_LEN; k++, x /= 62) code[k] = alphabet[x % 62];
+}
+static int run_mph_test(int argc, char *argv[]) {
+    uint64_t n = argc > 0 ? strtoull(argv[0], NULL, 10) : 10000000;
+    uint64_t lookups = argc > 1 ? strtoull(argv[1], NULL, 10) : 10000000;
+    uint64_t *hashes = n && n <= MPH_MAX_KEYS ? malloc(n * sizeof(uint64_t)) : NULL;
+    uint32_t *values = hashes ? malloc(n * sizeof(uint32_t)) : NULL;
+    uint64_t x = 0x9e3779b97f4a7c15ull, bad = 0, seed;
+    char path[] = "/tmp/cipher-mph-XXXXXX", code[STORE_CODE_LEN];
+    struct Mph m;
+    struct MphFile f;
+    int rc = 1, fd = -1;
+    memset(&f, 0, sizeof(f));
+    if (!hashes || !values || lookups == 0) {
+        fprintf(stderr, "Error: Usage: --mph-test [keys 1-%u] [lookups > 0] (or out of memory)\n", MPH_MAX_KEYS);
+        free(hashes);
+        free(values);
+        return 1;
+    }
+    uint64_t t0 = now_ns();
+    for (seed = 0; rc == 1 && seed < 8; seed++) {
+        for (uint64_t i = 0; i < n; i++) {
+            mph_test_code(i, code);
+            hashes[i] = mph_hash(code, STORE_CODE_LEN, seed);
+        }
+        rc = mph_build(&m, hashes, n, seed);
+    }
+    double build_s = (double)(now_ns() - t0) / 1e9;
+    if (rc == 0) {
+        for (uint64_t i = 0; i < n; i++) values[mph_position(&m, hashes[i])] = (uint32_t)i;
+        rc = (fd = mkstemp(path)) >= 0 ? 0 : -1;
+        if (fd >= 0) close(fd);
+    }
+    free(hashes);
+    t0 = now_ns();
+    if (rc == 0) rc = mph_file_write(path, &m, values, 0, n);
+    double write_s = (double)(now_ns() - t0) / 1e9;
+    free(values);
+    t0 = now_ns();
+    if (rc == 0) rc = mph_file_open(&f, path);
+    double load_s = (double)(now_ns() - t0) / 1e9;
+    if (rc != 0) {
+        fprintf(stderr, "Error: %s\n", rc > 0 ? "No seed gave a perfect hash" : "Cannot build the test file");
+        mph_free(&m);
+        if (fd >= 0) unlink(path);
+        return 1;
+    }
+    t0 = now_ns();
+    for (uint64_t l = 0; l < lookups; l++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        uint64_t i = x % n;
+        mph_test_code(i, code);
+        bad += f.values[mph_position(&f.mph, mph_hash(code, STORE_CODE_LEN, f.mph.seed))] != i;
+    }
+    double lookup_ns = (double)(now_ns() - t0) / (double)lookups;
+    printf("[mph-test] keys=%llu seed=%llu build_s=%.2f build_ns_per_key=%.0f index_bits_per_key=%.2f "
+           "file_bytes_per_key=%.2f write_s=%.2f load_ms=%.2f lookup_ns=%.1f mismatches=%llu\n",
+           (unsigned long long)n, (unsigned long long)m.seed, build_s, build_s * 1e9 / (double)n,
+           8.0 * (double)mph_index_bytes(&m) / (double)n, (double)f.size / (double)n, write_s, load_s * 1e3, lookup_ns,
+           (unsigned long long)bad);
+    mph_free(&m);
+    mph_file_close(&f);
+    unlink(path);
+    if (n <= (16u << 20)) {
+        uint64_t nslots = 1024;
+        while (n * 10 > nslots * 7) nslots *= 2; // As store_index_add() grows it
+        struct StoreIndex *ix = store_index_new(nslots);
+        if (!ix) return 1;
+        for (uint64_t i = 0; i < n; i++) {
+            mph_test_code(i, code);
+            store_index_place(ix, hash_bytes(code, STORE_CODE_LEN), i + 1);
+        }
+        t0 = now_ns();
+        for (uint64_t l = 0; l < lookups; l++) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            uint64_t i = x % n, hash, s;
+            mph_test_code(i, code);
+            hash = hash_bytes(code, STORE_CODE_LEN);
+            for (s = hash & ix->mask; ix->slots[s].offset && ix->slots[s].hash != hash; s = (s + 1) & ix->mask) {}
+            bad += ix->slots[s].offset != i + 1;
+        }
+        lookup_ns = (double)(now_ns() - t0) / (double)lookups;
+        printf("[mph-test] store_index slots=%llu bytes_per_key=%.2f lookup_ns=%.1f mismatches=%llu\n",
+               (unsigned long long)nslots, (double)(nslots * sizeof(struct StoreIndexSlot)) / (double)n, lookup_ns,
+               (unsigned long long)bad);
+        store_index_free(ix);
+    }
+    return bad == 0 ? 0 : 1;
+}
+static int reshard_point_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+// Prints the share of the code space moving between each pair of
+// nodes when the cluster goes from ring from to ring to.
+// RETURNS: 0, or -1 when out of memory.
+static int reshard_print_plan(const struct HashRing *from, const struct HashRing *to) {
+    static double share[CLUSTER_MAX_NODES][CLUSTER_MAX_NODES];
+    size_t n = from->npoints + to->npoints;
+    uint64_t *points = malloc(n * sizeof(uint64_t));
+    double moved = 0.0, ideal = 0.0;
+    if (!points) return -1;
+    memset(share, 0, sizeof(share));
+    for (size_t i = 0; i < from->npoints; i++) points[i] = from->points[i].point;
+    for (size_t i = 0; i < to->npoints; i++) points[from->npoints + i] = to->points[i].point;
+    qsort(points, n, sizeof(uint64_t), reshard_point_cmp);
+    // Between two consecutive points of either ring both owners are
+    // constant; the first range wraps around from the last point
+    for (size_t i = 0; i < n; i++) {
+        uint64_t width = points[i] - points[i == 0 ? n - 1 : i - 1];
+        share[hash_ring_owner_of(from, points[i])][hash_ring_owner_of(to, points[i])] +=
+            (double)width / 18446744073709551616.0;
+    }
+    free(points);
+    for (unsigned a = 0; a < from->nnodes; a++)
+        for (unsigned b = 0; b < to->nnodes; b++) {
+            if (share[a][b] == 0.0 || !strcmp(from->nodes[a], to->nodes[b])) continue;
+            printf("[reshard] %s -> %s: %.2f%% of codes\n", from->nodes[a], to->nodes[b], 100.0 * share[a][b]);
+            moved += share[a][b];
+        }
+    // With even shares, the least any placement could move is what
+    // each node gains over its old share
+    for (unsigned b = 0; b < to->nnodes; b++) {
+        int a = hash_ring_find(from, to->nodes[b], strlen(to->nodes[b]));
+        double gain = 1.0 / to->nnodes - (a >= 0 ? 1.0 / from->nnodes : 0.0);
+        if (gain > 0.0) ideal += gain;
+    }
+    printf("[reshard] %u -> %u nodes: %.2f%% of the code space moves (even split minimum %.2f%%)\n", from->nnodes,
+           to->nnodes, 100.0 * moved, 100.0 * ideal);
+    return 0;
+}
+// Copies the links of node whose owner changes from ring from to
+// ring to onto their new owners. RETURNS: 0 if all were copied.
+static int reshard_move(const struct HashRing *from, const struct HashRing *to, const char *node) {
+    int src = hash_ring_find(from, node, strlen(node));
+    char dir[] = "/tmp/cipher-reshard-XXXXXX", path[64], req[STORE_MAX_URL * 3 + 1200], url[STORE_MAX_URL];
+    struct Response snap = { .data = NULL, .size = 0 };
+    struct Store st;
+    size_t copied = 0, failed = 0;
+    long status = 0;
+    CURL *curl = curl_easy_init();
+    if (src < 0 || !curl || !mkdtemp(dir)) {
+        fprintf(stderr, "Error: %s\n", src < 0 ? "--move node is not in the old list" : "Cannot start the copy");
+        if (curl) curl_easy_cleanup(curl);
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/store.log", dir);
+    int ok = store_open(&st, dir, 1) == 0;
+    if (ok) {
+        // A replica loaded from the node's snapshot gives a consistent
+        // view without stopping it
+        snprintf(req, sizeof(req), "%s/_snapshot", from->nodes[src]);
+        curl_easy_setopt(curl, CURLOPT_URL, req);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &snap);
+        curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 5L);
+        curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+        if (curl_easy_perform(curl) == CURLE_OK) curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+        if (status != 200 || store_apply(&st, 0, (unsigned char *)snap.data, snap.size) == 0) {
+            fprintf(stderr, "Error: Cannot load the snapshot of %s\n", from->nodes[src]);
+            ok = 0;
+        }
+        free(snap.data);
+        for (uint64_t off = STORE_HEADER_SIZE; ok && off < st.tail; off += store_record(&st, off)->total) {
+            const struct StoreRecord *r = store_record(&st, off);
+            const char *code = (const char *)store_record_code(r);
+            struct Response reply = { .data = NULL, .size = 0 };
+            if (r->type != STORE_REC_LINK || hash_ring_owner(from, code, r->code_len) != (unsigned)src) continue;
+            const char *dest = to->nodes[hash_ring_owner(to, code, r->code_len)];
+            if (!strcmp(dest, from->nodes[src]) || store_get_url(&st, code, r->code_len, url, sizeof(url)) < 0)
+                continue;
+            char *escaped = curl_easy_escape(curl, url, 0);
+            snprintf(req, sizeof(req), "%s/api-create.php?alias=%.*s&url=%s", dest, (int)r->code_len, code,
+                     escaped ? escaped : "");
+            curl_free(escaped);
+            curl_easy_setopt(curl, CURLOPT_URL, req);
+            curl_easy_setopt(curl, CURLOPT_WRITEDATA, &reply);
+            status = 0;
+            if (curl_easy_perform(curl) == CURLE_OK) curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+            if (status == 200) {
+                copied++;
+            } else if (failed++ < 10) {
+                fprintf(stderr, "[reshard] %.*s -> %s failed: HTTP %ld %s", (int)r->code_len, code, dest, status,
+                        reply.data && reply.size ? reply.data : "\n");
+            }
+            free(reply.data);
+        }
+        store_close(&st);
+    }
+    unlink(path);
+    rmdir(dir);
+    curl_easy_cleanup(curl);
+    if (ok) printf("[reshard] copied %zu links from %s (%zu failed)\n", copied, from->nodes[src], failed);
+    return ok && failed == 0 ? 0 : -1;
+}
+// ============================================================
+// FUNCTION: run_reshard()
+// ------------------------------------------------------------
+// "--reshard <old nodes> <new nodes> [--move <node>]" prints the
+// share of the code space that changes owner when the cluster
+// goes from the old node list to the new one: only the ranges next
+// to added or removed vnodes.
+// With --move, node's links (read from its /_snapshot) that change
+// owner are copied to the new owners with ?alias=, so the new
+// owners must already run with the new list. The source keeps its
+// copies and answers 307 for them once restarted with the new
+// list. Copies are idempotent: run --move again after that restart
+// to catch links created in between.
+// RETURNS:
+// Process exit status.
+// ============================================================
+static int run_reshard(int argc, char *argv[]) {
+    struct HashRing from, to;
+    const char *move = NULL;
+    int rc = 1;
+    for (int i = 2; i < argc; i++) {
+        if (!strcmp(argv[i], "--move") && i + 1 < argc) {
+            move = argv[++i];
+        } else {
+            fprintf(stderr, "Error: Unknown reshard option '%s'\n", argv[i]);
+            return 1;
+        }
+    }
+    if (argc < 2 || hash_ring_build(&from, argv[0]) != 0) {
+        fprintf(stderr, "Error: Usage: --reshard <old node,...> <new node,...> [--move node]\n");
+        return 1;
+    }
+    if (hash_ring_build(&to, argv[1]) != 0) {
+        fprintf(stderr, "Error: Usage: --reshard <old node,...> <new node,...> [--move node]\n");
+        hash_ring_free(&from);
+        return 1;
+    }
+    if (reshard_print_plan(&from, &to) == 0 && (!move || reshard_move(&from, &to, move) == 0)) rc = 0;
+    hash_ring_free(&from);
+    hash_ring_free(&to);
+    return rc;
+}
+// ============================================================
+// FUNCTION: run_host_filter_tool()
+// ------------------------------------------------------------
+// "--host-filter-compile <list> <out>" compiles a text list (see
+// HOST FILTER). "--host-filter-test <filter> <file>" looks up every
+// host or URL in file (one per line) and reports the verdict counts
+// and the time per lookup.
+// RETURNS:
+// Process exit status.
+// ============================================================
+static int run_host_filter_tool(const char *mode, const char *a, const char *b) {
+    if (!strcmp(mode, "--host-filter-compile")) return host_filter_compile(a, b) == 0 ? 0 : 1;
+    struct HostFilter f;
+    FILE *in = fopen(b, "r");
+    char *line = NULL, *hosts = NULL, url[HOST_FILTER_MAX_HOST + 16];
+    size_t line_cap = 0, n = 0, cap = 0, allowed = 0, rounds = 0;
+    ssize_t len;
+    if (!in) {
+        fprintf(stderr, "Error: Cannot open '%s'\n", b);
+        return 1;
+    }
+    if (host_filter_open(&f, a) != 0) {
+        fclose(in);
+        return 1;
+    }
+    // Hosts are extracted up front and stored in fixed-size rows
+    while ((len = getline(&line, &line_cap, in)) > 0) {
+        line[strcspn(line, "\r\n")] = 0;
+        if (!strstr(line, "://")) {
+            snprintf(url, sizeof(url), "x://%.*s", HOST_FILTER_MAX_HOST, line);
+        } else {
+            snprintf(url, sizeof(url), "%.*s", (int)sizeof(url) - 1, line);
+        }
+        if (n == cap) {
+            char *grown = realloc(hosts, (cap = cap ? cap * 2 : 4096) * (HOST_FILTER_MAX_HOST + 1));
+            if (!grown) break;
+            hosts = grown;
+        }
+        if (host_filter_url_host(url, hosts + n * (HOST_FILTER_MAX_HOST + 1), HOST_FILTER_MAX_HOST + 1) > 0) n++;
+    }
+    free(line);
+    fclose(in);
+    int64_t t0 = now_ns(), elapsed;
+    do { // Repeat small inputs for a stable timing
+        allowed = 0;
+        for (size_t i = 0; i < n; i++) {
+            const char *host = hosts + i * (HOST_FILTER_MAX_HOST + 1);
+            allowed += host_filter_verdict(&f, host, strlen(host)) == HOST_FILTER_ALLOW;
+        }
+        rounds++;
+    } while (n > 0 && (elapsed = now_ns() - t0) < 200000000);
+    if (n > 0)
+        printf("[filter] hosts=%zu allowed=%zu blocked=%zu nodes=%u ns_per_lookup=%.1f\n", n, allowed, n - allowed,
+               f.header->nnodes, (double)elapsed / (double)(n * rounds));
+    else
+        fprintf(stderr, "Error: No hosts in '%s'\n", b);
+    free(hosts);
+    host_filter_close(&f);
+    return n > 0 ? 0 : 1;
+}
+// ============================================================
+// BENCHMARK: end-to-end runs and the regression gate
+// ------------------------------------------------------------
+// --bench times unshorten_url() end to end: -n requests from -c
+// threads, repeated --runs times, against a built-in mock that
+// answers each request with --hops redirects (or against --url,
+// where "{i}" becomes the request number). No network is needed.
+// It writes every request's latency and each run's throughput as
+// JSON.
+//
+// --bench-compare <baseline> <candidate> reads two such files (or
+// two cipher-microbench files) and bootstraps a 95% confidence
+// interval for the relative change of each metric: p50 and p99
+// latency and throughput for --bench, ns/op (median of samples)
+// per kernel for the microbenchmarks. A metric regresses when its
+// whole interval is worse than --threshold percent, so noise alone
+// does not fail the gate; the exit status is then 1.
+// ============================================================
+#define BENCH_MAX_HOPS 20
+struct BenchMock {
+    int listen_fd;
+    int port;
+};
+// Mock connection thread: /r/<n>/... redirects to /r/<n-1>/...,
+// /r/1/... to /final, anything else is 200.
+static void *bench_mock_conn_main(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    char buf[4096], reply[512];
+    size_t used = 0;
+    for (;;) {
+        char *end;
+        buf[used] = 0;
+        while ((end = strstr(buf, "\r\n\r\n")) == NULL && used < sizeof(buf) - 1) {
+            ssize_t n = recv(fd, buf + used, sizeof(buf) - 1 - used, 0);
+            if (n <= 0) break;
+            used += (size_t)n;
+            buf[used] = 0;
+        }
+        struct ServerRequest req;
+        if (!end || server_parse_request(buf, end, &req) != 0) break;
+        size_t consumed = (size_t)(end + 4 - buf);
+        int hops = !strncmp(req.target, "/r/", 3) ? atoi(req.target + 3) : 0;
+        const char *rest = hops > 0 ? strchr(req.target + 3, '/') : NULL;
+        int n;
+        if (hops > 1)
+            n = snprintf(reply, sizeof(reply), "HTTP/1.1 301 Moved Permanently\r\nLocation: /r/%d%s\r\n"
+                         "Content-Length: 0\r\n\r\n", hops - 1, rest ? rest : "");
+        else if (hops == 1)
+            n = snprintf(reply, sizeof(reply), "HTTP/1.1 302 Found\r\nLocation: /final\r\nContent-Length: 0\r\n\r\n");
+        else
+            n = snprintf(reply, sizeof(reply), "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n");
+        if (n <= 0 || (size_t)n >= sizeof(reply) || send_all(fd, reply, (size_t)n, 0) != 0) break;
+        memmove(buf, buf + consumed, used - consumed);
+        used -= consumed;
+    }
+    close(fd);
+    return NULL;
+}
+static void *bench_mock_main(void *arg) {
+    struct BenchMock *m = arg;
+    int fd;
+    while ((fd = accept(m->listen_fd, NULL, NULL)) >= 0) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, bench_mock_conn_main, (void *)(intptr_t)fd) != 0) close(fd);
+        else pthread_detach(t);
+    }
+    return NULL;
+}
+// Listens on an ephemeral loopback port. RETURNS: 0, or -1.
+static int bench_mock_start(struct BenchMock *m) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    pthread_t t;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    m->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (m->listen_fd < 0 || bind(m->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(m->listen_fd, 1024) != 0 || getsockname(m->listen_fd, (struct sockaddr *)&addr, &len) != 0 ||
+        pthread_create(&t, NULL, bench_mock_main, m) != 0) {
+        if (m->listen_fd >= 0) close(m->listen_fd);
+        return -1;
+    }
+    pthread_detach(t); // Runs until the process exits
+    m->port = ntohs(addr.sin_port);
+    return 0;
+}
+struct BenchRun {
+    const char *url; // Template; "{i}" is replaced by the request number
+    size_t requests;
+    size_t next; // Atomic: next request number
+    size_t errors; // Atomic
+    double *latency_us; // [requests]
+    struct Slots slots; // Engine runs: requests in flight
+};
+static void bench_url(const struct BenchRun *r, size_t i, char *url, size_t cap) {
+    const char *mark = strstr(r->url, "{i}");
+    if (mark)
+        snprintf(url, cap, "%.*s%zu%s", (int)(mark - r->url), r->url, i, mark + 3);
+    else
+        snprintf(url, cap, "%s", r->url);
+}
+static void *bench_client_main(void *arg) {
+    struct BenchRun *r = arg;
+    char url[2048];
+    size_t i;
+    while ((i = __atomic_fetch_add(&r->next, 1, __ATOMIC_RELAXED)) < r->requests) {
+        bench_url(r, i, url, sizeof(url));
+        uint64_t t0 = now_ns();
+        char *result = unshorten_url(url);
+        r->latency_us[i] = (double)(now_ns() - t0) / 1e3;
+        if (is_error_result(result)) __atomic_add_fetch(&r->errors, 1, __ATOMIC_RELAXED);
+        free(result);
+    }
+    return NULL;
+}
+struct BenchReq {
+    struct EngineReq req; // First: done() gets this pointer
+    size_t i;
+    uint64_t t0;
+    char url[2048];
+};
+static void bench_engine_done(struct EngineReq *req) {
+    struct BenchReq *b = (struct BenchReq *)req;
+    struct BenchRun *r = req->arg;
+    r->latency_us[b->i] = (double)(now_ns() - b->t0) / 1e3;
+    if (is_error_result(req->result)) __atomic_add_fetch(&r->errors, 1, __ATOMIC_RELAXED);
+    free(req->result);
+    slots_release(&r->slots);
+}
+// One run on the engine: the caller's thread submits, keeping -c
+// requests in flight.
+static void bench_run_engine(struct BenchRun *r, struct Engine *e, struct BenchReq *reqs) {
+    for (size_t i = 0; i < r->requests; i++) {
+        struct BenchReq *b = &reqs[i];
+        slots_acquire(&r->slots);
+        memset(&b->req, 0, sizeof(b->req));
+        bench_url(r, i, b->url, sizeof(b->url));
+        b->i = i;
+        b->req.url = b->url;
+        b->req.done = bench_engine_done;
+        b->req.arg = r;
+        b->t0 = now_ns();
+        engine_submit(e, &b->req);
+    }
+    slots_drain(&r->slots);
+}
+static int bench_double_cmp(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+static double bench_percentile(const double *sorted, size_t n, double p) {
+    return n ? sorted[(size_t)(p / 100.0 * (double)(n - 1) + 0.5)] : 0.0;
+}
+// ============================================================
+// FUNCTION: run_bench()
+// ------------------------------------------------------------
+// "--bench [-n requests] [-c concurrency] [--runs n] [--hops n]
+// [--url template] [--cores n | --scale n] [--out file]".
+// Without --cores, -c threads call unshorten_url(); with it, one
+// thread keeps -c requests in flight on an ENGINE of n cores.
+// --scale repeats the runs on 1, 2, 4 ... n cores and prints the
+// throughput of each core count relative to one core.
+// RETURNS:
+// Process exit status (1 if any request failed).
+// ============================================================
+static int run_bench(int argc, char *argv[]) {
+    struct BenchMock mock;
+    struct BenchRun run;
+    struct Engine engine;
+    const char *url = NULL, *out_path = NULL;
+    long requests = 2000, threads = 8, runs = 5, hops = 2, cores = 0, scale = 0;
+    long configs[16];
+    size_t nconfigs = 0;
+    char mock_url[128];
+    size_t errors = 0;
+    int ok = 1;
+    for (int i = 0; i < argc; i++) {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            requests = strtol(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "-c") && i + 1 < argc) {
+            threads = strtol(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--runs") && i + 1 < argc) {
+            runs = strtol(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--hops") && i + 1 < argc) {
+            hops = strtol(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--url") && i + 1 < argc) {
+            url = argv[++i];
+        } else if (!strcmp(argv[i], "--cores") && i + 1 < argc) {
+            cores = strtol(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--scale") && i + 1 < argc) {
+            scale = strtol(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--out") && i + 1 < argc) {
+            out_path = argv[++i];
+        } else {
+            fprintf(stderr, "Error: Unknown bench option '%s'\n", argv[i]);
+            return 1;
+        }
+    }
+    if (requests < 1 || threads < 1 || threads > 1024 || runs < 1 || hops < 0 || hops > BENCH_MAX_HOPS ||
+        cores < 0 || cores > ENGINE_MAX_CORES || scale < 0 || scale > ENGINE_MAX_CORES || (cores && scale)) {
+        fprintf(stderr, "Error: -n, -c (up to 1024) and --runs must be positive, --hops 0..%d, and --cores or "
+                        "--scale 1..%d (not both)\n", BENCH_MAX_HOPS, ENGINE_MAX_CORES);
+        return 1;
+    }
+    for (long c = 1; scale && c < scale; c *= 2) configs[nconfigs++] = c;
+    configs[nconfigs++] = scale ? scale : cores; // 0 = the thread-per-request clients
+    if (!url) {
+        if (bench_mock_start(&mock) != 0) {
+            fprintf(stderr, "Error: Cannot start the mock endpoint\n");
+            return 1;
+        }
+        snprintf(mock_url, sizeof(mock_url), hops ? "http://127.0.0.1:%d/r/%ld/{i}" : "http://127.0.0.1:%d/{i}",
+                 mock.port, hops);
+        url = mock_url;
+    }
+    FILE *out = out_path ? fopen(out_path, "w") : stdout;
+    pthread_t *tids = calloc((size_t)threads, sizeof(pthread_t));
+    struct BenchReq *reqs = configs[nconfigs - 1] ? calloc((size_t)requests, sizeof(struct BenchReq)) : NULL;
+    double *rps = calloc(nconfigs * (size_t)runs, sizeof(double));
+    memset(&run, 0, sizeof(run));
+    run.latency_us = malloc((size_t)requests * sizeof(double));
+    if (!out || !tids || !rps || !run.latency_us || (configs[nconfigs - 1] && !reqs)) {
+        fprintf(stderr, "Error: Cannot start the benchmark\n");
+        return 1;
+    }
+    run.slots.cap = (size_t)threads;
+    ec_init(&run.slots.freed);
+    fprintf(out, "{\"tool\":\"cipher-bench\",\"url\":\"%s\",\"requests\":%ld,\"concurrency\":%ld,\"runs\":[", url,
+            requests, threads);
+    for (size_t k = 0; ok && k < nconfigs; k++) {
+        if (configs[k] && engine_start(&engine, (size_t)configs[k], (size_t)threads) != 0) {
+            fprintf(stderr, "Error: Cannot start %ld engine cores\n", configs[k]);
+            ok = 0;
+        }
+        for (long r = 0; ok && r < runs; r++) {
+            run.url = url;
+            run.requests = (size_t)requests;
+            run.next = run.errors = 0;
+            uint64_t t0 = now_ns();
+            if (configs[k]) {
+                bench_run_engine(&run, &engine, reqs);
+            } else {
+                for (long t = 0; t < threads; t++) pthread_create(&tids[t], NULL, bench_client_main, &run);
+                for (long t = 0; t < threads; t++) pthread_join(tids[t], NULL);
+            }
+            double seconds = (double)(now_ns() - t0) / 1e9;
+            rps[k * (size_t)runs + (size_t)r] = (double)requests / seconds;
+            fprintf(out, "%s\n{\"cores\":%ld,\"seconds\":%.6f,\"throughput_rps\":%.2f,\"errors\":%zu,"
+                    "\"latencies_us\":[", k || r ? "," : "", configs[k], seconds, (double)requests / seconds,
+                    run.errors);
+            for (long i = 0; i < requests; i++) fprintf(out, "%s%.1f", i ? "," : "", run.latency_us[i]);
+            fprintf(out, "]}");
+            qsort(run.latency_us, (size_t)requests, sizeof(double), bench_double_cmp);
+            fprintf(stderr, "[bench] cores=%ld run %ld: %.0f req/s p50_us=%.1f p99_us=%.1f errors=%zu\n", configs[k],
+                    r + 1, (double)requests / seconds, bench_percentile(run.latency_us, (size_t)requests, 50),
+                    bench_percentile(run.latency_us, (size_t)requests, 99), run.errors);
+            errors += run.errors;
+        }
+        if (ok && configs[k]) engine_stop(&engine);
+        qsort(&rps[k * (size_t)runs], (size_t)runs, sizeof(double), bench_double_cmp);
+    }
+    fprintf(out, "\n]}\n");
+    for (size_t k = 0; ok && scale && k < nconfigs; k++) {
+        double median = bench_percentile(&rps[k * (size_t)runs], (size_t)runs, 50);
+        fprintf(stderr, "[scale] cores=%ld median=%.0f req/s speedup=%.2fx\n", configs[k], median,
+                median / bench_percentile(rps, (size_t)runs, 50));
+    }
+    if (out != stdout) fclose(out);
+    ec_destroy(&run.slots.freed);
+    free(run.latency_us);
+    free(rps);
+    free(reqs);
+    free(tids);
+    return !ok || errors ? 1 : 0;
+}
+// Result file reading: only what --bench and cipher-microbench write.
+// Finds "key": in [p, end). RETURNS: the value's start, or NULL.
+static const char *bench_json_key(const char *p, const char *end, const char *key) {
+    char pattern[64];
+    size_t len = (size_t)snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    for (const char *q = p; q && q + len <= end; q = memchr(q + 1, '"', (size_t)(end - q - 1)))
+        if (!memcmp(q, pattern, len)) return q + len;
+    return NULL;
+}
+// Appends v to the sample array *vals of *n values. RETURNS: 0, -1.
+static int bench_push(double **vals, size_t *n, double v) {
+    if ((*n & (*n - 1)) == 0 && *n >= 64) { // Full: capacity is the next power of two >= 64
+        double *grown = realloc(*vals, *n * 2 * sizeof(double));
+        if (!grown) return -1;
+        *vals = grown;
+    } else if (*n == 0 && (*vals = malloc(64 * sizeof(double))) == NULL) {
+        return -1;
+    }
+    (*vals)[(*n)++] = v;
+    return 0;
+}
+// Appends the numbers of the array at p to *vals. RETURNS: 0, -1.
+static int bench_json_array(const char *p, double **vals, size_t *n) {
+    if (!p || *p++ != '[') return -1;
+    while (*p && *p != ']') {
+        char *next;
+        double v = strtod(p, &next);
+        if (next == p || bench_push(vals, n, v) != 0) return -1;
+        p = next + (*next == ',');
+    }
+    return *p == ']' ? 0 : -1;
+}
+enum BenchStat { STAT_P50, STAT_P99, STAT_MEAN, STAT_MEDIAN };
+struct BenchMetric {
+    char name[96];
+    enum BenchStat stat;
+    int higher_is_better;
+    double *vals[2]; // Baseline, candidate samples
+    size_t n[2];
+};
+// Statistic of a bootstrap resample of vals (sorted): draws n
+// positions, counts them and walks the counts in order, so each
+// resample costs O(n) instead of a sort.
+static double bench_resample_stat(const double *sorted, size_t n, enum BenchStat stat, uint32_t *counts) {
+    double sum = 0.0;
+    memset(counts, 0, n * sizeof(uint32_t));
+    for (size_t i = 0; i < n; i++) counts[(size_t)(rng_unit() * (double)n) % n]++;
+    if (stat == STAT_MEAN) {
+        for (size_t i = 0; i < n; i++) sum += sorted[i] * counts[i];
+        return sum / (double)n;
+    }
+    size_t rank = (size_t)((stat == STAT_P99 ? 0.99 : 0.5) * (double)(n - 1) + 0.5), seen = 0;
+    for (size_t i = 0; i < n; i++)
+        if ((seen += counts[i]) > rank) return sorted[i];
+    return sorted[n - 1];
+}
+static int bench_load(const char *path, int side, struct BenchMetric *m, size_t *nm, size_t cap) {
+    FILE *in = fopen(path, "rb");
+    char *text = NULL;
+    size_t len = 0;
+    int ok = in != NULL;
+    if (ok) {
+        fseek(in, 0, SEEK_END);
+        len = (size_t)ftell(in);
+        rewind(in);
+        ok = (text = malloc(len + 1)) != NULL && fread(text, 1, len, in) == len;
+        fclose(in);
+    }
+    const char *end = text + len, *p;
+    if (ok) text[len] = 0;
+    int micro = ok && strstr(text, "\"tool\":\"cipher-microbench\"") != NULL;
+    ok = ok && (micro || strstr(text, "\"tool\":\"cipher-bench\"") != NULL);
+    if (ok && micro) {
+        // One metric per kernel: median ns/op over samples
+        for (p = bench_json_key(text, end, "name"); ok && p; p = bench_json_key(p, end, "name")) {
+            char name[64];
+            size_t i;
+            if (sscanf(p, "\"%63[^\"]\"", name) != 1) break;
+            for (i = 0; i < *nm && strcmp(m[i].name, name) != 0; i++) {}
+            if (i == *nm && side == 1) continue; // Not in the baseline
+            if (i == *nm && *nm < cap) {
+                memset(&m[i], 0, sizeof(m[i]));
+                snprintf(m[i].name, sizeof(m[i].name), "%s", name);
+                m[i].stat = STAT_MEDIAN;
+                (*nm)++;
+            }
+            if (i < *nm) ok = bench_json_array(bench_json_key(p, end, "samples_ns_per_op"), &m[i].vals[side],
+                                               &m[i].n[side]) == 0;
+        }
+    } else if (ok) {
+        static const char *const names[3] = {"latency_p50_us", "latency_p99_us", "throughput_rps"};
+        if (side == 0) {
+            for (int k = 0; k < 3; k++) {
+                memset(&m[k], 0, sizeof(m[k]));
+                snprintf(m[k].name, sizeof(m[k].name), "%s", names[k]);
+                m[k].stat = k == 0 ? STAT_P50 : k == 1 ? STAT_P99 : STAT_MEAN;
+                m[k].higher_is_better = k == 2;
+            }
+            *nm = 3;
+        }
+        for (p = bench_json_key(text, end, "throughput_rps"); ok && p; p = bench_json_key(p, end, "throughput_rps")) {
+            ok = bench_push(&m[2].vals[side], &m[2].n[side], strtod(p, NULL)) == 0 &&
+                 bench_json_array(bench_json_key(p, end, "latencies_us"), &m[0].vals[side], &m[0].n[side]) == 0;
+        }
+        if (ok && m[0].n[side] > 0) { // p50 and p99 bootstrap the same latencies
+            double *copy = malloc(m[0].n[side] * sizeof(double));
+            ok = copy != NULL;
+            if (ok) memcpy(copy, m[0].vals[side], m[0].n[side] * sizeof(double));
+            m[1].vals[side] = copy;
+            m[1].n[side] = m[0].n[side];
+        }
+    }
+    if (!ok) fprintf(stderr, "Error: '%s' is not a cipher benchmark result\n", path);
+    free(text);
+    return ok ? 0 : -1;
+}
+// ============================================================
+// FUNCTION: run_bench_compare()
+// ------------------------------------------------------------
+// "--bench-compare <baseline> <candidate> [--threshold pct]
+// [--resamples n]".
+// RETURNS:
+// 0 when nothing regressed, 1 on a regression, 2 on bad input.
+// ============================================================
+static int run_bench_compare(int argc, char *argv[]) {
+    struct BenchMetric metrics[64];
+    size_t nmetrics = 0;
+    double threshold = 5.0;
+    long resamples = 2000;
+    int regressed = 0, rc = 0;
+    for (int i = 2; i < argc; i++) {
+        if (!strcmp(argv[i], "--threshold") && i + 1 < argc) {
+            threshold = strtod(argv[++i], NULL);
+        } else if (!strcmp(argv[i], "--resamples") && i + 1 < argc) {
+            resamples = strtol(argv[++i], NULL, 10);
+        } else {
+            fprintf(stderr, "Error: Unknown compare option '%s'\n", argv[i]);
+            return 2;
+        }
+    }
+    if (argc < 2 || resamples < 100 || threshold < 0) {
+        fprintf(stderr, "Error: Usage: --bench-compare <baseline.json> <candidate.json> [--threshold pct] "
+                        "[--resamples n >= 100]\n");
+        return 2;
+    }
+    if (bench_load(argv[0], 0, metrics, &nmetrics, 64) != 0 || bench_load(argv[1], 1, metrics, &nmetrics, 64) != 0)
+        rc = 2;
+    double *deltas = malloc((size_t)resamples * sizeof(double));
+    if (!deltas) rc = 2;
+    if (rc == 0)
+        printf("%-24s %12s %12s %9s %20s  %s\n", "metric", "baseline", "candidate", "change", "95% CI", "verdict");
+    for (size_t k = 0; rc == 0 && k < nmetrics; k++) {
+        struct BenchMetric *m = &metrics[k];
+        double point[2];
+        uint32_t *counts[2] = {NULL, NULL};
+        if (m->n[0] == 0 || m->n[1] == 0) {
+            printf("%-24s (missing from one file)\n", m->name);
+            continue;
+        }
+        for (int s = 0; s < 2; s++) {
+            qsort(m->vals[s], m->n[s], sizeof(double), bench_double_cmp);
+            counts[s] = malloc(m->n[s] * sizeof(uint32_t));
+            if (m->stat == STAT_MEAN) {
+                point[s] = 0;
+                for (size_t i = 0; i < m->n[s]; i++) point[s] += m->vals[s][i] / (double)m->n[s];
+            } else {
+                point[s] = bench_percentile(m->vals[s], m->n[s], m->stat == STAT_P99 ? 99 : 50);
+            }
+        }
+        if (!counts[0] || !counts[1] || point[0] <= 0) {
+            free(counts[0]);
+            free(counts[1]);
+            rc = 2;
+            break;
+        }
+        for (long b = 0; b < resamples; b++) {
+            double base = bench_resample_stat(m->vals[0], m->n[0], m->stat, counts[0]);
+            double cand = bench_resample_stat(m->vals[1], m->n[1], m->stat, counts[1]);
+            deltas[b] = base > 0 ? 100.0 * (cand / base - 1.0) : 0.0;
+        }
+        free(counts[0]);
+        free(counts[1]);
+        qsort(deltas, (size_t)resamples, sizeof(double), bench_double_cmp);
+        double lo = bench_percentile(deltas, (size_t)resamples, 2.5);
+        double hi = bench_percentile(deltas, (size_t)resamples, 97.5);
+        // Worse means slower latency or lower throughput
+        double worse_lo = m->higher_is_better ? -hi : lo, better_lo = m->higher_is_better ? lo : -hi;
+        const char *verdict = worse_lo > threshold ? "REGRESSION" : better_lo > threshold ? "improved" : "ok";
+        regressed |= worse_lo > threshold;
+        printf("%-24s %12.2f %12.2f %+8.2f%% [%+7.2f%%, %+7.2f%%]  %s\n", m->name, point[0], point[1],
+               100.0 * (point[1] / point[0] - 1.0), lo, hi, verdict);
+    }
+    for (size_t k = 0; k < nmetrics; k++) {
+        free(metrics[k].vals[0]);
+        free(metrics[k].vals[1]);
+    }
+    free(deltas);
+    if (rc == 0)
+        printf("[compare] threshold=%.1f%% resamples=%ld: %s\n", threshold, resamples,
+               regressed ? "regression" : "no regression");
+    return rc ? rc : regressed;
+}
+// ============================================================
+// MICROBENCH: CPU cost of cipher's own code paths
+// ------------------------------------------------------------
+// Built with -DCIPHER_MICROBENCH (the cipher-microbench target,
+// see show_help()), the binary runs this suite instead of the
+// normal modes. Each kernel is timed in samples of a calibrated
+// iteration count; the report is the median ns/op over samples
+// plus allocations/op and requested bytes/op, counted by the
+// malloc/calloc/realloc wrappers below. JSON goes to stdout (or
+// --out) and a table to stderr; --bench-compare compares runs.
+// ============================================================
+#ifdef CIPHER_MICROBENCH
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+static uint64_t bench_allocs, bench_alloc_bytes; // Atomic
+void *malloc(size_t size) {
+    __atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&bench_alloc_bytes, size, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+void *calloc(size_t n, size_t size) {
+    __atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&bench_alloc_bytes, n * size, __ATOMIC_RELAXED);
+    return __libc_calloc(n, size);
+}
+void *realloc(void *ptr, size_t size) {
+    __atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&bench_alloc_bytes, size, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+#define BENCH_URLS 1024 // Power of two
+#define BENCH_MAX_SAMPLES 1000
+struct BenchState {
+    char *urls[BENCH_URLS];
+    char *missing[BENCH_URLS]; // Never inserted in cache
+    CURL *curl;
+    struct ResultCache cache;
+    FILE *sink; // /dev/null, fully buffered
+    char chunk[1024];
+    uint64_t i; // Rotates through the URLs
+};
+// The kernels. Each does iters operations on a BenchState.
+static void bench_write_callback(struct BenchState *b, uint64_t iters) {
+    for (uint64_t n = 0; n < iters; n++) { // One 16 KiB body in 1 KiB chunks
+        struct Response r = { .data = NULL, .size = 0 };
+        for (int c = 0; c < 16; c++) write_callback(b->chunk, 1, sizeof(b->chunk), &r);
+        free(r.data);
+    }
+}
+static void bench_curl_escape(struct BenchState *b, uint64_t iters) {
+    for (uint64_t n = 0; n < iters; n++) curl_free(curl_easy_escape(b->curl, b->urls[b->i++ & (BENCH_URLS - 1)], 0));
+}
+// Everything shorten_url() does before the network: handle, escaping,
+// API URL and options.
+static void bench_shorten_prepare(struct BenchState *b, uint64_t iters) {
+    char api_url[1024];
+    struct Response response = { .data = NULL, .size = 0 };
+    for (uint64_t n = 0; n < iters; n++) {
+        CURL *curl = curl_easy_init();
+        char *encoded = curl ? curl_easy_escape(curl, b->urls[b->i++ & (BENCH_URLS - 1)], 0) : NULL;
+        if (encoded && strlen(encoded) <= 900) {
+            snprintf(api_url, sizeof(api_url), "%s/api-create.php?url=%s", "https://tinyurl.com", encoded);
+            curl_easy_setopt(curl, CURLOPT_URL, api_url);
+            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
+            curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+            curl_easy_setopt(curl, CURLOPT_TIMEOUT, 8L);
+            curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 5L);
+            curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+        }
+        curl_free(encoded);
+        curl_easy_cleanup(curl);
+    }
+}
+static void bench_my_strdup(struct BenchState *b, uint64_t iters) {
+    for (uint64_t n = 0; n < iters; n++) free(my_strdup(b->urls[b->i++ & (BENCH_URLS - 1)]));
+}
+static void bench_parse_request(struct BenchState *b, uint64_t iters) {
+    static const char head[] = "GET /aB3dE9x HTTP/1.1\r\nHost: short.example\r\nUser-Agent: curl/8.5.0\r\n"
+                               "Accept: */*\r\nConnection: keep-alive\r\n\r\n";
+    char buf[sizeof(head)];
+    struct ServerRequest req;
+    (void)b;
+    for (uint64_t n = 0; n < iters; n++) {
+        memcpy(buf, head, sizeof(head)); // Parsing is destructive
+        server_parse_request(buf, strstr(buf, "\r\n\r\n"), &req);
+    }
+}
+static void bench_cache_hit(struct BenchState *b, uint64_t iters) {
+    enum CacheState state;
+    for (uint64_t n = 0; n < iters; n++) free(cache_lookup(&b->cache, b->urls[b->i++ & (BENCH_URLS - 1)], &state));
+}
+// Hits CACHE_BATCH at a time; an op is one key.
+static void bench_cache_hit_batch(struct BenchState *b, uint64_t iters) {
+    const char *urls[CACHE_BATCH];
+    char *values[CACHE_BATCH];
+    enum CacheState states[CACHE_BATCH];
+    for (uint64_t n = 0; n < iters; n += CACHE_BATCH) {
+        size_t g = iters - n < CACHE_BATCH ? (size_t)(iters - n) : CACHE_BATCH;
+        for (size_t i = 0; i < g; i++) urls[i] = b->urls[b->i++ & (BENCH_URLS - 1)];
+        cache_lookup_batch(&b->cache, urls, g, values, states);
+        for (size_t i = 0; i < g; i++) free(values[i]);
+    }
+}
+static void bench_cache_miss(struct BenchState *b, uint64_t iters) {
+    enum CacheState state;
+    for (uint64_t n = 0; n < iters; n++) free(cache_lookup(&b->cache, b->missing[b->i++ & (BENCH_URLS - 1)], &state));
+}
+// The worker's result line, as writer_main() prints it.
+static void bench_output_line(struct BenchState *b, uint64_t iters) {
+    for (uint64_t n = 0; n < iters; n++) {
+        const char *url = b->urls[b->i++ & (BENCH_URLS - 1)];
+        fprintf(b->sink, "%s\t%s\t%s\n", "web", url, url);
+    }
+}
+static const struct {
+    const char *name;
+    void (*run)(struct BenchState *b, uint64_t iters);
+} bench_kernels[] = {
+    {"write_callback_16k", bench_write_callback},
+    {"curl_escape_url", bench_curl_escape},
+    {"shorten_prepare", bench_shorten_prepare},
+    {"my_strdup_url", bench_my_strdup},
+    {"server_parse_request", bench_parse_request},
+    {"cache_lookup_hit", bench_cache_hit},
+    {"cache_lookup_hit_batch", bench_cache_hit_batch},
+    {"cache_lookup_miss", bench_cache_miss},
+    {"output_line", bench_output_line},
+};
+// ============================================================
+// FUNCTION: run_microbench()
+// ------------------------------------------------------------
+// Options: --filter <substring> (kernels to run), --samples <n>
+// (default 15), --sample-ms <n> (target time per sample, default
+// 20), --out <file> (JSON destination, default stdout).
+// RETURNS:
+// Process exit status.
+// ============================================================
+static int run_microbench(int argc, char *argv[]) {
+    static struct BenchState b;
+    const char *filter = NULL, *out_path = NULL;
+    long samples = 15, sample_ms = 20;
+    double ns[BENCH_MAX_SAMPLES];
+    int ok = 1, first = 1;
+    for (int i = 0; i < argc; i++) {
+        if (!strcmp(argv[i], "--filter") && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (!strcmp(argv[i], "--samples") && i + 1 < argc) {
+            samples = strtol(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--sample-ms") && i + 1 < argc) {
+            sample_ms = strtol(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--out") && i + 1 < argc) {
+            out_path = argv[++i];
+        } else {
+            fprintf(stderr, "Error: Usage: cipher-microbench [--filter s] [--samples n] [--sample-ms n] [--out f]\n");
+            return 1;
+        }
+    }
+    if (samples < 1 || samples > BENCH_MAX_SAMPLES || sample_ms < 1) {
+        fprintf(stderr, "Error: --samples must be 1..%d and --sample-ms positive\n", BENCH_MAX_SAMPLES);
+        return 1;
+    }
+    FILE *out = out_path ? fopen(out_path, "w") : stdout;
+    if (!out || curl_global_init(CURL_GLOBAL_ALL) != 0 || (b.curl = curl_easy_init()) == NULL ||
+        (b.sink = fopen("/dev/null", "w")) == NULL || cache_init(&b.cache, 16 * BENCH_URLS, 0) != 0) {
+        fprintf(stderr, "Error: Cannot set up the microbenchmarks\n");
+        return 1;
+    }
+    setvbuf(b.sink, NULL, _IOFBF, 1 << 16);
+    memset(b.chunk, 'x', sizeof(b.chunk));
+    b.cache.ttl_ns = b.cache.stale_ns = b.cache.neg_ttl_ns = 3600ull * 1000000000ull;
+    for (int i = 0; i < BENCH_URLS && ok; i++) {
+        char url[256];
+        snprintf(url, sizeof(url), "https://www.example-shop.com/products/category-%d/item-%d?utm_source=newsletter"
+                 "&utm_medium=email&ref=%d", i % 37, i, i * 7919);
+        ok = (b.urls[i] = my_strdup(url)) != NULL;
+        url[8] = 'W'; // Same length, never stored
+        ok = ok && (b.missing[i] = my_strdup(url)) != NULL;
+        if (ok) cache_store(&b.cache, b.urls[i], url);
+    }
+    fprintf(out, "{\"tool\":\"cipher-microbench\",\"unit\":\"ns/op\",\"results\":[");
+    fprintf(stderr, "%-22s %12s %10s %10s %12s\n", "kernel", "iterations", "ns/op", "allocs/op", "bytes/op");
+    for (size_t k = 0; ok && k < sizeof(bench_kernels) / sizeof(bench_kernels[0]); k++) {
+        if (filter && !strstr(bench_kernels[k].name, filter)) continue;
+        // Calibrate: grow the batch until it takes 1 ms, then scale
+        // it to sample_ms
+        uint64_t iters = 1, t = 0;
+        for (;;) {
+            uint64_t t0 = now_ns();
+            bench_kernels[k].run(&b, iters);
+            if ((t = now_ns() - t0) >= 1000000 || iters >= (1ull << 40)) break;
+            iters *= 2;
+        }
+        iters = iters * (uint64_t)sample_ms * 1000000 / (t ? t : 1);
+        if (iters == 0) iters = 1;
+        uint64_t allocs0 = __atomic_load_n(&bench_allocs, __ATOMIC_RELAXED);
+        uint64_t bytes0 = __atomic_load_n(&bench_alloc_bytes, __ATOMIC_RELAXED);
+        for (long s = 0; s < samples; s++) {
+            uint64_t t0 = now_ns();
+            bench_kernels[k].run(&b, iters);
+            ns[s] = (double)(now_ns() - t0) / (double)iters;
+        }
+        uint64_t total = iters * (uint64_t)samples;
+        double allocs = (double)(__atomic_load_n(&bench_allocs, __ATOMIC_RELAXED) - allocs0) / (double)total;
+        double bytes = (double)(__atomic_load_n(&bench_alloc_bytes, __ATOMIC_RELAXED) - bytes0) / (double)total;
+        fprintf(out, "%s\n{\"name\":\"%s\",\"iterations\":%llu,\"samples_ns_per_op\":[", first ? "" : ",",
+                bench_kernels[k].name, (unsigned long long)total);
+        for (long s = 0; s < samples; s++) fprintf(out, "%s%.3f", s ? "," : "", ns[s]);
+        qsort(ns, (size_t)samples, sizeof(double), bench_double_cmp);
+        double median = samples % 2 ? ns[samples / 2] : (ns[samples / 2 - 1] + ns[samples / 2]) / 2;
+        fprintf(out, "],\"ns_per_op\":%.3f,\"ns_per_op_min\":%.3f,\"allocs_per_op\":%.3f,\"bytes_per_op\":%.1f}",
+                median, ns[0], allocs, bytes);
+        fprintf(stderr, "%-22s %12llu %10.1f %10.2f %12.1f\n", bench_kernels[k].name, (unsigned long long)total,
+                median, allocs, bytes);
+        first = 0;
+    }
+    fprintf(out, "\n]}\n");
+    if (out != stdout) fclose(out);
+    for (int i = 0; i < BENCH_URLS; i++) {
+        free(b.urls[i]);
+        free(b.missing[i]);
+    }
+    cache_destroy(&b.cache);
+    fclose(b.sink);
+    curl_easy_cleanup(b.curl);
+    curl_global_cleanup();
+    return ok ? 0 : 1;
+}
+#endif
+// ============================================================
+// FUNCTION: show_help()
+// ------------------------------------------------------------
+// Prints a professional help/usage menu, similar to tools like
+// Hydra or Nmap when the "-h" flag is passed.
+// ============================================================
+void show_help(const char *prog_name) {
+printf("\n===========================================\n");
+printf(" URL Shortener & Unshortener Tool\n");
+printf("===========================================\n\n");
+printf("Usage:\n");
+printf(" %s [option] [url]\n\n", prog_name);
+printf("Options:\n");
+printf(" -s <url> Shorten a long URL using TinyURL API\n");
+printf(" -u <url> Unshorten a short URL to reveal its target\n");
+printf(" -w [opts] [name[:weight]=file ...] Worker mode: resolve job lines from\n");
+printf("    several clients (files, FIFOs, or - for stdin). Job line format:\n");
+printf("    [interactive|bulk] [-s|-u] <url>\n");
+printf("    -j <n> Resolver threads (default 8)\n");
+printf("    --bulk-every <n> While both classes wait, every n-th dispatch\n");
+printf("      goes to bulk (default 8, 0 = strict priority)\n");
+printf("    --queue-depth <n> Jobs buffered per client and class, and results\n");
+printf("      buffered for output (default 256); readers block when full\n");
+printf("    --cache-size <n> Cached unshorten results (default 100000, 0 = off)\n");
+printf("    --cache-ttl <s> Fresh lifetime of a result (default 600)\n");
+printf("    --cache-stale <s> Afterwards, serve it stale while refreshing it in\n");
+printf("      the background for up to this long (default 3600)\n");
+printf("    --cache-neg-ttl <s> Lifetime of a cached failure (default 30)\n");
+printf("    --cache-jitter <f> Shorten each TTL by up to this fraction so\n");
+printf("      entries do not expire together (default 0.1)\n");
+printf("    --cache-dir <dir> Share results with other cipher processes through\n");
+printf("      an on-disk cache in dir (mmap'd shards, lock-free reads)\n");
+printf("    --cache-shards <n> Shard files when creating dir (default 16)\n");
+printf("    --cache-hot-mb <n> Keep at most n MiB of records in the mmap'd hot\n");
+printf("      files; older ones move to compressed cold segments (default 0 = off)\n");
+printf("    --host-conns <n> Requests in flight per target host (default 4, 0 = no\n");
+printf("      limit); hosts are served round-robin, -j stays the global cap\n");
+printf("    --host-rate <r> Start at most r requests per second per host\n");
+printf("      (default 0 = unpaced)\n");
+printf("    --host-backlog <n> Jobs waiting for their host (default 4096)\n");
+printf("    --cores <n> Resolve -u jobs on n engine threads, each with its own\n");
+printf("      curl multi handle (connections, DNS, TLS sessions); a host always\n");
+printf("      maps to the same one. -j then caps the requests in flight\n");
+printf("    --hop-cache <n> Remember up to n redirect hops by source URL (default\n");
+printf("      100000, 0 = off): 301/308 for 30 days, others only per max-age or\n");
+printf("      Expires. Known hops of a chain are skipped without a request\n");
+printf("    --deadline <s> --remainder <file> Finish what can be finished in s\n");
+printf("      seconds: hosts with the shortest average job time go first, jobs\n");
+printf("      whose host cannot make it are skipped, request timeouts shrink to\n");
+printf("      the time left, and every input not completed (including the rest\n");
+printf("      of the input after the deadline) is written to file as job lines\n");
+printf("    --cost Charge thread CPU and wall time to each job per stage (parse,\n");
+printf("      cache, encode, network, tls, output) and print per mode and host\n");
+printf("      averages plus cores per 1k req/s and whether the run was CPU- or\n");
+printf("      latency-bound\n");
+printf("    --numa Pin resolver and engine threads one per CPU, spread evenly over\n");
+printf("      the NUMA nodes; each prefers its node's memory and shared cache\n");
+printf("      tables are interleaved across nodes\n");
+printf(" --scan [opts] [file ...] Copy text (files or stdin) to stdout with each\n");
+printf("    link on a shortener host annotated with its target: url [=> target].\n");
+printf("    Links are found by one pass of a multi-pattern matcher and resolved\n");
+printf("    concurrently on the engine (see -w --cores) while scanning goes on\n");
+printf("    --rewrite Replace each link by its target instead (failures stay)\n");
+printf("    --extract Only print the links found, one per line, unresolved\n");
+printf("    --hosts <file> Shortener hosts to look for, one per line (default:\n");
+printf("      bit.ly, tinyurl.com, t.co, goo.gl, ow.ly, is.gd and other common ones)\n");
+printf("    -j <n> Requests in flight (default 64)  --cores <n> Engine threads\n");
+printf("      (default 1)  --window <n> 64 KiB chunks buffered for output (default 64)\n");
+printf("    --cache-size <n> Cached results (default 100000)  --hop-cache <n> (see -w)\n");
+printf("    -f <file> Follow file as it grows, like tail -F: new lines are\n");
+printf("      expanded as they are written (inotify), across renames, re-creation\n");
+printf("      and truncation, until SIGINT/SIGTERM. Lines are micro-batched:\n");
+printf("    --batch-ms <ms> Longest wait for more lines (default 2, 0 = none)\n");
+printf("    --batch-bytes <n> Batch size that is sent at once (default 16384)\n");
+printf("    --numa Pin the engine threads by NUMA node (see -w)\n");
+printf(" --serve <port> --store <dir> [opts] Run a shortener: GET /api-create.php?url=\n");
+printf("    creates a link, GET /<code> redirects to it. Links are kept in\n");
+printf("    dir/store.log with URLs compressed by a learned symbol table\n");
+printf("    -j <n> Server threads (default 8)\n");
+printf("    --bind <addr> Listen address (default 0.0.0.0)\n");
+printf("    --follow <url> Read-only replica of the server at url: copies its\n");
+printf("      log (GET /_snapshot) and tails it (GET /_repl) while serving\n");
+printf("    --cluster <url,...> --self <url> Split the codes between these nodes\n");
+printf("      (consistent hashing): new codes come from self's share, others get\n");
+printf("      a 307 to their owner. &alias=<code> picks the code of a new link\n");
+printf("    --numa Pin server threads by NUMA node (see -w); the link index is\n");
+printf("      interleaved across nodes\n");
+printf(" --store-stats <dir> Print link count and bytes per URL of a store\n");
+printf(" --store-compile <dir> Write <dir>/store.mph, a perfect hash over the\n");
+printf("    store's codes (about 3 bits per link plus a 4-byte offset) that a\n");
+printf("    --serve started later uses instead of indexing those links in memory\n");
+printf(" --store-compress-test <file> Train a symbol table on a URL list (one\n");
+printf("    per line) and report bytes per URL before and after encoding\n");
+printf(" --host-filter-compile <list> <out> Compile allow/block domain lines\n");
+printf("    (allow|block <domain>, default allow|block) for CIPHER_HOST_FILTER\n");
+printf(" --host-filter-test <filter> <file> Check each host or URL in file and\n");
+printf("    report verdict counts and time per lookup\n");
+printf(" --cache-batch-test [entries] [lookups] Probe a filled result cache\n");
+printf("    with random hits one at a time and in prefetched batches (as -w\n");
+printf("    does) and report lookups per second for both\n");
+printf(" --swiss-test [keys] [lookups] Time puts, hits, misses and erases of\n");
+printf("    generated URLs in the Swiss table (as --scan uses) and in a chained\n");
+printf("    table, and report bytes per key for both\n");
+printf(" --mph-test [keys] [lookups] Build, write, map and probe a perfect hash\n");
+printf("    over keys codes (default 10000000) and compare with the link index\n");
+printf(" --hugepage-test [MiB] [lookups] Time random probes into a table on\n");
+printf("    4 KiB and on huge pages, with dTLB misses where perf counters exist\n");
+printf(" --reshard <old url,...> <new url,...> [--move <url>] Show the share of\n");
+printf("    codes changing owner between two node lists; --move copies node\n");
+printf("    url's links that change owner to their new owners\n");
+printf(" --bench [opts] Time -u end to end against a built-in local mock that\n");
+printf("    answers with redirects; writes every latency and throughput as JSON\n");
+printf("    -n <n> Requests per run (default 2000)  -c <n> Threads (default 8)\n");
+printf("    --runs <n> Repeated runs (default 5)  --hops <n> Redirects (default 2)\n");
+printf("    --url <url> Time this URL instead; {i} becomes the request number\n");
+printf("    --cores <n> Keep -c requests in flight on an n-core engine (see -w)\n");
+printf("    --scale <n> Repeat the runs on 1, 2, 4 ... n engine cores and print\n");
+printf("      the speedup over one core\n");
+printf("    --out <file> Write the JSON to file instead of stdout\n");
+printf(" --bench-compare <baseline> <candidate> [--threshold <pct>] [--resamples <n>]\n");
+printf("    Compare two --bench (or cipher-microbench) result files: bootstrap\n");
+printf("    95%% intervals for the change in p50, p99 and throughput (ns/op per\n");
+printf("    kernel); exits 1 if one is surely worse than pct (default 5)\n");
+printf(" -h Show this help message\n\n");
+printf("Examples:\n");
+printf(" %s -s https://example.com\n", prog_name);
+printf(" %s -u https://tinyurl.com/abc123\n", prog_name);
+printf(" %s -w -j 16 web:4=/run/web.fifo etl=batch.txt\n", prog_name);
+printf(" %s --scan --rewrite app.log > app.expanded.log\n", prog_name);
+printf(" %s --scan -f /var/log/app.log >> app.expanded.log\n", prog_name);
+printf(" %s --serve 8080 --store /var/lib/cipher\n", prog_name);
+printf(" %s --serve 8081 --store /tmp/replica --follow http://127.0.0.1:8080\n", prog_name);
+printf(" %s --bench --out new.json && %s --bench-compare base.json new.json\n\n", prog_name, prog_name);
+printf("Notes:\n");
+printf(" * Requires internet connectivity and libcurl.\n");
+printf(" * Caller must free() strings returned by -s and -u options.\n");
+printf(" * Worker mode prints per-class queue depth and wait times to\n");
+printf("   stderr on exit and on SIGUSR1, together with cache hit counts\n");
+printf("   and cache-served latency, and how often host limits held jobs back.\n");
+printf(" * Set CIPHER_SHORTEN_API=http://host:port to make -s use a cipher\n");
+printf("   server instead of TinyURL.\n");
+printf(" * Replication can be tried on one machine: start a server, then\n");
+printf("   followers on other ports and store dirs (a follower can also\n");
+printf("   follow another follower). curl -o copy/store.log\n");
+printf("   http://host:port/_snapshot saves a consistent copy of a store.\n");
+printf(" * Set CIPHER_HOST_FILTER to a file from --host-filter-compile to\n");
+printf("   make -u and -w refuse redirects to blocked hosts: every hop is\n");
+printf("   checked before it is requested. A domain entry covers its\n");
+printf("   subdomains and the most specific entry wins.\n");
+printf(" * Set CIPHER_BODY_SCAN=<bytes> (e.g. 16384) to make -u, -w and --scan\n");
+printf("   follow redirects made by a 200 page: <meta http-equiv=refresh> and\n");
+printf("   JS location assignments. Hops then use GET and stop reading a page\n");
+printf("   at the first such redirect or after that many bytes.\n");
+printf(" * Set CIPHER_HUGEPAGES=1 to put large tables (result and hop caches,\n");
+printf("   the store index) on 2 MiB pages: explicit huge pages when\n");
+printf("   vm.nr_hugepages has some, else transparent ones (=thp for those\n");
+printf("   only). The run summary reports what was granted. Per-thread\n");
+printf("   allocations follow with GLIBC_TUNABLES=glibc.malloc.hugetlb=1\n");
+printf(" * Set CIPHER_CLUSTER to a cluster's node list to make -u ask the\n");
+printf("   owning node directly; links on the public short domain are routed\n");
+printf("   too when CIPHER_CLUSTER_DOMAIN names it. To add a node: start it\n");
+printf("   with the new list, run --reshard old new --move <node> for each\n");
+printf("   old node, restart the old nodes with the new list, then run the\n");
+printf("   --move steps again for links created meanwhile.\n");
+printf(" * Compile with: gcc -std=c99 -o %s %s.c -lcurl -lpthread\n", prog_name, prog_name);
+printf("   (add -DCIPHER_USE_ZSTD -lzstd to zstd-compress cold cache segments,\n");
+printf("   -DCIPHER_TRACE for CIPHER_TRACE)\n");
+printf(" * -DCIPHER_MICROBENCH -o cipher-microbench builds the microbenchmarks\n");
+printf("   instead of the tool: ns, allocations and bytes per op for each CPU\n");
+printf("   kernel as JSON (--filter <s>, --samples <n>, --sample-ms <n>, --out <f>).\n");
+printf("   It also takes --bench-compare.\n");
+printf(" * In a -DCIPHER_TRACE build, CIPHER_TRACE=<file> records spans of\n");
+printf("   each request's phases (init, encode, dns, connect, tls, first_byte,\n");
+printf("   cache, parse, output, ...) and writes them at exit as Chrome\n");
+printf("   trace JSON, or as flamegraph.pl input if file ends in .folded.\n\n");
+}
+// ============================================================
+// FUNCTION: main()
+// ------------------------------------------------------------
+// Entry point of the program.
+// Parses arguments and determines which operation to perform.
+// ------------------------------------------------------------
+// NOTES:
+// - Requires libcurl; link with -lcurl during compilation.
+// - Initializes and cleans up global CURL resources.
+// ============================================================
+int main(int argc, char *argv[]) {
+#ifdef CIPHER_MICROBENCH
+if (argc >= 2 && strcmp(argv[1], "--bench-compare") == 0) return run_bench_compare(argc - 2, argv + 2);
+return run_microbench(argc - 1, argv + 1); // This build is the cipher-microbench target
+#endif
+// If no argument provided, show help
+if (argc < 2) {
+show_help(argv[0]);
+return 1;
+}
+// Initialize libcurl globally (must be done once)
+if (curl_global_init(CURL_GLOBAL_ALL) != 0) {
+fprintf(stderr, "Error: Failed to initialize libcurl\n");
+return 1;
+}
+trace_init(); // Spans for CIPHER_TRACE (-DCIPHER_TRACE builds)
+// Parse command-line flags
+if (strcmp(argv[1], "-h") == 0) {
+// Display help message
+show_help(argv[0]);
+} else if (strcmp(argv[1], "-s") == 0 && argc == 3) {
+// Shorten a URL
+TRACE_BEGIN(run_t);
+char *result = shorten_url(argv[2]);
+TRACE_END(run_t, "shorten");
+TRACE_BEGIN(output_t);
+printf("Shortened URL: %s\n", result);
+TRACE_END(output_t, "output");
+free(result);
+} else if (strcmp(argv[1], "-u") == 0 && argc == 3) {
+// Unshorten a URL
+TRACE_BEGIN(run_t);
+char *result = unshorten_url(argv[2]);
+TRACE_END(run_t, "unshorten");
+TRACE_BEGIN(output_t);
+printf("Original URL: %s\n", result);
+TRACE_END(output_t, "output");
+free(result);
+} else if (strcmp(argv[1], "-w") == 0) {
+// Batch worker fed by one or more clients
+int status = run_worker(argc - 2, argv + 2);
+curl_global_cleanup();
+return status;
+} else if (strcmp(argv[1], "--scan") == 0) {
+// Expand the short links found in text
+int status = run_scan(argc - 2, argv + 2);
+curl_global_cleanup();
+return status;
+} else if (strcmp(argv[1], "--serve") == 0) {
+// Self-hosted shortener backed by a local link store
+int status = run_server(argc - 2, argv + 2);
+curl_global_cleanup();
+return status;
+} else if ((strcmp(argv[1], "--host-filter-compile") == 0 || strcmp(argv[1], "--host-filter-test") == 0) &&
+           argc == 4) {
+// Compile or benchmark a redirect host filter
+int status = run_host_filter_tool(argv[1], argv[2], argv[3]);
+curl_global_cleanup();
+return status;
+} else if (strcmp(argv[1], "--hugepage-test") == 0) {
+// Probe time and TLB misses on 4 KiB versus huge pages
+int status = run_hugepage_test(argc - 2, argv + 2);
+curl_global_cleanup();
+return status;
+} else if (strcmp(argv[1], "--cache-batch-test") == 0) {
+// Sequential versus batched, prefetching cache probes
+int status = run_cache_batch_test(argc - 2, argv + 2);
+curl_global_cleanup();
+return status;
+} else if (strcmp(argv[1], "--mph-test") == 0) {
+// Perfect hash build, load and lookup times
+int status = run_mph_test(argc - 2, argv + 2);
+curl_global_cleanup();
+return status;
+} else if (strcmp(argv[1], "--swiss-test") == 0) {
+// Swiss table versus chained table on generated URLs
+int status = run_swiss_test(argc - 2, argv + 2);
+curl_global_cleanup();
+return status;
+} else if (strcmp(argv[1], "--bench") == 0) {
+// End-to-end benchmark, against the built-in mock by default
+int status = run_bench(argc - 2, argv + 2);
+curl_global_cleanup();
+return status;
+} else if (strcmp(argv[1], "--bench-compare") == 0) {
+// Regression gate over two benchmark result files
+int status = run_bench_compare(argc - 2, argv + 2);
+curl_global_cleanup();
+return status;
+} else if (strcmp(argv[1], "--reshard") == 0) {
+// Consistent-hash move plan, optionally copying the moved links
+int status = run_reshard(argc - 2, argv + 2);
+curl_global_cleanup();
+return status;
+} else if ((strcmp(argv[1], "--store-stats") == 0 || strcmp(argv[1], "--store-compile") == 0 ||
+            strcmp(argv[1], "--store-compress-test") == 0) && argc == 3) {
+// Store size report, perfect hash compiler or compression test on a URL corpus
+int status = run_store_tool(argv[1], argv[2]);
+curl_global_cleanup();
+return status;
 } else {
 // Invalid usage
 fprintf(stderr, "Error: Invalid command or missing argument.\n");